@@ -38,6 +38,12 @@ several games based on the Quake III Arena engine, in the form of "Q3Map2."
 
 
 
+/* bsp nodes and brushes of up to ~96 sides come from pools */
+memPool_t	brushPool = MEMPOOL( "brush", sizeof( brush_t ), 5 );
+memPool_t	nodePool = MEMPOOL( "node", sizeof( node_t ), 1 );
+
+
+
 /* -------------------------------------------------------------------------------
 
 functions
@@ -100,10 +106,9 @@ brush_t *AllocBrush( int numSides )
 	if( numSides <= 0 )
 		Error( "AllocBrush called with numsides = %d", numSides );
 	c = (int) &(((brush_t*) 0)->sides[ numSides ]);
-	bb = (brush_t *)safe_malloc( c );
+	bb = (brush_t *)MemPoolAlloc( &brushPool, c );
 	memset( bb, 0, c );
-	if( numthreads == 1 )
-		numActiveBrushes++;
+	ThreadAtomicAdd( &numActiveBrushes, 1 );
 	
 	/* return it */
 	return bb;
@@ -138,9 +143,8 @@ void FreeBrush( brush_t *b )
 	*((int*) b) = 0xFEFEFEFE;
 	
 	/* free it */
-	free( b );
-	if( numthreads == 1 )
-		numActiveBrushes--;
+	MemPoolFree( &brushPool, b );
+	ThreadAtomicAdd( &numActiveBrushes, -1 );
 }
 
 
@@ -599,12 +603,22 @@ node_t *AllocNode (void)
 {
 	node_t	*node;
 
-	node = (node_t *)safe_malloc(sizeof(*node));
+	node = (node_t *)MemPoolAlloc(&nodePool, sizeof(*node));
 	memset (node, 0, sizeof(*node));
 
 	return node;
 }
 
+/*
+================
+FreeTreeNode
+================
+*/
+void FreeTreeNode (node_t *node)
+{
+	MemPoolFree (&nodePool, node);
+}
+
 
 /*
 ================
@@ -412,42 +412,60 @@ void ProcessWorldModel( void )
 	PatchMapDrawSurfs( e );
 
 	/* build an initial bsp tree using all of the sides of all of the structural brushes */
+	ProfileBegin( "FaceBSP" );
 	faces = MakeStructuralBSPFaceList( entities[ 0 ].brushes );
 	tree = FaceBSP( faces, qfalse );
+	ProfileEnd();
+	ProfileBegin( "MakeTreePortals" );
 	MakeTreePortals( tree, qfalse );
+	ProfileEnd();
+	ProfileBegin( "FilterStructuralBrushesIntoTree" );
 	FilterStructuralBrushesIntoTree( e, tree, qfalse );
+	ProfileEnd();
 
 	/* note BSP phase (non-verbose-mode) */
 	if( !verbose )
 		Sys_Printf ( "--- BuildBSP ---\n" );
 	
 	/* see if the bsp is completely enclosed */
+	ProfileBegin( "FloodEntities" );
 	filled = ignoreLeaks;
 	if( filled )
 		FloodEntities( tree, qtrue );
 	else
 		filled = FloodEntities( tree, qfalse );
+	ProfileEnd();
 	if( filled )
 	{
 		Sys_FPrintf( SYS_VRB, "--- RebuildBSP ---\n" );
 
 		/* rebuild a better bsp tree using only the sides that are visible from the inside */
+		ProfileBegin( "RebuildBSP" );
 		FillOutside( tree->headnode );
 
 		/* chop the sides to the convex hull of their visible fragments, giving us the smallest polygons */
+		ProfileBegin( "ClipSidesIntoTree" );
 		ClipSidesIntoTree( e, tree, qtrue );
+		ProfileEnd();
 		
 		/* build a visible face tree */
+		ProfileBegin( "FaceBSP" );
 		faces = MakeVisibleBSPFaceList( entities[ 0 ].brushes );
 		FreeTree( tree );
 		tree = FaceBSP( faces, qtrue );
+		ProfileEnd();
+		ProfileBegin( "MakeTreePortals" );
 		MakeTreePortals( tree, qtrue );
+		ProfileEnd();
+		ProfileBegin( "FilterStructuralBrushesIntoTree" );
 		FilterStructuralBrushesIntoTree( e, tree, qtrue );
+		ProfileEnd();
 		leaked = qfalse;
 		
 		/* ydnar: flood again for skybox */
 		if( skyboxPresent )
 			FloodEntities( tree, qtrue );
+		ProfileEnd();
 
 		/* emit stats */
 		oldVerbose = verbose;
@@ -481,7 +499,9 @@ void ProcessWorldModel( void )
 		leaked = qtrue;
 		
 		/* chop the sides to the convex hull of their visible fragments, giving us the smallest polygons */
+		ProfileBegin( "ClipSidesIntoTree" );
 		ClipSidesIntoTree( e, tree, qfalse );
+		ProfileEnd();
 	}
 	
 	/* save out information for visibility processing */
@@ -490,6 +510,7 @@ void ProcessWorldModel( void )
 		WritePortalFile( tree );
 
 	/* note BSP phase (non-verbose-mode) */
+	ProfileBegin( "CreateMapDrawsurfs" );
 	if( !verbose )
 	{
 		Sys_Printf( "--- CreateMapDrawsurfs ---\n" );
@@ -532,8 +553,10 @@ void ProcessWorldModel( void )
 	FixBrushFaces( e );
 
 	/* add in any vertexes required to fix t-junctions */
+	ProfileBegin( "FixTJunctions" );
 	if( !noTJunc )
 		FixTJunctions( e );
+	ProfileEnd();
 
 	/* ydnar: classify the surfaces */
 	ClassifyEntitySurfaces( e );
@@ -546,6 +569,7 @@ void ProcessWorldModel( void )
 		Sys_Printf( "%d...", 6 );
 	
 	/* ydnar: meta surfaces */
+	ProfileBegin( "MakeEntityMetaTriangles" );
 	MakeEntityMetaTriangles( e );
 	if( !verbose )
 		Sys_Printf( "%d...", 7);
@@ -553,7 +577,10 @@ void ProcessWorldModel( void )
 	FixMetaTJunctions();
 	if( !verbose )
 		Sys_Printf( "%d...", 8 );
+	ProfileEnd();
+	ProfileBegin( "MergeMetaTriangles" );
 	MergeMetaTriangles();
+	ProfileEnd();
 	if( !verbose )
 		Sys_Printf( "%d...", 9 );
 	
@@ -629,9 +656,12 @@ void ProcessWorldModel( void )
 		Sys_Printf( " (%d)\n", (int) (I_FloatTime() - start) );
 		Sys_Printf( "%9d drawsurfs\n", numMapDrawSurfs );
 	}
+	ProfileEnd();
 
 	/* add references to the final drawsurfs in the apropriate clusters */
+	ProfileBegin( "FilterDrawsurfsIntoTree" );
 	FilterDrawsurfsIntoTree( e, tree, qtrue );
+	ProfileEnd();
 	if( !verbose )
 		EmitDrawsurfsSimpleStats();
 	else
@@ -755,7 +785,9 @@ void ProcessModels( void )
 	CreateMapFogs();
 
 	/* process world model */
+	ProfileBegin( "ProcessWorldModel" );
 	ProcessWorldModel();
+	ProfileEnd();
 	
 	/* process submodels */
 	verbose = qfalse;
@@ -763,6 +795,7 @@ void ProcessModels( void )
 	fOld = -1;
 
 	Sys_Printf ( "--- ProcessModels ---\n" );
+	ProfileBegin( "ProcessSubModels" );
 
 	/* count */
 	for( submodels = 0, mapEntityNum = 1; mapEntityNum < numEntities; mapEntityNum++ )
@@ -793,6 +826,7 @@ void ProcessModels( void )
 	/* print overall time */
 	if ( submodels > 10 )
 		Sys_Printf (" (%d)\n", (int) (I_FloatTime() - start) );
+	ProfileEnd();
 
 	/* restore -v setting */
 	verbose = oldVerbose;
@@ -800,6 +834,10 @@ void ProcessModels( void )
 	/* emit stats */
 	Sys_Printf( "%9i submodels\n", submodels);
 	EmitDrawsurfsStats();
+	MemPoolStats( &windingPool );
+	MemPoolStats( &brushPool );
+	MemPoolStats( &nodePool );
+	MemPoolStats( &portalPool );
 
 	/* write fogs */
 	EmitFogs();
@@ -1494,10 +1532,12 @@ int BSPMain( int argc, char **argv )
 	LoadShaderInfo();
 
 	/* load original file from temp spot in case it was renamed by the editor on the way in */
+	ProfileBegin( "LoadMapFile" );
 	if( strlen( tempSource ) > 0 )
 		LoadMapFile( tempSource, qfalse, qfalse, qfalse, qfalse );
 	else
 		LoadMapFile( name, qfalse, qfalse, qfalse, qfalse );
+	ProfileEnd();
 
 	/* check map for errors */
 	CheckMapForErrors();
@@ -1521,13 +1561,17 @@ int BSPMain( int argc, char **argv )
 	SetCloneModelNumbers();
 	
 	/* process world and submodels */
+	ProfileBegin( "ProcessModels" );
 	ProcessModels();
+	ProfileEnd();
 	
 	/* set light styles from targetted light entities */
 	SetLightStyles();
 	
 	/* finish and write bsp */
+	ProfileBegin( "EndBSPFile" );
 	EndBSPFile();
+	ProfileEnd();
 	
 	/* remove temp map source file if appropriate */
 	if( strlen( tempSource ) > 0)
@@ -31,6 +31,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "cmdlib.h"
 #include "mathlib.h"
 #include "inout.h"
+#include "threads.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -41,6 +42,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #if defined (__linux__) || defined (__APPLE__)
 #include <unistd.h>
+#include <sys/time.h>
 #endif
 
 #ifdef NeXT
@@ -67,68 +69,188 @@ void *safe_malloc_f( size_t size )
 }
 
 // VorteX: memory logging
-#define MEM_MAXLOGS	1024
-typedef struct memlogr_s
+// memlog.txt now holds the peak of every allocation tag instead of a line per call
+
+static memTag_t		*memTags = NULL;
+static volatile int	memTagsLock = 0;
+static int			memTagDepth = 0, memTagOverflow = 0;
+static memTag_t		memTagTotal = MEMTAG( "all tags" );
+
+#define MEMTAG_HEADER_SIZE	16		/* keeps 16 byte alignment */
+
+typedef struct memTagHeader_s
+{
+	memTag_t	*tag;
+	size_t		size;
+}
+memTagHeader_t;
+
+static void MemTagLock( volatile int *lock )
 {
-	char file[MAX_OS_PATH];
-	size_t bytes;
-}memlogr_t;
-memlogr_t memlogs[MEM_MAXLOGS];
-int memnumlogs;
+	while( ThreadAtomicCompareExchange( lock, 1, 0 ) != 0 )
+		;
+}
+
+static void MemTagUnlock( volatile int *lock )
+{
+	ThreadAtomicCompareExchange( lock, 0, 1 );
+}
+
+static void MemTagAdd( memTag_t *tag, size_t size, qboolean alloc )
+{
+	MemTagLock( &tag->lock );
+	if( alloc )
+	{
+		tag->current += size;
+		if( tag->current > tag->peak )
+			tag->peak = tag->current;
+		if( tag->current > tag->stagePeak[ memTagDepth ] )
+			tag->stagePeak[ memTagDepth ] = tag->current;
+	}
+	else
+		tag->current -= size;
+	MemTagUnlock( &tag->lock );
+}
 
 void safe_malloc_logstart()
 {
-	FILE *f;
+	memTag_t	*tag;
 
-	memnumlogs = 0;
-	f = fopen("memlog.txt", "w"); 
-	if (!f)
-		return;
-	fputs("LOG STARTED\n", f);
-	fputs("****************************************\n", f);
+	/* forget peaks from before the log was started */
+	MemTagLock( &memTagsLock );
+	for( tag = memTags; tag != NULL; tag = tag->next )
+		memset( tag->stagePeak, 0, sizeof( tag->stagePeak ) );
+	MemTagUnlock( &memTagsLock );
 }
 
 void *safe_malloc_log(size_t size, const char *file, int line)
 {
-	int log;
-	char str[MAX_OS_PATH];
 	void *p;
 
-	if (memlog) 
-	{
-		safe_malloc_logend();
-		sprintf(str, "%s:%i", file, line);
-		for (log = 0; log < memnumlogs; log++)
-			if (!strcmp(str, memlogs[log].file))
-				memlogs[log].bytes += size;
-		if (memnumlogs >= MEM_MAXLOGS)
-			Error("MEM_MAXLOGS exceeded\n");
-		// new
-		strcpy(memlogs[memnumlogs].file, str);
-		memlogs[memnumlogs].bytes = size;
-		memnumlogs++;
-	}
-
 	// malloc
 	p = malloc(size);
 	if (!p)
+	{
+		if (memlog)
+			safe_malloc_logend();
 		Error("safe_malloc(%s:%i) failed on allocation of %i bytes", file, line, size);
+	}
 	return p;
 }
 
 void safe_malloc_logend()
 {
-	int log;
+	memTag_t *tag;
 	FILE *f;
 
-	f = fopen("memlog.txt", "a"); 
+	f = fopen("memlog.txt", "w"); 
 	if (!f)
 		return;
-	for (log = 0; log < memnumlogs; log++)
-		fprintf(f, "%s = %i\n", memlogs[log].file, memlogs[log].bytes);
+	fprintf(f, "%s = %.0f KB peak, %.0f KB current\n", memTagTotal.name, memTagTotal.peak / 1024.0, memTagTotal.current / 1024.0);
+	for (tag = memTags; tag != NULL; tag = tag->next)
+		fprintf(f, "%s = %.0f KB peak, %.0f KB current\n", tag->name, tag->peak / 1024.0, tag->current / 1024.0);
 	fclose(f);
 }
 
+/*
+safe_malloc_tag()
+allocates memory charged to a tag, must be released with safe_free_tag()
+*/
+void *safe_malloc_tag( size_t size, memTag_t *tag )
+{
+	memTagHeader_t	*header;
+
+	/* register the tag */
+	if( !tag->registered )
+	{
+		MemTagLock( &memTagsLock );
+		if( !tag->registered )
+		{
+			tag->next = memTags;
+			memTags = tag;
+			tag->registered = qtrue;
+		}
+		MemTagUnlock( &memTagsLock );
+	}
+
+	header = (memTagHeader_t *)malloc( size + MEMTAG_HEADER_SIZE );
+	if( header == NULL )
+	{
+		if( memlog )
+			safe_malloc_logend();
+		Error( "safe_malloc_tag: failed on allocation of %.0f KB for %s (%.0f KB in use)", size / 1024.0, tag->name, memTagTotal.current / 1024.0 );
+	}
+	header->tag = tag;
+	header->size = size;
+	MemTagAdd( tag, size, qtrue );
+	MemTagAdd( &memTagTotal, size, qtrue );
+	return (byte *)header + MEMTAG_HEADER_SIZE;
+}
+
+void safe_free_tag( void *p )
+{
+	memTagHeader_t	*header;
+
+	if( p == NULL )
+		return;
+	header = (memTagHeader_t *)((byte *)p - MEMTAG_HEADER_SIZE);
+	MemTagAdd( header->tag, header->size, qfalse );
+	MemTagAdd( &memTagTotal, header->size, qfalse );
+	free( header );
+}
+
+/*
+MemTagPush()
+MemTagPop()
+bracket a stage; with -memlog, popping prints the peak of every tag that was in use during the stage
+*/
+void MemTagPush( void )
+{
+	memTag_t	*tag;
+
+	if( memTagDepth >= MAX_MEMTAG_DEPTH - 1 )
+	{
+		memTagOverflow++;
+		return;
+	}
+	memTagDepth++;
+	for( tag = memTags; tag != NULL; tag = tag->next )
+		tag->stagePeak[ memTagDepth ] = tag->current;
+	memTagTotal.stagePeak[ memTagDepth ] = memTagTotal.current;
+}
+
+void MemTagPop( const char *stage )
+{
+	memTag_t	*tag;
+	int			depth;
+
+	if( memTagOverflow > 0 )
+	{
+		memTagOverflow--;
+		return;
+	}
+	if( memTagDepth <= 0 )
+		return;
+	depth = memTagDepth;
+	memTagDepth--;
+
+	/* fold into the enclosing stage */
+	for( tag = memTags; tag != NULL; tag = tag->next )
+		if( tag->stagePeak[ depth ] > tag->stagePeak[ depth - 1 ] )
+			tag->stagePeak[ depth - 1 ] = tag->stagePeak[ depth ];
+	if( memTagTotal.stagePeak[ depth ] > memTagTotal.stagePeak[ depth - 1 ] )
+		memTagTotal.stagePeak[ depth - 1 ] = memTagTotal.stagePeak[ depth ];
+
+	/* report */
+	if( !memlog || memTagTotal.stagePeak[ depth ] == 0 )
+		return;
+	Sys_Printf( "--- Memory (%s) ---\n", stage );
+	for( tag = memTags; tag != NULL; tag = tag->next )
+		if( tag->stagePeak[ depth ] > 0 )
+			Sys_Printf( "%9.0f KB peak, %.0f KB current: %s\n", tag->stagePeak[ depth ] / 1024.0, tag->current / 1024.0, tag->name );
+	Sys_Printf( "%9.0f KB peak, %.0f KB current: %s\n", memTagTotal.stagePeak[ depth ] / 1024.0, memTagTotal.current / 1024.0, memTagTotal.name );
+}
+
 void *safe_malloc_info( size_t size, char* info )
 {
   void *p;
@@ -402,6 +524,31 @@ double I_FloatTime (void)
 #endif
 }
 
+/*
+================
+I_PreciseTime
+
+seconds with sub-millisecond resolution, for timing individual work items
+================
+*/
+double I_PreciseTime (void)
+{
+#if defined(WIN32) || defined(WIN64)
+	static LARGE_INTEGER	freq;
+	LARGE_INTEGER			count;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency (&freq);
+	QueryPerformanceCounter (&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timeval tp;
+
+	gettimeofday (&tp, NULL);
+	return tp.tv_sec + tp.tv_usec/1000000.0;
+#endif
+}
+
 void Q_getwd (char *out)
 {
 	int i = 0;
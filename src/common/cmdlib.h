@@ -68,6 +68,24 @@ void safe_malloc_logend();
 void *safe_malloc_info( size_t size, char* info );
 // VorteX: memlog.txt writing
 extern qboolean memlog;
+
+// tagged allocations, current and peak bytes per tag and per stage
+#define MAX_MEMTAG_DEPTH 32
+typedef struct memTag_s
+{
+	const char			*name;
+	struct memTag_s		*next;
+	volatile int		registered;
+	volatile int		lock;
+	size_t				current, peak;
+	size_t				stagePeak[ MAX_MEMTAG_DEPTH ];
+}
+memTag_t;
+#define MEMTAG( name ) { name }
+void *safe_malloc_tag( size_t size, memTag_t *tag );
+void safe_free_tag( void *p );
+void MemTagPush( void );
+void MemTagPop( const char *stage );
 #define safe_malloc(s) safe_malloc_log(s, __FILE__, __LINE__);
 #else
 #define safe_malloc(a) malloc(a)
@@ -100,6 +118,7 @@ void ExpandWildcards( int *argc, char ***argv );
 
 
 double I_FloatTime( void );
+double I_PreciseTime( void );
 
 void	Error( const char *error, ... );
 int		CheckParm( const char *check );
@@ -32,12 +32,15 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "mathlib.h"
 #include "polylib.h"
 #include "inout.h"
+#include "threads.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #if defined(WIN32) || defined(WIN64)
 #include <direct.h>
 #include <windows.h>
+#else
+#include <pthread.h>
 #endif
 
 // network broadcasting
@@ -83,8 +86,22 @@ xmlNodePtr xml_NodeForVec( vec3_t v )
 	return ret;
 }
 
+// the document is shared with the log writer thread
+static volatile int logXMLLock = 0;
+
+static void LockXML( void )
+{
+	while( ThreadAtomicCompareExchange( &logXMLLock, 1, 0 ) != 0 )
+		;
+}
+
+static void UnlockXML( void )
+{
+	ThreadAtomicCompareExchange( &logXMLLock, 0, 1 );
+}
+
 // send a node down the stream, add it to the document
-void xml_SendNode (xmlNodePtr node)
+static void SendNode (xmlNodePtr node)
 {
 	xmlBufferPtr xml_buf;
 	char xmlbuf[MAX_NETMESSAGE]; // we have to copy content from the xmlBufferPtr into an aux buffer .. that sucks ..
@@ -149,6 +166,13 @@ void xml_SendNode (xmlNodePtr node)
 	}  
 }
 
+void xml_SendNode (xmlNodePtr node)
+{
+	LockXML();
+	SendNode( node );
+	UnlockXML();
+}
+
 /*
 xml_Select()
 debug message with entity info
@@ -308,19 +332,13 @@ void Broadcast_Shutdown()
 	}
 }
 
-// all output ends up through here
-void FPrintf( int flag, char *buf )
+// the XML part of FPrintf, not for SYS_NOXML messages
+static void FPrintfXML( int flag, char *buf )
 {
 	xmlNodePtr node;
 	static qboolean bGotXML = qfalse;
 	char level[2];
 
-	printf( buf );
-
-	// the following part is XML stuff only.. but maybe we don't want that message to go down the XML pipe?
-	if( flag == SYS_NOXML )
-		return;
-
 	// ouput an XML file of the run
 	// use the DOM interface to build a tree
 	/*
@@ -345,7 +363,266 @@ void FPrintf( int flag, char *buf )
 	level[0] = (int)'0' + flag;
 	level[1] = 0;
 	xmlSetProp( node, (xmlChar *)"level", (xmlChar *)&level );
-	xml_SendNode( node );
+	SendNode( node );
+}
+
+// all output ends up through here
+void FPrintf( int flag, char *buf )
+{
+	fputs( buf, stdout );
+
+	// the following part is XML stuff only.. but maybe we don't want that message to go down the XML pipe?
+	if( flag == SYS_NOXML )
+		return;
+	FPrintfXML( flag, buf );
+}
+
+/*
+asynchronous log
+Sys_Printf() and Sys_FPrintf() format on the calling thread and post the line into that thread's ring,
+a writer thread merges the rings back into print order (by sequence number) and does the slow part:
+stdout, the XML document and the editor socket; XML text is batched so the editor gets at most a few
+messages a second however chatty the compile is
+*/
+
+#define LOG_RING_SIZE			256			/* lines per thread, power of two */
+#define LOG_LINE_SIZE			256			/* longer lines are printed synchronously */
+#define MAX_LOG_RINGS			256
+#define LOG_BROADCAST_INTERVAL	0.25		/* seconds between XML messages */
+
+typedef struct logLine_s
+{
+	int					seq;
+	int					flag;
+	char				text[ LOG_LINE_SIZE ];
+}
+logLine_t;
+
+typedef struct logRing_s
+{
+	volatile int		head, tail;			/* head is advanced by the writer, tail by the owning thread */
+	logLine_t			lines[ LOG_RING_SIZE ];
+}
+logRing_t;
+
+static logRing_t				*logRings[ MAX_LOG_RINGS ];
+static volatile int				numLogRings = 0;
+static volatile int				logSeq = 0;			/* next sequence number to hand out */
+static volatile int				logWritten = 0;		/* sequence numbers below this are written */
+static volatile int				logRunning = 0;
+static THREAD_LOCAL logRing_t	*logRing = NULL;
+static THREAD_LOCAL int			logWriter = 0;
+
+/* pending XML text */
+static char						logXML[ MAX_NETMESSAGE / 2 ];
+static int						logXMLFlag = -1, logXMLLength = 0;
+static double					logXMLTime = 0;
+
+#if defined(WIN32) || defined(WIN64)
+static HANDLE					logThread;
+#else
+static pthread_t				logThread;
+#endif
+
+static void FlushLogXML( void )
+{
+	if( logXMLLength <= 0 )
+		return;
+	LockXML();
+	FPrintfXML( logXMLFlag, logXML );
+	UnlockXML();
+	logXMLLength = 0;
+	logXMLFlag = -1;
+	logXMLTime = I_PreciseTime();
+}
+
+static void WriteLogLine( int flag, char *text )
+{
+	int		length;
+
+	fputs( text, stdout );
+	if( flag == SYS_NOXML )
+		return;
+
+	/* batch XML text of the same level */
+	length = strlen( text );
+	if( flag != logXMLFlag || logXMLLength + length >= (int) sizeof( logXML ) )
+		FlushLogXML();
+	if( length >= (int) sizeof( logXML ) )
+	{
+		LockXML();
+		FPrintfXML( flag, text );
+		UnlockXML();
+		return;
+	}
+	memcpy( logXML + logXMLLength, text, length + 1 );
+	logXMLLength += length;
+	logXMLFlag = flag;
+
+	/* warnings and errors go out right away */
+	if( flag == SYS_WRN || flag == SYS_ERR || I_PreciseTime() - logXMLTime >= LOG_BROADCAST_INTERVAL )
+		FlushLogXML();
+}
+
+/*
+DrainLog()
+writes every posted line whose turn has come, returns the number of lines written
+*/
+
+static int DrainLog( void )
+{
+	int			i, n, count;
+	logRing_t	*ring;
+	logLine_t	*line;
+
+	count = 0;
+	n = numLogRings;
+	for( ;; )
+	{
+		/* find the ring holding the next line */
+		for( i = 0; i < n; i++ )
+		{
+			ring = logRings[ i ];
+			if( ring == NULL || ring->head == ring->tail )
+				continue;
+			line = &ring->lines[ ring->head & (LOG_RING_SIZE - 1) ];
+			if( line->seq == logWritten )
+				break;
+		}
+		if( i >= n )
+			return count;
+
+		WriteLogLine( line->flag, line->text );
+		ThreadAtomicAdd( &ring->head, 1 );
+		ThreadAtomicAdd( &logWritten, 1 );
+		count++;
+	}
+}
+
+#if defined(WIN32) || defined(WIN64)
+static DWORD WINAPI LogWriterThread( LPVOID param )
+#else
+static void *LogWriterThread( void *param )
+#endif
+{
+	int		idle;
+
+	logWriter = 1;
+	idle = 0;
+	while( logRunning || logWritten != logSeq )
+	{
+		if( DrainLog() > 0 )
+		{
+			idle = 0;
+			continue;
+		}
+
+		/* nothing to do, push out what is pending and back off */
+		if( idle++ == 0 )
+			fflush( stdout );
+		if( logXMLLength > 0 && I_PreciseTime() - logXMLTime >= LOG_BROADCAST_INTERVAL )
+			FlushLogXML();
+		Sys_Sleep( idle < 16 ? 0 : 1 );
+	}
+	FlushLogXML();
+	fflush( stdout );
+	return 0;
+}
+
+/*
+Sys_LogStart()
+starts the writer thread, until then all output is synchronous
+*/
+
+void Sys_LogStart( void )
+{
+	if( logRunning )
+		return;
+	logRunning = 1;
+	logXMLTime = I_PreciseTime();
+#if defined(WIN32) || defined(WIN64)
+	logThread = CreateThread( NULL, 0, LogWriterThread, NULL, 0, NULL );
+	if( logThread == NULL )
+		logRunning = 0;
+#else
+	if( pthread_create( &logThread, NULL, LogWriterThread, NULL ) != 0 )
+		logRunning = 0;
+#endif
+}
+
+/*
+Sys_LogShutdown()
+writes everything posted so far and stops the writer thread, output is synchronous again afterwards
+*/
+
+void Sys_LogShutdown( void )
+{
+	if( !logRunning || logWriter )
+		return;
+	logRunning = 0;
+#if defined(WIN32) || defined(WIN64)
+	WaitForSingleObject( logThread, INFINITE );
+	CloseHandle( logThread );
+#else
+	pthread_join( logThread, NULL );
+#endif
+}
+
+/*
+PostLog()
+queues a formatted line for the writer thread, or prints it right away when there is none
+*/
+
+static void PostLog( int flag, char *text )
+{
+	int			index, seq;
+	logLine_t	*line;
+
+	/* synchronous */
+	if( !logRunning || logWriter || strlen( text ) >= LOG_LINE_SIZE )
+	{
+		/* keep order with anything still queued */
+		if( logRunning && !logWriter )
+		{
+			while( logWritten != logSeq )
+				Sys_Sleep( 0 );
+		}
+		if( flag == SYS_NOXML )
+			FPrintf( flag, text );
+		else
+		{
+			LockXML();
+			FPrintf( flag, text );
+			UnlockXML();
+		}
+		return;
+	}
+
+	/* first line from this thread */
+	if( logRing == NULL )
+	{
+		index = ThreadAtomicAdd( &numLogRings, 1 );
+		if( index >= MAX_LOG_RINGS )
+		{
+			ThreadAtomicAdd( &numLogRings, -1 );
+			Error( "PostLog: MAX_LOG_RINGS (%d) exceeded", MAX_LOG_RINGS );
+		}
+		logRing = (logRing_t *)safe_malloc( sizeof( *logRing ) );
+		memset( logRing, 0, sizeof( *logRing ) );
+		logRings[ index ] = logRing;
+	}
+
+	/* wait for room */
+	while( logRing->tail - logRing->head >= LOG_RING_SIZE )
+		Sys_Sleep( 0 );
+
+	/* fill and publish */
+	line = &logRing->lines[ logRing->tail & (LOG_RING_SIZE - 1) ];
+	seq = ThreadAtomicAdd( &logSeq, 1 );
+	line->seq = seq;
+	line->flag = flag;
+	strcpy( line->text, text );
+	ThreadAtomicAdd( &logRing->tail, 1 );
 }
 
 #ifdef DBG_XML
@@ -379,7 +656,7 @@ void Sys_FPrintf( int flag, const char *format, ... )
 	va_end( argptr );
 
 	/* send */
-	FPrintf (flag, out_buffer);
+	PostLog( flag, out_buffer );
 }
 
 void Sys_Printf( const char *format, ... )
@@ -402,7 +679,7 @@ void Sys_Printf( const char *format, ... )
 	va_end( argptr );
 
 	/* send */
-	FPrintf( SYS_STD, out_buffer );
+	PostLog( SYS_STD, out_buffer );
 }
 
 /*
@@ -628,6 +905,7 @@ void Error( const char *error, ... )
 
 	sprintf( out_buffer, "************ ERROR ************\n%s\n", tmp );
 
+	Sys_LogShutdown();
 	FPrintf( SYS_ERR, out_buffer );
 
 	#ifdef DBG_XML  
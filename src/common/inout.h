@@ -35,6 +35,10 @@ extern qboolean bNetworkBroadcast;
 void Broadcast_Setup( const char *dest );
 void Broadcast_Shutdown();
 
+// asynchronous log writer
+void Sys_LogStart( void );
+void Sys_LogShutdown( void );
+
 #define SYS_VRB 0   // verbose support (on/off)
 #define SYS_STD 1   // standard print level
 #define SYS_WRN 2   // warnings
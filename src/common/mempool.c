@@ -0,0 +1,205 @@
+/*
+Copyright (C) 1999-2006 Id Software, Inc. and contributors.
+For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+This file is part of GtkRadiant.
+
+GtkRadiant is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+GtkRadiant is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with GtkRadiant; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "cmdlib.h"
+#include "inout.h"
+#include "threads.h"
+#include "mempool.h"
+
+#define	MAX_MEMPOOLS			16
+#define	MEMPOOL_BLOCK_SIZE		(64 * 1024)
+
+/* every object is preceded by a header; header and class sizes are padded to 16 bytes, so objects keep the alignment of the heap block */
+typedef struct memPoolHeader_s
+{
+	struct memPoolHeader_s	*next;		/* free list link, leaves the object body untouched */
+	int						sizeClass;	/* -1 when allocated straight from the heap */
+}
+memPoolHeader_t;
+
+#define	MEMPOOL_HEADER_SIZE		16
+
+typedef struct memPoolCache_s
+{
+	int						generation;
+	memPoolHeader_t			*free[ MAX_MEMPOOL_CLASSES ];
+	byte					*cursor, *end;
+}
+memPoolCache_t;
+
+static volatile int					numMemPools = 0;
+static THREAD_LOCAL memPoolCache_t	memPoolCaches[ MAX_MEMPOOLS ];
+
+/*
+MemPoolCache()
+returns the calling thread's cache for a pool, dropping it if the pool was released since
+*/
+
+static memPoolCache_t *MemPoolCache( memPool_t *pool )
+{
+	memPoolCache_t	*cache;
+	int				index;
+	
+	
+	/* register the pool */
+	if( pool->index == 0 )
+	{
+		index = ThreadAtomicAdd( &numMemPools, 1 ) + 1;
+		if( index > MAX_MEMPOOLS )
+			Error( "MemPoolCache: MAX_MEMPOOLS (%d) exceeded", MAX_MEMPOOLS );
+		ThreadAtomicCompareExchange( &pool->index, index, 0 );
+	}
+	
+	/* stale? */
+	cache = &memPoolCaches[ pool->index - 1 ];
+	if( cache->generation != pool->generation + 1 )
+	{
+		memset( cache, 0, sizeof( *cache ) );
+		cache->generation = pool->generation + 1;
+	}
+	return cache;
+}
+
+/*
+MemPoolAlloc()
+allocates size bytes (not cleared)
+*/
+
+void *MemPoolAlloc( memPool_t *pool, int size )
+{
+	memPoolCache_t	*cache;
+	memPoolHeader_t	*h;
+	memPoolBlock_t	*block;
+	int				c, classBytes, blockSize, active, peak;
+	
+	
+	/* find size class */
+	for( c = 0; c < pool->numClasses && (pool->minSize << c) < size; c++ );
+	
+	/* too big for the pool */
+	if( c >= pool->numClasses )
+	{
+		h = (memPoolHeader_t *)safe_malloc( MEMPOOL_HEADER_SIZE + size );
+		h->sizeClass = -1;
+	}
+	else
+	{
+		cache = MemPoolCache( pool );
+		
+		/* reuse a freed object */
+		if( cache->free[ c ] != NULL )
+		{
+			h = cache->free[ c ];
+			cache->free[ c ] = h->next;
+		}
+		
+		/* carve from the thread's arena block */
+		else
+		{
+			classBytes = MEMPOOL_HEADER_SIZE + (((pool->minSize << c) + 15) & ~15);
+			if( cache->cursor == NULL || cache->cursor + classBytes > cache->end )
+			{
+				blockSize = classBytes > MEMPOOL_BLOCK_SIZE ? classBytes : MEMPOOL_BLOCK_SIZE;
+				block = (memPoolBlock_t *)safe_malloc( MEMPOOL_HEADER_SIZE + blockSize );
+				block->size = blockSize;
+				while( ThreadAtomicCompareExchange( &pool->lock, 1, 0 ) != 0 );
+				block->next = pool->blocks;
+				pool->blocks = block;
+				ThreadAtomicCompareExchange( &pool->lock, 0, 1 );
+				ThreadAtomicAdd( &pool->blockBytes, blockSize );
+				cache->cursor = (byte *)block + MEMPOOL_HEADER_SIZE;
+				cache->end = cache->cursor + blockSize;
+			}
+			h = (memPoolHeader_t *)cache->cursor;
+			cache->cursor += classBytes;
+		}
+		h->sizeClass = c;
+	}
+	h->next = NULL;
+	
+	/* count */
+	ThreadAtomicAdd( &pool->allocs, 1 );
+	active = ThreadAtomicAdd( &pool->active, 1 ) + 1;
+	for( peak = pool->peak; active > peak; peak = pool->peak )
+	{
+		if( ThreadAtomicCompareExchange( &pool->peak, active, peak ) == peak )
+			break;
+	}
+	
+	return (byte *)h + MEMPOOL_HEADER_SIZE;
+}
+
+/*
+MemPoolFree()
+returns an object to the calling thread's free list
+*/
+
+void MemPoolFree( memPool_t *pool, void *p )
+{
+	memPoolCache_t	*cache;
+	memPoolHeader_t	*h;
+	
+	
+	h = (memPoolHeader_t *)((byte *)p - MEMPOOL_HEADER_SIZE);
+	if( h->sizeClass < 0 )
+		free( h );
+	else
+	{
+		cache = MemPoolCache( pool );
+		h->next = cache->free[ h->sizeClass ];
+		cache->free[ h->sizeClass ] = h;
+	}
+	ThreadAtomicAdd( &pool->active, -1 );
+}
+
+/*
+MemPoolRelease()
+bulk release: once every object of the pool has been freed, hands all of its blocks back to the heap;
+call between threaded stages only
+*/
+
+void MemPoolRelease( memPool_t *pool )
+{
+	memPoolBlock_t	*block, *next;
+	
+	
+	if( pool->active != 0 || pool->blocks == NULL )
+		return;
+	for( block = pool->blocks; block != NULL; block = next )
+	{
+		next = block->next;
+		free( block );
+	}
+	pool->blocks = NULL;
+	pool->blockBytes = 0;
+	pool->generation++;
+}
+
+/*
+MemPoolStats()
+prints pool counters
+*/
+
+void MemPoolStats( memPool_t *pool )
+{
+	Sys_FPrintf( SYS_VRB, "%9d %s allocations, %d peak, %d active, %d KB in blocks\n",
+		pool->allocs, pool->name, pool->peak, pool->active, pool->blockBytes / 1024 );
+}
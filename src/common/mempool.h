@@ -0,0 +1,67 @@
+/*
+Copyright (C) 1999-2006 Id Software, Inc. and contributors.
+For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+This file is part of GtkRadiant.
+
+GtkRadiant is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+GtkRadiant is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with GtkRadiant; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef __MEMPOOL__
+#define __MEMPOOL__
+
+/*
+pool allocator for small, frequently allocated objects
+objects are carved from arena blocks and recycled through per-thread free lists (one per power of
+two size class starting at minSize); anything above the largest class goes straight to the heap
+*/
+
+#define	MAX_MEMPOOL_CLASSES		8
+
+typedef struct memPoolBlock_s
+{
+	struct memPoolBlock_s	*next;
+	int						size;
+}
+memPoolBlock_t;
+
+typedef struct memPool_s
+{
+	const char				*name;
+	int						minSize;
+	int						numClasses;
+
+	/* assigned on first use */
+	volatile int			index;
+	volatile int			generation;
+	volatile int			lock;
+	memPoolBlock_t			*blocks;
+
+	/* counters, valid when threaded */
+	volatile int			allocs;
+	volatile int			active;
+	volatile int			peak;
+	volatile int			blockBytes;
+}
+memPool_t;
+
+#define	MEMPOOL( name, minSize, numClasses )	{ name, minSize, numClasses, 0, 0, 0, NULL, 0, 0, 0, 0 }
+
+void	*MemPoolAlloc (memPool_t *pool, int size);
+void	MemPoolFree (memPool_t *pool, void *p);
+void	MemPoolRelease (memPool_t *pool);
+void	MemPoolStats (memPool_t *pool);
+
+#endif
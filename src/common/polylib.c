@@ -25,16 +25,13 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "inout.h"
 #include "polylib.h"
 #include "files.h"
+#include "mempool.h"
 
 
 extern int numthreads;
 
-// counters are only bumped when running single threaded,
-// because they are an awefull coherence problem
-int	c_active_windings;
-int	c_peak_windings;
-int	c_winding_allocs;
-int	c_winding_points;
+// windings of up to 4, 8, 16, 32 and 64 points come from the pool
+memPool_t	windingPool = MEMPOOL( "winding", sizeof(int) + sizeof(vec_t)*3*4, 5 );
 
 #define	BOGUS_RANGE	WORLD_SIZE
 
@@ -59,16 +56,8 @@ winding_t *AllocWinding(int points)
   if (points >= MAX_POINTS_ON_WINDING)
     Error ("AllocWinding failed: MAX_POINTS_ON_WINDING exceeded");
 
-	if( numthreads == 1 )
-	{
-		c_winding_allocs++;
-		c_winding_points += points;
-		c_active_windings++;
-		if (c_active_windings > c_peak_windings)
-			c_peak_windings = c_active_windings;
-	}
 	s = sizeof(vec_t)*3*points + sizeof(int);
-	w = (winding_t *)safe_malloc (s);
+	w = (winding_t *)MemPoolAlloc (&windingPool, s);
 	memset (w, 0, s); 
 	return w;
 }
@@ -78,9 +67,7 @@ void FreeWinding (winding_t *w)
 	if (*(unsigned *)w == 0xdeaddead)
 		Error ("FreeWinding: freed a freed winding");
 	*(unsigned *)w = 0xdeaddead;
-	if( numthreads == 1 )
-		c_active_windings--;
-	free (w);
+	MemPoolFree (&windingPool, w);
 }
 
 /*
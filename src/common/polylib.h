@@ -30,6 +30,8 @@ typedef struct
 
 #define	MAX_POINTS_ON_WINDING	64
 
+extern struct memPool_s	windingPool;
+
 // you can define on_epsilon in the makefile as tighter
 #ifndef	ON_EPSILON
 #define	ON_EPSILON	0.1
@@ -0,0 +1,256 @@
+/*
+Copyright (C) 1999-2006 Id Software, Inc. and contributors.
+For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+This file is part of GtkRadiant.
+
+GtkRadiant is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+GtkRadiant is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with GtkRadiant; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "cmdlib.h"
+#include "inout.h"
+#include "profile.h"
+
+#define	MAX_PROFILE_THREADS		256
+#define	MAX_PROFILE_DEPTH		64
+
+typedef struct profileNode_s
+{
+	const char				*name;
+	struct profileNode_s	*parent, *children, *next;
+	int						count;
+	double					start, total;
+	double					busy, capacity;		/* thread time used and available in threaded runs */
+}
+profileNode_t;
+
+typedef struct profileEvent_s
+{
+	const char				*name;
+	int						tid;
+	double					ts, dur;
+}
+profileEvent_t;
+
+static qboolean			profiling = qfalse;
+static char				profileFile[ MAX_OS_PATH ];
+static double			profileStart;
+static profileNode_t	profileRoot;
+static profileNode_t	*profileCurrent = NULL;
+static profileEvent_t	*profileEvents = NULL;
+static int				numProfileEvents = 0, maxProfileEvents = 0;
+static int				profileThreads = 0;
+static const char		*stageNames[ MAX_PROFILE_DEPTH ];
+static int				numStages = 0;
+static double			threadBusy[ MAX_PROFILE_THREADS ], threadIdle[ MAX_PROFILE_THREADS ];
+
+static void AddProfileEvent( const char *name, int tid, double ts, double dur )
+{
+	profileEvent_t	*events;
+	
+	
+	if( numProfileEvents >= maxProfileEvents )
+	{
+		maxProfileEvents = maxProfileEvents ? maxProfileEvents * 2 : 1024;
+		events = (profileEvent_t *)safe_malloc( maxProfileEvents * sizeof( *events ) );
+		if( profileEvents != NULL )
+		{
+			memcpy( events, profileEvents, numProfileEvents * sizeof( *events ) );
+			free( profileEvents );
+		}
+		profileEvents = events;
+	}
+	profileEvents[ numProfileEvents ].name = name;
+	profileEvents[ numProfileEvents ].tid = tid;
+	profileEvents[ numProfileEvents ].ts = ts - profileStart;
+	profileEvents[ numProfileEvents ].dur = dur;
+	numProfileEvents++;
+}
+
+/*
+ProfileStart()
+enables profiling, the trace is written to filename by ProfileWrite()
+*/
+
+void ProfileStart( const char *filename )
+{
+	strncpy( profileFile, filename, MAX_OS_PATH - 1 );
+	profileFile[ MAX_OS_PATH - 1 ] = '\0';
+	memset( &profileRoot, 0, sizeof( profileRoot ) );
+	profileRoot.name = "total";
+	profileStart = I_PreciseTime();
+	profileRoot.start = profileStart;
+	profileCurrent = &profileRoot;
+	profiling = qtrue;
+}
+
+qboolean ProfileEnabled( void )
+{
+	return profiling;
+}
+
+/*
+ProfileBegin()
+opens a scope below the current one; scopes with the same name and parent are merged in the summary
+*/
+
+void ProfileBegin( const char *name )
+{
+	profileNode_t	*node, **link;
+	
+	
+	/* stage memory accounting runs without the profiler */
+	if( numStages < MAX_PROFILE_DEPTH )
+		stageNames[ numStages ] = name;
+	numStages++;
+	MemTagPush();
+	
+	if( !profiling )
+		return;
+	
+	/* find or append child, keeping children in order of first use */
+	for( link = &profileCurrent->children; *link != NULL; link = &(*link)->next )
+		if( !strcmp( (*link)->name, name ) )
+			break;
+	node = *link;
+	if( node == NULL )
+	{
+		node = (profileNode_t *)safe_malloc( sizeof( *node ) );
+		memset( node, 0, sizeof( *node ) );
+		node->name = name;
+		node->parent = profileCurrent;
+		*link = node;
+	}
+	
+	node->start = I_PreciseTime();
+	profileCurrent = node;
+}
+
+void ProfileEnd( void )
+{
+	profileNode_t	*node;
+	double			dur;
+	
+	
+	if( numStages > 0 )
+	{
+		numStages--;
+		MemTagPop( numStages < MAX_PROFILE_DEPTH ? stageNames[ numStages ] : "?" );
+	}
+	
+	if( !profiling || profileCurrent == &profileRoot )
+		return;
+	
+	node = profileCurrent;
+	dur = I_PreciseTime() - node->start;
+	node->total += dur;
+	node->count++;
+	AddProfileEvent( node->name, 0, node->start, dur );
+	profileCurrent = node->parent;
+}
+
+/*
+ProfileThreads()
+records the busy time of every worker in one threaded run and charges it to the current scope
+*/
+
+void ProfileThreads( double start, double end, int numthreads, const double *threadStart, const double *threadEnd )
+{
+	int				i;
+	double			busy;
+	
+	
+	if( !profiling )
+		return;
+	if( numthreads > MAX_PROFILE_THREADS )
+		numthreads = MAX_PROFILE_THREADS;
+	if( numthreads > profileThreads )
+		profileThreads = numthreads;
+	
+	for( i = 0; i < numthreads; i++ )
+	{
+		busy = threadEnd[ i ] - threadStart[ i ];
+		threadBusy[ i ] += busy;
+		threadIdle[ i ] += (end - start) - busy;
+		profileCurrent->busy += busy;
+		AddProfileEvent( profileCurrent->name, i + 1, threadStart[ i ], busy );
+	}
+	profileCurrent->capacity += (end - start) * numthreads;
+}
+
+static void PrintProfileNode( profileNode_t *node, int depth )
+{
+	profileNode_t	*child;
+	
+	
+	Sys_Printf( "%9.2fs %*s%s", node->total, depth * 2, "", node->name );
+	if( node->count > 1 )
+		Sys_Printf( " (%d times)", node->count );
+	if( node->capacity > 0.0 )
+		Sys_Printf( ", %.0f%% thread utilization", 100.0 * node->busy / node->capacity );
+	Sys_Printf( "\n" );
+	
+	for( child = node->children; child != NULL; child = child->next )
+		PrintProfileNode( child, depth + 1 );
+}
+
+/*
+ProfileWrite()
+closes open scopes, prints the scope tree and per-thread totals and writes the trace file
+*/
+
+void ProfileWrite( void )
+{
+	FILE			*file;
+	int				i;
+	profileEvent_t	*ev;
+	
+	
+	if( !profiling )
+		return;
+	
+	/* close everything still open */
+	while( profileCurrent != &profileRoot )
+		ProfileEnd();
+	profileRoot.total = I_PreciseTime() - profileRoot.start;
+	profileRoot.count = 1;
+	
+	/* summary */
+	Sys_Printf( "--- Profile ---\n" );
+	PrintProfileNode( &profileRoot, 0 );
+	for( i = 0; i < profileThreads; i++ )
+		Sys_Printf( "%9.2fs busy, %.2fs idle on thread %d\n", threadBusy[ i ], threadIdle[ i ], i );
+	
+	/* trace */
+	file = fopen( profileFile, "w" );
+	if( file == NULL )
+	{
+		Sys_Printf( "WARNING: could not write profile to %s\n", profileFile );
+		profiling = qfalse;
+		return;
+	}
+	fprintf( file, "{\"traceEvents\":[\n" );
+	fprintf( file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}}" );
+	for( i = 0; i < profileThreads; i++ )
+		fprintf( file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}", i + 1, i );
+	for( i = 0, ev = profileEvents; i < numProfileEvents; i++, ev++ )
+		fprintf( file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.0f,\"dur\":%.0f}",
+			ev->name, ev->tid, ev->ts * 1000000.0, ev->dur * 1000000.0 );
+	fprintf( file, "\n]}\n" );
+	fclose( file );
+	
+	Sys_Printf( "%9d profile events written to %s\n", numProfileEvents, profileFile );
+	profiling = qfalse;
+}
@@ -0,0 +1,39 @@
+/*
+Copyright (C) 1999-2006 Id Software, Inc. and contributors.
+For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+This file is part of GtkRadiant.
+
+GtkRadiant is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+GtkRadiant is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with GtkRadiant; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef __PROFILE__
+#define __PROFILE__
+
+/*
+stage profiler
+ProfileBegin()/ProfileEnd() pairs open nested named scopes on the main thread (names must be string literals),
+RunThreadsOn() adds per-thread busy time; enabled by -profile <file.json>, which is written in Chrome trace format
+with -memlog the end of every scope also reports the tagged memory peaks of that stage
+*/
+
+void		ProfileStart (const char *filename);
+qboolean	ProfileEnabled (void);
+void		ProfileBegin (const char *name);
+void		ProfileEnd (void);
+void		ProfileThreads (double start, double end, int numthreads, const double *threadStart, const double *threadEnd);
+void		ProfileWrite (void);
+
+#endif
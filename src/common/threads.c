@@ -23,79 +23,273 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "mathlib.h"
 #include "inout.h"
 #include "threads.h"
+#include "profile.h"
 
 #define	MAX_THREADS	256
 
-int	dispatch;
-int	workcount;
-int	oldf;
-qboolean pacifier;
-qboolean threaded;
+/* guided scheduling: each grab takes remaining / (numthreads * GUIDED_CHUNK_DIVISOR) items */
+#define	GUIDED_CHUNK_DIVISOR	4
+#define	GUIDED_CHUNK_MAX		64
+
+volatile int	dispatch;
+int				workcount;
+volatile int	oldf;
+volatile int	pacifierBusy;
+qboolean		pacifier;
+qboolean		threaded;
+qboolean		threadAffinity = qfalse;
+static int		*workOrder = NULL;		/* cost ordered dispatch, see RunThreadsOnIndividualCost() */
+
+/*
+ThreadWorkPacifier()
+prints progress up to the current dispatch point; only one thread prints at a time,
+others skip instead of waiting, so the work dispenser never blocks on output
+*/
+
+static void ThreadWorkPacifier( int work )
+{
+	int	f;
+
+	if( pacifier == qfalse || workcount <= 0 )
+		return;
+	f = 10 * work / workcount;
+	if( oldf >= f )
+		return;
+	if( ThreadAtomicCompareExchange( &pacifierBusy, 1, 0 ) != 0 )
+		return;
+	while( oldf < f )
+	{
+		oldf++;
+		Sys_Printf( "%i...", oldf );
+	}
+	pacifierBusy = 0;
+}
+
+/*
+GetThreadWorkChunk()
+grabs a range of work items [*start, *end) without taking the global lock;
+chunk size shrinks as work runs out (guided scheduling) so the tail stays balanced;
+cost ordered runs take one item at a time
+*/
+
+qboolean GetThreadWorkChunk( int *start, int *end )
+{
+	int	d, chunk;
+
+	while( 1 )
+	{
+		d = dispatch;
+		if( d >= workcount )
+			return qfalse;
+		chunk = (workcount - d) / (numthreads * GUIDED_CHUNK_DIVISOR);
+		if( chunk > GUIDED_CHUNK_MAX )
+			chunk = GUIDED_CHUNK_MAX;
+		if( chunk < 1 || workOrder != NULL )
+			chunk = 1;
+		if( ThreadAtomicCompareExchange( &dispatch, d + chunk, d ) == d )
+			break;
+	}
+	*start = d;
+	*end = d + chunk;
+	ThreadWorkPacifier( d );
+	return qtrue;
+}
 
 // get a new work for thread
 int	GetThreadWork ( void )
 {
 	int	r;
-	int	f;
 
-	ThreadLock();
-	if (dispatch >= workcount)
+	if( dispatch >= workcount )
+		return -1;
+	r = ThreadAtomicAdd( &dispatch, 1 );
+	if( r >= workcount )
+		return -1;
+	ThreadWorkPacifier( r );
+	return r;
+}
+
+/*
+cost ordered dispatch
+the *Cost() run variants estimate every item up front and hand out the largest estimates first,
+so the most expensive items don't end up as the tail
+*/
+
+static float	(*workCostFunc)(int) = NULL;
+static float	*workEstimate = NULL;
+static double	*workActual = NULL;
+
+static void EstimateWorkThread( int threadnum )
+{
+	int	work, start, end;
+
+	while( GetThreadWorkChunk( &start, &end ) )
 	{
-		ThreadUnlock();
+		for( work = start; work < end; work++ )
+			workEstimate[ work ] = workCostFunc( work );
+	}
+}
+
+static int CompareWorkEstimate( const void *a, const void *b )
+{
+	int	ia = *(const int *)a, ib = *(const int *)b;
+
+	if( workEstimate[ ia ] > workEstimate[ ib ] )
 		return -1;
+	if( workEstimate[ ia ] < workEstimate[ ib ] )
+		return 1;
+	return ia - ib;
+}
+
+static void FreeWorkOrder( void )
+{
+	free( workEstimate );
+	free( workActual );
+	free( workOrder );
+	workEstimate = NULL;
+	workActual = NULL;
+	workOrder = NULL;
+}
+
+static void BeginWorkOrder( int workcnt, float(*cost)(int) )
+{
+	int		i;
+
+	if( workOrder != NULL )
+		FreeWorkOrder();
+	if( cost == NULL || workcnt <= 1 )
+		return;
+
+	/* estimate in parallel, then sort */
+	workEstimate = (float *)safe_malloc( workcnt * sizeof( *workEstimate ) );
+	workActual = (double *)safe_malloc( workcnt * sizeof( *workActual ) );
+	workCostFunc = cost;
+	RunThreadsOn( workcnt, qfalse, EstimateWorkThread );
+	workCostFunc = NULL;
+
+	workOrder = (int *)safe_malloc( workcnt * sizeof( *workOrder ) );
+	for( i = 0; i < workcnt; i++ )
+	{
+		workOrder[ i ] = i;
+		workActual[ i ] = 0.0;
 	}
-	if (pacifier == qtrue)
+	qsort( workOrder, workcnt, sizeof( *workOrder ), CompareWorkEstimate );
+}
+
+static void EndWorkOrder( int workcnt )
+{
+	int		i, slowest, rank;
+	double	n, sumE, sumA, sumEE, sumAA, sumEA, varE, varA, corr;
+
+	if( workOrder == NULL )
+		return;
+
+	/* correlation of estimated against measured cost */
+	sumE = sumA = sumEE = sumAA = sumEA = 0.0;
+	slowest = 0;
+	for( i = 0; i < workcnt; i++ )
 	{
-		f = 10 * dispatch / workcount;
-		while ( oldf < f)
-		{
-			oldf++;
-			Sys_Printf ("%i...", oldf);
-		}
+		sumE += workEstimate[ i ];
+		sumA += workActual[ i ];
+		sumEE += (double) workEstimate[ i ] * workEstimate[ i ];
+		sumAA += workActual[ i ] * workActual[ i ];
+		sumEA += workEstimate[ i ] * workActual[ i ];
+		if( workActual[ i ] > workActual[ slowest ] )
+			slowest = i;
 	}
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
-	return r;
+	n = workcnt;
+	varE = sumEE - sumE * sumE / n;
+	varA = sumAA - sumA * sumA / n;
+	corr = (varE > 0.0 && varA > 0.0) ? (sumEA - sumE * sumA / n) / sqrt( varE * varA ) : 0.0;
+	for( rank = 0; rank < workcnt && workOrder[ rank ] != slowest; rank++ );
+
+	Sys_Printf( "%9d items dispatched by cost, estimate/actual correlation %.2f\n", workcnt, corr );
+	if( sumE > 0.0 && sumA > 0.0 )
+		Sys_FPrintf( SYS_VRB, "%9.2f seconds in slowest item %d: %.1f%% of measured, %.1f%% of estimated cost (rank %d)\n",
+			workActual[ slowest ], slowest, 100.0 * workActual[ slowest ] / sumA, 100.0 * workEstimate[ slowest ] / sumE, rank + 1 );
+
+	FreeWorkOrder();
 }
 
-// RunThreadsOnIndividual worker
+// RunThreadsOnIndividual work item
 void (*workfunction) (int);
+static void RunWorkItem( int work )
+{
+	double	start;
+
+	if( workOrder == NULL )
+	{
+		workfunction( work );
+		return;
+	}
+	work = workOrder[ work ];
+	start = I_PreciseTime();
+	workfunction( work );
+	workActual[ work ] = I_PreciseTime() - start;
+}
+
+// RunThreadsOnIndividual worker
 void RunThreadsOnIndividualThread(int threadnum)
 {
-	int	work;
-	while (1)
+	int	work, start, end;
+	while( GetThreadWorkChunk( &start, &end ) )
 	{
-		work = GetThreadWork ( );
-		if (work == -1)
-			break;
-		workfunction(work);
+		for( work = start; work < end; work++ )
+			RunWorkItem(work);
 	}
 }
 
 // run threads on individual numbers
 void RunThreadsOnIndividual(int workcnt, qboolean showpacifier, void(*func)(int))
+{
+	RunThreadsOnIndividualCost(workcnt, showpacifier, func, NULL);
+}
+
+// run threads on individual numbers, most expensive first by the cost estimate
+void RunThreadsOnIndividualCost(int workcnt, qboolean showpacifier, void(*func)(int), float(*cost)(int))
 {
 	if( numthreads <= 0 )
 		ThreadSetDefault();
 	if ( threaded == qtrue )
 		Error("RunThreadsOnIndividual: recursively entered!");
 
+	BeginWorkOrder(workcnt, cost);
 	workfunction = func;
 	RunThreadsOn(workcnt, showpacifier, RunThreadsOnIndividualThread);
+	EndWorkOrder(workcnt);
+}
+
+// profiled thread function, records when each thread starts and finishes its share
+static void(*profiledfunction)(int);
+static double profileThreadStart[MAX_THREADS], profileThreadEnd[MAX_THREADS];
+static void ProfiledThread(int threadnum)
+{
+	profileThreadStart[threadnum] = I_PreciseTime();
+	profiledfunction(threadnum);
+	profileThreadEnd[threadnum] = I_PreciseTime();
 }
 
 // run thread functions
 void _RunThreadsOn(int workcnt, qboolean showpacifier, void(*threadfunc)(int));
 void RunThreadsOn(int workcnt, qboolean showpacifier, void(*threadfunc)(int))
 {
+	double	start;
+
 	if( numthreads <= 0 )
 		ThreadSetDefault();
 	if( threaded == qtrue )
 		Error("RunThreadsOn: recursively entered!");
 
 	threaded = qtrue;
-	_RunThreadsOn(workcnt, showpacifier, threadfunc);
+	if( ProfileEnabled() )
+	{
+		profiledfunction = threadfunc;
+		start = I_PreciseTime();
+		_RunThreadsOn(workcnt, showpacifier, ProfiledThread);
+		ProfileThreads(start, I_PreciseTime(), numthreads, profileThreadStart, profileThreadEnd);
+	}
+	else
+		_RunThreadsOn(workcnt, showpacifier, threadfunc);
 	threaded = qfalse;
 }
 
@@ -113,6 +307,7 @@ void RunSameThreadOn(int workcnt, qboolean showpacifier, void(*threadfunc)(int))
 	dispatch = 0;
 	workcount = workcnt;
 	oldf = -1;
+	pacifierBusy = 0;
 	pacifier = showpacifier;
 	threadfunc(0);
 	end = I_FloatTime ();
@@ -141,9 +336,12 @@ void RunSameThreadOnIndividual(int workcnt, qboolean showpacifier, void(*func)(i
 	dispatch = 0;
 	workcount = workcnt;
 	oldf = -1;
+	pacifierBusy = 0;
 	pacifier = showpacifier;
+	BeginWorkOrder(workcnt, NULL);
 	workfunction = func;
 	RunThreadsOnIndividualThread(0);
+	EndWorkOrder(workcnt);
 	end = I_FloatTime ();
 	if (pacifier == qtrue)
 	{
@@ -156,6 +354,305 @@ void RunSameThreadOnIndividual(int workcnt, qboolean showpacifier, void(*func)(i
 	}
 }
 
+/*
+===================================================================
+
+ TASKS
+
+===================================================================
+*/
+
+/* every thread owns a small deque; it pushes and pops at the tail, idle threads steal from the head */
+#define	MAX_THREAD_TASKS		256
+
+#if defined(WIN32) || defined(WIN64)
+	#define ThreadYield()		Sleep( 0 )
+#elif defined(__linux__)
+	#include <sched.h>
+	#define ThreadYield()		sched_yield()
+#else
+	#define ThreadYield()
+#endif
+
+typedef struct threadTask_s
+{
+	void				(*func)(void *);
+	void				*data;
+	threadTaskGroup_t	*group;
+}
+threadTask_t;
+
+typedef struct threadTaskQueue_s
+{
+	volatile int		lock;
+	volatile int		head, tail;
+	threadTask_t		tasks[ MAX_THREAD_TASKS ];
+}
+threadTaskQueue_t;
+
+static threadTaskQueue_t	*taskQueues = NULL;
+static volatile int			taskActive;
+static volatile int			tasksSpawned, tasksStolen;
+static THREAD_LOCAL int		taskThread = -1;
+
+static void TaskQueueLock( threadTaskQueue_t *queue )
+{
+	while( ThreadAtomicCompareExchange( &queue->lock, 1, 0 ) != 0 )
+		ThreadYield();
+}
+
+static void TaskQueueUnlock( threadTaskQueue_t *queue )
+{
+	ThreadAtomicCompareExchange( &queue->lock, 0, 1 );
+}
+
+/*
+PopTask()
+takes the newest task from the calling thread's own queue
+*/
+
+static qboolean PopTask( threadTask_t *task )
+{
+	threadTaskQueue_t	*queue;
+	qboolean			found;
+
+	queue = &taskQueues[ taskThread ];
+	if( queue->head == queue->tail )
+		return qfalse;
+	TaskQueueLock( queue );
+	found = (queue->head != queue->tail) ? qtrue : qfalse;
+	if( found )
+	{
+		queue->tail--;
+		*task = queue->tasks[ queue->tail % MAX_THREAD_TASKS ];
+	}
+	TaskQueueUnlock( queue );
+	return found;
+}
+
+/*
+StealTask()
+takes the oldest task from another thread's queue
+*/
+
+static qboolean StealTask( threadTask_t *task )
+{
+	threadTaskQueue_t	*queue;
+	int					i;
+	qboolean			found;
+
+	for( i = 1; i < numthreads; i++ )
+	{
+		queue = &taskQueues[ (taskThread + i) % numthreads ];
+		if( queue->head == queue->tail )
+			continue;
+		TaskQueueLock( queue );
+		found = (queue->head != queue->tail) ? qtrue : qfalse;
+		if( found )
+		{
+			*task = queue->tasks[ queue->head % MAX_THREAD_TASKS ];
+			queue->head++;
+		}
+		TaskQueueUnlock( queue );
+		if( found )
+		{
+			ThreadAtomicAdd( &tasksStolen, 1 );
+			return qtrue;
+		}
+	}
+	return qfalse;
+}
+
+static void RunTask( threadTask_t *task )
+{
+	task->func( task->data );
+	ThreadAtomicAdd( &task->group->pending, -1 );
+	ThreadAtomicAdd( &taskActive, -1 );
+}
+
+void ThreadTaskGroupInit( threadTaskGroup_t *group )
+{
+	group->pending = 0;
+}
+
+/*
+ThreadSpawnTask()
+queues func( data ) on the calling thread; runs it immediately when called outside
+RunTasksOnIndividual(), when single threaded or when the queue is full
+*/
+
+void ThreadSpawnTask( threadTaskGroup_t *group, void(*func)(void *), void *data )
+{
+	threadTaskQueue_t	*queue;
+	threadTask_t		*task;
+
+	if( taskThread < 0 || numthreads <= 1 )
+	{
+		func( data );
+		return;
+	}
+
+	queue = &taskQueues[ taskThread ];
+	TaskQueueLock( queue );
+	if( queue->tail - queue->head >= MAX_THREAD_TASKS )
+	{
+		TaskQueueUnlock( queue );
+		func( data );
+		return;
+	}
+	ThreadAtomicAdd( &group->pending, 1 );
+	ThreadAtomicAdd( &taskActive, 1 );
+	task = &queue->tasks[ queue->tail % MAX_THREAD_TASKS ];
+	task->func = func;
+	task->data = data;
+	task->group = group;
+	queue->tail++;
+	TaskQueueUnlock( queue );
+	ThreadAtomicAdd( &tasksSpawned, 1 );
+}
+
+/*
+ThreadWaitTaskGroup()
+returns once every task in the group has finished; the caller runs queued or stolen tasks meanwhile,
+so never wait while holding ThreadLock()
+*/
+
+void ThreadWaitTaskGroup( threadTaskGroup_t *group )
+{
+	threadTask_t	task;
+
+	while( group->pending > 0 )
+	{
+		if( PopTask( &task ) || StealTask( &task ) )
+			RunTask( &task );
+		else
+			ThreadYield();
+	}
+}
+
+// RunTasksOnIndividual worker
+void RunTasksOnIndividualThread( int threadnum )
+{
+	threadTask_t	task;
+	int				work, start, end;
+
+	taskThread = threadnum;
+	while( 1 )
+	{
+		/* own subtasks first, then fresh work, then help others with theirs */
+		if( PopTask( &task ) )
+		{
+			RunTask( &task );
+			continue;
+		}
+		ThreadAtomicAdd( &taskActive, 1 );
+		if( GetThreadWorkChunk( &start, &end ) )
+		{
+			for( work = start; work < end; work++ )
+				RunWorkItem( work );
+			ThreadAtomicAdd( &taskActive, -1 );
+			continue;
+		}
+		ThreadAtomicAdd( &taskActive, -1 );
+		if( StealTask( &task ) )
+		{
+			RunTask( &task );
+			continue;
+		}
+		if( taskActive <= 0 )
+			break;
+		ThreadYield();
+	}
+	taskThread = -1;
+}
+
+/*
+RunTasksOnIndividual()
+like RunThreadsOnIndividual(), but func may split its item with ThreadSpawnTask()/ThreadWaitTaskGroup()
+and threads that run out of items keep stealing those subtasks until everything is done
+*/
+
+void RunTasksOnIndividual( int workcnt, qboolean showpacifier, void(*func)(int) )
+{
+	RunTasksOnIndividualCost( workcnt, showpacifier, func, NULL );
+}
+
+void RunTasksOnIndividualCost( int workcnt, qboolean showpacifier, void(*func)(int), float(*cost)(int) )
+{
+	int		i;
+
+	if( numthreads <= 0 )
+		ThreadSetDefault();
+	if( threaded == qtrue )
+		Error( "RunTasksOnIndividual: recursively entered!" );
+
+	taskQueues = (threadTaskQueue_t *)safe_malloc( numthreads * sizeof( *taskQueues ) );
+	for( i = 0; i < numthreads; i++ )
+	{
+		taskQueues[ i ].lock = 0;
+		taskQueues[ i ].head = 0;
+		taskQueues[ i ].tail = 0;
+	}
+	taskActive = 0;
+	tasksSpawned = 0;
+	tasksStolen = 0;
+
+	BeginWorkOrder( workcnt, cost );
+	workfunction = func;
+	RunThreadsOn( workcnt, showpacifier, RunTasksOnIndividualThread );
+	EndWorkOrder( workcnt );
+
+	free( taskQueues );
+	taskQueues = NULL;
+	if( tasksSpawned > 0 )
+		Sys_FPrintf( SYS_VRB, "%9d subtasks spawned, %d stolen\n", tasksSpawned, tasksStolen );
+}
+
+/*
+ThreadAtomicAdd(), ThreadAtomicCompareExchange()
+fallback for compilers without interlocked intrinsics
+*/
+
+#if !defined(WIN32) && !defined(WIN64) && !defined(__GNUC__)
+int ThreadAtomicAdd( volatile int *p, int v )
+{
+	int	r;
+
+	ThreadLock();
+	r = *p;
+	*p = r + v;
+	ThreadUnlock();
+	return r;
+}
+
+int ThreadAtomicCompareExchange( volatile int *p, int x, int c )
+{
+	int	r;
+
+	ThreadLock();
+	r = *p;
+	if( r == c )
+		*p = x;
+	ThreadUnlock();
+	return r;
+}
+#endif
+
+/*
+ThreadPoolStart(), ThreadPoolShutdown()
+platforms without a persistent pool spawn threads per stage
+*/
+
+#if !defined(WIN32) && !defined(WIN64) && !defined(__linux__)
+void ThreadPoolStart( void )
+{
+}
+
+void ThreadPoolShutdown( void )
+{
+}
+#endif
+
 /*
 ===================================================================
 
@@ -183,7 +680,7 @@ void ThreadStats (void)
 {
 	if( numthreads <= 0 )
 		ThreadSetDefault();
-	Sys_Printf (" %i threads\n", numthreads);
+	Sys_Printf (" %i threads%s\n", numthreads, threadAffinity ? " (pinned)" : "");
 }
 
 void ThreadSetDefault (void)
@@ -222,6 +719,85 @@ void ThreadUnlock (void)
 	LeaveCriticalSection (&crit);
 }
 
+/*
+persistent worker pool
+workers are created once by ThreadPoolStart() and sleep on their own start event between stages
+*/
+
+static HANDLE			poolThreads[MAX_THREADS];
+static HANDLE			poolStart[MAX_THREADS];
+static HANDLE			poolDone;
+static void				(*poolFunc)(int);
+static volatile int		poolPending;
+static qboolean			poolStarted = qfalse;
+static qboolean			poolQuit = qfalse;
+
+static DWORD WINAPI ThreadPoolWorker( LPVOID param )
+{
+	int	num = (int)(size_t)param;
+
+	while( 1 )
+	{
+		WaitForSingleObject( poolStart[ num ], INFINITE );
+		if( poolQuit )
+			break;
+		poolFunc( num );
+		if( ThreadAtomicAdd( &poolPending, -1 ) == 1 )
+			SetEvent( poolDone );
+	}
+	return 0;
+}
+
+void ThreadPoolStart( void )
+{
+	SYSTEM_INFO info;
+	DWORD	threadid;
+	int		i, numcpus;
+
+	if( numthreads <= 0 )
+		ThreadSetDefault();
+	if( poolStarted || numthreads == 1 )
+		return;
+
+	GetSystemInfo( &info );
+	numcpus = info.dwNumberOfProcessors;
+	if( numcpus < 1 )
+		numcpus = 1;
+
+	poolQuit = qfalse;
+	poolDone = CreateEvent( NULL, FALSE, FALSE, NULL );
+	for( i = 0; i < numthreads; i++ )
+	{
+		poolStart[ i ] = CreateEvent( NULL, FALSE, FALSE, NULL );
+		/* ydnar: cranking stack size to eliminate radiosity crash with 1MB stack on win32 */
+		poolThreads[ i ] = CreateThread( NULL, (4096 * 1024), ThreadPoolWorker, (LPVOID)(size_t)i, 0, &threadid );
+		if( poolThreads[ i ] == NULL )
+			Error( "ThreadPoolStart: CreateThread failed" );
+		if( threadAffinity && (i % numcpus) < (int)(sizeof( DWORD_PTR ) * 8) )
+			SetThreadAffinityMask( poolThreads[ i ], ((DWORD_PTR) 1) << (i % numcpus) );
+	}
+	poolStarted = qtrue;
+}
+
+void ThreadPoolShutdown( void )
+{
+	int		i;
+
+	if( !poolStarted )
+		return;
+	poolQuit = qtrue;
+	for( i = 0; i < numthreads; i++ )
+		SetEvent( poolStart[ i ] );
+	for( i = 0; i < numthreads; i++ )
+	{
+		WaitForSingleObject( poolThreads[ i ], INFINITE );
+		CloseHandle( poolThreads[ i ] );
+		CloseHandle( poolStart[ i ] );
+	}
+	CloseHandle( poolDone );
+	poolStarted = qfalse;
+}
+
 void _RunThreadsOn(int workcnt, qboolean showpacifier, void(*func)(int))
 {
 	int		threadid[MAX_THREADS];
@@ -233,6 +809,7 @@ void _RunThreadsOn(int workcnt, qboolean showpacifier, void(*func)(int))
 	dispatch = 0;
 	workcount = workcnt;
 	oldf = -1;
+	pacifierBusy = 0;
 	pacifier = showpacifier;
 
 	// run threads in parallel
@@ -242,6 +819,14 @@ void _RunThreadsOn(int workcnt, qboolean showpacifier, void(*func)(int))
 	{	// use same thread
 		func (0);
 	}
+	else if( poolStarted )
+	{	// wake up pooled workers
+		poolFunc = func;
+		poolPending = numthreads;
+		for (i=0 ; i<numthreads ; i++)
+			SetEvent (poolStart[i]);
+		WaitForSingleObject (poolDone, INFINITE);
+	}
 	else
 	{
 		for (i=0 ; i<numthreads ; i++)
@@ -375,6 +960,7 @@ void _RunThreadsOn (int workcnt, qboolean showpacifier, void(*func)(int))
 	dispatch = 0;
 	workcount = workcnt;
 	oldf = -1;
+	pacifierBusy = 0;
 	pacifier = showpacifier;
 
 	if (pacifier)
@@ -472,6 +1058,7 @@ void _RunThreadsOn (int workcnt, qboolean showpacifier, void(*func)(int))
 	dispatch = 0;
 	workcount = workcnt;
 	oldf = -1;
+	pacifierBusy = 0;
 	pacifier = showpacifier;
 
 	if (pacifier)
@@ -529,6 +1116,8 @@ void ThreadSetDefault (void)
 }
 
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 typedef struct pt_mutex_s
 {
@@ -606,6 +1195,91 @@ void recursive_mutex_init(pthread_mutexattr_t attribs)
   pt_mutex->lock = 0;
 }
 
+/*
+=============
+persistent worker pool
+workers are created once by ThreadPoolStart() and wait for a new generation between stages
+=============
+*/
+static pthread_t       pool_threads[MAX_THREADS];
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  pool_done  = PTHREAD_COND_INITIALIZER;
+static void            (*pool_func)(int);
+static int             pool_generation = 0;
+static int             pool_pending = 0;
+static qboolean        pool_started = qfalse;
+static qboolean        pool_quit = qfalse;
+
+static void *ThreadPoolWorker(void *param)
+{
+  int num = (int)(size_t)param;
+  int generation = 0;
+
+  pthread_mutex_lock(&pool_mutex);
+  while(1)
+  {
+    while(pool_generation == generation && !pool_quit)
+      pthread_cond_wait(&pool_start, &pool_mutex);
+    if(pool_quit)
+      break;
+    generation = pool_generation;
+    pthread_mutex_unlock(&pool_mutex);
+
+    pool_func(num);
+
+    pthread_mutex_lock(&pool_mutex);
+    if(--pool_pending == 0)
+      pthread_cond_signal(&pool_done);
+  }
+  pthread_mutex_unlock(&pool_mutex);
+  return NULL;
+}
+
+void ThreadPoolStart(void)
+{
+  cpu_set_t cpus;
+  int       i, numcpus;
+
+  if(numthreads <= 0)
+    ThreadSetDefault();
+  if(pool_started || numthreads == 1)
+    return;
+
+  numcpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if(numcpus < 1)
+    numcpus = 1;
+
+  pool_quit = qfalse;
+  for(i = 0; i < numthreads; i++)
+  {
+    if(pthread_create(&pool_threads[i], NULL, ThreadPoolWorker, (void*)(size_t)i) != 0)
+      Error("ThreadPoolStart: pthread_create failed");
+    if(threadAffinity)
+    {
+      CPU_ZERO(&cpus);
+      CPU_SET(i % numcpus, &cpus);
+      pthread_setaffinity_np(pool_threads[i], sizeof(cpus), &cpus);
+    }
+  }
+  pool_started = qtrue;
+}
+
+void ThreadPoolShutdown(void)
+{
+  int i;
+
+  if(!pool_started)
+    return;
+  pthread_mutex_lock(&pool_mutex);
+  pool_quit = qtrue;
+  pthread_cond_broadcast(&pool_start);
+  pthread_mutex_unlock(&pool_mutex);
+  for(i = 0; i < numthreads; i++)
+    pthread_join(pool_threads[i], NULL);
+  pool_started = qfalse;
+}
+
 /*
 =============
 _RunThreadsOn
@@ -623,6 +1297,7 @@ void _RunThreadsOn (int workcnt, qboolean showpacifier, void(*func)(int))
   pacifier  = showpacifier;
   dispatch  = 0;
   oldf      = -1;
+  pacifierBusy = 0;
   workcount = workcnt;
   
   if(numthreads == 1)
@@ -642,16 +1317,31 @@ void _RunThreadsOn (int workcnt, qboolean showpacifier, void(*func)(int))
       Error ("pthread_mutexattr_settype failed");
     recursive_mutex_init(mattrib);
 
-    for (i=0 ; i<numthreads ; i++)
+    if(pool_started)
     {
-      /* Default pthread attributes: joinable & non-realtime scheduling */
-      if(pthread_create(&work_threads[i], NULL, (void*)func, (void*)i) != 0)
-        Error("pthread_create failed");
+      /* wake up pooled workers */
+      pthread_mutex_lock(&pool_mutex);
+      pool_func = func;
+      pool_pending = numthreads;
+      pool_generation++;
+      pthread_cond_broadcast(&pool_start);
+      while(pool_pending > 0)
+        pthread_cond_wait(&pool_done, &pool_mutex);
+      pthread_mutex_unlock(&pool_mutex);
     }
-    for (i=0 ; i<numthreads ; i++)
+    else
     {
-      if(pthread_join(work_threads[i], (void **)&status) != 0)
-        Error("pthread_join failed");
+      for (i=0 ; i<numthreads ; i++)
+      {
+        /* Default pthread attributes: joinable & non-realtime scheduling */
+        if(pthread_create(&work_threads[i], NULL, (void*)func, (void*)i) != 0)
+          Error("pthread_create failed");
+      }
+      for (i=0 ; i<numthreads ; i++)
+      {
+        if(pthread_join(work_threads[i], (void **)&status) != 0)
+          Error("pthread_join failed");
+      }
     }
     pthread_mutexattr_destroy(&mattrib);
   }
@@ -701,6 +1391,7 @@ void _RunThreadsOn (int workcnt, qboolean showpacifier, void(*func)(int))
 	dispatch = 0;
 	workcount = workcnt;
 	oldf = -1;
+	pacifierBusy = 0;
 	pacifier = showpacifier;
 	start = I_FloatTime (); 
 	func(0);
@@ -21,18 +21,36 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 
 extern int numthreads;
+extern qboolean threadAffinity;
 
 /* threads */
 void ThreadSetDefault (void);
 void ThreadStats (void);
+void ThreadPoolStart (void);
+void ThreadPoolShutdown (void);
 int	 GetThreadWork (void);
+qboolean GetThreadWorkChunk (int *start, int *end);
 void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, void(*func)(int));
+void RunThreadsOnIndividualCost (int workcnt, qboolean showpacifier, void(*func)(int), float(*cost)(int));
 void RunThreadsOn (int workcnt, qboolean showpacifier, void(*func)(int));
 void RunSameThreadOn(int workcnt, qboolean showpacifier, void(*threadfunc)(int));
 void RunSameThreadOnIndividual(int workcnt, qboolean showpacifier, void(*threadfunc)(int));
 void ThreadLock (void);
 void ThreadUnlock (void);
 
+/* tasks (work stealing; subtasks may be spawned from inside RunTasksOnIndividual) */
+typedef struct threadTaskGroup_s
+{
+	volatile int	pending;
+}
+threadTaskGroup_t;
+
+void RunTasksOnIndividual (int workcnt, qboolean showpacifier, void(*func)(int));
+void RunTasksOnIndividualCost (int workcnt, qboolean showpacifier, void(*func)(int), float(*cost)(int));
+void ThreadTaskGroupInit (threadTaskGroup_t *group);
+void ThreadSpawnTask (threadTaskGroup_t *group, void(*func)(void *), void *data);
+void ThreadWaitTaskGroup (threadTaskGroup_t *group);
+
 /* mutex */
 #if defined(WIN32) || defined(WIN64)
 	#define	USED
@@ -62,4 +80,23 @@ void ThreadUnlock (void);
 	#define ThreadMutexLock(m) ThreadLock()
 	#define ThreadMutexUnlock(m) ThreadUnlock()
 	#define ThreadMutexDelete(m)
-#endif
\ No newline at end of file
+#endif
+
+/* thread local storage */
+#if defined(WIN32) || defined(WIN64)
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
+/* atomics (both return the previous value) */
+#if defined(WIN32) || defined(WIN64)
+	#define ThreadAtomicAdd(p, v) InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v))
+	#define ThreadAtomicCompareExchange(p, x, c) InterlockedCompareExchange((volatile LONG *)(p), (LONG)(x), (LONG)(c))
+#elif defined(__GNUC__)
+	#define ThreadAtomicAdd(p, v) __sync_fetch_and_add((p), (v))
+	#define ThreadAtomicCompareExchange(p, x, c) __sync_val_compare_and_swap((p), (c), (x))
+#else
+	int ThreadAtomicAdd(volatile int *p, int v);
+	int ThreadAtomicCompareExchange(volatile int *p, int x, int c);
+#endif
@@ -47,7 +47,8 @@ this creates a sun light
 
 static void CreateSunLight( sun_t *sun )
 {
-	int			i;
+	int			i, n;
+	unsigned int	seed;
 	float		photons, d, angle, elevation, da, de;
 	vec3_t		direction;
 	light_t		*light;
@@ -64,6 +65,10 @@ static void CreateSunLight( sun_t *sun )
 	/* set photons */
 	photons = sun->photons / sun->numSamples;
 	
+	/* jitter stream, unique per sun */
+	seed = RandomSeed( numSunLights, 0, 0 );
+	n = 0;
+	
 	/* create the right number of suns */
 	for( i = 0; i < sun->numSamples; i++ )
 	{
@@ -89,8 +94,8 @@ static void CreateSunLight( sun_t *sun )
 			/* jitter the angles (loop to keep random sample within sun->deviance steridians) */
 			do
 			{
-				da = (Random() * 2.0f - 1.0f) * sun->deviance;
-				de = (Random() * 2.0f - 1.0f) * sun->deviance;
+				da = (RandomForSeed( seed, n++ ) * 2.0f - 1.0f) * sun->deviance;
+				de = (RandomForSeed( seed, n++ ) * 2.0f - 1.0f) * sun->deviance;
 			}
 			while( (da * da + de * de) > (sun->deviance * sun->deviance) );
 			angle += da;
@@ -221,7 +226,8 @@ creates lights from light entities
 
 void CreateEntityLights( void )
 {
-	int				i, j;
+	int				i, j, n;
+	unsigned int	seed;
 	light_t			*light, *light2;
 	entity_t		*e, *e2;
 	const char		*name;
@@ -510,6 +516,8 @@ void CreateEntityLights( void )
 		}
 		
 		/* jitter the light */
+		seed = RandomSeed( i, 0, 0 );
+		n = 0;
 		for( j = 1; j < numSamples; j++ )
 		{
 			/* create a light */
@@ -528,20 +536,20 @@ void CreateEntityLights( void )
 			if (devianceForm == 1)
 			{
 				/* spherical jitter */
-				scale = Random();
-				dest[0] = Random() * 2.0f - 1.0;
-				dest[1] = Random() * 2.0f - 1.0;
+				scale = RandomForSeed( seed, n++ );
+				dest[0] = RandomForSeed( seed, n++ ) * 2.0f - 1.0;
+				dest[1] = RandomForSeed( seed, n++ ) * 2.0f - 1.0;
 
-				dest[2] = Random() * 2.0f - 1.0;
+				dest[2] = RandomForSeed( seed, n++ ) * 2.0f - 1.0;
 				VectorNormalize(dest, dest);
 				VectorScale(dest, scale, dest);
 			}
 			else
 			{
 				/* box jitter */
-				dest[0] = Random() * 2.0f - 1.0;
-				dest[1] = Random() * 2.0f - 1.0;
-				dest[2] = Random() * 2.0f - 1.0;
+				dest[0] = RandomForSeed( seed, n++ ) * 2.0f - 1.0;
+				dest[1] = RandomForSeed( seed, n++ ) * 2.0f - 1.0;
+				dest[2] = RandomForSeed( seed, n++ ) * 2.0f - 1.0;
 				scale = min(1.0, VectorLength(dest) / 1.43f);
 				scale = sqrt(deviance * deviance);
 			}
@@ -793,6 +801,20 @@ float PointToPolygonFormFactor( const vec3_t point, const vec3_t normal, const w
 	return total;
 }
 
+/*
+LightContributionShadowed()
+tests the result of the shadow ray LightContribution() traces towards a light; callers that
+clear testOcclusion to trace the ray themselves (see IlluminateLuxelRows) use it afterwards
+*/
+
+qboolean LightContributionShadowed( light_t *light, int compileFlags, qboolean passSolid, qboolean opaque )
+{
+	/* sunlight has to reach the sky */
+	if( light->type == EMIT_SUN )
+		return (!(compileFlags & C_SKY) || opaque) ? qtrue : qfalse;
+	return (passSolid || opaque) ? qtrue : qfalse;
+}
+
 /*
 LightContribution()
 determines the amount of light reaching a sample (luxel or vertex) from a given light
@@ -1064,8 +1086,8 @@ int LightContribution( trace_t *trace, int lightflags, qboolean point3d )
 		if( trace->testOcclusion && !trace->forceSunlight )
 		{
 			/* raytrace */
-			TraceLine( trace );
-			if( !(trace->compileFlags & C_SKY) || trace->opaque )
+			TraceLineShadow( trace );
+			if( LightContributionShadowed( light, trace->compileFlags, trace->passSolid, trace->opaque ) )
 			{
 				VectorClear( trace->color );
 				return -1;
@@ -1088,8 +1110,8 @@ int LightContribution( trace_t *trace, int lightflags, qboolean point3d )
 	VectorScale( light->color, add, trace->color );
 	
 	/* raytrace */
-	TraceLine( trace );
-	if( trace->passSolid || trace->opaque )
+	TraceLineShadow( trace );
+	if( LightContributionShadowed( light, trace->compileFlags, trace->passSolid, trace->opaque ) )
 	{
 		VectorClear( trace->color );
 		return -1;
@@ -1748,6 +1770,14 @@ void IlluminateGridBlock( int num )
 	/* create trace lights */
 	CreateTraceLightsForBounds( qtrue, mins, maxs, normal, numClusters, clusters, LIGHT_GRID, &trace );
 
+	/* reuse the block from the last run (grid points sampled from the lightmaps aren't covered) */
+	if( !gridSampleLightmap && RelightGridBlock( num, &trace ) )
+	{
+		FreeTraceLights( &trace );
+		free( clusters );
+		return;
+	}
+
 	/* find lightmap surfaces */
 	numLightmaps = 0;
 	if( gridSampleLightmap )
@@ -1958,6 +1988,9 @@ void IlluminateGrid( void )
 	RunThreadsOnIndividual( numRawGridPoints, qtrue, IlluminateGridPointOld );
 #endif
 
+	/* save the blocks for the next run */
+	WriteRelightGrid();
+
 	/* postprocess */
 	FinishIlluminateGrid();
 }
@@ -2356,7 +2389,9 @@ minGridLight[ 2 ] ) )
 	SetupSurfaceLightmaps();
 	
 	/* initialize the surface facet tracing */
+	ProfileBegin( "SetupTraceNodes" );
 	SetupTraceNodes();
+	ProfileEnd();
 
 	/* allocate raw lightmaps */
 	AllocateSurfaceLightmaps();
@@ -2364,8 +2399,10 @@ minGridLight[ 2 ] ) )
 	/* create world lights (note in verbose mode) */
 	if( verbose )
 		Sys_Printf( "--- CreateLights ---\n" );
+	ProfileBegin( "CreateLights" );
 	CreateEntityLights();
 	CreateSurfaceLights();
+	ProfileEnd();
 	if( numPointLights || verbose )
 		Sys_Printf( "%9d point lightsources created\n", numPointLights );
 	if( numSpotLights || verbose )
@@ -2386,16 +2423,25 @@ minGridLight[ 2 ] ) )
 	Sys_Printf( "--- SetupGrid ---\n" );
 	SetupGrid();
 	
+	/* load the results of the last run for incremental relighting */
+	LoadRelight();
+	
 	/* illuminate lightgrid */
 	if( !noGridLighting && !gridFromLightmap)
+	{
+		ProfileBegin( "IlluminateGrid" );
 		IlluminateGrid( );
+		ProfileEnd();
+	}
 	
 	/* slight optimization to remove a sqrt */
 	subdivideThreshold *= subdivideThreshold;
 	
 	/* map the world luxels */
 	Sys_Printf( "--- MapRawLightmap ---\n" );
-	RunThreadsOnIndividual( numRawLightmaps, qtrue, MapRawLightmap );
+	ProfileBegin( "MapRawLightmap" );
+	RunThreadsOnIndividualCost( numRawLightmaps, qtrue, MapRawLightmap, RawLightmapCost );
+	ProfileEnd();
 	Sys_Printf( "%9d luxels\n", numLuxels );
 	Sys_Printf( "%9d luxels mapped\n", numLuxelsMapped );
 	Sys_Printf( "%9d luxels remapped\n", numLuxelsRemapped );
@@ -2406,7 +2452,12 @@ minGridLight[ 2 ] ) )
 	if( !gridOnly && dirty )
 	{
 		Sys_Printf( "--- DirtyRawLightmap ---\n" );
-		RunThreadsOnIndividual( numRawLightmaps, qtrue, DirtyRawLightmap );
+		ProfileBegin( "DirtyRawLightmap" );
+		numDirtSamplesStopped = 0;
+		RunThreadsOnIndividualCost( numRawLightmaps, qtrue, DirtyRawLightmap, RawLightmapCost );
+		ProfileEnd();
+		if( dirtEarlyOut > 0 )
+			Sys_Printf( "%9d open dirt samples stopped early\n", numDirtSamplesStopped );
 	}
 
 	/* floodlight pass */
@@ -2420,6 +2471,10 @@ minGridLight[ 2 ] ) )
 	if( !gridOnly )
 		SetupEnvelopes( qfalse, fast );
 	
+	/* biggest lightmaps go first */
+	Sys_Printf( "--- IlluminateRawLightmap ---\n" );
+	ProfileBegin( "IlluminateRawLightmap" );
+
 	/* light up my world */
 	lightsPlaneCulled = 0;
 	lightsEnvelopeCulled = 0;
@@ -2427,20 +2482,33 @@ minGridLight[ 2 ] ) )
 	lightsClusterCulled = 0;
 
 	/* illuminate lightmaps */
-	Sys_Printf( "--- IlluminateRawLightmap ---\n" );
-	RunThreadsOnIndividual( numRawLightmaps, qtrue, IlluminateRawLightmap );
+	ResetTraceRayStats();
+	RunTasksOnIndividualCost( numRawLightmaps, qtrue, IlluminateRawLightmap, IlluminateRawLightmapCost );
+	ProfileEnd();
 	Sys_Printf( "%9d luxels illuminated\n", numLuxelsIlluminated );
+	if( lightSamples > 1 )
+		Sys_Printf( "%9d luxels refined (%d subsamples)\n", numLuxelsRefined, numLuxelSubsamples );
+	if( lightCutSize > 0 )
+		Sys_Printf( "%9d area lights sampled through light cuts (%d samples)\n", numLightCutLights, numLightCutSamples );
+	PrintTraceRayStats();
+	
+	/* save the lightmaps for the next run */
+	WriteRelight();
 	
 	/* filter lightmaps */
 	Sys_Printf( "--- FilterRawLightmap ---\n" );
 	ThreadMutexInit(&LightmapGrowStitchMutex);
+	ProfileBegin( "FilterRawLightmap" );
 	RunThreadsOnIndividual( numRawLightmaps, qtrue, FilterRawLightmap );
+	ProfileEnd();
 	if( numLuxelsStitched || verbose )
 		Sys_Printf( "%9d luxels marked for stitching\n", numLuxelsStitched );
 	ThreadMutexDelete(&LightmapGrowStitchMutex);
 
 	/* stitch lightmaps */
+	ProfileBegin( "StitchRawLightmaps" );
 	StitchRawLightmaps();
+	ProfileEnd();
 
 	/* generate debug surfaces for luxels */
 	if( debugLightmap )
@@ -2452,8 +2520,12 @@ minGridLight[ 2 ] ) )
 
 	/* illuminate vertexes */
 	Sys_Printf( "--- IlluminateVertexes ---\n" );
+	ProfileBegin( "IlluminateVertexes" );
+	ResetTraceRayStats();
 	RunThreadsOnIndividual( numBSPDrawSurfaces, qtrue, IlluminateVertexes );
+	ProfileEnd();
 	Sys_Printf( "%9d vertexes illuminated\n", numVertsIlluminated );
+	PrintTraceRayStats();
 
 	/* ydnar: emit statistics on light culling */
 	Sys_FPrintf( SYS_VRB, "%9d lights plane culled\n", lightsPlaneCulled );
@@ -2467,9 +2539,13 @@ minGridLight[ 2 ] ) )
 	while( bounce > 0 )
 	{
 		/* store off the bsp between bounces */
+		ProfileBegin( "StoreSurfaceLightmaps" );
 		StoreSurfaceLightmaps();
+		ProfileEnd();
 		Sys_Printf( "Writing %s\n", source );
+		ProfileBegin( "WriteBSPFile" );
 		WriteBSPFile( source );
+		ProfileEnd();
 		
 		/* note it */
 		Sys_Printf( "\n--- Radiosity (bounce %d of %d) ---\n", b, bt );
@@ -2479,56 +2555,104 @@ minGridLight[ 2 ] ) )
 		VectorClear( ambientColor );
 		VectorSet( colorMod, 1, 1, 1 );
 		
-		/* generate diffuse lights */
-		RadFreeLights();
-		RadCreateDiffuseLights();
-		
-		/* setup light envelopes */
-		SetupEnvelopes( qfalse, fastbounce );
-		if( numLights == 0 )
+		/* gather the bounce from the lightmaps instead of making diffuse lights */
+		if( bounceCache || bounceGather )
 		{
-			Sys_Printf( "No diffuse light to calculate, ending radiosity.\n" );
-			break;
+			Sys_Printf( "--- %s ---\n", bounceCache ? "BounceCacheRawLightmap" : "BounceGatherRawLightmap" );
+			if( bouncegrid && b == 1 )
+				Sys_Printf( "WARNING: -bouncegrid has no effect with %s\n", bounceCache ? "-bouncecache" : "-bouncegather" );
+			ProfileBegin( "GatherBounce" );
+			
+			/* drop the lights on this thread, so the threaded stages below find an empty (set up) list */
+			RadFreeLights();
+			SetupEnvelopes( qfalse, fastbounce );
+			if( !(bounceCache ? BounceCacheRawLightmaps() : BounceGatherRawLightmaps()) )
+			{
+				ProfileEnd();
+				Sys_Printf( "No bounced light to gather, ending radiosity.\n" );
+				break;
+			}
+			ProfileEnd();
 		}
-		
-		/* add to lightgrid */
-		if( bouncegrid )
+		else
 		{
-			Sys_Printf( "--- BounceGrid ---\n" );
+			/* generate diffuse lights */
+			ProfileBegin( "RadCreateDiffuseLights" );
+			RadFreeLights();
+			RadCreateDiffuseLights();
+			ProfileEnd();
+		
+			/* setup light envelopes */
+			SetupEnvelopes( qfalse, fastbounce );
+			if( numLights == 0 )
+			{
+				Sys_Printf( "No diffuse light to calculate, ending radiosity.\n" );
+				break;
+			}
+		
+			/* add to lightgrid */
+			if( bouncegrid )
+			{
+				Sys_Printf( "--- BounceGrid ---\n" );
+				ProfileBegin( "BounceGrid" );
 #ifdef GRID_BLOCK_OPTIMIZATION
-	RunThreadsOnIndividual( numGridBlocks, qtrue, IlluminateGridBlock );
+				RunThreadsOnIndividual( numGridBlocks, qtrue, IlluminateGridBlock );
 #else
-	RunThreadsOnIndividual( numRawGridPoints, qtrue, IlluminateGridPointOld );
+				RunThreadsOnIndividual( numRawGridPoints, qtrue, IlluminateGridPointOld );
 #endif
-		}
+				ProfileEnd();
+			}
 		
-		/* light up my world */
-		lightsPlaneCulled = 0;
-		lightsEnvelopeCulled = 0;
-		lightsBoundsCulled = 0;
-		lightsClusterCulled = 0;
+			/* biggest lightmaps go first */
+			Sys_Printf( "--- IlluminateRawLightmap ---\n" );
+			ProfileBegin( "IlluminateRawLightmap" );
+
+			/* light up my world */
+			lightsPlaneCulled = 0;
+			lightsEnvelopeCulled = 0;
+			lightsBoundsCulled = 0;
+			lightsClusterCulled = 0;
 
-		/* illuminate lightmaps */
-		Sys_Printf( "--- IlluminateRawLightmap ---\n" );
-		numLuxelsIlluminated = 0;
-		RunThreadsOnIndividual( numRawLightmaps, qtrue, IlluminateRawLightmap );
-		Sys_Printf( "%9d luxels illuminated\n", numLuxelsIlluminated );
+			/* illuminate lightmaps */
+			numLuxelsIlluminated = 0;
+			numLuxelsRefined = 0;
+			numLuxelSubsamples = 0;
+			numLightCutLights = 0;
+			numLightCutSamples = 0;
+			ResetTraceRayStats();
+			RunTasksOnIndividualCost( numRawLightmaps, qtrue, IlluminateRawLightmap, IlluminateRawLightmapCost );
+			ProfileEnd();
+			Sys_Printf( "%9d luxels illuminated\n", numLuxelsIlluminated );
+			if( lightSamples > 1 )
+				Sys_Printf( "%9d luxels refined (%d subsamples)\n", numLuxelsRefined, numLuxelSubsamples );
+			if( lightCutSize > 0 )
+				Sys_Printf( "%9d area lights sampled through light cuts (%d samples)\n", numLightCutLights, numLightCutSamples );
+			PrintTraceRayStats();
+		}
 
 		/* filter lightmaps */
 		Sys_Printf( "--- FilterRawLightmap ---\n" );
 		ThreadMutexInit(&LightmapGrowStitchMutex);
+		ProfileBegin( "FilterRawLightmap" );
 		RunThreadsOnIndividual( numRawLightmaps, qtrue, FilterRawLightmap );
+		ProfileEnd();
 		if( numLuxelsStitched || verbose )
 			Sys_Printf( "%9d luxels marked for stitching\n", numLuxelsStitched );
 		ThreadMutexDelete(&LightmapGrowStitchMutex);
 		
 		/* stitch lightmaps */
+		ProfileBegin( "StitchRawLightmaps" );
 		StitchRawLightmaps();
+		ProfileEnd();
 
 		/* illuminate vertexes */
 		Sys_Printf( "--- IlluminateVertexes ---\n" );
+		ProfileBegin( "IlluminateVertexes" );
+		ResetTraceRayStats();
 		RunThreadsOnIndividual( numBSPDrawSurfaces, qtrue, IlluminateVertexes );
+		ProfileEnd();
 		Sys_Printf( "%9d vertexes illuminated\n", numVertsIlluminated );
+		PrintTraceRayStats();
 
 		/* ydnar: emit statistics on light culling */
 		Sys_FPrintf( SYS_VRB, "%9d lights plane culled\n", lightsPlaneCulled );
@@ -2546,7 +2670,11 @@ minGridLight[ 2 ] ) )
 	{
 		/* sample lightgrid from lightmap */
 		if( !noGridLighting )
+		{
+			ProfileBegin( "IlluminateGridByLightmap" );
 			IlluminateGridByLightmap();
+			ProfileEnd();
+		}
 
 		/* sample lightmap from lightgrid */
 		if ( debugGrid )
@@ -2568,7 +2696,7 @@ main routine for light processing
 
 int LightMain( int argc, char **argv )
 {
-	int			i;
+	int			i, j;
 	float		f;
 	char		mapSource[ MAX_OS_PATH ];
 
@@ -2720,6 +2848,38 @@ int LightMain( int argc, char **argv )
 			i++;
 		}
 		
+		else if( !strcmp( argv[ i ], "-bouncecache" ) )
+		{
+			bounceCache = qtrue;
+			Sys_Printf( " Radiosity gathered through an irradiance cache instead of diffuse lights\n" );
+		}
+		
+		else if( !strcmp( argv[ i ], "-bouncecachesamples" ) )
+		{
+			bounceCacheSamples = atoi( argv[ i + 1 ] );
+			if( bounceCacheSamples < 1 )
+				bounceCacheSamples = 1;
+			Sys_Printf( " Irradiance cache records gather %d ray(s)\n", bounceCacheSamples );
+			i++;
+		}
+		
+		else if( !strcmp( argv[ i ], "-bouncegather" ) )
+		{
+			bounceGather = qtrue;
+			Sys_Printf( " Radiosity gathered at every luxel instead of diffuse lights\n" );
+		}
+		
+		else if( !strcmp( argv[ i ], "-bouncegathersamples" ) )
+		{
+			/* rays are traced in whole packets */
+			bounceGatherSamples = atoi( argv[ i + 1 ] );
+			if( bounceGatherSamples < 1 )
+				bounceGatherSamples = 1;
+			bounceGatherSamples = ((bounceGatherSamples + MAX_PACKET_RAYS - 1) / MAX_PACKET_RAYS) * MAX_PACKET_RAYS;
+			Sys_Printf( " Gathered luxels trace up to %d rays\n", bounceGatherSamples );
+			i++;
+		}
+		
 		/* lightmap/lightgrid supersampling */
 		else if( !strcmp( argv[ i ], "-supersample" ) || !strcmp( argv[ i ], "-super" ) )
 		{
@@ -2735,12 +2895,59 @@ int LightMain( int argc, char **argv )
 		else if( !strcmp( argv[ i ], "-samples" ) )
 		{
 			lightSamples = atoi( argv[ i + 1 ] );
+			lightSamplesAdaptive = qfalse;
 			if( lightSamples < 1 )
 				lightSamples = 1;
 			else if( lightSamples > 1 )
 				Sys_Printf( " Adaptive supersampling enabled with %d sample(s) per lightmap texel\n", lightSamples );
 			i++;
 		}
+		
+		/* lightmap adaptive supersampling of shadow edges and high contrast luxels only */
+		else if( !strcmp( argv[ i ], "-adaptive" ) )
+		{
+			/* each subsampling level doubles the ordered grid */
+			j = atoi( argv[ i + 1 ] );
+			lightSamplesAdaptive = qtrue;
+			lightSamples = 1;
+			while( (1 << (lightSamples - 1)) < j && lightSamples < 4 )
+				lightSamples++;
+			if( lightSamplesContrast <= 0.0f )
+				lightSamplesContrast = 0.2f;
+			if( lightSamples > 1 )
+				Sys_Printf( " Adaptive supersampling enabled with up to %d x %d samples per lightmap texel, contrast threshold %f\n",
+					1 << (lightSamples - 1), 1 << (lightSamples - 1), lightSamplesContrast );
+			i++;
+		}
+		else if( !strcmp( argv[ i ], "-adaptivecontrast" ) )
+		{
+			lightSamplesContrast = atof( argv[ i + 1 ] );
+			if( lightSamplesContrast < 0.0f )
+				lightSamplesContrast = 0.0f;
+			Sys_Printf( " Adaptive supersampling contrast threshold set to %f\n", lightSamplesContrast );
+			i++;
+		}
+		
+		/* stochastic light cuts for lightmaps reached by many area lights */
+		else if( !strcmp( argv[ i ], "-lightcuts" ) )
+		{
+			lightCutSize = atoi( argv[ i + 1 ] );
+			if( lightCutSize < 0 )
+				lightCutSize = 0;
+			else if( lightCutSize > MAX_LIGHT_CUT )
+				lightCutSize = MAX_LIGHT_CUT;
+			if( lightCutSize > 0 )
+				Sys_Printf( " Area lights sampled through light cuts of up to %d lights per luxel\n", lightCutSize );
+			i++;
+		}
+		else if( !strcmp( argv[ i ], "-lightcutsquality" ) )
+		{
+			lightCutQuality = atof( argv[ i + 1 ] );
+			if( lightCutQuality < 0.0f )
+				lightCutQuality = 0.0f;
+			Sys_Printf( " Light cut nodes are split while they bound more than %f of the light\n", lightCutQuality );
+			i++;
+		}
 
 		/* lightmap filter (blur) */
 		else if( !strcmp( argv[ i ], "-filter" ) )
@@ -3244,6 +3451,21 @@ int LightMain( int argc, char **argv )
 			loMemSky = qtrue;
 			Sys_Printf( " Enabling low-memory (slower) lighting mode for sky light\n" );
 		}
+		else if( !strcmp( argv[ i ], "-bvh" ) )
+		{
+			traceBVH = qtrue;
+			Sys_Printf( " Tracing shadows through a bounding volume hierarchy\n" );
+		}
+		else if( !strcmp( argv[ i ], "-tracecache" ) )
+		{
+			traceCache = qtrue;
+			Sys_Printf( " Caching the shadow tracing structures next to the bsp\n" );
+		}
+		else if( !strcmp( argv[ i ], "-incremental" ) )
+		{
+			incrementalLight = qtrue;
+			Sys_Printf( " Relighting only the lightmaps and grid blocks that changed since the last run\n" );
+		}
 		else if ( !strcmp( argv[ i ], "-lightanglehl" ) )
 		{
 			qboolean newLightAngleHL = atoi( argv[ i + 1 ] ) != 0 ? qtrue : qfalse;
@@ -3331,6 +3553,15 @@ int LightMain( int argc, char **argv )
 			Sys_Printf( " Dirtmapping depth exponent set to %.1f\n", dirtDepthExponent );
 			i++;
 		}
+		else if( !strcmp( argv[ i ], "-dirtearlyout" ) || !strcmp( argv[ i ], "-aoearlyout" ) )
+		{
+			dirtEarlyOut = atoi( argv[ i + 1 ] );
+			if( dirtEarlyOut < 0 )
+				dirtEarlyOut = 0;
+			if( dirtEarlyOut > 0 )
+				Sys_Printf( " Dirtmapping stops samples whose first %d ray(s) are all open\n", dirtEarlyOut );
+			i++;
+		}
 		else if( !strcmp( argv[ i ], "-dirtscale" ) || !strcmp( argv[ i ], "-aoscale" ) )
 		{
 			dirtScale = atof( argv[ i + 1 ] );
@@ -3510,13 +3741,17 @@ int LightMain( int argc, char **argv )
 	LoadSurfaceExtraFile( source );
 	
 	/* load bsp file */
+	ProfileBegin( "LoadBSPFile" );
 	LoadBSPFile( source );
+	ProfileEnd();
 	
 	/* parse bsp entities */
 	ParseEntities();
 	
 	/* load map file */
+	ProfileBegin( "LoadMapFile" );
 	LoadMapFile( mapSource, (IntForKey( &entities[ 0 ], "_keepLights" ) > 0) ? qfalse : qtrue, qtrue, qfalse, qfalse );
+	ProfileEnd();
 	
 	/* set the entity/model origins and init yDrawVerts */
 	SetEntityOrigins();
@@ -3524,11 +3759,19 @@ int LightMain( int argc, char **argv )
 	/* ydnar: set up optimization */
 	SetupBrushes();
 
+	/* hash the light settings for incremental relighting */
+	if( incrementalLight )
+		SetupRelight( argc, argv );
+
 	/* light the world */
+	ProfileBegin( "LightWorld" );
 	LightWorld( mapSource );
+	ProfileEnd();
 
 	/* ydnar: store off lightmaps */
+	ProfileBegin( "StoreSurfaceLightmaps" );
 	StoreSurfaceLightmaps();
+	ProfileEnd();
 
 	/* vortex: set deluxeMaps key */
 	if (deluxemap)
@@ -3551,7 +3794,9 @@ int LightMain( int argc, char **argv )
 	Sys_Printf( "--- WriteBSPFile ---\n" );
 	UnparseEntities(qfalse);
 	Sys_Printf( "Writing %s\n", source );
+	ProfileBegin( "WriteBSPFile" );
 	WriteBSPFile( source );
+	ProfileEnd();
 	
 	/* ydnar: export lightmaps */
 	if( exportLightmaps && !externalLightmaps )
@@ -957,5 +957,826 @@ void RadCreateDiffuseLights( void )
 
 
 
+/* -------------------------------------------------------------------------------
+
+irradiance cache bounce (-bouncecache)
+
+instead of turning the lit surfaces into area lights, each bounce gathers the light of the
+previous pass straight from the lightmaps: hemisphere rays look up the radiance of the luxel
+they hit, and the gathers are only made at sparse cache records that nearby luxels interpolate
+
+------------------------------------------------------------------------------- */
+
+#define BOUNCE_CACHE_ACCURACY		0.3f	/* records are used while position + normal error stays below this */
+#define BOUNCE_CACHE_MIN_REACH		2.0f	/* record reach limits in luxels */
+#define BOUNCE_CACHE_MAX_REACH		12.0f
+#define BOUNCE_CACHE_STRIDE			4		/* the first pass seeds records on this luxel grid */
+#define BOUNCE_CACHE_BUCKET			8		/* luxels per record bucket side */
+
+typedef struct bouncePoint_s
+{
+	vec3_t				origin, normal;
+	vec3_t				radiance;
+	float				radius;
+	qboolean			twoSided;
+	int					next;				/* next point in the same cell */
+}
+bouncePoint_t;
+
+typedef struct bounceRecord_s
+{
+	vec3_t				origin, normal;
+	vec3_t				irradiance;
+	float				radius;
+}
+bounceRecord_t;
+
+typedef struct bounceRecordRef_s
+{
+	int					recordNum;
+	int					next;
+}
+bounceRecordRef_t;
+
+typedef struct bounceCache_s
+{
+	rawLightmap_t		*lm;
+	trace_t				*trace;
+	float				spacing;			/* world units per luxel */
+	int					bw, bh;				/* buckets */
+	int					*buckets;
+	int					numRecords, maxRecords;
+	bounceRecord_t		*records;
+	int					numRefs, maxRefs;
+	bounceRecordRef_t	*refs;
+	int					numRays;
+}
+bounceCache_t;
+
+static int				numBouncePoints = 0;
+static bouncePoint_t	*bouncePoints = NULL;
+static int				numBounceCells = 0;
+static int				*bounceCells = NULL;
+static float			bounceCellSize = 0.0f;
+static vec3_t			*bounceReflect = NULL;		/* per raw lightmap */
+
+static int				numBounceRecords = 0, numBounceRays = 0, numBounceInterpolated = 0;
+static int				numBounceGathered = 0, numBounceConverged = 0;
+
+
+
+/*
+BounceCellForPoint()
+hashes a grid cell of the bounce points
+*/
+
+static int BounceCellForPoint( int x, int y, int z )
+{
+	return (((unsigned int) x * 73856093u) ^ ((unsigned int) y * 19349663u) ^ ((unsigned int) z * 83492791u)) & (numBounceCells - 1);
+}
+
+
+
+/*
+SetupBouncePoints()
+makes a point per mapped lightmap luxel with the light it reflects in the next bounce
+*/
+
+static int SetupBouncePoints( void )
+{
+	int					i, j, x, y, sx, sy, maxPoints, cell, c[ 3 ];
+	float				value, *radLuxel;
+	vec3_t				reflect;
+	rawLightmap_t		*lm;
+	shaderInfo_t		*si;
+	bouncePoint_t		*bp;
+	
+	
+	/* count luxels */
+	maxPoints = 0;
+	for( i = 0; i < numRawLightmaps; i++ )
+		maxPoints += rawLightmaps[ i ].w * rawLightmaps[ i ].h;
+	bouncePoints = (bouncePoint_t *)safe_malloc( (maxPoints + 1) * sizeof( *bouncePoints ) );
+	numBouncePoints = 0;
+	bounceReflect = (vec3_t *)safe_malloc( (numRawLightmaps + 1) * sizeof( *bounceReflect ) );
+	memset( bounceReflect, 0, (numRawLightmaps + 1) * sizeof( *bounceReflect ) );
+	bounceCellSize = 1.0f;
+	
+	/* walk the raw lightmaps */
+	for( i = 0; i < numRawLightmaps; i++ )
+	{
+		lm = &rawLightmaps[ i ];
+		if( lm->radLuxels[ 0 ] == NULL || lm->numLightSurfaces <= 0 )
+			continue;
+		
+		/* the surfaces of a raw lightmap share one reflectivity (the average texture color) */
+		si = surfaceInfos[ lightSurfaces[ lm->firstLightSurface ] ].si;
+		if( si->bounceScale <= 0.0f || (si->compileFlags & C_SKY) || si->autosprite )
+			continue;
+		value = RADIOSITY_VALUE * si->bounceScale * 0.375f * formFactorValueScale * bounceScale;
+		for( j = 0; j < 3; j++ )
+			reflect[ j ] = (si->averageColor[ j ] / 255.0f) * (value / 255.0f);
+		VectorCopy( reflect, bounceReflect[ i ] );
+		
+		/* one point per bsp luxel at the center super luxel */
+		for( y = 0; y < lm->h; y++ )
+		{
+			for( x = 0; x < lm->w; x++ )
+			{
+				sx = min( x * superSample + superSample / 2, lm->sw - 1 );
+				sy = min( y * superSample + superSample / 2, lm->sh - 1 );
+				if( *SUPER_CLUSTER( sx, sy ) < 0 )
+					continue;
+				radLuxel = RAD_LUXEL( 0, x, y );
+				
+				bp = &bouncePoints[ numBouncePoints ];
+				for( j = 0; j < 3; j++ )
+					bp->radiance[ j ] = radLuxel[ j ] * reflect[ j ];
+				if( VectorLength( bp->radiance ) < RADIOSITY_MIN )
+					continue;
+				VectorCopy( SUPER_ORIGIN( sx, sy ), bp->origin );
+				VectorCopy( SUPER_NORMAL( sx, sy ), bp->normal );
+				bp->radius = lm->actualSampleSize;
+				bp->twoSided = (si->twoSided || (si->compileFlags & C_FOG)) ? qtrue : qfalse;
+				if( bp->radius > bounceCellSize )
+					bounceCellSize = bp->radius;
+				numBouncePoints++;
+			}
+		}
+	}
+	
+	/* hash them into cells at least one radius wide */
+	numBounceCells = 1024;
+	while( numBounceCells < numBouncePoints * 2 )
+		numBounceCells <<= 1;
+	bounceCells = (int *)safe_malloc( numBounceCells * sizeof( *bounceCells ) );
+	for( i = 0; i < numBounceCells; i++ )
+		bounceCells[ i ] = -1;
+	for( i = numBouncePoints - 1; i >= 0; i-- )
+	{
+		bp = &bouncePoints[ i ];
+		for( j = 0; j < 3; j++ )
+			c[ j ] = (int) floor( bp->origin[ j ] / bounceCellSize );
+		cell = BounceCellForPoint( c[ 0 ], c[ 1 ], c[ 2 ] );
+		bp->next = bounceCells[ cell ];
+		bounceCells[ cell ] = i;
+	}
+	
+	return numBouncePoints;
+}
+
+
+
+/*
+FreeBouncePoints()
+frees the bounce points of a pass
+*/
+
+static void FreeBouncePoints( void )
+{
+	free( bouncePoints );
+	bouncePoints = NULL;
+	numBouncePoints = 0;
+	free( bounceCells );
+	bounceCells = NULL;
+	numBounceCells = 0;
+	free( bounceReflect );
+	bounceReflect = NULL;
+}
+
+
+
+/*
+BounceLuxelRadiance()
+looks the light reflected at a hit up in the raw lightmap of the surface that was hit,
+returns qfalse if the surface has no planar lightmap or the luxel there isn't mapped
+*/
+
+static qboolean BounceLuxelRadiance( int surfaceNum, vec3_t hit, vec3_t direction, vec3_t radiance )
+{
+	int					i, sx, sy, x, y;
+	float				s, t, ls, lt, *radLuxel;
+	vec3_t				delta;
+	shaderInfo_t		*si;
+	rawLightmap_t		*lm;
+	
+	
+	/* only planar lightmaps can be projected onto */
+	if( surfaceNum < 0 || surfaceNum >= numBSPDrawSurfaces )
+		return qfalse;
+	lm = surfaceInfos[ surfaceNum ].lm;
+	if( lm == NULL || lm->plane == NULL || lm->vecs == NULL || lm->radLuxels[ 0 ] == NULL )
+		return qfalse;
+	
+	/* the back of a one sided surface reflects nothing */
+	VectorClear( radiance );
+	si = surfaceInfos[ surfaceNum ].si;
+	if( !si->twoSided && !(si->compileFlags & C_FOG) && DotProduct( lm->plane, direction ) >= 0.0f )
+		return qtrue;
+	
+	/* project onto the lightmap axes, super luxel centers are at lm->origin + x * vecs[ 0 ] + y * vecs[ 1 ] */
+	VectorSubtract( hit, lm->origin, delta );
+	s = t = ls = lt = 0.0f;
+	for( i = 0; i < 3; i++ )
+	{
+		if( i == lm->axisNum )
+			continue;
+		s += delta[ i ] * lm->vecs[ 0 ][ i ];
+		t += delta[ i ] * lm->vecs[ 1 ][ i ];
+		ls += lm->vecs[ 0 ][ i ] * lm->vecs[ 0 ][ i ];
+		lt += lm->vecs[ 1 ][ i ] * lm->vecs[ 1 ][ i ];
+	}
+	if( ls <= 0.0f || lt <= 0.0f )
+		return qfalse;
+	sx = (int) floor( s / ls + 0.5f );
+	sy = (int) floor( t / lt + 0.5f );
+	
+	/* hits on the border can round a luxel off the lightmap */
+	if( sx < -1 || sy < -1 || sx > lm->sw || sy > lm->sh )
+		return qfalse;
+	sx = max( 0, min( lm->sw - 1, sx ) );
+	sy = max( 0, min( lm->sh - 1, sy ) );
+	if( *SUPER_CLUSTER( sx, sy ) < 0 )
+		return qfalse;
+	
+	/* light of the last pass times the reflectivity */
+	x = sx / superSample;
+	y = sy / superSample;
+	radLuxel = RAD_LUXEL( 0, x, y );
+	for( i = 0; i < 3; i++ )
+		radiance[ i ] = radLuxel[ i ] * bounceReflect[ lm - rawLightmaps ][ i ];
+	return qtrue;
+}
+
+
+
+/*
+BounceRadiance()
+finds the light reflected towards a ray at its hit, from the lightmap of the surface hit
+or else the nearest bounce point around it
+*/
+
+static qboolean BounceRadiance( vec3_t hit, vec3_t direction, int surfaceNum, vec3_t radiance )
+{
+	int					i, x, y, z, c[ 3 ], best;
+	float				dist, bestDist;
+	vec3_t				delta;
+	bouncePoint_t		*bp;
+	
+	
+	/* the lightmap of the surface hit */
+	if( BounceLuxelRadiance( surfaceNum, hit, direction, radiance ) )
+		return qtrue;
+	
+	/* nearest point */
+	for( i = 0; i < 3; i++ )
+		c[ i ] = (int) floor( hit[ i ] / bounceCellSize );
+	best = -1;
+	bestDist = 0.0f;
+	for( z = c[ 2 ] - 1; z <= c[ 2 ] + 1; z++ )
+	{
+		for( y = c[ 1 ] - 1; y <= c[ 1 ] + 1; y++ )
+		{
+			for( x = c[ 0 ] - 1; x <= c[ 0 ] + 1; x++ )
+			{
+				for( i = bounceCells[ BounceCellForPoint( x, y, z ) ]; i >= 0; i = bp->next )
+				{
+					bp = &bouncePoints[ i ];
+					VectorSubtract( bp->origin, hit, delta );
+					dist = DotProduct( delta, delta );
+					if( dist > bp->radius * bp->radius || (best >= 0 && dist >= bestDist) )
+						continue;
+					if( !bp->twoSided && DotProduct( bp->normal, direction ) >= 0.0f )
+						continue;
+					best = i;
+					bestDist = dist;
+				}
+			}
+		}
+	}
+	
+	if( best < 0 )
+		return qfalse;
+	VectorCopy( bouncePoints[ best ].radiance, radiance );
+	return qtrue;
+}
+
+
+
+/*
+GatherBouncePacket()
+traces a packet of cosine weighted rays from a luxel, ray n lies in stratum n % (strata * strata)
+of the hemisphere, the light found is added to total and (unless invDist is NULL) the inverse hit
+distances to invDist
+*/
+
+static void GatherBouncePacket( trace_t *trace, vec3_t origin, vec3_t normal, vec3_t right, vec3_t up, unsigned int seed, int first, int numRays, int strata, vec3_t total, float *invDist )
+{
+	int					i, n, stratum;
+	float				u1, u2, r, phi;
+	vec3_t				local, direction, displacement, radiance;
+	tracePacket_t		packet;
+	
+	
+	/* stratified cosine weighted directions */
+	packet.numRays = 0;
+	VectorCopy( origin, trace->origin );
+	for( i = 0; i < numRays; i++ )
+	{
+		n = first + i;
+		stratum = n % (strata * strata);
+		u1 = ((stratum % strata) + RandomForSeed( seed, n * 2 )) / strata;
+		u2 = ((stratum / strata) + RandomForSeed( seed, n * 2 + 1 )) / strata;
+		phi = u1 * 2.0f * Q_PI;
+		r = sqrt( u2 );
+		local[ 0 ] = r * cos( phi );
+		local[ 1 ] = r * sin( phi );
+		local[ 2 ] = sqrt( max( 0.0f, 1.0f - u2 ) );
+		direction[ 0 ] = right[ 0 ] * local[ 0 ] + up[ 0 ] * local[ 1 ] + normal[ 0 ] * local[ 2 ];
+		direction[ 1 ] = right[ 1 ] * local[ 0 ] + up[ 1 ] * local[ 1 ] + normal[ 1 ] * local[ 2 ];
+		direction[ 2 ] = right[ 2 ] * local[ 0 ] + up[ 2 ] * local[ 1 ] + normal[ 2 ] * local[ 2 ];
+		VectorMA( origin, MAX_WORLD_COORD * 2.0f, direction, trace->end );
+		VectorSet( trace->color, 1.0f, 1.0f, 1.0f );
+		AddTracePacketRay( &packet, trace, i );
+	}
+	
+	/* trace and add the light reflected by the surfaces hit */
+	TraceLinePacket( trace, &packet, qfalse );
+	for( i = 0; i < packet.numRays; i++ )
+	{
+		if( !packet.opaque[ i ] )
+			continue;
+		if( invDist != NULL )
+		{
+			VectorSubtract( packet.hit[ i ], origin, displacement );
+			r = VectorLength( displacement );
+			if( r > 0.0f )
+				*invDist += 1.0f / r;
+		}
+		if( BounceRadiance( packet.hit[ i ], packet.direction[ i ], packet.hitSurfaceNum[ i ], radiance ) )
+			VectorAdd( total, radiance, total );
+	}
+}
+
 
 
+/*
+GatherBounceRecord()
+traces a stratified cosine weighted hemisphere of rays from a luxel and makes a cache record
+of the light they find, its radius is the harmonic mean distance to the hit surfaces
+*/
+
+static int GatherBounceRecord( bounceCache_t *cache, vec3_t origin, vec3_t normal, int cluster, unsigned int seed )
+{
+	int					i, strata, numRays;
+	float				invDist, reach;
+	vec3_t				right, up, total;
+	trace_t				*trace;
+	bounceRecord_t		*record;
+	
+	
+	/* setup */
+	trace = cache->trace;
+	trace->cluster = cluster;
+	VectorCopy( normal, trace->normal );
+	MakeNormalVectors( normal, right, up );
+	strata = (int) sqrt( (float) bounceCacheSamples );
+	if( strata < 1 )
+		strata = 1;
+	numRays = strata * strata;
+	
+	/* gather */
+	VectorClear( total );
+	invDist = 0.0f;
+	for( i = 0; i < numRays; i += MAX_PACKET_RAYS )
+		GatherBouncePacket( trace, origin, normal, right, up, seed, i, min( MAX_PACKET_RAYS, numRays - i ), strata, total, &invDist );
+	cache->numRays += numRays;
+	
+	/* grow the records */
+	if( cache->numRecords >= cache->maxRecords )
+	{
+		cache->maxRecords = cache->maxRecords ? cache->maxRecords * 2 : 256;
+		cache->records = (bounceRecord_t *)realloc( cache->records, cache->maxRecords * sizeof( *cache->records ) );
+		if( cache->records == NULL )
+			Error( "GatherBounceRecord: out of memory" );
+	}
+	
+	/* make the record, its reach is clamped to a sane number of luxels */
+	record = &cache->records[ cache->numRecords ];
+	VectorCopy( origin, record->origin );
+	VectorCopy( normal, record->normal );
+	VectorScale( total, 1.0f / numRays, record->irradiance );
+	reach = invDist > 0.0f ? BOUNCE_CACHE_ACCURACY * numRays / invDist / cache->spacing : BOUNCE_CACHE_MAX_REACH;
+	if( reach < BOUNCE_CACHE_MIN_REACH )
+		reach = BOUNCE_CACHE_MIN_REACH;
+	else if( reach > BOUNCE_CACHE_MAX_REACH )
+		reach = BOUNCE_CACHE_MAX_REACH;
+	record->radius = reach * cache->spacing / BOUNCE_CACHE_ACCURACY;
+	return cache->numRecords++;
+}
+
+
+
+/*
+AddBounceRecord()
+links a record into the luxel buckets it can reach
+*/
+
+static void AddBounceRecord( bounceCache_t *cache, int recordNum, int x, int y )
+{
+	int					bx, by, reach, bucket;
+	bounceRecord_t		*record;
+	
+	
+	record = &cache->records[ recordNum ];
+	reach = (int) ceil( BOUNCE_CACHE_ACCURACY * record->radius / cache->spacing ) + 1;
+	for( by = max( 0, (y - reach) / BOUNCE_CACHE_BUCKET ); by <= min( cache->bh - 1, (y + reach) / BOUNCE_CACHE_BUCKET ); by++ )
+	{
+		for( bx = max( 0, (x - reach) / BOUNCE_CACHE_BUCKET ); bx <= min( cache->bw - 1, (x + reach) / BOUNCE_CACHE_BUCKET ); bx++ )
+		{
+			if( cache->numRefs >= cache->maxRefs )
+			{
+				cache->maxRefs = cache->maxRefs ? cache->maxRefs * 2 : 1024;
+				cache->refs = (bounceRecordRef_t *)realloc( cache->refs, cache->maxRefs * sizeof( *cache->refs ) );
+				if( cache->refs == NULL )
+					Error( "AddBounceRecord: out of memory" );
+			}
+			bucket = by * cache->bw + bx;
+			cache->refs[ cache->numRefs ].recordNum = recordNum;
+			cache->refs[ cache->numRefs ].next = cache->buckets[ bucket ];
+			cache->buckets[ bucket ] = cache->numRefs++;
+		}
+	}
+}
+
+
+
+/*
+InterpolateBounceRecords()
+blends the records whose position and normal error at a luxel is below the accuracy,
+weights fall to zero at the error limit so record borders don't show
+*/
+
+static qboolean InterpolateBounceRecords( bounceCache_t *cache, vec3_t origin, vec3_t normal, int x, int y, vec3_t irradiance )
+{
+	int					ref;
+	float				error, weight, totalWeight, d;
+	vec3_t				delta;
+	bounceRecord_t		*record;
+	
+	
+	VectorClear( irradiance );
+	totalWeight = 0.0f;
+	for( ref = cache->buckets[ (y / BOUNCE_CACHE_BUCKET) * cache->bw + (x / BOUNCE_CACHE_BUCKET) ]; ref >= 0; ref = cache->refs[ ref ].next )
+	{
+		record = &cache->records[ cache->refs[ ref ].recordNum ];
+		VectorSubtract( origin, record->origin, delta );
+		d = DotProduct( normal, record->normal );
+		error = VectorLength( delta ) / record->radius + sqrt( max( 0.0f, 1.0f - d ) );
+		if( error >= BOUNCE_CACHE_ACCURACY )
+			continue;
+		weight = 1.0f - error / BOUNCE_CACHE_ACCURACY;
+		VectorMA( irradiance, weight, record->irradiance, irradiance );
+		totalWeight += weight;
+	}
+	
+	if( totalWeight <= 0.0f )
+		return qfalse;
+	VectorScale( irradiance, 1.0f / totalWeight, irradiance );
+	return qtrue;
+}
+
+
+
+/*
+SetupBounceRawLightmap()
+sets up the trace of a raw lightmap and clears its luxels like IlluminateRawLightmap()
+*/
+
+static void SetupBounceRawLightmap( rawLightmap_t *lm, trace_t *trace )
+{
+	int					i, x, y, size;
+	int					*cluster;
+	float				*luxel;
+	surfaceInfo_t		*info;
+	
+	
+	/* setup trace */
+	memset( trace, 0, sizeof( *trace ) );
+	trace->entityNum = lm->entityNum;
+	trace->testOcclusion = qtrue;
+	trace->recvShadows = lm->recvShadows;
+	trace->numSurfaces = lm->numLightSurfaces;
+	trace->surfaces = &lightSurfaces[ lm->firstLightSurface ];
+	for( i = 0; i < trace->numSurfaces; i++ )
+	{
+		info = &surfaceInfos[ trace->surfaces[ i ] ];
+		if( info->si->twoSided )
+		{
+			trace->twoSided = qtrue;
+			break;
+		}
+	}
+	
+	/* clear luxels */
+	for( y = 0; y < lm->sh; y++ )
+	{
+		for( x = 0; x < lm->sw; x++ )
+		{
+			cluster = SUPER_CLUSTER( x, y );
+			luxel = SUPER_LUXEL( 0, x, y );
+			if( *cluster < 0 )
+			{
+				VectorClear( luxel );
+				if( deluxemap )
+					VectorClear( SUPER_DELUXEL( x, y ) );
+			}
+			else
+			{
+				VectorCopy( lm->ambient, luxel );
+				if( deluxemap )
+					VectorScale( SUPER_NORMAL( x, y ), 0.00390625f, SUPER_DELUXEL( x, y ) );
+				luxel[ 3 ] = 1.0f;
+			}
+		}
+	}
+	size = lm->sw * lm->sh * SUPER_LUXEL_SIZE * sizeof( float );
+	for( i = 1; i < MAX_LIGHTMAPS; i++ )
+	{
+		if( lm->superLuxels[ i ] != NULL )
+			memset( lm->superLuxels[ i ], 0, size );
+	}
+}
+
+
+
+/*
+BounceCacheRawLightmap()
+lights a raw lightmap with the bounced light of the last pass through an irradiance cache
+*/
+
+static void BounceCacheRawLightmap( int rawLightmapNum )
+{
+	int					i, x, y, pass, step, recordNum, numInterpolated;
+	int					*cluster;
+	float				*luxel, *origin, *normal;
+	vec3_t				irradiance;
+	rawLightmap_t		*lm;
+	trace_t				trace;
+	bounceCache_t		cache;
+	
+	
+	/* get lightmap */
+	lm = &rawLightmaps[ rawLightmapNum ];
+	SetupBounceRawLightmap( lm, &trace );
+	
+	/* setup cache */
+	memset( &cache, 0, sizeof( cache ) );
+	cache.lm = lm;
+	cache.trace = &trace;
+	cache.spacing = lm->actualSampleSize / superSample;
+	if( cache.spacing <= 0.0f )
+		cache.spacing = 1.0f;
+	cache.bw = (lm->sw + BOUNCE_CACHE_BUCKET - 1) / BOUNCE_CACHE_BUCKET;
+	cache.bh = (lm->sh + BOUNCE_CACHE_BUCKET - 1) / BOUNCE_CACHE_BUCKET;
+	cache.buckets = (int *)safe_malloc( cache.bw * cache.bh * sizeof( *cache.buckets ) );
+	for( i = 0; i < cache.bw * cache.bh; i++ )
+		cache.buckets[ i ] = -1;
+	
+	/* seed records on a coarse grid first, then fill in every luxel */
+	numInterpolated = 0;
+	for( pass = 0; pass < 2; pass++ )
+	{
+		step = pass == 0 ? BOUNCE_CACHE_STRIDE : 1;
+		for( y = 0; y < lm->sh; y += step )
+		{
+			for( x = 0; x < lm->sw; x += step )
+			{
+				cluster = SUPER_CLUSTER( x, y );
+				if( *cluster < 0 )
+					continue;
+				origin = SUPER_ORIGIN( x, y );
+				normal = SUPER_NORMAL( x, y );
+				
+				/* interpolate or gather */
+				if( InterpolateBounceRecords( &cache, origin, normal, x, y, irradiance ) )
+				{
+					if( pass > 0 )
+						numInterpolated++;
+				}
+				else
+				{
+					recordNum = GatherBounceRecord( &cache, origin, normal, *cluster, RandomSeed( rawLightmapNum, y * lm->sw + x, bounce ) );
+					AddBounceRecord( &cache, recordNum, x, y );
+					VectorCopy( cache.records[ recordNum ].irradiance, irradiance );
+				}
+				
+				/* add to the luxel on the final pass */
+				if( pass == 0 )
+					continue;
+				luxel = SUPER_LUXEL( 0, x, y );
+				VectorAdd( luxel, irradiance, luxel );
+				luxel[ 4 ] += 1.0f;
+			}
+		}
+	}
+	
+	/* add to counts */
+	ThreadLock();
+	numBounceRecords += cache.numRecords;
+	numBounceRays += cache.numRays;
+	numBounceInterpolated += numInterpolated;
+	ThreadUnlock();
+	
+	/* free the cache */
+	free( cache.buckets );
+	free( cache.records );
+	free( cache.refs );
+}
+
+
+
+/*
+BounceCacheRawLightmaps()
+one irradiance cache bounce over all raw lightmaps, returns qfalse if there is no light to bounce
+*/
+
+qboolean BounceCacheRawLightmaps( void )
+{
+	/* reflected light of the last pass */
+	if( SetupBouncePoints() == 0 )
+	{
+		FreeBouncePoints();
+		return qfalse;
+	}
+	Sys_FPrintf( SYS_VRB, "%9d bounce points\n", numBouncePoints );
+	
+	/* gather */
+	numBounceRecords = 0;
+	numBounceRays = 0;
+	numBounceInterpolated = 0;
+	ResetTraceRayStats();
+	RunThreadsOnIndividualCost( numRawLightmaps, qtrue, BounceCacheRawLightmap, RawLightmapCost );
+	
+	/* emit some stats */
+	Sys_Printf( "%9d irradiance cache records (%d gather rays)\n", numBounceRecords, numBounceRays );
+	Sys_Printf( "%9d luxels interpolated\n", numBounceInterpolated );
+	PrintTraceRayStats();
+	
+	FreeBouncePoints();
+	return qtrue;
+}
+
+
+
+/* -------------------------------------------------------------------------------
+
+monte carlo gather bounce (-bouncegather)
+
+every luxel gathers the bounce itself with packets of stratified cosine weighted rays,
+more packets are traced until their means agree or the sample budget is spent
+
+------------------------------------------------------------------------------- */
+
+#define BOUNCE_GATHER_STRATA		4		/* 4 x 4 strata fill a packet */
+#define BOUNCE_GATHER_MIN_PACKETS	2
+#define BOUNCE_GATHER_ERROR			0.05f	/* relative standard error a luxel converges at */
+#define BOUNCE_GATHER_MIN_MEAN		1.0f	/* error floor: luxels gathering less than this (rgb sum, in the raw
+											   0-255 luxel units added to the lightmap) converge at an absolute
+											   error of BOUNCE_GATHER_ERROR * this instead of a relative error */
+
+
+
+/*
+GatherBounceLuxel()
+gathers the bounced light at a luxel, returns the number of rays traced
+*/
+
+static int GatherBounceLuxel( trace_t *trace, vec3_t origin, vec3_t normal, int cluster, unsigned int seed, vec3_t irradiance )
+{
+	int					numPackets, maxPackets;
+	float				mean, sum, sumSquares, variance;
+	vec3_t				right, up, total;
+	
+	
+	/* setup */
+	trace->cluster = cluster;
+	VectorCopy( normal, trace->normal );
+	MakeNormalVectors( normal, right, up );
+	maxPackets = bounceGatherSamples / MAX_PACKET_RAYS;		/* whole packets, see -bouncegathersamples */
+	if( maxPackets < 1 )
+		maxPackets = 1;
+	
+	/* gather packets until the standard error of their means is small enough */
+	VectorClear( irradiance );
+	sum = 0.0f;
+	sumSquares = 0.0f;
+	numPackets = 0;
+	while( numPackets < maxPackets )
+	{
+		VectorClear( total );
+		GatherBouncePacket( trace, origin, normal, right, up, seed, numPackets * MAX_PACKET_RAYS, MAX_PACKET_RAYS, BOUNCE_GATHER_STRATA, total, NULL );
+		VectorAdd( irradiance, total, irradiance );
+		numPackets++;
+		
+		mean = (total[ 0 ] + total[ 1 ] + total[ 2 ]) / MAX_PACKET_RAYS;
+		sum += mean;
+		sumSquares += mean * mean;
+		if( numPackets < BOUNCE_GATHER_MIN_PACKETS )
+			continue;
+		mean = sum / numPackets;
+		variance = (sumSquares / numPackets - mean * mean) / (numPackets - 1);
+		mean = max( mean, BOUNCE_GATHER_MIN_MEAN );
+		if( variance <= BOUNCE_GATHER_ERROR * BOUNCE_GATHER_ERROR * mean * mean )
+			break;
+	}
+	
+	VectorScale( irradiance, 1.0f / (numPackets * MAX_PACKET_RAYS), irradiance );
+	return numPackets * MAX_PACKET_RAYS;
+}
+
+
+
+/*
+BounceGatherRawLightmap()
+lights a raw lightmap with the bounced light of the last pass gathered at every luxel
+*/
+
+static void BounceGatherRawLightmap( int rawLightmapNum )
+{
+	int					x, y, rays, numRays, numGathered, numConverged;
+	int					*cluster;
+	float				*luxel;
+	vec3_t				irradiance;
+	rawLightmap_t		*lm;
+	trace_t				trace;
+	
+	
+	/* get lightmap */
+	lm = &rawLightmaps[ rawLightmapNum ];
+	SetupBounceRawLightmap( lm, &trace );
+	
+	/* gather */
+	numRays = 0;
+	numGathered = 0;
+	numConverged = 0;
+	for( y = 0; y < lm->sh; y++ )
+	{
+		for( x = 0; x < lm->sw; x++ )
+		{
+			cluster = SUPER_CLUSTER( x, y );
+			if( *cluster < 0 )
+				continue;
+			
+			rays = GatherBounceLuxel( &trace, SUPER_ORIGIN( x, y ), SUPER_NORMAL( x, y ), *cluster, RandomSeed( rawLightmapNum, y * lm->sw + x, bounce ), irradiance );
+			numRays += rays;
+			numGathered++;
+			if( rays < bounceGatherSamples )		/* a multiple of MAX_PACKET_RAYS */
+				numConverged++;
+			
+			luxel = SUPER_LUXEL( 0, x, y );
+			VectorAdd( luxel, irradiance, luxel );
+			luxel[ 4 ] += 1.0f;
+		}
+	}
+	
+	/* add to counts */
+	ThreadLock();
+	numBounceRays += numRays;
+	numBounceGathered += numGathered;
+	numBounceConverged += numConverged;
+	ThreadUnlock();
+}
+
+
+
+/*
+BounceGatherRawLightmaps()
+one gathered bounce over all raw lightmaps, returns qfalse if there is no light to bounce
+*/
+
+qboolean BounceGatherRawLightmaps( void )
+{
+	/* reflected light of the last pass */
+	if( SetupBouncePoints() == 0 )
+	{
+		FreeBouncePoints();
+		return qfalse;
+	}
+	Sys_FPrintf( SYS_VRB, "%9d bounce points\n", numBouncePoints );
+	
+	/* gather */
+	numBounceRays = 0;
+	numBounceGathered = 0;
+	numBounceConverged = 0;
+	ResetTraceRayStats();
+	RunThreadsOnIndividualCost( numRawLightmaps, qtrue, BounceGatherRawLightmap, RawLightmapCost );
+	
+	/* emit some stats */
+	Sys_Printf( "%9d luxels gathered (%d rays)\n", numBounceGathered, numBounceRays );
+	Sys_Printf( "%9d luxels converged early\n", numBounceConverged );
+	PrintTraceRayStats();
+	
+	FreeBouncePoints();
+	return qtrue;
+}
@@ -0,0 +1,390 @@
+/* -------------------------------------------------------------------------------
+
+Copyright (C) 1999-2006 Id Software, Inc. and contributors.
+For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+This file is part of GtkRadiant.
+
+GtkRadiant is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+GtkRadiant is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with GtkRadiant; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+----------------------------------------------------------------------------------
+
+This code has been altered significantly from its original form, to support
+several games based on the Quake III Arena engine, in the form of "Q3Map2."
+
+------------------------------------------------------------------------------- */
+
+
+
+/* marker */
+#define LIGHT_CUTS_C
+
+
+
+/* dependencies */
+#include "q3map2.h"
+
+
+
+/*
+stochastic light cuts (-lightcuts N)
+
+raw lightmaps reached by more than N plain area lights don't evaluate every one of them
+per luxel. the area lights go into a binary light tree, and each luxel picks a cut of at
+most N nodes through it, splitting the nodes with the largest bound on their light until
+no bound is above -lightcutsquality of the total. one light is sampled from each node of
+the cut in proportion to its estimated light and weighted by the inverse probability of
+picking it, so the luxels converge on the exact sum while the cost stays fixed.
+*/
+
+#define LIGHT_CUT_MIN_DIST		16.0f	/* estimates don't grow any closer than this, like light->mindist */
+
+
+
+/*
+LightCutPooled()
+returns qtrue for lights that can be sampled through the light tree, the others need the exact
+per light pass (styles, negative lights, filtering and the other light types)
+*/
+
+static qboolean LightCutPooled( light_t *light )
+{
+	return (light->type == EMIT_AREA && light->style == LS_NORMAL && !(light->flags & LIGHT_NEGATIVE) &&
+		light->filterRadius <= 0.0f && light->envelope > 0.0f) ? qtrue : qfalse;
+}
+
+
+
+/*
+LightCutIntensity()
+the part of the estimated light of an area light that doesn't depend on the sample
+*/
+
+static float LightCutIntensity( light_t *light )
+{
+	return light->photons * (light->color[ 0 ] + light->color[ 1 ] + light->color[ 2 ]);
+}
+
+
+
+/*
+BuildLightCutTree_r()
+splits the lights at the middle of the longest axis of their bounds, returns the node number
+*/
+
+static int BuildLightCutTree_r( lightCutTree_t *tree, light_t **lights, int numLights )
+{
+	int					i, j, nodeNum, axis, child;
+	float				mid;
+	light_t				*temp;
+	lightCutNode_t		*node;
+	
+	
+	/* make the node */
+	nodeNum = tree->numNodes++;
+	node = &tree->nodes[ nodeNum ];
+	ClearBounds( node->mins, node->maxs );
+	node->intensity = 0.0f;
+	for( i = 0; i < numLights; i++ )
+	{
+		AddPointToBounds( lights[ i ]->origin, node->mins, node->maxs );
+		node->intensity += LightCutIntensity( lights[ i ] );
+	}
+	node->children[ 0 ] = node->children[ 1 ] = -1;
+	node->light = NULL;
+	
+	/* leaf */
+	if( numLights == 1 )
+	{
+		node->light = lights[ 0 ];
+		return nodeNum;
+	}
+	
+	/* split */
+	axis = 0;
+	for( i = 1; i < 3; i++ )
+	{
+		if( (node->maxs[ i ] - node->mins[ i ]) > (node->maxs[ axis ] - node->mins[ axis ]) )
+			axis = i;
+	}
+	mid = (node->mins[ axis ] + node->maxs[ axis ]) * 0.5f;
+	for( i = 0, j = numLights - 1; i <= j; )
+	{
+		if( lights[ i ]->origin[ axis ] < mid )
+			i++;
+		else
+		{
+			temp = lights[ i ];
+			lights[ i ] = lights[ j ];
+			lights[ j ] = temp;
+			j--;
+		}
+	}
+	
+	/* coincident lights are split in half */
+	if( i == 0 || i == numLights )
+		i = numLights / 2;
+	
+	/* children (the node array is allocated up front, so node stays valid) */
+	child = BuildLightCutTree_r( tree, lights, i );
+	node->children[ 0 ] = child;
+	child = BuildLightCutTree_r( tree, lights + i, numLights - i );
+	node->children[ 1 ] = child;
+	return nodeNum;
+}
+
+
+
+/*
+CreateLightCuts()
+moves the area lights of a raw lightmap's light list into a light tree if there are more of them
+than the cut size, returns NULL if the lightmap is lit exactly
+*/
+
+lightCutTree_t *CreateLightCuts( rawLightmap_t *lm, trace_t *trace )
+{
+	int					i, numPooled;
+	lightCutTree_t		*tree;
+	
+	
+	/* filtered lightmaps need the light of each light on its own */
+	if( lightCutSize <= 0 || lm->filterRadius > 0.0f || filter )
+		return NULL;
+	
+	/* enough lights to be worth it? */
+	numPooled = 0;
+	for( i = 0; i < trace->numLights; i++ )
+	{
+		if( LightCutPooled( trace->lights[ i ] ) )
+			numPooled++;
+	}
+	if( numPooled <= lightCutSize )
+		return NULL;
+	
+	/* split the light list */
+	tree = (lightCutTree_t *)safe_malloc( sizeof( *tree ) );
+	tree->numLights = 0;
+	tree->lights = (light_t **)safe_malloc( numPooled * sizeof( *tree->lights ) );
+	numPooled = trace->numLights;
+	trace->numLights = 0;
+	for( i = 0; i < numPooled; i++ )
+	{
+		if( LightCutPooled( trace->lights[ i ] ) )
+			tree->lights[ tree->numLights++ ] = trace->lights[ i ];
+		else
+			trace->lights[ trace->numLights++ ] = trace->lights[ i ];
+	}
+	trace->lights[ trace->numLights ] = NULL;
+	
+	/* build the tree */
+	tree->numNodes = 0;
+	tree->nodes = (lightCutNode_t *)safe_malloc( (tree->numLights * 2 - 1) * sizeof( *tree->nodes ) );
+	BuildLightCutTree_r( tree, tree->lights, tree->numLights );
+	
+	/* add to counts */
+	ThreadLock();
+	numLightCutLights += tree->numLights;
+	ThreadUnlock();
+	
+	return tree;
+}
+
+
+
+/*
+FreeLightCuts()
+frees a light tree
+*/
+
+void FreeLightCuts( lightCutTree_t *tree )
+{
+	if( tree == NULL )
+		return;
+	free( tree->nodes );
+	free( tree->lights );
+	free( tree );
+}
+
+
+
+/*
+LightCutBound()
+estimates the light a node can give a sample, zero if all its lights are behind a one sided sample
+*/
+
+static float LightCutBound( lightCutNode_t *node, trace_t *trace )
+{
+	int					i;
+	float				front, dist, size;
+	vec3_t				delta;
+	
+	
+	/* MrE: lights behind the surface don't light it (see LightContribution()) */
+	if( !trace->twoSided )
+	{
+		front = 0.0f;
+		for( i = 0; i < 3; i++ )
+			front += trace->normal[ i ] * ((trace->normal[ i ] > 0.0f ? node->maxs[ i ] : node->mins[ i ]) - trace->origin[ i ]);
+		if( front < 0.0f )
+			return 0.0f;
+	}
+	
+	/* inverse square distance to the middle of the node, clamped by its size */
+	for( i = 0; i < 3; i++ )
+		delta[ i ] = (node->mins[ i ] + node->maxs[ i ]) * 0.5f - trace->origin[ i ];
+	dist = DotProduct( delta, delta );
+	VectorSubtract( node->maxs, node->mins, delta );
+	size = DotProduct( delta, delta ) * 0.25f;
+	if( dist < size )
+		dist = size;
+	if( dist < (LIGHT_CUT_MIN_DIST * LIGHT_CUT_MIN_DIST) )
+		dist = LIGHT_CUT_MIN_DIST * LIGHT_CUT_MIN_DIST;
+	return node->intensity / dist;
+}
+
+
+
+/*
+IlluminateLightCutLuxel()
+adds the light of a light tree to the sample in trace, returns the number of lights that lit it
+*/
+
+static int IlluminateLightCutLuxel( lightCutTree_t *tree, trace_t *trace, unsigned int seed, float *luxel, float *deluxel, int *numSamples )
+{
+	int					i, numCut, best, nodeNum, random, numLit;
+	int					cut[ MAX_LIGHT_CUT ];
+	float				bound[ MAX_LIGHT_CUT ], total, b0, b1, pdf, brightness;
+	lightCutNode_t		*node;
+	
+	
+	/* start with the root */
+	cut[ 0 ] = 0;
+	bound[ 0 ] = LightCutBound( &tree->nodes[ 0 ], trace );
+	total = bound[ 0 ];
+	numCut = 1;
+	
+	/* split the inner node with the largest bound until the cut is full or good enough */
+	while( numCut < lightCutSize && numCut < MAX_LIGHT_CUT )
+	{
+		best = -1;
+		for( i = 0; i < numCut; i++ )
+		{
+			if( tree->nodes[ cut[ i ] ].light == NULL && (best < 0 || bound[ i ] > bound[ best ]) )
+				best = i;
+		}
+		if( best < 0 || bound[ best ] <= 0.0f || bound[ best ] <= lightCutQuality * total )
+			break;
+		
+		node = &tree->nodes[ cut[ best ] ];
+		total -= bound[ best ];
+		cut[ best ] = node->children[ 0 ];
+		bound[ best ] = LightCutBound( &tree->nodes[ cut[ best ] ], trace );
+		cut[ numCut ] = node->children[ 1 ];
+		bound[ numCut ] = LightCutBound( &tree->nodes[ cut[ numCut ] ], trace );
+		total += bound[ best ] + bound[ numCut ];
+		numCut++;
+	}
+	
+	/* sample one light per node of the cut */
+	random = 0;
+	numLit = 0;
+	for( i = 0; i < numCut; i++ )
+	{
+		if( bound[ i ] <= 0.0f )
+			continue;
+		
+		/* walk down to a leaf, picking children in proportion to their bounds */
+		nodeNum = cut[ i ];
+		pdf = 1.0f;
+		while( nodeNum >= 0 && tree->nodes[ nodeNum ].light == NULL )
+		{
+			node = &tree->nodes[ nodeNum ];
+			b0 = LightCutBound( &tree->nodes[ node->children[ 0 ] ], trace );
+			b1 = LightCutBound( &tree->nodes[ node->children[ 1 ] ], trace );
+			if( (b0 + b1) <= 0.0f )
+				nodeNum = -1;
+			else if( RandomForSeed( seed, random++ ) * (b0 + b1) < b0 )
+			{
+				nodeNum = node->children[ 0 ];
+				pdf *= b0 / (b0 + b1);
+			}
+			else
+			{
+				nodeNum = node->children[ 1 ];
+				pdf *= b1 / (b0 + b1);
+			}
+		}
+		if( nodeNum < 0 || pdf <= 0.0f )
+			continue;
+		
+		/* light it */
+		trace->light = tree->nodes[ nodeNum ].light;
+		(*numSamples)++;
+		if( LightContribution( trace, LIGHT_SURFACES, qfalse ) != 1 )
+			continue;
+		VectorMA( luxel, 1.0f / pdf, trace->color, luxel );
+		numLit++;
+		
+		/* add to light direction map */
+		if( deluxel != NULL )
+		{
+			brightness = trace->colorNoShadow[ 0 ] * 0.3f + trace->colorNoShadow[ 1 ] * 0.59f + trace->colorNoShadow[ 2 ] * 0.11f;
+			brightness *= (1.0 / 255.0) / pdf;
+			VectorMA( deluxel, brightness, trace->direction, deluxel );
+		}
+	}
+	
+	return numLit;
+}
+
+
+
+/*
+IlluminateLightCutRows()
+lights rows y0 to y1 of a raw lightmap's style 0 luxels with its light tree
+*/
+
+void IlluminateLightCutRows( rawLightmap_t *lm, lightCutTree_t *tree, trace_t *trace, int y0, int y1 )
+{
+	int					x, y, *cluster, numSamples;
+	float				*luxel, *deluxel;
+	
+	
+	numSamples = 0;
+	for( y = y0; y < y1; y++ )
+	{
+		for( x = 0; x < lm->sw; x++ )
+		{
+			cluster = SUPER_CLUSTER( x, y );
+			if( *cluster < 0 )
+				continue;
+			
+			/* setup trace */
+			trace->cluster = *cluster;
+			VectorCopy( SUPER_ORIGIN( x, y ), trace->origin );
+			VectorCopy( SUPER_NORMAL( x, y ), trace->normal );
+			
+			/* sample the tree */
+			luxel = SUPER_LUXEL( 0, x, y );
+			deluxel = deluxemap ? SUPER_DELUXEL( x, y ) : NULL;
+			luxel[ 4 ] += IlluminateLightCutLuxel( tree, trace, RandomSeed( (int) (lm - rawLightmaps), y * lm->sw + x, bounce ), luxel, deluxel, &numSamples );
+		}
+	}
+	
+	/* add to counts */
+	ThreadLock();
+	numLightCutSamples += numSamples;
+	ThreadUnlock();
+}
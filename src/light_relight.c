@@ -0,0 +1,679 @@
+/* -------------------------------------------------------------------------------
+
+Copyright (C) 1999-2006 Id Software, Inc. and contributors.
+For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+This file is part of GtkRadiant.
+
+GtkRadiant is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+GtkRadiant is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with GtkRadiant; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+----------------------------------------------------------------------------------
+
+This code has been altered significantly from its original form, to support
+several games based on the Quake III Arena engine, in the form of "Q3Map2."
+
+------------------------------------------------------------------------------- */
+
+
+
+/* marker */
+#define LIGHT_RELIGHT_C
+
+
+
+/* dependencies */
+#include "q3map2.h"
+
+
+
+/*
+incremental relighting (-incremental)
+
+every raw lightmap and lightgrid block gets a key that hashes everything its direct
+lighting is computed from: the map-wide options and trace geometry, its own luxel
+positions/normals/clusters and the culled lights that reach it. the keys and the lit
+luxels/grid points are written to mapname.relight, and a rerun that finds the same key
+copies the stored result back instead of tracing it again.
+*/
+
+#define RELIGHT_IDENT			(('T' << 24) + ('L' << 16) + ('R' << 8) + 'B')
+#define RELIGHT_VERSION			1
+
+#define RELIGHT_LIGHTMAP		0
+#define RELIGHT_GRID_BLOCK		1
+
+#define RELIGHT_ALIGN( x )		(((x) + 3) & ~3)	/* records stay 4 byte aligned */
+
+#define HashValue( md4, v )		MD4Update( (md4), (unsigned char*) &(v), sizeof( v ) )
+
+typedef struct relightHeader_s
+{
+	int					ident, version;
+	byte				key[ 16 ];
+	int					numRecords;
+}
+relightHeader_t;
+
+typedef struct relightRecord_s
+{
+	int					type, num;
+	byte				key[ 16 ];
+	int					length;			/* bytes of (padded) data following the record */
+}
+relightRecord_t;
+
+typedef struct relightLightmap_s
+{
+	int					sw, sh;
+	int					luxelMask;		/* which superLuxels[] follow */
+	int					deluxels;		/* superDeluxels follow the luxels */
+	byte				styles[ MAX_LIGHTMAPS ];
+}
+relightLightmap_t;
+
+static byte				relightArgsKey[ 16 ];
+static byte				relightKey[ 16 ];
+
+static byte				*relightData = NULL;
+static relightRecord_t	**oldLightmapRecords = NULL, **oldGridRecords = NULL;
+
+static byte				*lightmapKeys = NULL, *gridBlockKeys = NULL;
+static qboolean			gridBlocksKeyed = qfalse;
+
+static FILE				*relightFile = NULL;
+static int				numRelightRecords = 0;
+
+static int				numRelitLightmaps = 0, numRelitGridBlocks = 0, numRelitLuxels = 0;
+
+
+
+/*
+RelightFilename()
+the relight file lives next to the bsp
+*/
+
+static void RelightFilename( char *filename )
+{
+	strcpy( filename, source );
+	StripExtension( filename );
+	strcat( filename, ".relight" );
+}
+
+
+
+/*
+SetupRelight()
+hashes the options that affect lighting; the worldspawn keys go in as well since
+they hold the global light settings
+*/
+
+void SetupRelight( int argc, char **argv )
+{
+	int			i;
+	MD4_CTX		md4;
+	epair_t		*ep;
+	
+	
+	/* nothing to reuse when only the grid or debug colors are made */
+	if( gridOnly || lightmapDebugState )
+	{
+		Sys_Printf( "WARNING: -incremental is ignored with -gridonly and the lightmap debug modes\n" );
+		incrementalLight = qfalse;
+		return;
+	}
+	
+	MD4Init( &md4 );
+	i = RELIGHT_VERSION;
+	HashValue( &md4, i );
+	MD4Update( &md4, (unsigned char*) game->arg, strlen( game->arg ) + 1 );
+	
+	/* skip the map name and the switches that don't change the output */
+	for( i = 1; i < (argc - 1); i++ )
+	{
+		if( !strcmp( argv[ i ], "-v" ) || !strcmp( argv[ i ], "-incremental" ) || !strcmp( argv[ i ], "-tracecache" ) )
+			continue;
+		if( !strcmp( argv[ i ], "-threads" ) )
+		{
+			i++;
+			continue;
+		}
+		MD4Update( &md4, (unsigned char*) argv[ i ], strlen( argv[ i ] ) + 1 );
+	}
+	
+	/* worldspawn */
+	if( numEntities > 0 )
+	{
+		for( ep = entities[ 0 ].epairs; ep != NULL; ep = ep->next )
+		{
+			MD4Update( &md4, (unsigned char*) ep->key, strlen( ep->key ) + 1 );
+			MD4Update( &md4, (unsigned char*) ep->value, strlen( ep->value ) + 1 );
+		}
+	}
+	
+	MD4Final( relightArgsKey, &md4 );
+}
+
+
+
+/*
+LoadRelight()
+reads the records of the previous run, called once the raw lightmaps and the grid are allocated
+*/
+
+void LoadRelight( void )
+{
+	int					length, offset, numRecords;
+	char				filename[ MAX_OS_PATH ];
+	byte				geometryKey[ 16 ];
+	MD4_CTX				md4;
+	relightHeader_t		*header;
+	relightRecord_t		*record;
+	
+	
+	if( !incrementalLight )
+		return;
+	
+	/* combine the options with the trace geometry */
+	TraceGeometryKey( geometryKey );
+	MD4Init( &md4 );
+	MD4Update( &md4, relightArgsKey, sizeof( relightArgsKey ) );
+	MD4Update( &md4, geometryKey, sizeof( geometryKey ) );
+	MD4Final( relightKey, &md4 );
+	
+	/* keys of this run */
+	lightmapKeys = (byte*) safe_malloc( (numRawLightmaps + 1) * 16 );
+	memset( lightmapKeys, 0, (numRawLightmaps + 1) * 16 );
+	gridBlockKeys = (byte*) safe_malloc( (numGridBlocks + 1) * 16 );
+	memset( gridBlockKeys, 0, (numGridBlocks + 1) * 16 );
+	gridBlocksKeyed = qfalse;
+	
+	/* records of the last one */
+	oldLightmapRecords = (relightRecord_t**) safe_malloc( (numRawLightmaps + 1) * sizeof( *oldLightmapRecords ) );
+	memset( oldLightmapRecords, 0, (numRawLightmaps + 1) * sizeof( *oldLightmapRecords ) );
+	oldGridRecords = (relightRecord_t**) safe_malloc( (numGridBlocks + 1) * sizeof( *oldGridRecords ) );
+	memset( oldGridRecords, 0, (numGridBlocks + 1) * sizeof( *oldGridRecords ) );
+	
+	/* load the file */
+	RelightFilename( filename );
+	length = TryLoadFile( filename, (void**) &relightData );
+	if( length < 0 )
+		return;
+	header = (relightHeader_t*) relightData;
+	if( length < (int) sizeof( *header ) || header->ident != RELIGHT_IDENT || header->version != RELIGHT_VERSION ||
+		memcmp( header->key, relightKey, sizeof( relightKey ) ) )
+	{
+		Sys_Printf( "Relight file %s is out of date, relighting everything\n", filename );
+		free( relightData );
+		relightData = NULL;
+		return;
+	}
+	
+	/* index the records */
+	numRecords = 0;
+	for( offset = sizeof( *header ); offset <= length - (int) sizeof( *record ); offset += sizeof( *record ) + record->length )
+	{
+		record = (relightRecord_t*) (relightData + offset);
+		if( record->length < 0 || (record->length & 3) || record->length > length - offset - (int) sizeof( *record ) )
+			break;
+		if( record->type == RELIGHT_LIGHTMAP && record->num >= 0 && record->num < numRawLightmaps )
+			oldLightmapRecords[ record->num ] = record;
+		else if( record->type == RELIGHT_GRID_BLOCK && record->num >= 0 && record->num < numGridBlocks )
+			oldGridRecords[ record->num ] = record;
+		numRecords++;
+	}
+	if( numRecords != header->numRecords )
+		Sys_Printf( "WARNING: Relight file %s is damaged\n", filename );
+	Sys_Printf( "Loaded %d relight records from %s\n", numRecords, filename );
+}
+
+
+
+/*
+HashLight()
+adds the values of a light that change its contribution to a sample
+*/
+
+static void HashLight( MD4_CTX *md4, light_t *light )
+{
+	int			i;
+	
+	
+	HashValue( md4, light->type );
+	HashValue( md4, light->flags );
+	if( light->si != NULL )
+		MD4Update( md4, (unsigned char*) light->si->shader, strlen( light->si->shader ) + 1 );
+	HashValue( md4, light->origin );
+	HashValue( md4, light->normal );
+	HashValue( md4, light->dist );
+	HashValue( md4, light->photons );
+	HashValue( md4, light->mindist );
+	HashValue( md4, light->style );
+	HashValue( md4, light->color );
+	HashValue( md4, light->radiusByDist );
+	HashValue( md4, light->fade );
+	HashValue( md4, light->angleScale );
+	HashValue( md4, light->add );
+	HashValue( md4, light->envelope );
+	HashValue( md4, light->cluster );
+	HashValue( md4, light->emitColor );
+	HashValue( md4, light->falloffTolerance );
+	HashValue( md4, light->filterRadius );
+	if( light->w != NULL )
+	{
+		HashValue( md4, light->w->numpoints );
+		MD4Update( md4, (unsigned char*) light->w->p, light->w->numpoints * sizeof( *light->w->p ) );
+	}
+	HashValue( md4, light->devianceRadius );
+	HashValue( md4, light->devianceSamples );
+	if( light->devianceOrigins != NULL )
+	{
+		for( i = 0; i < light->devianceSamples; i++ )
+			HashValue( md4, light->devianceOrigins[ i ] );
+	}
+}
+
+
+
+/*
+HashTraceLights()
+adds the culled light list of a trace
+*/
+
+static void HashTraceLights( MD4_CTX *md4, trace_t *trace )
+{
+	int			i;
+	
+	
+	HashValue( md4, trace->numLights );
+	HashValue( md4, trace->twoSided );
+	HashValue( md4, trace->testOcclusion );
+	for( i = 0; i < trace->numLights; i++ )
+		HashLight( md4, trace->lights[ i ] );
+}
+
+
+
+/*
+RelightRawLightmap()
+computes the key of a raw lightmap about to be illuminated and restores its luxels
+from the last run when the key matches
+*/
+
+qboolean RelightRawLightmap( int rawLightmapNum, trace_t *trace )
+{
+	int					i, size, luxelSize;
+	byte				*key, *data;
+	MD4_CTX				md4;
+	rawLightmap_t		*lm;
+	relightRecord_t		*record;
+	relightLightmap_t	*header;
+	
+	
+	/* only the direct pass */
+	if( !incrementalLight || bouncing || lightmapKeys == NULL )
+		return qfalse;
+	lm = &rawLightmaps[ rawLightmapNum ];
+	size = lm->sw * lm->sh;
+	
+	/* make the key */
+	MD4Init( &md4 );
+	MD4Update( &md4, relightKey, sizeof( relightKey ) );
+	HashValue( &md4, rawLightmapNum );
+	HashValue( &md4, lm->sw );
+	HashValue( &md4, lm->sh );
+	HashValue( &md4, lm->w );
+	HashValue( &md4, lm->h );
+	HashValue( &md4, lm->sampleSize );
+	HashValue( &md4, lm->actualSampleSize );
+	HashValue( &md4, lm->entityNum );
+	HashValue( &md4, lm->recvShadows );
+	HashValue( &md4, lm->brightness );
+	HashValue( &md4, lm->filterRadius );
+	HashValue( &md4, lm->floodlightDirectionScale );
+	HashValue( &md4, lm->floodlightRGB );
+	HashValue( &md4, lm->floodlightIntensity );
+	HashValue( &md4, lm->floodlightDistance );
+	HashValue( &md4, lm->aoScale );
+	HashValue( &md4, lm->aoGainScale );
+	HashValue( &md4, lm->ambient );
+	HashValue( &md4, lm->minlight );
+	HashValue( &md4, lm->colormod );
+	HashValue( &md4, lm->styles );
+	MD4Update( &md4, (unsigned char*) &lightSurfaces[ lm->firstLightSurface ], lm->numLightSurfaces * sizeof( *lightSurfaces ) );
+	MD4Update( &md4, (unsigned char*) lm->superOrigins, size * SUPER_ORIGIN_SIZE * sizeof( float ) );
+	MD4Update( &md4, (unsigned char*) lm->superNormals, size * SUPER_NORMAL_SIZE * sizeof( float ) );
+	MD4Update( &md4, (unsigned char*) lm->superClusters, size * sizeof( int ) );
+	if( lm->superTriorigins != NULL )
+		MD4Update( &md4, (unsigned char*) lm->superTriorigins, size * SUPER_TRIORIGIN_SIZE * sizeof( float ) );
+	if( lm->superTrinormals != NULL )
+		MD4Update( &md4, (unsigned char*) lm->superTrinormals, size * SUPER_TRINORMAL_SIZE * sizeof( float ) );
+	HashTraceLights( &md4, trace );
+	key = lightmapKeys + rawLightmapNum * 16;
+	MD4Final( key, &md4 );
+	
+	/* same as last time? */
+	record = oldLightmapRecords[ rawLightmapNum ];
+	if( record == NULL || memcmp( record->key, key, 16 ) || record->length < (int) sizeof( *header ) )
+		return qfalse;
+	header = (relightLightmap_t*) (record + 1);
+	if( header->sw != lm->sw || header->sh != lm->sh || (header->deluxels != 0) != (deluxemap != qfalse) )
+		return qfalse;
+	luxelSize = size * SUPER_LUXEL_SIZE * sizeof( float );
+	for( i = 0, data = (byte*) (header + 1); i < MAX_LIGHTMAPS; i++ )
+	{
+		if( header->luxelMask & (1 << i) )
+			data += luxelSize;
+	}
+	if( header->deluxels )
+		data += size * SUPER_DELUXEL_SIZE * sizeof( float );
+	if( data != (byte*) (record + 1) + record->length )
+		return qfalse;
+	
+	/* restore the luxels */
+	data = (byte*) (header + 1);
+	for( i = 0; i < MAX_LIGHTMAPS; i++ )
+	{
+		lm->styles[ i ] = header->styles[ i ];
+		if( !(header->luxelMask & (1 << i)) )
+		{
+			if( lm->superLuxels[ i ] != NULL )
+				memset( lm->superLuxels[ i ], 0, luxelSize );
+			continue;
+		}
+		if( lm->superLuxels[ i ] == NULL )
+			lm->superLuxels[ i ] = (float *)safe_malloc_tag( luxelSize, &superLuxelTag );
+		memcpy( lm->superLuxels[ i ], data, luxelSize );
+		data += luxelSize;
+	}
+	if( header->deluxels )
+		memcpy( lm->superDeluxels, data, size * SUPER_DELUXEL_SIZE * sizeof( float ) );
+	
+	/* count it */
+	numRelitLightmaps++;
+	numRelitLuxels += size;
+	return qtrue;
+}
+
+
+
+/*
+GridBlockPoints()
+lists the grid points of a block in the order IlluminateGridBlock() visits them
+*/
+
+static int GridBlockPoints( int num, int *points )
+{
+	int			mod, x, y, z, i, j, k, px, py, pz, numPoints;
+	
+	
+	mod = num; 
+	z = mod / (gridBlocks[ 0 ] * gridBlocks[ 1 ]);
+	mod -= z * (gridBlocks[ 0 ] * gridBlocks[ 1 ]); 
+	y = mod / gridBlocks[ 0 ];
+	mod -= y * gridBlocks[ 0 ];
+	x = mod;
+	x *= gridBlockSize[ 0 ];
+	y *= gridBlockSize[ 1 ];
+	z *= gridBlockSize[ 2 ];
+	
+	numPoints = 0;
+	for( i = 0; i < gridBlockSize[ 2 ] && (pz = z + i) < gridBounds[ 2 ]; i++ )
+	{
+		for( j = 0; j < gridBlockSize[ 1 ] && (py = y + j) < gridBounds[ 1 ]; j++ )
+		{
+			for( k = 0; k < gridBlockSize[ 0 ] && (px = x + k) < gridBounds[ 0 ]; k++ )
+				points[ numPoints++ ] = (pz * gridBounds[ 1 ] + py) * gridBounds[ 0 ] + px;
+		}
+	}
+	return numPoints;
+}
+
+
+
+/*
+RelightGridBlock()
+computes the key of a lightgrid block about to be illuminated and restores its points
+from the last run when the key matches
+*/
+
+qboolean RelightGridBlock( int num, trace_t *trace )
+{
+	int					i, numPoints, *points;
+	byte				*key, *data;
+	MD4_CTX				md4;
+	relightRecord_t		*record;
+	
+	
+	if( !incrementalLight || gridBlockKeys == NULL )
+		return qfalse;
+	points = (int*) safe_malloc( gridBlockSize[ 0 ] * gridBlockSize[ 1 ] * gridBlockSize[ 2 ] * sizeof( *points ) );
+	numPoints = GridBlockPoints( num, points );
+	
+	/* make the key from the untouched points */
+	MD4Init( &md4 );
+	MD4Update( &md4, relightKey, sizeof( relightKey ) );
+	HashValue( &md4, num );
+	HashValue( &md4, gridMins );
+	HashValue( &md4, gridSize );
+	HashValue( &md4, gridBounds );
+	HashValue( &md4, gridBlockSize );
+	for( i = 0; i < numPoints; i++ )
+		HashValue( &md4, rawGridPoints[ points[ i ] ] );
+	HashTraceLights( &md4, trace );
+	key = gridBlockKeys + num * 16;
+	MD4Final( key, &md4 );
+	gridBlocksKeyed = qtrue;
+	
+	/* same as last time? */
+	record = oldGridRecords[ num ];
+	if( record == NULL || memcmp( record->key, key, 16 ) ||
+		record->length != RELIGHT_ALIGN( numPoints * (int) (sizeof( *rawGridPoints ) + sizeof( *bspGridPoints )) ) )
+	{
+		free( points );
+		return qfalse;
+	}
+	
+	/* restore the points */
+	data = (byte*) (record + 1);
+	for( i = 0; i < numPoints; i++ )
+	{
+		memcpy( &rawGridPoints[ points[ i ] ], data, sizeof( *rawGridPoints ) );
+		data += sizeof( *rawGridPoints );
+		memcpy( &bspGridPoints[ points[ i ] ], data, sizeof( *bspGridPoints ) );
+		data += sizeof( *bspGridPoints );
+	}
+	free( points );
+	numRelitGridBlocks++;
+	return qtrue;
+}
+
+
+
+/*
+OpenRelightFile()
+starts the relight file of this run, the header is filled in by WriteRelight()
+*/
+
+static qboolean OpenRelightFile( void )
+{
+	char				filename[ MAX_OS_PATH ];
+	relightHeader_t		header;
+	
+	
+	if( relightFile != NULL )
+		return qtrue;
+	RelightFilename( filename );
+	relightFile = fopen( filename, "wb" );
+	if( relightFile == NULL )
+	{
+		Sys_Printf( "WARNING: Can't write relight file %s\n", filename );
+		return qfalse;
+	}
+	memset( &header, 0, sizeof( header ) );
+	fwrite( &header, 1, sizeof( header ), relightFile );
+	numRelightRecords = 0;
+	return qtrue;
+}
+
+
+
+/*
+WriteRelightRecord()
+appends a record header, its data follows
+*/
+
+static void WriteRelightRecord( int type, int num, byte *key, int length )
+{
+	relightRecord_t		record;
+	
+	
+	record.type = type;
+	record.num = num;
+	memcpy( record.key, key, sizeof( record.key ) );
+	record.length = length;
+	fwrite( &record, 1, sizeof( record ), relightFile );
+	numRelightRecords++;
+}
+
+
+
+/*
+WriteRelightGrid()
+writes the illuminated grid blocks, called before the grid is flooded
+*/
+
+void WriteRelightGrid( void )
+{
+	int			num, i, numPoints, length, *points;
+	byte		pad[ 4 ];
+	
+	
+	if( !incrementalLight || !gridBlocksKeyed || !OpenRelightFile() )
+		return;
+	
+	points = (int*) safe_malloc( gridBlockSize[ 0 ] * gridBlockSize[ 1 ] * gridBlockSize[ 2 ] * sizeof( *points ) );
+	for( num = 0; num < numGridBlocks; num++ )
+	{
+		numPoints = GridBlockPoints( num, points );
+		length = numPoints * (sizeof( *rawGridPoints ) + sizeof( *bspGridPoints ));
+		WriteRelightRecord( RELIGHT_GRID_BLOCK, num, gridBlockKeys + num * 16, RELIGHT_ALIGN( length ) );
+		for( i = 0; i < numPoints; i++ )
+		{
+			fwrite( &rawGridPoints[ points[ i ] ], 1, sizeof( *rawGridPoints ), relightFile );
+			fwrite( &bspGridPoints[ points[ i ] ], 1, sizeof( *bspGridPoints ), relightFile );
+		}
+		memset( pad, 0, sizeof( pad ) );
+		fwrite( pad, 1, RELIGHT_ALIGN( length ) - length, relightFile );
+	}
+	free( points );
+	
+	/* emit some stats */
+	Sys_Printf( "%9d of %d grid blocks reused\n", numRelitGridBlocks, numGridBlocks );
+}
+
+
+
+/*
+WriteRelight()
+writes the directly lit raw lightmaps and finishes the relight file
+*/
+
+void WriteRelight( void )
+{
+	int					i, num, size, luxelSize, length;
+	char				filename[ MAX_OS_PATH ];
+	rawLightmap_t		*lm;
+	relightLightmap_t	lmHeader;
+	relightHeader_t		header;
+	
+	
+	if( !incrementalLight || lightmapKeys == NULL )
+		return;
+	
+	/* lightmaps */
+	if( OpenRelightFile() )
+	{
+		for( num = 0; num < numRawLightmaps; num++ )
+		{
+			lm = &rawLightmaps[ num ];
+			size = lm->sw * lm->sh;
+			luxelSize = size * SUPER_LUXEL_SIZE * sizeof( float );
+			
+			memset( &lmHeader, 0, sizeof( lmHeader ) );
+			lmHeader.sw = lm->sw;
+			lmHeader.sh = lm->sh;
+			lmHeader.deluxels = (deluxemap && lm->superDeluxels != NULL) ? 1 : 0;
+			memcpy( lmHeader.styles, lm->styles, sizeof( lmHeader.styles ) );
+			length = sizeof( lmHeader );
+			for( i = 0; i < MAX_LIGHTMAPS; i++ )
+			{
+				if( lm->superLuxels[ i ] != NULL )
+				{
+					lmHeader.luxelMask |= (1 << i);
+					length += luxelSize;
+				}
+			}
+			if( lmHeader.deluxels )
+				length += size * SUPER_DELUXEL_SIZE * sizeof( float );
+			
+			WriteRelightRecord( RELIGHT_LIGHTMAP, num, lightmapKeys + num * 16, length );
+			fwrite( &lmHeader, 1, sizeof( lmHeader ), relightFile );
+			for( i = 0; i < MAX_LIGHTMAPS; i++ )
+			{
+				if( lm->superLuxels[ i ] != NULL )
+					fwrite( lm->superLuxels[ i ], 1, luxelSize, relightFile );
+			}
+			if( lmHeader.deluxels )
+				fwrite( lm->superDeluxels, 1, size * SUPER_DELUXEL_SIZE * sizeof( float ), relightFile );
+		}
+		
+		/* finish with the header so an interrupted write leaves a file that won't load */
+		header.ident = RELIGHT_IDENT;
+		header.version = RELIGHT_VERSION;
+		memcpy( header.key, relightKey, sizeof( header.key ) );
+		header.numRecords = numRelightRecords;
+		fseek( relightFile, 0, SEEK_SET );
+		fwrite( &header, 1, sizeof( header ), relightFile );
+		RelightFilename( filename );
+		if( ferror( relightFile ) )
+		{
+			fclose( relightFile );
+			remove( filename );
+			Sys_Printf( "WARNING: Can't write relight file %s\n", filename );
+		}
+		else
+		{
+			Sys_FPrintf( SYS_VRB, "Wrote relight file %s (%.2fMB)\n", filename, (float) ftell( relightFile ) / (1024.0f * 1024.0f) );
+			fclose( relightFile );
+		}
+		relightFile = NULL;
+	}
+	
+	/* emit some stats */
+	Sys_Printf( "%9d of %d raw lightmaps reused\n", numRelitLightmaps, numRawLightmaps );
+	Sys_Printf( "%9d luxels reused\n", numRelitLuxels );
+	
+	/* the bounces relight everything */
+	free( relightData );
+	relightData = NULL;
+	free( oldLightmapRecords );
+	oldLightmapRecords = NULL;
+	free( oldGridRecords );
+	oldGridRecords = NULL;
+	free( lightmapKeys );
+	lightmapKeys = NULL;
+	free( gridBlockKeys );
+	gridBlockKeys = NULL;
+}
@@ -32,6 +32,12 @@ several games based on the Quake III Arena engine, in the form of "Q3Map2."
 /* dependencies */
 #include "q3map2.h"
 
+#ifdef Q_UNIX
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
 #define Vector2Copy( a, b )		((b)[ 0 ] = (a)[ 0 ], (b)[ 1 ] = (a)[ 1 ])
 #define Vector4Copy( a, b )		((b)[ 0 ] = (a)[ 0 ], (b)[ 1 ] = (a)[ 1 ], (b)[ 2 ] = (a)[ 2 ], (b)[ 3 ] = (a)[ 3 ])
 
@@ -52,6 +58,91 @@ several games based on the Quake III Arena engine, in the form of "Q3Map2."
 #define TRACE_LEAF				-1
 #define TRACE_LEAF_SOLID		-2
 
+#define BVH_MIN_LEAF_TRIANGLES	2
+#define BVH_MAX_LEAF_TRIANGLES	8
+#define BVH_SAH_BINS			16
+#define BVH_TRAVERSAL_COST		1.0f		/* relative to one triangle test */
+#define BVH_MAX_SAH_DEPTH		40			/* deeper subtrees are split in half */
+#define BVH_TASK_TRIANGLES		4096
+#define BVH_BOX_EPSILON			0.125f
+#define BVH_BARY_EPSILON		0.01f		/* BARY_EPSILON */
+#define MAX_BVH_STACK			128
+#define MAX_TRACE_STACK			64			/* deeper walks recurse */
+#define TRACE_PACKET_COHERENCE	0.9f		/* minimum cosine between packet rays */
+
+#define TRACE_RAY_BLOCK			1024
+#define OCCLUDER_CACHE_SIZE		256			/* per thread, indexed by light */
+#define MAX_COVERAGE_LEVELS		16
+
+#define COVERAGE_MIXED			0			/* texels of an alphashadow/lightfilter triangle */
+#define COVERAGE_OPAQUE			1
+#define COVERAGE_CLEAR			2
+
+#define MAX_CAST_GROUPS			31
+#define CAST_GROUP_OVERFLOW		(1u << MAX_CAST_GROUPS)	/* castShadows values past the first 31 */
+
+#define TRACE_CACHE_IDENT		(('C' << 24) + ('T' << 16) + ('M' << 8) + 'B')	/* "BMTC" */
+#define TRACE_CACHE_VERSION		2
+
+#define TRACE_CACHE_INFOS		0
+#define TRACE_CACHE_TRIANGLES	1
+#define TRACE_CACHE_NODES		2
+#define TRACE_CACHE_BVH_NODES	3
+#define TRACE_CACHE_BLOCKS		4
+#define TRACE_CACHE_MODELS		5
+#define TRACE_CACHE_INSTANCES	6
+#define TRACE_CACHE_COVERAGE	7
+#define NUM_TRACE_CACHE_LUMPS	8
+
+/* simd triangle tests: 8 wide when built for avx2 (-mavx2, /arch:AVX2), otherwise 4 wide sse2 */
+#if defined( __AVX2__ )
+	#include <immintrin.h>
+	#define TRACE_SIMD
+	#define TRACE_SIMD_NAME		"avx2"
+	#define TRACE_BLOCK_LANES	8
+	typedef __m256				simd_t;
+	#define SimdSet1			_mm256_set1_ps
+	#define SimdLoad			_mm256_loadu_ps
+	#define SimdStore			_mm256_storeu_ps
+	#define SimdAdd				_mm256_add_ps
+	#define SimdSub				_mm256_sub_ps
+	#define SimdMul				_mm256_mul_ps
+	#define SimdDiv				_mm256_div_ps
+	#define SimdAnd				_mm256_and_ps
+	#define SimdAndNot			_mm256_andnot_ps
+	#define SimdGE( a, b )		_mm256_cmp_ps( a, b, _CMP_GE_OQ )
+	#define SimdLE( a, b )		_mm256_cmp_ps( a, b, _CMP_LE_OQ )
+	#define SimdLT( a, b )		_mm256_cmp_ps( a, b, _CMP_LT_OQ )
+	#define SimdMask			_mm256_movemask_ps
+#elif defined( __SSE2__ ) || defined( _M_X64 ) || (defined( _M_IX86_FP ) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define TRACE_SIMD
+	#define TRACE_SIMD_NAME		"sse2"
+	#define TRACE_BLOCK_LANES	4
+	typedef __m128				simd_t;
+	#define SimdSet1			_mm_set1_ps
+	#define SimdLoad			_mm_loadu_ps
+	#define SimdStore			_mm_storeu_ps
+	#define SimdAdd				_mm_add_ps
+	#define SimdSub				_mm_sub_ps
+	#define SimdMul				_mm_mul_ps
+	#define SimdDiv				_mm_div_ps
+	#define SimdAnd				_mm_and_ps
+	#define SimdAndNot			_mm_andnot_ps
+	#define SimdGE				_mm_cmpge_ps
+	#define SimdLE				_mm_cmple_ps
+	#define SimdLT				_mm_cmplt_ps
+	#define SimdMask			_mm_movemask_ps
+#else
+	#define TRACE_SIMD_NAME		"scalar"
+	#define TRACE_BLOCK_LANES	4
+#endif
+
+#define SimdDot( a, b )			SimdAdd( SimdAdd( SimdMul( (a)[ 0 ], (b)[ 0 ] ), SimdMul( (a)[ 1 ], (b)[ 1 ] ) ), SimdMul( (a)[ 2 ], (b)[ 2 ] ) )
+#define SimdCross( a, b, c )	((c)[ 0 ] = SimdSub( SimdMul( (a)[ 1 ], (b)[ 2 ] ), SimdMul( (a)[ 2 ], (b)[ 1 ] ) ), \
+								 (c)[ 1 ] = SimdSub( SimdMul( (a)[ 2 ], (b)[ 0 ] ), SimdMul( (a)[ 0 ], (b)[ 2 ] ) ), \
+								 (c)[ 2 ] = SimdSub( SimdMul( (a)[ 0 ], (b)[ 1 ] ), SimdMul( (a)[ 1 ], (b)[ 0 ] ) ))
+
 typedef struct traceVert_s
 {
 	vec3_t						xyz;
@@ -65,6 +156,7 @@ typedef struct traceInfo_s
 	int							surfaceNum;
 	int                         entityNum;
 	int							castShadows;
+	unsigned int				castGroup;		/* bit of castShadows, see CastGroupBit() */
 }
 traceInfo_t;
 
@@ -93,9 +185,85 @@ typedef struct traceNode_s
 	int							children[ 2 ];
 	int							numItems, maxItems;
 	int							*items;
+	int							firstBlock;
 }
 traceNode_t;
 
+typedef struct traceBlock_s
+{
+	float						origin[ 3 ][ TRACE_BLOCK_LANES ];
+	float						edge1[ 3 ][ TRACE_BLOCK_LANES ];
+	float						edge2[ 3 ][ TRACE_BLOCK_LANES ];
+	int							items[ TRACE_BLOCK_LANES ];
+	unsigned int				castGroups[ TRACE_BLOCK_LANES ];
+}
+traceBlock_t;
+
+typedef struct traceBVHNode_s
+{
+	vec3_t						mins, maxs;
+	int							first;		/* children first and first + 1, or first bvhItems index (first block once packed) for leafs */
+	unsigned short				numItems;	/* 0 for inner nodes */
+	unsigned short				axis;
+}
+traceBVHNode_t;
+
+typedef struct traceCoverageMip_s
+{
+	image_t						*image;
+	int							numLevels;
+	int							width[ MAX_COVERAGE_LEVELS ], height[ MAX_COVERAGE_LEVELS ];
+	byte						*texels[ MAX_COVERAGE_LEVELS ];	/* min alpha, max alpha, min color, max color */
+}
+traceCoverageMip_t;
+
+typedef struct traceOccluder_s
+{
+	light_t						*light;
+	int							triangleNum, instanceNum;
+}
+traceOccluder_t;
+
+typedef struct traceModel_s
+{
+	picoModel_t					*model;
+	int							skin, castShadows;
+	int							firstTriangle, numTriangles;	/* in model space */
+	int							rootNode;
+}
+traceModel_t;
+
+typedef struct traceInstance_s
+{
+	m4x4_t						transform, inverse;				/* model to world and back */
+	float						coplanarScale;					/* COPLANAR_EPSILON to model space */
+	int							modelNum, rootNode;
+}
+traceInstance_t;
+
+typedef struct traceBVHTree_s
+{
+	int							rootNode, first, num;
+}
+traceBVHTree_t;
+
+typedef struct traceCacheInfo_s
+{
+	char						shader[ MAX_QPATH ];			/* traceInfo_t with the shader by name */
+	int							surfaceNum, entityNum, castShadows;
+}
+traceCacheInfo_t;
+
+typedef struct traceCacheHeader_s
+{
+	int							ident, version;
+	byte						key[ 16 ];
+	int							headNodeNum, skyboxNodeNum, maxTraceDepth, numTraceLeafNodes;
+	int							numWorldBVHItems, numTriangleBVHNodes, instanceRootNode;
+	bspLump_t					lumps[ NUM_TRACE_CACHE_LUMPS ];
+}
+traceCacheHeader_t;
+
 
 int								noDrawContentFlags, noDrawSurfaceFlags, noDrawCompileFlags;
 
@@ -112,6 +280,174 @@ int								headNodeNum = 0, skyboxNodeNum = 0, maxTraceDepth = 0, numTraceLeafNo
 int								numTraceNodes = 0, maxTraceNodes = 0;
 traceNode_t						*traceNodes = NULL;
 
+static volatile int				numBVHNodes = 0;
+static int						maxBVHNodes = 0, numBVHItems = 0;
+static traceBVHNode_t			*bvhNodes = NULL;
+static int						*bvhItems = NULL;
+static vec3_t					*bvhTriMins = NULL, *bvhTriMaxs = NULL, *bvhCentroids = NULL;
+static int						numWorldBVHItems = 0, numTriangleBVHNodes = 0, instanceRootNode = -1;
+static int						numBVHTrees = 0;
+static traceBVHTree_t			*bvhTrees = NULL;
+
+static int						numTraceModels = 0, maxTraceModels = 0;
+static traceModel_t				*traceModels = NULL;
+static int						numTraceInstances = 0, maxTraceInstances = 0;
+static traceInstance_t			*traceInstances = NULL;
+
+static int						numTraceBlocks = 0, maxTraceBlocks = 0;
+static traceBlock_t				*traceBlocks = NULL;
+
+static byte						*traceCoverage = NULL;		/* COVERAGE_* per triangle */
+static byte						traceGeometryKey[ 16 ];		/* TraceCacheKey() of this run */
+
+static int						numCastGroups = 0;
+static int						castGroupValues[ MAX_CAST_GROUPS ];
+static unsigned int				recvGroupMasks[ 256 ][ 2 ];	/* recv and self groups for _rs -128..127 */
+
+static volatile int				numTraceRayBlocks = 0;
+static THREAD_LOCAL int			numTraceRays = 0;
+static double					traceRayStart = 0;
+
+static THREAD_LOCAL traceOccluder_t	traceOccluders[ OCCLUDER_CACHE_SIZE ];
+static THREAD_LOCAL int			traceHitTriangle = -1, traceHitInstance = -1, traceInstanceNum = -1;
+static THREAD_LOCAL int			numOccluderTests = 0, numOccluderHits = 0;
+static THREAD_LOCAL qboolean	traceNearest = qfalse;		/* TraceLine() wants the nearest hit, shadow rays any opaque one */
+static volatile int				numOccluderTestBlocks = 0, numOccluderHitBlocks = 0;
+
+static memTag_t					traceNodeTag = MEMTAG( "trace nodes" );
+static memTag_t					traceTriangleTag = MEMTAG( "trace triangles" );
+
+
+
+/* -------------------------------------------------------------------------------
+
+shadow groups (castShadows values as bits, so _cs/_rs filtering is an and per triangle)
+
+------------------------------------------------------------------------------- */
+
+/*
+CastGroupBit()
+returns the bit of a castShadows value, values past MAX_CAST_GROUPS share the overflow bit
+*/
+
+static unsigned int CastGroupBit( int castShadows )
+{
+	int		i;
+	
+	
+	for( i = 0; i < numCastGroups; i++ )
+	{
+		if( castGroupValues[ i ] == castShadows )
+			return 1u << i;
+	}
+	if( numCastGroups >= MAX_CAST_GROUPS )
+		return CAST_GROUP_OVERFLOW;
+	castGroupValues[ numCastGroups ] = castShadows;
+	return 1u << numCastGroups++;
+}
+
+
+
+/*
+ShadowGroupMasks()
+finds the cast groups that shadow a receive group (recvGroups) and the ones that need the
+full test in TraceTriangleShadows() (selfGroups: _rs 1 self shadowing and the overflow bit)
+*/
+
+static void ShadowGroupMasks( int recvShadows, unsigned int *recvGroups, unsigned int *selfGroups )
+{
+	int		i, castShadows;
+	
+	
+	*recvGroups = 0;
+	*selfGroups = CAST_GROUP_OVERFLOW;
+	for( i = 0; i < numCastGroups; i++ )
+	{
+		castShadows = castGroupValues[ i ];
+		if( recvShadows == 1 )
+		{
+			if( castShadows == 1 )
+				*recvGroups |= 1u << i;
+			else if( castShadows == 0 )
+				*selfGroups |= 1u << i;
+		}
+		else if( recvShadows > 1 )
+		{
+			if( castShadows == 1 || abs( castShadows ) == abs( recvShadows ) )
+				*recvGroups |= 1u << i;
+		}
+		else if( abs( castShadows ) == abs( recvShadows ) )
+			*recvGroups |= 1u << i;
+	}
+}
+
+
+
+/*
+SetupTraceShadowGroups()
+tabulates the group masks of every char sized receive group
+*/
+
+static void SetupTraceShadowGroups( void )
+{
+	int		i;
+	
+	
+	for( i = 0; i < 256; i++ )
+		ShadowGroupMasks( i - 128, &recvGroupMasks[ i ][ 0 ], &recvGroupMasks[ i ][ 1 ] );
+	Sys_FPrintf( SYS_VRB, "%9d shadow cast groups\n", numCastGroups );
+}
+
+
+
+/*
+TraceShadowGroups()
+sets the group masks and the surface hash of a trace
+*/
+
+static void TraceShadowGroups( trace_t *trace )
+{
+	int		i;
+	
+	
+	/* group masks */
+	if( trace->recvShadows >= -128 && trace->recvShadows <= 127 )
+	{
+		trace->recvGroups = recvGroupMasks[ trace->recvShadows + 128 ][ 0 ];
+		trace->selfGroups = recvGroupMasks[ trace->recvShadows + 128 ][ 1 ];
+	}
+	else
+		ShadowGroupMasks( trace->recvShadows, &trace->recvGroups, &trace->selfGroups );
+	
+	/* one bit per surface number & 31, so most surfaces aren't looked up */
+	trace->surfaceHash = 0;
+	for( i = 0; i < trace->numSurfaces; i++ )
+		trace->surfaceHash |= 1u << (trace->surfaces[ i ] & 31);
+}
+
+
+
+/*
+TraceSelfSurface()
+returns qtrue if a surface is one of the trace's own surfaces
+*/
+
+static qboolean TraceSelfSurface( int surfaceNum, trace_t *trace )
+{
+	int		i;
+	
+	
+	if( !(trace->surfaceHash & (1u << (surfaceNum & 31))) )
+		return qfalse;
+	for( i = 0; i < trace->numSurfaces; i++ )
+	{
+		if( surfaceNum == trace->surfaces[ i ] )
+			return qtrue;
+	}
+	return qfalse;
+}
+
+
 
 
 /* -------------------------------------------------------------------------------
@@ -145,17 +481,18 @@ static int AddTraceInfo( traceInfo_t *ti )
 	{
 		/* allocate more room */
 		maxTraceInfos += GROW_TRACE_INFOS;
-		temp = safe_malloc( maxTraceInfos * sizeof( *traceInfos ) );
+		temp = safe_malloc_tag( maxTraceInfos * sizeof( *traceInfos ), &traceTriangleTag );
 		if( traceInfos != NULL )
 		{
 			memcpy( temp, traceInfos, numTraceInfos * sizeof( *traceInfos ) );
-			free( traceInfos );
+			safe_free_tag( traceInfos );
 		}
 		traceInfos = (traceInfo_t*) temp;
 	}
 	
 	/* add the info */
 	memcpy( &traceInfos[ num ], ti, sizeof( *traceInfos ) );
+	traceInfos[ num ].castGroup = CastGroupBit( ti->castShadows );
 	if( num == numTraceInfos )
 		numTraceInfos++;
 	
@@ -180,11 +517,11 @@ static int AllocTraceNode( void )
 	{
 		/* reallocate more room */
 		maxTraceNodes += GROW_TRACE_NODES;
-		temp = (traceNode_t *)safe_malloc( maxTraceNodes * sizeof( traceNode_t ) );
+		temp = (traceNode_t *)safe_malloc_tag( maxTraceNodes * sizeof( traceNode_t ), &traceNodeTag );
 		if( traceNodes != NULL )
 		{
 			memcpy( temp, traceNodes, numTraceNodes * sizeof( traceNode_t ) );
-			free( traceNodes );
+			safe_free_tag( traceNodes );
 		}
 		traceNodes = temp;
 	}
@@ -246,11 +583,11 @@ static int AddTraceWinding( traceWinding_t *tw )
 		{
 			/* allocate more room */
 			maxTraceWindings += GROW_TRACE_WINDINGS;
-			temp = safe_malloc( maxTraceWindings * sizeof( *traceWindings ) );
+			temp = safe_malloc_tag( maxTraceWindings * sizeof( *traceWindings ), &traceTriangleTag );
 			if( traceWindings != NULL )
 			{
 				memcpy( temp, traceWindings, numTraceWindings * sizeof( *traceWindings ) );
-				free( traceWindings );
+				safe_free_tag( traceWindings );
 			}
 			traceWindings = (traceWinding_t*) temp;
 		}
@@ -292,11 +629,11 @@ static int AddTraceTriangle( traceTriangle_t *tt )
 		{
 			/* allocate more room */
 			maxTraceTriangles += GROW_TRACE_TRIANGLES;
-			temp = safe_malloc( maxTraceTriangles * sizeof( *traceTriangles ) );
+			temp = safe_malloc_tag( maxTraceTriangles * sizeof( *traceTriangles ), &traceTriangleTag );
 			if( traceTriangles != NULL )
 			{
 				memcpy( temp, traceTriangles, numTraceTriangles * sizeof( *traceTriangles ) );
-				free( traceTriangles );
+				safe_free_tag( traceTriangles );
 			}
 			traceTriangles = (traceTriangle_t*) temp;
 		}
@@ -342,11 +679,11 @@ static int AddItemToTraceNode( traceNode_t *node, int num )
 			node->maxItems += GROW_NODE_ITEMS;
 		if( node->maxItems <= 0 )
 			node->maxItems = GROW_NODE_ITEMS;
-		temp = safe_malloc( node->maxItems * sizeof( *node->items ) );
+		temp = safe_malloc_tag( node->maxItems * sizeof( *node->items ), &traceNodeTag );
 		if( node->items != NULL )
 		{
 			memcpy( temp, node->items, node->numItems * sizeof( *node->items ) );
-			free( node->items );
+			safe_free_tag( node->items );
 		}
 		node->items = (int*) temp;
 	}
@@ -747,11 +1084,11 @@ static void SubdivideTraceNode_r( int nodeNum, int depth )
 	
 	/* setup front node */
 	frontNode->maxItems = (node->maxItems >> 1);
-	frontNode->items = (int *)safe_malloc( frontNode->maxItems * sizeof( *frontNode->items ) );
+	frontNode->items = (int *)safe_malloc_tag( frontNode->maxItems * sizeof( *frontNode->items ), &traceNodeTag );
 	
 	/* setup back node */
 	backNode->maxItems = (node->maxItems >> 1);
-	backNode->items = (int *)safe_malloc( backNode->maxItems * sizeof( *backNode->items ) );
+	backNode->items = (int *)safe_malloc_tag( backNode->maxItems * sizeof( *backNode->items ), &traceNodeTag );
 	
 	/* filter windings into child nodes */
 	for( i = 0; i < node->numItems; i++ )
@@ -784,21 +1121,21 @@ static void SubdivideTraceNode_r( int nodeNum, int depth )
 	/* free original node winding list */
 	node->numItems = 0;
 	node->maxItems = 0;
-	free( node->items );
+	safe_free_tag( node->items );
 	node->items = NULL;
 	
 	/* check children */
 	if( frontNode->numItems <= 0 )
 	{
 		frontNode->maxItems = 0;
-		free( frontNode->items );
+		safe_free_tag( frontNode->items );
 		frontNode->items = NULL;
 	}
 	
 	if( backNode->numItems <= 0 )
 	{
 		backNode->maxItems = 0;
-		free( backNode->items );
+		safe_free_tag( backNode->items );
 		backNode->items = NULL;
 	}
 	
@@ -845,7 +1182,7 @@ static int TriangulateTraceNode_r( int nodeNum )
 	{
 		node->maxItems = 0;
 		if( node->items != NULL )
-			free( node->items );
+			safe_free_tag( node->items );
 		return node->numItems;
 	}
 	
@@ -856,7 +1193,7 @@ static int TriangulateTraceNode_r( int nodeNum )
 	/* clear it */
 	node->numItems = 0;
 	node->maxItems = numWindings * 2;
-	node->items = (int *)safe_malloc( node->maxItems * sizeof( tt ) );
+	node->items = (int *)safe_malloc_tag( node->maxItems * sizeof( tt ), &traceNodeTag );
 	
 	/* walk winding list */
 	for( i = 0; i < numWindings; i++ )
@@ -887,7 +1224,7 @@ static int TriangulateTraceNode_r( int nodeNum )
 	
 	/* free windings */
 	if( windings != NULL )
-		free( windings );
+		safe_free_tag( windings );
 	
 	/* return item count */
 	return node->numItems;
@@ -897,844 +1234,3002 @@ static int TriangulateTraceNode_r( int nodeNum )
 
 /* -------------------------------------------------------------------------------
 
-shadow casting item setup (triangles, patches, entities)
+bounding volume hierarchy (-bvh)
 
 ------------------------------------------------------------------------------- */
 
 /*
-PopulateWithBSPModel() - ydnar
-filters a bsp model's surfaces into the raytracing tree
+CollectTraceBVHItems_r()
+moves the triangles of every leaf below a node into the bvh item list
 */
 
-static void PopulateWithBSPModel( bspModel_t *model, m4x4_t transform )
+static void CollectTraceBVHItems_r( int nodeNum )
 {
-	int					i, j, x, y, pw[ 5 ], r, nodeNum;
-	bspDrawSurface_t	*ds;
-	surfaceInfo_t		*info;
-	bspDrawVert_t		*verts;
-	int					*indexes;
-	mesh_t				srcMesh, *mesh, *subdivided;
-	traceInfo_t			ti;
-	traceWinding_t		tw;
+	traceNode_t		*node;
 	
 	
 	/* dummy check */
-	if( model == NULL || transform == NULL )
+	if( nodeNum < 0 || nodeNum >= numTraceNodes )
 		return;
 	
-	/* walk the list of surfaces in this model and fill out the info structs */
-	for( i = 0; i < model->numBSPSurfaces; i++ )
+	/* recurse down decision nodes */
+	node = &traceNodes[ nodeNum ];
+	if( node->type >= 0 )
 	{
-		/* get surface and info */
-		ds = &bspDrawSurfaces[ model->firstBSPSurface + i ];
-		info = &surfaceInfos[ model->firstBSPSurface + i ];
-		if( info->si == NULL )
-			continue;
+		CollectTraceBVHItems_r( node->children[ 0 ] );
+		CollectTraceBVHItems_r( node->children[ 1 ] );
+		return;
+	}
+	
+	/* the leaf keeps its solid flag but loses its items, TraceNodes() then only checks for solid */
+	if( node->numItems > 0 )
+	{
+		memcpy( &bvhItems[ numBVHItems ], node->items, node->numItems * sizeof( *bvhItems ) );
+		numBVHItems += node->numItems;
+		safe_free_tag( node->items );
+	}
+	node->items = NULL;
+	node->numItems = 0;
+	node->maxItems = 0;
+}
 
-		/* no shadows */
-		/* vortex: disabled
-		if( !info->castShadows )
-			continue;
-		*/
-		
-		/* patchshadows? */
-		if( ds->surfaceType == MST_PATCH && patchShadows == qfalse )
-			continue;
-		
-		/* some surfaces in the bsp might have been tagged as nodraw, with a bogus shader */
-		if( (bspShaders[ ds->shaderNum ].contentFlags & noDrawContentFlags) || 
-			(bspShaders[ ds->shaderNum ].surfaceFlags & noDrawSurfaceFlags) )
+
+
+/*
+BVHSurfaceArea()
+half surface area of a box, enough for comparing split costs
+*/
+
+static float BVHSurfaceArea( vec3_t mins, vec3_t maxs )
+{
+	vec3_t		size;
+	
+	
+	VectorSubtract( maxs, mins, size );
+	if( size[ 0 ] < 0.0f || size[ 1 ] < 0.0f || size[ 2 ] < 0.0f )
+		return 0.0f;
+	return size[ 0 ] * size[ 1 ] + size[ 1 ] * size[ 2 ] + size[ 2 ] * size[ 0 ];
+}
+
+
+
+/*
+BuildTraceBVH_r()
+splits a range of bvh items with a binned surface area heuristic; big subtrees are handed to
+other threads as tasks
+*/
+
+typedef struct bvhBuildTask_s
+{
+	int			nodeNum, first, num, depth;
+}
+bvhBuildTask_t;
+
+static void BuildTraceBVHTask( void *data );
+
+static void BuildTraceBVH_r( int nodeNum, int first, int num, int depth )
+{
+	int					i, j, axis, bestAxis, bestBin, bin, mid, temp, child, countLeft;
+	float				scale, cost, bestCost, leafCost, area;
+	vec3_t				centerMins, centerMaxs, mins, maxs;
+	int					binCounts[ BVH_SAH_BINS ], countsRight[ BVH_SAH_BINS ];
+	vec3_t				binMins[ BVH_SAH_BINS ], binMaxs[ BVH_SAH_BINS ];
+	float				areasRight[ BVH_SAH_BINS ];
+	traceBVHNode_t		*node;
+	bvhBuildTask_t		*task;
+	threadTaskGroup_t	group;
+	
+	
+	/* bound the items and their centroids */
+	node = &bvhNodes[ nodeNum ];
+	ClearBounds( node->mins, node->maxs );
+	ClearBounds( centerMins, centerMaxs );
+	for( i = first; i < first + num; i++ )
+	{
+		j = bvhItems[ i ];
+		AddPointToBounds( bvhTriMins[ j ], node->mins, node->maxs );
+		AddPointToBounds( bvhTriMaxs[ j ], node->mins, node->maxs );
+		AddPointToBounds( bvhCentroids[ j ], centerMins, centerMaxs );
+	}
+	
+	/* small enough for a leaf? */
+	if( num <= BVH_MIN_LEAF_TRIANGLES )
+	{
+		node->first = first;
+		node->numItems = num;
+		return;
+	}
+	
+	/* find the cheapest bin boundary on each axis */
+	bestCost = 1e30f;
+	bestAxis = -1;
+	bestBin = 0;
+	for( axis = 0; axis < 3 && depth < BVH_MAX_SAH_DEPTH; axis++ )
+	{
+		if( centerMaxs[ axis ] - centerMins[ axis ] <= 0.001f )
 			continue;
+		scale = BVH_SAH_BINS / (centerMaxs[ axis ] - centerMins[ axis ]);
 		
-		/* translucent surfaces that are neither alphashadow or lightfilter don't cast shadows */
-		if( (info->si->compileFlags & C_NODRAW) )
-			continue;
-		if( (info->si->compileFlags & C_TRANSLUCENT) &&
-			!(info->si->compileFlags & C_ALPHASHADOW) && 
-			!(info->si->compileFlags & C_LIGHTFILTER) )
-			continue;
+		/* sort items into bins */
+		for( bin = 0; bin < BVH_SAH_BINS; bin++ )
+		{
+			binCounts[ bin ] = 0;
+			ClearBounds( binMins[ bin ], binMaxs[ bin ] );
+		}
+		for( i = first; i < first + num; i++ )
+		{
+			j = bvhItems[ i ];
+			bin = (int) ((bvhCentroids[ j ][ axis ] - centerMins[ axis ]) * scale);
+			bin = bin < 0 ? 0 : (bin >= BVH_SAH_BINS ? BVH_SAH_BINS - 1 : bin);
+			binCounts[ bin ]++;
+			AddPointToBounds( bvhTriMins[ j ], binMins[ bin ], binMaxs[ bin ] );
+			AddPointToBounds( bvhTriMaxs[ j ], binMins[ bin ], binMaxs[ bin ] );
+		}
 		
-		/* setup trace info */
-		ti.si = info->si;
-		ti.castShadows = info->castShadows;
-		ti.surfaceNum = model->firstBSPSurface + i; // vortex: fixed: was (model->firstBSPBrush + i)
-		ti.entityNum = GetSurfaceExtraEntityNum( ti.surfaceNum );
-
-		/* choose which node (normal or skybox) */
-		if( info->parentSurfaceNum >= 0 )
+		/* sweep from the right, then from the left */
+		ClearBounds( mins, maxs );
+		countLeft = 0;
+		for( bin = BVH_SAH_BINS - 1; bin > 0; bin-- )
 		{
-			nodeNum = skyboxNodeNum;
-			
-			/* sky surfaces in portal skies are ignored */
-			if( info->si->compileFlags & C_SKY )
+			AddPointToBounds( binMins[ bin ], mins, maxs );
+			AddPointToBounds( binMaxs[ bin ], mins, maxs );
+			countLeft += binCounts[ bin ];
+			countsRight[ bin ] = countLeft;
+			areasRight[ bin ] = BVHSurfaceArea( mins, maxs );
+		}
+		ClearBounds( mins, maxs );
+		countLeft = 0;
+		for( bin = 0; bin < BVH_SAH_BINS - 1; bin++ )
+		{
+			AddPointToBounds( binMins[ bin ], mins, maxs );
+			AddPointToBounds( binMaxs[ bin ], mins, maxs );
+			countLeft += binCounts[ bin ];
+			if( countLeft == 0 || countsRight[ bin + 1 ] == 0 )
 				continue;
+			cost = BVHSurfaceArea( mins, maxs ) * countLeft + areasRight[ bin + 1 ] * countsRight[ bin + 1 ];
+			if( cost < bestCost )
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = bin;
+			}
 		}
-		else
-			nodeNum = headNodeNum;
-		
-		/* setup trace winding */
-		memset( &tw, 0, sizeof( tw ) );
-		tw.infoNum = AddTraceInfo( &ti );
-		tw.numVerts = 3;
-		
-		/* switch on type */
-		switch( ds->surfaceType )
+	}
+	
+	/* compare against not splitting at all (costs relative to one triangle test) */
+	area = BVHSurfaceArea( node->mins, node->maxs );
+	leafCost = area * num;
+	if( bestAxis >= 0 && area > 0.0f )
+		bestCost = BVH_TRAVERSAL_COST * area + bestCost;
+	if( num <= BVH_MAX_LEAF_TRIANGLES && (bestAxis < 0 || leafCost <= bestCost) )
+	{
+		node->first = first;
+		node->numItems = num;
+		return;
+	}
+	
+	/* partition the items */
+	if( bestAxis >= 0 )
+	{
+		scale = BVH_SAH_BINS / (centerMaxs[ bestAxis ] - centerMins[ bestAxis ]);
+		i = first;
+		j = first + num - 1;
+		while( i <= j )
 		{
-			/* handle patches */
-			case MST_PATCH:
-				/* subdivide the surface */
-				srcMesh.width = ds->patchWidth;
-				srcMesh.height = ds->patchHeight;
-				srcMesh.verts = &bspDrawVerts[ ds->firstVert ];
-				//%	subdivided = SubdivideMesh( srcMesh, 8, 512 );
-				subdivided = SubdivideMesh2( srcMesh, info->patchIterations );
-				
-				/* fit it to the curve and remove colinear verts on rows/columns */
-				PutMeshOnCurve( *subdivided );
-				mesh = RemoveLinearMeshColumnsRows( subdivided );
-				FreeMesh( subdivided );
-				
-				/* set verts */
-				verts = mesh->verts;
-				
-				/* subdivide each quad to place the models */
-				for( y = 0; y < (mesh->height - 1); y++ )
-				{
-					for( x = 0; x < (mesh->width - 1); x++ )
-					{
-						/* set indexes */
-						pw[ 0 ] = x + (y * mesh->width);
-						pw[ 1 ] = x + ((y + 1) * mesh->width);
-						pw[ 2 ] = x + 1 + ((y + 1) * mesh->width);
-						pw[ 3 ] = x + 1 + (y * mesh->width);
-						pw[ 4 ] = x + (y * mesh->width);	/* same as pw[ 0 ] */
-						
-						/* set radix */
-						r = (x + y) & 1;
-						
-						/* make first triangle */
-						VectorCopy( verts[ pw[ r + 0 ] ].xyz, tw.v[ 0 ].xyz );
-						Vector2Copy( verts[ pw[ r + 0 ] ].st, tw.v[ 0 ].st );
-						VectorCopy( verts[ pw[ r + 1 ] ].xyz, tw.v[ 1 ].xyz );
-						Vector2Copy( verts[ pw[ r + 1 ] ].st, tw.v[ 1 ].st );
-						VectorCopy( verts[ pw[ r + 2 ] ].xyz, tw.v[ 2 ].xyz );
-						Vector2Copy( verts[ pw[ r + 2 ] ].st, tw.v[ 2 ].st );
-						m4x4_transform_point( transform, tw.v[ 0 ].xyz );
-						m4x4_transform_point( transform, tw.v[ 1 ].xyz );
-						m4x4_transform_point( transform, tw.v[ 2 ].xyz );
-						FilterTraceWindingIntoNodes_r( &tw, nodeNum );
-						
-						/* make second triangle */
-						VectorCopy( verts[ pw[ r + 0 ] ].xyz, tw.v[ 0 ].xyz );
-						Vector2Copy( verts[ pw[ r + 0 ] ].st, tw.v[ 0 ].st );
-						VectorCopy( verts[ pw[ r + 2 ] ].xyz, tw.v[ 1 ].xyz );
-						Vector2Copy( verts[ pw[ r + 2 ] ].st, tw.v[ 1 ].st );
-						VectorCopy( verts[ pw[ r + 3 ] ].xyz, tw.v[ 2 ].xyz );
-						Vector2Copy( verts[ pw[ r + 3 ] ].st, tw.v[ 2 ].st );
-						m4x4_transform_point( transform, tw.v[ 0 ].xyz );
-						m4x4_transform_point( transform, tw.v[ 1 ].xyz );
-						m4x4_transform_point( transform, tw.v[ 2 ].xyz );
-						FilterTraceWindingIntoNodes_r( &tw, nodeNum );
-					}
-				}
-				
-				/* free the subdivided mesh */
-				FreeMesh( mesh );
-				break;
-			
-			/* handle triangle surfaces */
-			case MST_TRIANGLE_SOUP:
-			case MST_PLANAR:
-				/* set verts and indexes */
-				verts = &bspDrawVerts[ ds->firstVert ];
-				indexes = &bspDrawIndexes[ ds->firstIndex ];
-				
-				/* walk the triangle list */
-				for( j = 0; j < ds->numIndexes; j += 3 )
-				{
-					VectorCopy( verts[ indexes[ j ] ].xyz, tw.v[ 0 ].xyz );
-					Vector2Copy( verts[ indexes[ j ] ].st, tw.v[ 0 ].st );
-					VectorCopy( verts[ indexes[ j + 1 ] ].xyz, tw.v[ 1 ].xyz );
-					Vector2Copy( verts[ indexes[ j + 1 ] ].st, tw.v[ 1 ].st );
-					VectorCopy( verts[ indexes[ j + 2 ] ].xyz, tw.v[ 2 ].xyz );
-					Vector2Copy( verts[ indexes[ j + 2 ] ].st, tw.v[ 2 ].st );
-					m4x4_transform_point( transform, tw.v[ 0 ].xyz );
-					m4x4_transform_point( transform, tw.v[ 1 ].xyz );
-					m4x4_transform_point( transform, tw.v[ 2 ].xyz );
-					FilterTraceWindingIntoNodes_r( &tw, nodeNum );
-				}
-				break;
-			
-			/* other surface types do not cast shadows */
-			default:
-				break;
+			bin = (int) ((bvhCentroids[ bvhItems[ i ] ][ bestAxis ] - centerMins[ bestAxis ]) * scale);
+			if( bin <= bestBin )
+				i++;
+			else
+			{
+				temp = bvhItems[ i ];
+				bvhItems[ i ] = bvhItems[ j ];
+				bvhItems[ j ] = temp;
+				j--;
+			}
 		}
+		mid = i;
+		node->axis = bestAxis;
+	}
+	
+	/* degenerate items or runaway depth, split the list in half */
+	else
+	{
+		mid = first + (num >> 1);
+		VectorSubtract( node->maxs, node->mins, mins );
+		node->axis = (mins[ 0 ] >= mins[ 1 ] && mins[ 0 ] >= mins[ 2 ]) ? 0 : (mins[ 1 ] >= mins[ 2 ] ? 1 : 2);
+	}
+	if( mid <= first || mid >= first + num )
+		mid = first + (num >> 1);
+	
+	/* children are allocated in pairs */
+	child = ThreadAtomicAdd( &numBVHNodes, 2 );
+	if( child + 2 > maxBVHNodes )
+		Error( "BuildTraceBVH_r: node pool exhausted (%d)", maxBVHNodes );
+	node->first = child;
+	node->numItems = 0;
+	
+	/* build children, handing the left one to another thread if it is big */
+	if( num >= BVH_TASK_TRIANGLES )
+	{
+		task = (bvhBuildTask_t*) safe_malloc( sizeof( *task ) );
+		task->nodeNum = child;
+		task->first = first;
+		task->num = mid - first;
+		task->depth = depth + 1;
+		ThreadTaskGroupInit( &group );
+		ThreadSpawnTask( &group, BuildTraceBVHTask, task );
+		BuildTraceBVH_r( child + 1, mid, first + num - mid, depth + 1 );
+		ThreadWaitTaskGroup( &group );
+	}
+	else
+	{
+		BuildTraceBVH_r( child, first, mid - first, depth + 1 );
+		BuildTraceBVH_r( child + 1, mid, first + num - mid, depth + 1 );
 	}
 }
 
+static void BuildTraceBVHTask( void *data )
+{
+	bvhBuildTask_t	*task;
+	
+	
+	task = (bvhBuildTask_t*) data;
+	BuildTraceBVH_r( task->nodeNum, task->first, task->num, task->depth );
+	free( task );
+}
+
+static void BuildTraceBVHTree( int num )
+{
+	BuildTraceBVH_r( bvhTrees[ num ].rootNode, bvhTrees[ num ].first, bvhTrees[ num ].num, 0 );
+}
+
+
+
 /*
-PopulateWithPicoModel() - ydnar
-filters a picomodel's surfaces into the raytracing tree
+TraceBVHDepth_r()
+stats only
 */
 
-static void PopulateWithPicoModel( char castShadows, picoModel_t *model, m4x4_t transform, int skin )
+static int TraceBVHDepth_r( int nodeNum, int *numLeafs )
 {
-	int					i, j, k, numSurfaces, numIndexes;
-	picoSurface_t		*surface;
-	picoVec_t			*xyz, *st;
-	picoIndex_t			*indexes;
-	traceInfo_t			ti;
-	traceWinding_t		tw;
+	int		a, b;
 	
-	/* dummy check */
-	if( model == NULL || transform == NULL )
-		return;
+	
+	if( bvhNodes[ nodeNum ].numItems > 0 )
+	{
+		(*numLeafs)++;
+		return 1;
+	}
+	a = TraceBVHDepth_r( bvhNodes[ nodeNum ].first, numLeafs );
+	b = TraceBVHDepth_r( bvhNodes[ nodeNum ].first + 1, numLeafs );
+	return 1 + (a > b ? a : b);
+}
 
-	/* no shadows */
-	/* vortex: disabled
-	if ( castShadows == 0 )
-		return;
-	*/
+
+
+/*
+AddTraceBVHTree()
+queues a bvh build over a range of bvh items, returns its root node
+*/
+
+static int AddTraceBVHTree( int first, int num )
+{
+	bvhTrees[ numBVHTrees ].rootNode = numBVHNodes++;
+	bvhTrees[ numBVHTrees ].first = first;
+	bvhTrees[ numBVHTrees ].num = num;
+	numBVHTrees++;
+	return numBVHNodes - 1;
+}
+
+
+
+/*
+SetupTraceBVH()
+takes the triangles out of the world trace nodes and builds a bvh over them (with -bvh), builds
+one bvh per instanced model and a bvh over the model instances
+*/
+
+static void SetupTraceBVH( void )
+{
+	int				i, j, k, depth, numLeafs, numItems, firstInstanceItem;
+	float			pad;
+	double			start;
+	vec3_t			size, corner;
+	traceTriangle_t	*tt;
+	traceModel_t	*tm;
+	traceInstance_t	*inst, *sorted;
+	traceBVHNode_t	*node;
 	
-	/* get info */
-	numSurfaces = PicoGetModelNumSurfaces( model );
 	
-	/* walk the list of surfaces in this model and fill out the info structs */
-	for( i = 0; i < numSurfaces; i++ )
+	/* note it */
+	Sys_FPrintf( SYS_VRB, "--- SetupTraceBVH ---\n" );
+	start = I_PreciseTime();
+	
+	/* gather triangles; skybox triangles stay in their node */
+	numItems = numTraceTriangles + numTraceInstances;
+	bvhItems = (int*) safe_malloc_tag( (numItems + 1) * sizeof( *bvhItems ), &traceNodeTag );
+	numBVHItems = 0;
+	if( traceBVH )
+		CollectTraceBVHItems_r( headNodeNum );
+	numWorldBVHItems = numBVHItems;
+	
+	/* model triangles follow, instances are items numTraceTriangles and up */
+	for( i = 0; i < numTraceModels; i++ )
 	{
-		/* get surface */
-		surface = PicoGetModelSurface( model, i );
-		if( surface == NULL )
-			continue;
-		
-		/* only handle triangle surfaces initially (fixme: support patches) */
-		if( PicoGetSurfaceType( surface ) != PICO_TRIANGLES )
-			continue;
-		
-		/* get shader (fixme: support shader remapping) */
-		/* vortex: support .skin files */
-		ti.si = ShaderInfoForShader( PicoGetSurfaceShaderNameForSkin( surface, skin ) );
-		if( ti.si == NULL )
-			continue;
-		
-		/* translucent surfaces that are neither alphashadow or lightfilter don't cast shadows */
-		if( (ti.si->compileFlags & C_NODRAW) )
-			continue;
-		if( (ti.si->compileFlags & C_TRANSLUCENT) &&
-			!(ti.si->compileFlags & C_ALPHASHADOW) && 
-			!(ti.si->compileFlags & C_LIGHTFILTER) )
-			continue;
-		
-		/* setup trace info */
-		ti.castShadows = castShadows;
-		ti.surfaceNum = -1;
-		ti.entityNum = -1;
-		
-		/* setup trace winding */
-		memset( &tw, 0, sizeof( tw ) );
-		tw.infoNum = AddTraceInfo( &ti );
-		tw.numVerts = 3;
-		
-		/* get info */
-		numIndexes = PicoGetSurfaceNumIndexes( surface );
-		indexes = PicoGetSurfaceIndexes( surface, 0 );
+		tm = &traceModels[ i ];
+		for( j = 0; j < tm->numTriangles; j++ )
+			bvhItems[ numBVHItems++ ] = tm->firstTriangle + j;
+	}
+	
+	/* per item bounds and centroids for the build */
+	bvhTriMins = (vec3_t*) safe_malloc( numItems * sizeof( vec3_t ) );
+	bvhTriMaxs = (vec3_t*) safe_malloc( numItems * sizeof( vec3_t ) );
+	bvhCentroids = (vec3_t*) safe_malloc( numItems * sizeof( vec3_t ) );
+	for( i = 0; i < numBVHItems; i++ )
+	{
+		j = bvhItems[ i ];
+		tt = &traceTriangles[ j ];
+		ClearBounds( bvhTriMins[ j ], bvhTriMaxs[ j ] );
+		for( k = 0; k < 3; k++ )
+			AddPointToBounds( tt->v[ k ].xyz, bvhTriMins[ j ], bvhTriMaxs[ j ] );
+		VectorAdd( bvhTriMins[ j ], bvhTriMaxs[ j ], bvhCentroids[ j ] );
+		VectorScale( bvhCentroids[ j ], 0.5f, bvhCentroids[ j ] );
 		
-		/* walk the triangle list */
-		for( j = 0; j < numIndexes; j += 3, indexes += 3 )
+		/* TraceTriangle() accepts hits slightly outside the triangle, so pad the box to match */
+		VectorSubtract( bvhTriMaxs[ j ], bvhTriMins[ j ], size );
+		pad = BVH_BOX_EPSILON + BVH_BARY_EPSILON * (size[ 0 ] + size[ 1 ] + size[ 2 ]);
+		for( k = 0; k < 3; k++ )
+		{
+			bvhTriMins[ j ][ k ] -= pad;
+			bvhTriMaxs[ j ][ k ] += pad;
+		}
+	}
+	
+	/* a binary tree with at least one item per leaf has less than twice as many nodes as items */
+	maxBVHNodes = 2 * numItems + numTraceModels + 2;
+	bvhNodes = (traceBVHNode_t*) safe_malloc_tag( maxBVHNodes * sizeof( *bvhNodes ), &traceNodeTag );
+	memset( bvhNodes, 0, sizeof( *bvhNodes ) );
+	bvhTrees = (traceBVHTree_t*) safe_malloc( (numTraceModels + 1) * sizeof( *bvhTrees ) );
+	numBVHTrees = 0;
+	numBVHNodes = 0;
+	
+	/* the world tree is always node 0 */
+	AddTraceBVHTree( 0, numWorldBVHItems );
+	if( numWorldBVHItems <= 0 )
+		numBVHTrees = 0;
+	
+	/* one tree per model */
+	for( i = 0, j = numWorldBVHItems; i < numTraceModels; j += traceModels[ i ].numTriangles, i++ )
+	{
+		if( traceModels[ i ].numTriangles > 0 )
+			traceModels[ i ].rootNode = AddTraceBVHTree( j, traceModels[ i ].numTriangles );
+	}
+	
+	/* build */
+	if( numBVHTrees > 0 )
+		RunTasksOnIndividual( numBVHTrees, qfalse, BuildTraceBVHTree );
+	numTriangleBVHNodes = numBVHNodes;
+	
+	/* instances are bounded by their model's root box in world space */
+	if( numTraceInstances > 0 )
+	{
+		firstInstanceItem = numBVHItems;
+		for( i = 0; i < numTraceInstances; i++ )
 		{
+			inst = &traceInstances[ i ];
+			inst->rootNode = traceModels[ inst->modelNum ].rootNode;
+			node = &bvhNodes[ inst->rootNode ];
+			j = numTraceTriangles + i;
+			bvhItems[ numBVHItems++ ] = j;
+			ClearBounds( bvhTriMins[ j ], bvhTriMaxs[ j ] );
+			for( k = 0; k < 8; k++ )
+			{
+				corner[ 0 ] = (k & 1) ? node->maxs[ 0 ] : node->mins[ 0 ];
+				corner[ 1 ] = (k & 2) ? node->maxs[ 1 ] : node->mins[ 1 ];
+				corner[ 2 ] = (k & 4) ? node->maxs[ 2 ] : node->mins[ 2 ];
+				m4x4_transform_point( inst->transform, corner );
+				AddPointToBounds( corner, bvhTriMins[ j ], bvhTriMaxs[ j ] );
+			}
 			for( k = 0; k < 3; k++ )
 			{
-				xyz = PicoGetSurfaceXYZ( surface, indexes[ k ] );
-				st = PicoGetSurfaceST( surface, 0, indexes[ k ] );
-				VectorCopy( xyz, tw.v[ k ].xyz );
-				Vector2Copy( st, tw.v[ k ].st );
-				m4x4_transform_point( transform, tw.v[ k ].xyz );
+				bvhTriMins[ j ][ k ] -= BVH_BOX_EPSILON;
+				bvhTriMaxs[ j ][ k ] += BVH_BOX_EPSILON;
 			}
-			FilterTraceWindingIntoNodes_r( &tw, headNodeNum );
+			VectorAdd( bvhTriMins[ j ], bvhTriMaxs[ j ], bvhCentroids[ j ] );
+			VectorScale( bvhCentroids[ j ], 0.5f, bvhCentroids[ j ] );
+		}
+		
+		/* build the instance tree after the others so its nodes come last */
+		numBVHTrees = 0;
+		instanceRootNode = AddTraceBVHTree( firstInstanceItem, numTraceInstances );
+		RunTasksOnIndividual( 1, qfalse, BuildTraceBVHTree );
+		
+		/* store the instances in leaf order, so leafs index them directly */
+		sorted = (traceInstance_t*) safe_malloc_tag( numTraceInstances * sizeof( *sorted ), &traceNodeTag );
+		for( i = 0; i < numTraceInstances; i++ )
+			memcpy( &sorted[ i ], &traceInstances[ bvhItems[ firstInstanceItem + i ] - numTraceTriangles ], sizeof( *sorted ) );
+		safe_free_tag( traceInstances );
+		traceInstances = sorted;
+		maxTraceInstances = numTraceInstances;
+		for( i = numTriangleBVHNodes; i < numBVHNodes; i++ )
+		{
+			if( bvhNodes[ i ].numItems > 0 )
+				bvhNodes[ i ].first -= firstInstanceItem;
 		}
 	}
+	
+	/* free build data */
+	free( bvhTrees );
+	bvhTrees = NULL;
+	free( bvhTriMins );
+	free( bvhTriMaxs );
+	free( bvhCentroids );
+	bvhTriMins = bvhTriMaxs = bvhCentroids = NULL;
+	
+	/* emit some stats */
+	Sys_Printf( "%9d bvh nodes (%.2fMB)\n", numBVHNodes, (float) (numBVHNodes * sizeof( *bvhNodes )) / (1024.0f * 1024.0f) );
+	if( numWorldBVHItems > 0 )
+	{
+		numLeafs = 0;
+		depth = TraceBVHDepth_r( 0, &numLeafs );
+		Sys_FPrintf( SYS_VRB, "%9d bvh leafs\n", numLeafs );
+		Sys_FPrintf( SYS_VRB, "%9d max bvh depth\n", depth );
+	}
+	if( instanceRootNode >= 0 )
+	{
+		numLeafs = 0;
+		depth = TraceBVHDepth_r( instanceRootNode, &numLeafs );
+		Sys_FPrintf( SYS_VRB, "%9d max instance bvh depth\n", depth );
+	}
+	Sys_FPrintf( SYS_VRB, "%9.2f seconds to build bvh\n", I_PreciseTime() - start );
 }
 
 
 
+
+/* -------------------------------------------------------------------------------
+
+triangle blocks (leaf triangles in structure of arrays form for simd tests)
+
+------------------------------------------------------------------------------- */
+
 /*
-PopulateTraceNodes() - ydnar
-fills the raytracing tree with world and entity occluders
+AllocTraceBlocks()
+packs a list of triangles into consecutive blocks, returns the first block
 */
 
-static void PopulateTraceNodes( void )
+static int AllocTraceBlocks( int *items, int numItems )
 {
-	int				i, m, frame, skin;
-	char			castShadows;
-	float			temp;
-	entity_t		*e;
-	const char		*value;
-	picoModel_t		*model;
-	vec3_t			origin, scale, angles;
-	m4x4_t			transform;
+	int					i, j, k, first;
+	traceBlock_t		*block;
+	traceTriangle_t		*tt;
+	
+	
+	/* allocated up front by SetupTraceBlocks() */
+	first = numTraceBlocks;
+	numTraceBlocks += (numItems + TRACE_BLOCK_LANES - 1) / TRACE_BLOCK_LANES;
+	if( numTraceBlocks > maxTraceBlocks )
+		Error( "AllocTraceBlocks: block pool exhausted (%d)", maxTraceBlocks );
+	
+	/* fill lanes, unused lanes are degenerate and never hit */
+	memset( &traceBlocks[ first ], 0, (numTraceBlocks - first) * sizeof( *traceBlocks ) );
+	for( i = 0; i < numItems; i++ )
+	{
+		block = &traceBlocks[ first + i / TRACE_BLOCK_LANES ];
+		j = i % TRACE_BLOCK_LANES;
+		tt = &traceTriangles[ items[ i ] ];
+		for( k = 0; k < 3; k++ )
+		{
+			block->origin[ k ][ j ] = tt->v[ 0 ].xyz[ k ];
+			block->edge1[ k ][ j ] = tt->edge1[ k ];
+			block->edge2[ k ][ j ] = tt->edge2[ k ];
+		}
+		block->items[ j ] = items[ i ];
+		block->castGroups[ j ] = traceInfos[ tt->infoNum ].castGroup;
+	}
+	
+	return first;
+}
 
-	/* add worldspawn triangles */
-	m4x4_identity( transform );
-	PopulateWithBSPModel( &bspModels[ 0 ], transform );
+
+
+/*
+SetupTraceBlocks()
+moves the triangles of every trace leaf (and triangle bvh leaf) into blocks
+*/
+
+static void SetupTraceBlocks( void )
+{
+	int				i, numLanes;
+	traceNode_t		*node;
+	traceBVHNode_t	*bvhNode;
 	
-	/* walk each entity list */
-	for( i = 1; i < numEntities; i++ )
+	
+	/* count blocks */
+	maxTraceBlocks = 0;
+	numLanes = 0;
+	for( i = 0; i < numTraceNodes; i++ )
 	{
-		/* get entity */
-		e = &entities[ i ];
-		
-		/* get shadow flags */
-		GetEntityShadowFlags( e, NULL, &castShadows, NULL, qfalse );
-		
-		/* get entity origin */
-		GetVectorForKey( e, "origin", origin );
-		
-		/* get scale */
-		scale[ 0 ] = scale[ 1 ] = scale[ 2 ] = 1.0f;
-		temp = FloatForKey( e, "modelscale" );
-		if( temp != 0.0f )
-			scale[ 0 ] = scale[ 1 ] = scale[ 2 ] = temp;
-		value = ValueForKey( e, "modelscale_vec" );
-		if( value[ 0 ] != '\0' )
-			sscanf( value, "%f %f %f", &scale[ 0 ], &scale[ 1 ], &scale[ 2 ] );
-		
-		/* get "angle" (yaw) or "angles" (pitch yaw roll) */
-		angles[ 0 ] = angles[ 1 ] = angles[ 2 ] = 0.0f;
-		angles[ 2 ] = FloatForKey( e, "angle" );
-		value = ValueForKey( e, "angles" );
-		if( value[ 0 ] != '\0' )
-			sscanf( value, "%f %f %f", &angles[ 1 ], &angles[ 2 ], &angles[ 0 ] );
+		if( traceNodes[ i ].type < 0 && traceNodes[ i ].numItems > 0 )
+		{
+			maxTraceBlocks += (traceNodes[ i ].numItems + TRACE_BLOCK_LANES - 1) / TRACE_BLOCK_LANES;
+			numLanes += traceNodes[ i ].numItems;
+		}
+	}
+	for( i = 0; i < numTriangleBVHNodes; i++ )
+	{
+		if( bvhNodes[ i ].numItems > 0 )
+		{
+			maxTraceBlocks += (bvhNodes[ i ].numItems + TRACE_BLOCK_LANES - 1) / TRACE_BLOCK_LANES;
+			numLanes += bvhNodes[ i ].numItems;
+		}
+	}
+	traceBlocks = (traceBlock_t*) safe_malloc_tag( (maxTraceBlocks + 1) * sizeof( *traceBlocks ), &traceTriangleTag );
+	numTraceBlocks = 0;
+	
+	/* pack trace node leafs */
+	for( i = 0; i < numTraceNodes; i++ )
+	{
+		node = &traceNodes[ i ];
+		if( node->type >= 0 || node->numItems <= 0 )
+			continue;
+		node->firstBlock = AllocTraceBlocks( node->items, node->numItems );
+		safe_free_tag( node->items );
+		node->items = NULL;
+		node->maxItems = 0;
+	}
+	
+	/* pack bvh leafs */
+	for( i = 0; i < numTriangleBVHNodes; i++ )
+	{
+		bvhNode = &bvhNodes[ i ];
+		if( bvhNode->numItems > 0 )
+			bvhNode->first = AllocTraceBlocks( &bvhItems[ bvhNode->first ], bvhNode->numItems );
+	}
+	if( bvhItems != NULL )
+		safe_free_tag( bvhItems );
+	bvhItems = NULL;
+	
+	/* emit some stats */
+	Sys_FPrintf( SYS_VRB, "%9d trace triangle blocks (%.2fMB, %d%% lanes used, %s)\n", numTraceBlocks,
+		(float) (numTraceBlocks * sizeof( *traceBlocks )) / (1024.0f * 1024.0f),
+		numTraceBlocks > 0 ? (100 * numLanes) / (numTraceBlocks * TRACE_BLOCK_LANES) : 0, TRACE_SIMD_NAME );
+}
+
+
+
+
+/* -------------------------------------------------------------------------------
+
+alpha coverage (which filter triangles only cover fully opaque or fully clear texels)
+
+------------------------------------------------------------------------------- */
+
+/*
+BuildCoverageMip()
+builds a min/max alpha and color mip chain for a light image
+*/
+
+static void BuildCoverageMip( traceCoverageMip_t *mip, image_t *image )
+{
+	int				i, x, y, sx, sy, level, width, height;
+	byte			*in, *out, *pixel;
+	
+	
+	/* level 0 straight from the image */
+	mip->image = image;
+	mip->width[ 0 ] = image->width;
+	mip->height[ 0 ] = image->height;
+	mip->texels[ 0 ] = (byte*) safe_malloc( image->width * image->height * 4 );
+	for( i = 0; i < image->width * image->height; i++ )
+	{
+		pixel = &image->pixels[ i * 4 ];
+		out = &mip->texels[ 0 ][ i * 4 ];
+		out[ 0 ] = out[ 1 ] = pixel[ 3 ];
+		out[ 2 ] = min( pixel[ 0 ], min( pixel[ 1 ], pixel[ 2 ] ) );
+		out[ 3 ] = max( pixel[ 0 ], max( pixel[ 1 ], pixel[ 2 ] ) );
+	}
+	
+	/* each level texel covers 2x2 texels of the level below */
+	for( level = 1; level < MAX_COVERAGE_LEVELS && (mip->width[ level - 1 ] > 1 || mip->height[ level - 1 ] > 1); level++ )
+	{
+		width = mip->width[ level ] = (mip->width[ level - 1 ] + 1) >> 1;
+		height = mip->height[ level ] = (mip->height[ level - 1 ] + 1) >> 1;
+		mip->texels[ level ] = (byte*) safe_malloc( width * height * 4 );
+		for( y = 0; y < height; y++ )
+		{
+			for( x = 0; x < width; x++ )
+			{
+				out = &mip->texels[ level ][ (y * width + x) * 4 ];
+				out[ 0 ] = out[ 2 ] = 255;
+				out[ 1 ] = out[ 3 ] = 0;
+				for( sy = y * 2; sy <= y * 2 + 1 && sy < mip->height[ level - 1 ]; sy++ )
+				{
+					for( sx = x * 2; sx <= x * 2 + 1 && sx < mip->width[ level - 1 ]; sx++ )
+					{
+						in = &mip->texels[ level - 1 ][ (sy * mip->width[ level - 1 ] + sx) * 4 ];
+						out[ 0 ] = min( out[ 0 ], in[ 0 ] );
+						out[ 1 ] = max( out[ 1 ], in[ 1 ] );
+						out[ 2 ] = min( out[ 2 ], in[ 2 ] );
+						out[ 3 ] = max( out[ 3 ], in[ 3 ] );
+					}
+				}
+			}
+		}
+	}
+	mip->numLevels = level;
+}
+
+
+
+/*
+CoverageForRegion()
+adds the min/max values of texels x0..x1, y0..y1 (inside the image) to range, using the finest
+level where the region spans at most 2x2 texels
+*/
+
+static void CoverageForRegion( traceCoverageMip_t *mip, int x0, int x1, int y0, int y1, byte range[ 4 ] )
+{
+	int				x, y, level;
+	byte			*texel;
+	
+	
+	for( level = 0; level < mip->numLevels - 1 && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1); level++ );
+	for( y = y0 >> level; y <= (y1 >> level); y++ )
+	{
+		for( x = x0 >> level; x <= (x1 >> level); x++ )
+		{
+			texel = &mip->texels[ level ][ (y * mip->width[ level ] + x) * 4 ];
+			range[ 0 ] = min( range[ 0 ], texel[ 0 ] );
+			range[ 1 ] = max( range[ 1 ], texel[ 1 ] );
+			range[ 2 ] = min( range[ 2 ], texel[ 2 ] );
+			range[ 3 ] = max( range[ 3 ], texel[ 3 ] );
+		}
+	}
+}
+
+
+
+/*
+ClassifyTriangleCoverage()
+finds the texels a filter triangle can sample in TraceTriangleHit() (with a texel of slack,
+st wraps) and whether they all block or all pass light
+*/
+
+static int ClassifyTriangleCoverage( traceTriangle_t *tt, shaderInfo_t *si, traceCoverageMip_t *mip )
+{
+	int				i, j, k, size, lo, hi, num[ 2 ], first[ 2 ][ 2 ], last[ 2 ][ 2 ];
+	float			mins, maxs, pad;
+	byte			range[ 4 ];
+	
+	
+	/* texel intervals on each axis, split in two where they wrap */
+	for( i = 0; i < 2; i++ )
+	{
+		mins = maxs = tt->v[ 0 ].st[ i ];
+		for( k = 1; k < 3; k++ )
+		{
+			mins = min( mins, tt->v[ k ].st[ i ] );
+			maxs = max( maxs, tt->v[ k ].st[ i ] );
+		}
+		pad = (maxs - mins) * 0.001f;
+		size = i ? mip->height[ 0 ] : mip->width[ 0 ];
+		lo = (int) floor( (mins - pad) * size ) - 1;
+		hi = (int) floor( (maxs + pad) * size ) + 1;
+		if( hi - lo + 1 >= size )
+		{
+			num[ i ] = 1;
+			first[ i ][ 0 ] = 0;
+			last[ i ][ 0 ] = size - 1;
+			continue;
+		}
+		k = ((lo % size) + size) % size;
+		hi = k + (hi - lo);
+		lo = k;
+		first[ i ][ 0 ] = lo;
+		if( hi < size )
+		{
+			num[ i ] = 1;
+			last[ i ][ 0 ] = hi;
+		}
+		else
+		{
+			num[ i ] = 2;
+			last[ i ][ 0 ] = size - 1;
+			first[ i ][ 1 ] = 0;
+			last[ i ][ 1 ] = hi - size;
+		}
+	}
+	
+	/* gather the min/max values */
+	range[ 0 ] = range[ 2 ] = 255;
+	range[ 1 ] = range[ 3 ] = 0;
+	for( j = 0; j < num[ 1 ]; j++ )
+	{
+		for( i = 0; i < num[ 0 ]; i++ )
+			CoverageForRegion( mip, first[ 0 ][ i ], last[ 0 ][ i ], first[ 1 ][ j ], last[ 1 ][ j ], range );
+	}
+	
+	/* opaque if every texel zeroes the light, clear if every texel keeps all of it */
+	if( ((si->compileFlags & C_ALPHASHADOW) && range[ 0 ] == 255) ||
+		((si->compileFlags & C_LIGHTFILTER) && range[ 3 ] == 0) )
+		return COVERAGE_OPAQUE;
+	if( (!(si->compileFlags & C_ALPHASHADOW) || range[ 1 ] == 0) &&
+		(!(si->compileFlags & C_LIGHTFILTER) || range[ 2 ] == 255) )
+		return COVERAGE_CLEAR;
+	return COVERAGE_MIXED;
+}
+
+
+
+/*
+SetupTraceCoverage()
+classifies the texel coverage of every alphashadow and lightfilter triangle
+*/
+
+static void SetupTraceCoverage( void )
+{
+	int					i, j, numMips, maxMips, coverage, counts[ 3 ];
+	traceTriangle_t		*tt;
+	shaderInfo_t		*si;
+	traceCoverageMip_t	*mips, *mip;
+	void				*temp;
+	
+	
+	/* walk triangles */
+	numMips = maxMips = 0;
+	mips = NULL;
+	counts[ 0 ] = counts[ 1 ] = counts[ 2 ] = 0;
+	for( i = 0; i < numTraceTriangles; i++ )
+	{
+		/* filter triangles only */
+		tt = &traceTriangles[ i ];
+		si = traceInfos[ tt->infoNum ].si;
+		if( !(si->compileFlags & (C_ALPHASHADOW | C_LIGHTFILTER)) || si->lightImage == NULL || si->lightImage->pixels == NULL )
+			continue;
 		
-		/* set transform matrix (thanks spog) */
-		m4x4_identity( transform );
-		m4x4_pivoted_transform_by_vec3( transform, origin, angles, eXYZ, scale, vec3_origin );
+		/* find or build the image's mip chain */
+		for( j = 0; j < numMips && mips[ j ].image != si->lightImage; j++ );
+		if( j == numMips )
+		{
+			if( numMips >= maxMips )
+			{
+				maxMips += 64;
+				temp = safe_malloc( maxMips * sizeof( *mips ) );
+				if( mips != NULL )
+				{
+					memcpy( temp, mips, numMips * sizeof( *mips ) );
+					free( mips );
+				}
+				mips = (traceCoverageMip_t*) temp;
+			}
+			BuildCoverageMip( &mips[ numMips++ ], si->lightImage );
+		}
+		mip = &mips[ j ];
 		
-		/* hack: Stable-1_2 and trunk have differing row/column major matrix order
-		   this transpose is necessary with Stable-1_2
-		   uncomment the following line with old m4x4_t (non 1.3/spog_branch) code */
-		//%	m4x4_transpose( transform );
+		/* classify */
+		if( traceCoverage == NULL )
+		{
+			traceCoverage = (byte*) safe_malloc_tag( numTraceTriangles, &traceTriangleTag );
+			memset( traceCoverage, COVERAGE_MIXED, numTraceTriangles );
+		}
+		coverage = ClassifyTriangleCoverage( tt, si, mip );
+		traceCoverage[ i ] = coverage;
+		counts[ coverage ]++;
+	}
+	
+	/* free the mip chains */
+	for( i = 0; i < numMips; i++ )
+	{
+		for( j = 0; j < mips[ i ].numLevels; j++ )
+			free( mips[ i ].texels[ j ] );
+	}
+	if( mips != NULL )
+		free( mips );
+	
+	/* emit some stats */
+	if( traceCoverage != NULL )
+		Sys_Printf( "%9d alpha filter triangles (%d opaque, %d clear, %d mixed)\n",
+			counts[ COVERAGE_OPAQUE ] + counts[ COVERAGE_CLEAR ] + counts[ COVERAGE_MIXED ],
+			counts[ COVERAGE_OPAQUE ], counts[ COVERAGE_CLEAR ], counts[ COVERAGE_MIXED ] );
+}
+
+
+
+
+/* -------------------------------------------------------------------------------
+
+shadow casting item setup (triangles, patches, entities)
+
+------------------------------------------------------------------------------- */
+
+/*
+PopulateWithBSPModel() - ydnar
+filters a bsp model's surfaces into the raytracing tree
+*/
+
+static void PopulateWithBSPModel( bspModel_t *model, m4x4_t transform )
+{
+	int					i, j, x, y, pw[ 5 ], r, nodeNum;
+	bspDrawSurface_t	*ds;
+	surfaceInfo_t		*info;
+	bspDrawVert_t		*verts;
+	int					*indexes;
+	mesh_t				srcMesh, *mesh, *subdivided;
+	traceInfo_t			ti;
+	traceWinding_t		tw;
+	
+	
+	/* dummy check */
+	if( model == NULL || transform == NULL )
+		return;
+	
+	/* walk the list of surfaces in this model and fill out the info structs */
+	for( i = 0; i < model->numBSPSurfaces; i++ )
+	{
+		/* get surface and info */
+		ds = &bspDrawSurfaces[ model->firstBSPSurface + i ];
+		info = &surfaceInfos[ model->firstBSPSurface + i ];
+		if( info->si == NULL )
+			continue;
+
+		/* no shadows */
+		/* vortex: disabled
+		if( !info->castShadows )
+			continue;
+		*/
 		
-		/* get model */
-		value = ValueForKey( e, "model" );
+		/* patchshadows? */
+		if( ds->surfaceType == MST_PATCH && patchShadows == qfalse )
+			continue;
 		
-		/* switch on model type */
-		switch( value[ 0 ] )
+		/* some surfaces in the bsp might have been tagged as nodraw, with a bogus shader */
+		if( (bspShaders[ ds->shaderNum ].contentFlags & noDrawContentFlags) || 
+			(bspShaders[ ds->shaderNum ].surfaceFlags & noDrawSurfaceFlags) )
+			continue;
+		
+		/* translucent surfaces that are neither alphashadow or lightfilter don't cast shadows */
+		if( (info->si->compileFlags & C_NODRAW) )
+			continue;
+		if( (info->si->compileFlags & C_TRANSLUCENT) &&
+			!(info->si->compileFlags & C_ALPHASHADOW) && 
+			!(info->si->compileFlags & C_LIGHTFILTER) )
+			continue;
+		
+		/* setup trace info */
+		ti.si = info->si;
+		ti.castShadows = info->castShadows;
+		ti.surfaceNum = model->firstBSPSurface + i; // vortex: fixed: was (model->firstBSPBrush + i)
+		ti.entityNum = GetSurfaceExtraEntityNum( ti.surfaceNum );
+
+		/* choose which node (normal or skybox) */
+		if( info->parentSurfaceNum >= 0 )
 		{
-			/* no model */
-			case '\0':
-				break;
-			
-			/* bsp model */
-			case '*':
-				m = atoi( &value[ 1 ] );
-				if( m <= 0 || m >= numBSPModels )
-					continue;
-				PopulateWithBSPModel( &bspModels[ m ], transform );
-				break;
+			nodeNum = skyboxNodeNum;
 			
-			/* external model */
-			default:
-				frame = 0;
-				if( KeyExists( e, "frame" ) )
-					frame = IntForKey( e, "frame" );
-				if( KeyExists( e, "_frame" ) )
-					frame = IntForKey( e, "_frame" );
-
-				skin = 0;
-				if( KeyExists( e, "skin" ) )
-					skin = IntForKey( e, "skin" );
-				if( KeyExists( e, "_skin" ) )
-					skin = IntForKey( e, "_skin" );
-
-				model = LoadModel( (char*) value, frame );
-				if( model == NULL )
-					continue;
-				PopulateWithPicoModel( castShadows, model, transform, skin );
+			/* sky surfaces in portal skies are ignored */
+			if( info->si->compileFlags & C_SKY )
 				continue;
 		}
+		else
+			nodeNum = headNodeNum;
 		
-		/* get model2 */
-		value = ValueForKey( e, "model2" );
+		/* setup trace winding */
+		memset( &tw, 0, sizeof( tw ) );
+		tw.infoNum = AddTraceInfo( &ti );
+		tw.numVerts = 3;
 		
-		/* switch on model type */
-		switch( value[ 0 ] )
+		/* switch on type */
+		switch( ds->surfaceType )
 		{
-			/* no model */
-			case '\0':
-				break;
-			
-			/* bsp model */
-			case '*':
-				m = atoi( &value[ 1 ] );
-				if( m <= 0 || m >= numBSPModels )
-					continue;
-				PopulateWithBSPModel( &bspModels[ m ], transform );
-				break;
-			
-			/* external model */
-			default:
-				frame = 0;
-				if( KeyExists( e, "frame2" ) )
-					frame = IntForKey( e, "frame2" );
-				if( KeyExists( e, "_frame2" ) )
-					frame = IntForKey( e, "_frame2" );
+			/* handle patches */
+			case MST_PATCH:
+				/* subdivide the surface */
+				srcMesh.width = ds->patchWidth;
+				srcMesh.height = ds->patchHeight;
+				srcMesh.verts = &bspDrawVerts[ ds->firstVert ];
+				//%	subdivided = SubdivideMesh( srcMesh, 8, 512 );
+				subdivided = SubdivideMesh2( srcMesh, info->patchIterations );
+				
+				/* fit it to the curve and remove colinear verts on rows/columns */
+				PutMeshOnCurve( *subdivided );
+				mesh = RemoveLinearMeshColumnsRows( subdivided );
+				FreeMesh( subdivided );
+				
+				/* set verts */
+				verts = mesh->verts;
+				
+				/* subdivide each quad to place the models */
+				for( y = 0; y < (mesh->height - 1); y++ )
+				{
+					for( x = 0; x < (mesh->width - 1); x++ )
+					{
+						/* set indexes */
+						pw[ 0 ] = x + (y * mesh->width);
+						pw[ 1 ] = x + ((y + 1) * mesh->width);
+						pw[ 2 ] = x + 1 + ((y + 1) * mesh->width);
+						pw[ 3 ] = x + 1 + (y * mesh->width);
+						pw[ 4 ] = x + (y * mesh->width);	/* same as pw[ 0 ] */
+						
+						/* set radix */
+						r = (x + y) & 1;
+						
+						/* make first triangle */
+						VectorCopy( verts[ pw[ r + 0 ] ].xyz, tw.v[ 0 ].xyz );
+						Vector2Copy( verts[ pw[ r + 0 ] ].st, tw.v[ 0 ].st );
+						VectorCopy( verts[ pw[ r + 1 ] ].xyz, tw.v[ 1 ].xyz );
+						Vector2Copy( verts[ pw[ r + 1 ] ].st, tw.v[ 1 ].st );
+						VectorCopy( verts[ pw[ r + 2 ] ].xyz, tw.v[ 2 ].xyz );
+						Vector2Copy( verts[ pw[ r + 2 ] ].st, tw.v[ 2 ].st );
+						m4x4_transform_point( transform, tw.v[ 0 ].xyz );
+						m4x4_transform_point( transform, tw.v[ 1 ].xyz );
+						m4x4_transform_point( transform, tw.v[ 2 ].xyz );
+						FilterTraceWindingIntoNodes_r( &tw, nodeNum );
+						
+						/* make second triangle */
+						VectorCopy( verts[ pw[ r + 0 ] ].xyz, tw.v[ 0 ].xyz );
+						Vector2Copy( verts[ pw[ r + 0 ] ].st, tw.v[ 0 ].st );
+						VectorCopy( verts[ pw[ r + 2 ] ].xyz, tw.v[ 1 ].xyz );
+						Vector2Copy( verts[ pw[ r + 2 ] ].st, tw.v[ 1 ].st );
+						VectorCopy( verts[ pw[ r + 3 ] ].xyz, tw.v[ 2 ].xyz );
+						Vector2Copy( verts[ pw[ r + 3 ] ].st, tw.v[ 2 ].st );
+						m4x4_transform_point( transform, tw.v[ 0 ].xyz );
+						m4x4_transform_point( transform, tw.v[ 1 ].xyz );
+						m4x4_transform_point( transform, tw.v[ 2 ].xyz );
+						FilterTraceWindingIntoNodes_r( &tw, nodeNum );
+					}
+				}
+				
+				/* free the subdivided mesh */
+				FreeMesh( mesh );
+				break;
+			
+			/* handle triangle surfaces */
+			case MST_TRIANGLE_SOUP:
+			case MST_PLANAR:
+				/* set verts and indexes */
+				verts = &bspDrawVerts[ ds->firstVert ];
+				indexes = &bspDrawIndexes[ ds->firstIndex ];
+				
+				/* walk the triangle list */
+				for( j = 0; j < ds->numIndexes; j += 3 )
+				{
+					VectorCopy( verts[ indexes[ j ] ].xyz, tw.v[ 0 ].xyz );
+					Vector2Copy( verts[ indexes[ j ] ].st, tw.v[ 0 ].st );
+					VectorCopy( verts[ indexes[ j + 1 ] ].xyz, tw.v[ 1 ].xyz );
+					Vector2Copy( verts[ indexes[ j + 1 ] ].st, tw.v[ 1 ].st );
+					VectorCopy( verts[ indexes[ j + 2 ] ].xyz, tw.v[ 2 ].xyz );
+					Vector2Copy( verts[ indexes[ j + 2 ] ].st, tw.v[ 2 ].st );
+					m4x4_transform_point( transform, tw.v[ 0 ].xyz );
+					m4x4_transform_point( transform, tw.v[ 1 ].xyz );
+					m4x4_transform_point( transform, tw.v[ 2 ].xyz );
+					FilterTraceWindingIntoNodes_r( &tw, nodeNum );
+				}
+				break;
+			
+			/* other surface types do not cast shadows */
+			default:
+				break;
+		}
+	}
+}
 
-				skin = 0;
-				if( KeyExists( e, "skin2" ) )
-					skin = IntForKey( e, "skin2" );
-				if( KeyExists( e, "_skin2" ) )
-					skin = IntForKey( e, "_skin2" );
+/*
+AddTraceModel()
+finds or creates the model space triangles of a picomodel with a skin and shadow group, which
+are shared by all of its instances
+*/
 
-				model = LoadModel( (char*) value, frame );
-				if( model == NULL )
-					continue;
-				PopulateWithPicoModel( castShadows, model, transform, skin );
+static int AddTraceModel( char castShadows, picoModel_t *model, int skin )
+{
+	int					i, j, k, numSurfaces, numIndexes;
+	picoSurface_t		*surface;
+	picoVec_t			*xyz, *st;
+	picoIndex_t			*indexes;
+	traceInfo_t			ti;
+	traceTriangle_t		tt;
+	traceModel_t		*tm;
+	vec4_t				plane;
+	void				*temp;
+	
+	
+	/* find an existing model */
+	for( i = 0; i < numTraceModels; i++ )
+	{
+		if( traceModels[ i ].model == model && traceModels[ i ].skin == skin && traceModels[ i ].castShadows == castShadows )
+			return i;
+	}
+	
+	/* enough space? */
+	if( numTraceModels >= maxTraceModels )
+	{
+		maxTraceModels += 64;
+		temp = safe_malloc_tag( maxTraceModels * sizeof( *traceModels ), &traceTriangleTag );
+		if( traceModels != NULL )
+		{
+			memcpy( temp, traceModels, numTraceModels * sizeof( *traceModels ) );
+			safe_free_tag( traceModels );
+		}
+		traceModels = (traceModel_t*) temp;
+	}
+	
+	/* add the model */
+	tm = &traceModels[ numTraceModels ];
+	memset( tm, 0, sizeof( *tm ) );
+	tm->model = model;
+	tm->skin = skin;
+	tm->castShadows = castShadows;
+	tm->firstTriangle = numTraceTriangles;
+	tm->rootNode = -1;
+	
+	/* get info */
+	numSurfaces = PicoGetModelNumSurfaces( model );
+	
+	/* walk the list of surfaces in this model and fill out the info structs */
+	for( i = 0; i < numSurfaces; i++ )
+	{
+		/* get surface */
+		surface = PicoGetModelSurface( model, i );
+		if( surface == NULL )
+			continue;
+		
+		/* only handle triangle surfaces initially (fixme: support patches) */
+		if( PicoGetSurfaceType( surface ) != PICO_TRIANGLES )
+			continue;
+		
+		/* get shader (fixme: support shader remapping) */
+		/* vortex: support .skin files */
+		ti.si = ShaderInfoForShader( PicoGetSurfaceShaderNameForSkin( surface, skin ) );
+		if( ti.si == NULL )
+			continue;
+		
+		/* translucent surfaces that are neither alphashadow or lightfilter don't cast shadows */
+		if( (ti.si->compileFlags & C_NODRAW) )
+			continue;
+		if( (ti.si->compileFlags & C_TRANSLUCENT) &&
+			!(ti.si->compileFlags & C_ALPHASHADOW) && 
+			!(ti.si->compileFlags & C_LIGHTFILTER) )
+			continue;
+		
+		/* setup trace info */
+		ti.castShadows = castShadows;
+		ti.surfaceNum = -1;
+		ti.entityNum = -1;
+		
+		/* setup trace triangle */
+		memset( &tt, 0, sizeof( tt ) );
+		tt.infoNum = AddTraceInfo( &ti );
+		
+		/* get info */
+		numIndexes = PicoGetSurfaceNumIndexes( surface );
+		indexes = PicoGetSurfaceIndexes( surface, 0 );
+		
+		/* walk the triangle list */
+		for( j = 0; j < numIndexes; j += 3, indexes += 3 )
+		{
+			for( k = 0; k < 3; k++ )
+			{
+				xyz = PicoGetSurfaceXYZ( surface, indexes[ k ] );
+				st = PicoGetSurfaceST( surface, 0, indexes[ k ] );
+				VectorCopy( xyz, tt.v[ k ].xyz );
+				Vector2Copy( st, tt.v[ k ].st );
+			}
+			
+			/* filter out bogus triangles like FilterTraceWindingIntoNodes_r() does */
+			if( !PlaneFromPoints( plane, tt.v[ 0 ].xyz, tt.v[ 1 ].xyz, tt.v[ 2 ].xyz ) )
 				continue;
+			AddTraceTriangle( &tt );
+			tm->numTriangles++;
+		}
+	}
+	
+	/* return the model number */
+	numTraceModels++;
+	return numTraceModels - 1;
+}
+
+
+
+/*
+PopulateWithPicoModel() - ydnar
+adds an instance of a picomodel to the raytracing tree, the triangles are stored once per model
+in model space and traced through their own bvh
+*/
+
+static void PopulateWithPicoModel( char castShadows, picoModel_t *model, m4x4_t transform, int skin )
+{
+	int					modelNum;
+	double				det;
+	traceInstance_t		*inst;
+	void				*temp;
+	
+	/* dummy check */
+	if( model == NULL || transform == NULL )
+		return;
+
+	/* no shadows */
+	/* vortex: disabled
+	if ( castShadows == 0 )
+		return;
+	*/
+	
+	/* get the shared model */
+	modelNum = AddTraceModel( castShadows, model, skin );
+	if( traceModels[ modelNum ].numTriangles <= 0 )
+		return;
+	
+	/* skip flattened instances, they can't be inverted */
+	det = transform[ 0 ] * (transform[ 5 ] * transform[ 10 ] - transform[ 6 ] * transform[ 9 ]) -
+		transform[ 4 ] * (transform[ 1 ] * transform[ 10 ] - transform[ 2 ] * transform[ 9 ]) +
+		transform[ 8 ] * (transform[ 1 ] * transform[ 6 ] - transform[ 2 ] * transform[ 5 ]);
+	if( fabs( det ) < 0.000001 )
+		return;
+	
+	/* enough space? */
+	if( numTraceInstances >= maxTraceInstances )
+	{
+		maxTraceInstances += 1024;
+		temp = safe_malloc_tag( maxTraceInstances * sizeof( *traceInstances ), &traceNodeTag );
+		if( traceInstances != NULL )
+		{
+			memcpy( temp, traceInstances, numTraceInstances * sizeof( *traceInstances ) );
+			safe_free_tag( traceInstances );
 		}
+		traceInstances = (traceInstance_t*) temp;
 	}
+	
+	/* add the instance */
+	inst = &traceInstances[ numTraceInstances++ ];
+	m4x4_assign( inst->transform, transform );
+	m4x4_assign( inst->inverse, transform );
+	m4x4_invert( inst->inverse );
+	inst->coplanarScale = 1.0 / fabs( det );
+	inst->modelNum = modelNum;
+	inst->rootNode = -1;
+}
+
+
+
+/*
+PopulateTraceNodes() - ydnar
+fills the raytracing tree with world and entity occluders
+*/
+
+static void PopulateTraceNodes( void )
+{
+	int				i, m, frame, skin;
+	char			castShadows;
+	float			temp;
+	entity_t		*e;
+	const char		*value;
+	picoModel_t		*model;
+	vec3_t			origin, scale, angles;
+	m4x4_t			transform;
+
+	/* add worldspawn triangles */
+	m4x4_identity( transform );
+	PopulateWithBSPModel( &bspModels[ 0 ], transform );
+	
+	/* walk each entity list */
+	for( i = 1; i < numEntities; i++ )
+	{
+		/* get entity */
+		e = &entities[ i ];
+		
+		/* get shadow flags */
+		GetEntityShadowFlags( e, NULL, &castShadows, NULL, qfalse );
+		
+		/* get entity origin */
+		GetVectorForKey( e, "origin", origin );
+		
+		/* get scale */
+		scale[ 0 ] = scale[ 1 ] = scale[ 2 ] = 1.0f;
+		temp = FloatForKey( e, "modelscale" );
+		if( temp != 0.0f )
+			scale[ 0 ] = scale[ 1 ] = scale[ 2 ] = temp;
+		value = ValueForKey( e, "modelscale_vec" );
+		if( value[ 0 ] != '\0' )
+			sscanf( value, "%f %f %f", &scale[ 0 ], &scale[ 1 ], &scale[ 2 ] );
+		
+		/* get "angle" (yaw) or "angles" (pitch yaw roll) */
+		angles[ 0 ] = angles[ 1 ] = angles[ 2 ] = 0.0f;
+		angles[ 2 ] = FloatForKey( e, "angle" );
+		value = ValueForKey( e, "angles" );
+		if( value[ 0 ] != '\0' )
+			sscanf( value, "%f %f %f", &angles[ 1 ], &angles[ 2 ], &angles[ 0 ] );
+		
+		/* set transform matrix (thanks spog) */
+		m4x4_identity( transform );
+		m4x4_pivoted_transform_by_vec3( transform, origin, angles, eXYZ, scale, vec3_origin );
+		
+		/* hack: Stable-1_2 and trunk have differing row/column major matrix order
+		   this transpose is necessary with Stable-1_2
+		   uncomment the following line with old m4x4_t (non 1.3/spog_branch) code */
+		//%	m4x4_transpose( transform );
+		
+		/* get model */
+		value = ValueForKey( e, "model" );
+		
+		/* switch on model type */
+		switch( value[ 0 ] )
+		{
+			/* no model */
+			case '\0':
+				break;
+			
+			/* bsp model */
+			case '*':
+				m = atoi( &value[ 1 ] );
+				if( m <= 0 || m >= numBSPModels )
+					continue;
+				PopulateWithBSPModel( &bspModels[ m ], transform );
+				break;
+			
+			/* external model */
+			default:
+				frame = 0;
+				if( KeyExists( e, "frame" ) )
+					frame = IntForKey( e, "frame" );
+				if( KeyExists( e, "_frame" ) )
+					frame = IntForKey( e, "_frame" );
+
+				skin = 0;
+				if( KeyExists( e, "skin" ) )
+					skin = IntForKey( e, "skin" );
+				if( KeyExists( e, "_skin" ) )
+					skin = IntForKey( e, "_skin" );
+
+				model = LoadModel( (char*) value, frame );
+				if( model == NULL )
+					continue;
+				PopulateWithPicoModel( castShadows, model, transform, skin );
+				continue;
+		}
+		
+		/* get model2 */
+		value = ValueForKey( e, "model2" );
+		
+		/* switch on model type */
+		switch( value[ 0 ] )
+		{
+			/* no model */
+			case '\0':
+				break;
+			
+			/* bsp model */
+			case '*':
+				m = atoi( &value[ 1 ] );
+				if( m <= 0 || m >= numBSPModels )
+					continue;
+				PopulateWithBSPModel( &bspModels[ m ], transform );
+				break;
+			
+			/* external model */
+			default:
+				frame = 0;
+				if( KeyExists( e, "frame2" ) )
+					frame = IntForKey( e, "frame2" );
+				if( KeyExists( e, "_frame2" ) )
+					frame = IntForKey( e, "_frame2" );
+
+				skin = 0;
+				if( KeyExists( e, "skin2" ) )
+					skin = IntForKey( e, "skin2" );
+				if( KeyExists( e, "_skin2" ) )
+					skin = IntForKey( e, "_skin2" );
+
+				model = LoadModel( (char*) value, frame );
+				if( model == NULL )
+					continue;
+				PopulateWithPicoModel( castShadows, model, transform, skin );
+				continue;
+		}
+	}
+}
+
+
+
+
+/* -------------------------------------------------------------------------------
+
+acceleration cache (-tracecache), the finished trace structures next to the bsp
+
+------------------------------------------------------------------------------- */
+
+/*
+TraceCacheFilename()
+the cache lives next to the bsp as mapname.trace
+*/
+
+static void TraceCacheFilename( char *filename )
+{
+	strcpy( filename, source );
+	StripExtension( filename );
+	strcat( filename, ".trace" );
+}
+
+
+
+/*
+TraceCacheKey()
+md4 of everything the trace structures are built from: trace geometry of the bsp, the shadow
+casting entities, the surface infos, shaders (with alpha/filter images) and the trace options
+*/
+
+static void TraceCacheKey( byte key[ 16 ] )
+{
+	int					i, values[ 16 ];
+	MD4_CTX				md4;
+	bspDrawSurface_t	*ds;
+	surfaceInfo_t		*info;
+	shaderInfo_t		*si;
+	entity_t			*e;
+	epair_t				*ep;
+	
+	
+	MD4Init( &md4 );
+	
+	/* format and options */
+	values[ 0 ] = TRACE_CACHE_VERSION;
+	values[ 1 ] = TRACE_BLOCK_LANES;
+	values[ 2 ] = sizeof( traceTriangle_t );
+	values[ 3 ] = sizeof( traceNode_t );
+	values[ 4 ] = sizeof( traceBVHNode_t );
+	values[ 5 ] = sizeof( traceBlock_t );
+	values[ 6 ] = sizeof( traceModel_t );
+	values[ 7 ] = sizeof( traceInstance_t );
+	values[ 8 ] = traceBVH;
+	values[ 9 ] = loMem;
+	values[ 10 ] = loMemSky;
+	values[ 11 ] = patchShadows;
+	values[ 12 ] = noDrawContentFlags;
+	values[ 13 ] = noDrawSurfaceFlags;
+	values[ 14 ] = noDrawCompileFlags;
+	values[ 15 ] = numBSPDrawSurfaces;
+	MD4Update( &md4, (unsigned char*) values, sizeof( values ) );
+	
+	/* bsp tree and models */
+	MD4Update( &md4, (unsigned char*) bspPlanes, numBSPPlanes * sizeof( *bspPlanes ) );
+	MD4Update( &md4, (unsigned char*) bspNodes, numBSPNodes * sizeof( *bspNodes ) );
+	for( i = 0; i < numBSPLeafs; i++ )
+		MD4Update( &md4, (unsigned char*) &bspLeafs[ i ].cluster, sizeof( bspLeafs[ i ].cluster ) );
+	MD4Update( &md4, (unsigned char*) bspModels, numBSPModels * sizeof( *bspModels ) );
+	for( i = 0; i < numBSPShaders; i++ )
+	{
+		MD4Update( &md4, (unsigned char*) &bspShaders[ i ].surfaceFlags, sizeof( bspShaders[ i ].surfaceFlags ) );
+		MD4Update( &md4, (unsigned char*) &bspShaders[ i ].contentFlags, sizeof( bspShaders[ i ].contentFlags ) );
+	}
+	
+	/* surface geometry (not the lightmap and vertex color data light writes back) */
+	for( i = 0; i < numBSPDrawSurfaces; i++ )
+	{
+		ds = &bspDrawSurfaces[ i ];
+		info = &surfaceInfos[ i ];
+		values[ 0 ] = ds->shaderNum;
+		values[ 1 ] = ds->surfaceType;
+		values[ 2 ] = ds->firstVert;
+		values[ 3 ] = ds->numVerts;
+		values[ 4 ] = ds->firstIndex;
+		values[ 5 ] = ds->numIndexes;
+		values[ 6 ] = ds->patchWidth;
+		values[ 7 ] = ds->patchHeight;
+		values[ 8 ] = info->castShadows;
+		values[ 9 ] = info->parentSurfaceNum;
+		values[ 10 ] = info->patchIterations;
+		values[ 11 ] = GetSurfaceExtraEntityNum( i );
+		MD4Update( &md4, (unsigned char*) values, 12 * sizeof( values[ 0 ] ) );
+		if( info->si != NULL )
+			MD4Update( &md4, (unsigned char*) info->si->shader, strlen( info->si->shader ) + 1 );
+	}
+	for( i = 0; i < numBSPDrawVerts; i++ )
+	{
+		MD4Update( &md4, (unsigned char*) bspDrawVerts[ i ].xyz, sizeof( bspDrawVerts[ i ].xyz ) );
+		MD4Update( &md4, (unsigned char*) bspDrawVerts[ i ].st, sizeof( bspDrawVerts[ i ].st ) );
+	}
+	MD4Update( &md4, (unsigned char*) bspDrawIndexes, numBSPDrawIndexes * sizeof( *bspDrawIndexes ) );
+	
+	/* entities with models (light entities come and go with -keeplights) */
+	for( i = 1; i < numEntities; i++ )
+	{
+		e = &entities[ i ];
+		if( ValueForKey( e, "model" )[ 0 ] == '\0' && ValueForKey( e, "model2" )[ 0 ] == '\0' )
+			continue;
+		for( ep = e->epairs; ep != NULL; ep = ep->next )
+		{
+			MD4Update( &md4, (unsigned char*) ep->key, strlen( ep->key ) + 1 );
+			MD4Update( &md4, (unsigned char*) ep->value, strlen( ep->value ) + 1 );
+		}
+	}
+	
+	/* shaders */
+	for( i = 0; i < numShaderInfo; i++ )
+	{
+		si = &shaderInfo[ i ];
+		MD4Update( &md4, (unsigned char*) si->shader, strlen( si->shader ) + 1 );
+		MD4Update( &md4, (unsigned char*) &si->compileFlags, sizeof( si->compileFlags ) );
+		if( (si->compileFlags & (C_ALPHASHADOW | C_LIGHTFILTER)) && si->lightImage != NULL && si->lightImage->pixels != NULL )
+		{
+			values[ 0 ] = si->lightImage->width;
+			values[ 1 ] = si->lightImage->height;
+			MD4Update( &md4, (unsigned char*) values, 2 * sizeof( values[ 0 ] ) );
+			MD4Update( &md4, si->lightImage->pixels, si->lightImage->width * si->lightImage->height * 4 );
+		}
+	}
+	
+	MD4Final( key, &md4 );
+}
+
+
+
+/*
+MapTraceCache()
+maps a cache file read only, returns NULL if it can't
+*/
+
+static byte *MapTraceCache( const char *filename, int *length )
+{
+#if defined(WIN32) || defined(WIN64)
+	HANDLE			file, mapping;
+	void			*data;
+	
+	
+	file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( file == INVALID_HANDLE_VALUE )
+		return NULL;
+	*length = (int) GetFileSize( file, NULL );
+	mapping = *length > 0 ? CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL ) : NULL;
+	CloseHandle( file );
+	if( mapping == NULL )
+		return NULL;
+	data = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+	CloseHandle( mapping );
+	return (byte*) data;
+#else
+	int				file;
+	struct stat		st;
+	void			*data;
+	
+	
+	file = open( filename, O_RDONLY );
+	if( file < 0 )
+		return NULL;
+	data = MAP_FAILED;
+	if( fstat( file, &st ) == 0 && st.st_size > 0 )
+	{
+		*length = (int) st.st_size;
+		data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, file, 0 );
+	}
+	close( file );
+	return data != MAP_FAILED ? (byte*) data : NULL;
+#endif
+}
+
+
+
+/*
+UnmapTraceCache()
+releases a mapping from MapTraceCache()
+*/
+
+static void UnmapTraceCache( byte *data, int length )
+{
+#if defined(WIN32) || defined(WIN64)
+	UnmapViewOfFile( data );
+#else
+	munmap( data, length );
+#endif
+}
+
+
+
+/*
+LoadTraceCache()
+maps the cache file of an earlier run with the same key and points the trace structures
+into it (infos and models are copied to restore their pointers), returns qfalse if
+the structures have to be built
+*/
+
+static qboolean LoadTraceCache( byte key[ 16 ] )
+{
+	int					i, length;
+	char				filename[ MAX_OS_PATH ];
+	byte				*data;
+	traceCacheHeader_t	*header;
+	traceCacheInfo_t	*info;
+	bspLump_t			*lumps;
+	
+	
+	/* map it */
+	TraceCacheFilename( filename );
+	data = MapTraceCache( filename, &length );
+	if( data == NULL )
+		return qfalse;
+	
+	/* check it was built from the same map and options */
+	header = (traceCacheHeader_t*) data;
+	lumps = header->lumps;
+	if( length < (int) sizeof( *header ) || header->ident != TRACE_CACHE_IDENT || header->version != TRACE_CACHE_VERSION ||
+		memcmp( header->key, key, sizeof( header->key ) ) )
+	{
+		Sys_Printf( "Trace cache %s is out of date\n", filename );
+		UnmapTraceCache( data, length );
+		return qfalse;
+	}
+	for( i = 0; i < NUM_TRACE_CACHE_LUMPS; i++ )
+	{
+		if( lumps[ i ].offset < (int) sizeof( *header ) || lumps[ i ].length < 0 || lumps[ i ].offset > length - lumps[ i ].length )
+		{
+			Sys_Printf( "Trace cache %s is damaged\n", filename );
+			UnmapTraceCache( data, length );
+			return qfalse;
+		}
+	}
+	
+	/* infos need their shaders back */
+	numTraceInfos = maxTraceInfos = lumps[ TRACE_CACHE_INFOS ].length / sizeof( traceCacheInfo_t );
+	traceInfos = (traceInfo_t*) safe_malloc_tag( (maxTraceInfos + 1) * sizeof( *traceInfos ), &traceTriangleTag );
+	info = (traceCacheInfo_t*) (data + lumps[ TRACE_CACHE_INFOS ].offset);
+	for( i = 0; i < numTraceInfos; i++ )
+	{
+		traceInfos[ i ].si = ShaderInfoForShader( info[ i ].shader );
+		traceInfos[ i ].surfaceNum = info[ i ].surfaceNum;
+		traceInfos[ i ].entityNum = info[ i ].entityNum;
+		traceInfos[ i ].castShadows = info[ i ].castShadows;
+		traceInfos[ i ].castGroup = CastGroupBit( info[ i ].castShadows );
+	}
+	
+	/* models are copied without their picomodels, which are only used while populating */
+	numTraceModels = maxTraceModels = lumps[ TRACE_CACHE_MODELS ].length / sizeof( traceModel_t );
+	traceModels = (traceModel_t*) safe_malloc_tag( (maxTraceModels + 1) * sizeof( *traceModels ), &traceTriangleTag );
+	memcpy( traceModels, data + lumps[ TRACE_CACHE_MODELS ].offset, numTraceModels * sizeof( *traceModels ) );
+	
+	/* everything else is used in place */
+	numTraceTriangles = maxTraceTriangles = lumps[ TRACE_CACHE_TRIANGLES ].length / sizeof( traceTriangle_t );
+	traceTriangles = (traceTriangle_t*) (data + lumps[ TRACE_CACHE_TRIANGLES ].offset);
+	numTraceNodes = maxTraceNodes = lumps[ TRACE_CACHE_NODES ].length / sizeof( traceNode_t );
+	traceNodes = (traceNode_t*) (data + lumps[ TRACE_CACHE_NODES ].offset);
+	numBVHNodes = maxBVHNodes = lumps[ TRACE_CACHE_BVH_NODES ].length / sizeof( traceBVHNode_t );
+	bvhNodes = (traceBVHNode_t*) (data + lumps[ TRACE_CACHE_BVH_NODES ].offset);
+	numTraceBlocks = maxTraceBlocks = lumps[ TRACE_CACHE_BLOCKS ].length / sizeof( traceBlock_t );
+	traceBlocks = (traceBlock_t*) (data + lumps[ TRACE_CACHE_BLOCKS ].offset);
+	numTraceInstances = maxTraceInstances = lumps[ TRACE_CACHE_INSTANCES ].length / sizeof( traceInstance_t );
+	traceInstances = (traceInstance_t*) (data + lumps[ TRACE_CACHE_INSTANCES ].offset);
+	traceCoverage = lumps[ TRACE_CACHE_COVERAGE ].length > 0 ? data + lumps[ TRACE_CACHE_COVERAGE ].offset : NULL;
+	
+	headNodeNum = header->headNodeNum;
+	skyboxNodeNum = header->skyboxNodeNum;
+	maxTraceDepth = header->maxTraceDepth;
+	numTraceLeafNodes = header->numTraceLeafNodes;
+	numWorldBVHItems = header->numWorldBVHItems;
+	numTriangleBVHNodes = header->numTriangleBVHNodes;
+	instanceRootNode = header->instanceRootNode;
+	
+	/* emit some stats */
+	Sys_Printf( "Mapped trace cache %s (%.2fMB)\n", filename, (float) length / (1024.0f * 1024.0f) );
+	Sys_Printf( "%9d trace triangles\n", numTraceTriangles );
+	Sys_Printf( "%9d trace nodes\n", numTraceNodes );
+	if( numTraceInstances > 0 )
+		Sys_Printf( "%9d model instances of %d models\n", numTraceInstances, numTraceModels );
+	return qtrue;
+}
+
+
+
+/*
+WriteTraceCacheLump()
+appends a 16 byte aligned lump to the cache file
+*/
+
+static void WriteTraceCacheLump( FILE *file, traceCacheHeader_t *header, int lumpNum, const void *data, int length )
+{
+	byte			pad[ 16 ];
+	
+	
+	memset( pad, 0, sizeof( pad ) );
+	fwrite( pad, 1, (16 - ftell( file ) % 16) % 16, file );
+	header->lumps[ lumpNum ].offset = ftell( file );
+	header->lumps[ lumpNum ].length = length;
+	if( length > 0 )
+		fwrite( data, 1, length, file );
+}
+
+
+
+/*
+WriteTraceCache()
+writes the finished trace structures for later runs, the header goes in last so an
+interrupted write leaves a file that won't load
+*/
+
+static void WriteTraceCache( byte key[ 16 ] )
+{
+	int					i;
+	char				filename[ MAX_OS_PATH ];
+	FILE				*file;
+	traceCacheHeader_t	header;
+	traceCacheInfo_t	*infos;
+	traceNode_t			*nodes;
+	
+	
+	/* open the file */
+	TraceCacheFilename( filename );
+	file = fopen( filename, "wb" );
+	if( file == NULL )
+	{
+		Sys_Printf( "WARNING: Can't write trace cache %s\n", filename );
+		return;
+	}
+	memset( &header, 0, sizeof( header ) );
+	fwrite( &header, 1, sizeof( header ), file );
+	
+	/* infos keep shader names */
+	infos = (traceCacheInfo_t*) safe_malloc( (numTraceInfos + 1) * sizeof( *infos ) );
+	memset( infos, 0, (numTraceInfos + 1) * sizeof( *infos ) );
+	for( i = 0; i < numTraceInfos; i++ )
+	{
+		strcpy( infos[ i ].shader, traceInfos[ i ].si->shader );
+		infos[ i ].surfaceNum = traceInfos[ i ].surfaceNum;
+		infos[ i ].entityNum = traceInfos[ i ].entityNum;
+		infos[ i ].castShadows = traceInfos[ i ].castShadows;
+	}
+	WriteTraceCacheLump( file, &header, TRACE_CACHE_INFOS, infos, numTraceInfos * sizeof( *infos ) );
+	free( infos );
+	
+	/* nodes without their (already packed) item lists */
+	nodes = (traceNode_t*) safe_malloc( (numTraceNodes + 1) * sizeof( *nodes ) );
+	memcpy( nodes, traceNodes, numTraceNodes * sizeof( *nodes ) );
+	for( i = 0; i < numTraceNodes; i++ )
+	{
+		nodes[ i ].items = NULL;
+		nodes[ i ].maxItems = 0;
+	}
+	WriteTraceCacheLump( file, &header, TRACE_CACHE_NODES, nodes, numTraceNodes * sizeof( *nodes ) );
+	free( nodes );
+	
+	/* the rest as is */
+	WriteTraceCacheLump( file, &header, TRACE_CACHE_TRIANGLES, traceTriangles, numTraceTriangles * sizeof( *traceTriangles ) );
+	WriteTraceCacheLump( file, &header, TRACE_CACHE_BVH_NODES, bvhNodes, numBVHNodes * sizeof( *bvhNodes ) );
+	WriteTraceCacheLump( file, &header, TRACE_CACHE_BLOCKS, traceBlocks, numTraceBlocks * sizeof( *traceBlocks ) );
+	WriteTraceCacheLump( file, &header, TRACE_CACHE_MODELS, traceModels, numTraceModels * sizeof( *traceModels ) );
+	WriteTraceCacheLump( file, &header, TRACE_CACHE_INSTANCES, traceInstances, numTraceInstances * sizeof( *traceInstances ) );
+	WriteTraceCacheLump( file, &header, TRACE_CACHE_COVERAGE, traceCoverage, traceCoverage != NULL ? numTraceTriangles : 0 );
+	
+	/* finish with the header */
+	header.ident = TRACE_CACHE_IDENT;
+	header.version = TRACE_CACHE_VERSION;
+	memcpy( header.key, key, sizeof( header.key ) );
+	header.headNodeNum = headNodeNum;
+	header.skyboxNodeNum = skyboxNodeNum;
+	header.maxTraceDepth = maxTraceDepth;
+	header.numTraceLeafNodes = numTraceLeafNodes;
+	header.numWorldBVHItems = numWorldBVHItems;
+	header.numTriangleBVHNodes = numTriangleBVHNodes;
+	header.instanceRootNode = instanceRootNode;
+	fseek( file, 0, SEEK_SET );
+	fwrite( &header, 1, sizeof( header ), file );
+	
+	/* close it */
+	if( ferror( file ) )
+	{
+		fclose( file );
+		remove( filename );
+		Sys_Printf( "WARNING: Can't write trace cache %s\n", filename );
+		return;
+	}
+	Sys_FPrintf( SYS_VRB, "Wrote trace cache %s (%.2fMB)\n", filename, (float) ftell( file ) / (1024.0f * 1024.0f) );
+	fclose( file );
+}
+
+
+
+/*
+TraceGeometryKey()
+returns the key of the trace geometry, incremental relighting builds on it
+*/
+
+void TraceGeometryKey( byte key[ 16 ] )
+{
+	memcpy( key, traceGeometryKey, sizeof( traceGeometryKey ) );
+}
+
+
+
+
+/* -------------------------------------------------------------------------------
+
+trace initialization
+
+------------------------------------------------------------------------------- */
+
+/*
+SetupTraceNodes() - ydnar
+creates a balanced bsp with axis-aligned splits for efficient raytracing
+*/
+
+void SetupTraceNodes( void )
+{
+	int		i, numInstanced;
+	
+	
+	/* note it */
+	Sys_FPrintf( SYS_VRB, "--- SetupTraceNodes ---\n" );
+	
+	/* find nodraw bit */
+	noDrawContentFlags = noDrawSurfaceFlags = noDrawCompileFlags = 0;
+	ApplySurfaceParm( "nodraw", &noDrawContentFlags, &noDrawSurfaceFlags, &noDrawCompileFlags );
+	
+	/* reuse the structures of an earlier run on the same map */
+	if( traceCache || incrementalLight )
+		TraceCacheKey( traceGeometryKey );
+	if( traceCache && LoadTraceCache( traceGeometryKey ) )
+	{
+		SetupTraceShadowGroups();
+		return;
+	}
+
+	/* create the baseline raytracing tree from the bsp tree */
+	headNodeNum = SetupTraceNodes_r( 0 );
+
+	/* create outside node for skybox surfaces */
+	skyboxNodeNum = AllocTraceNode();
+
+	/* populate the tree with triangles from the world and shadow casting entities */
+	PopulateTraceNodes();
+	
+	/* create the raytracing bsp (world triangles go into a bvh instead with -bvh) */
+	if( loMem == qfalse )
+	{
+		if( traceBVH == qfalse )
+			SubdivideTraceNode_r( headNodeNum, 0 );
+		if( loMemSky == qfalse )
+			SubdivideTraceNode_r( skyboxNodeNum, 0 );
+	}
+	
+	/* create triangles from the trace windings */
+	TriangulateTraceNode_r( headNodeNum );
+	TriangulateTraceNode_r( skyboxNodeNum );
+	
+	/* emit some stats */
+	//%	Sys_FPrintf( SYS_VRB, "%9d original triangles\n", numOriginalTriangles );
+	Sys_Printf( "%9d trace windings (%.2fMB)\n", numTraceWindings, (float) (numTraceWindings * sizeof( *traceWindings )) / (1024.0f * 1024.0f) );
+	Sys_Printf( "%9d trace triangles (%.2fMB)\n", numTraceTriangles, (float) (numTraceTriangles * sizeof( *traceTriangles )) / (1024.0f * 1024.0f) );
+	Sys_Printf( "%9d trace nodes (%.2fMB)\n", numTraceNodes, (float) (numTraceNodes * sizeof( *traceNodes )) / (1024.0f * 1024.0f) );
+	Sys_Printf( "%9d leaf nodes (%.2fMB)\n", numTraceLeafNodes, (float) (numTraceLeafNodes * sizeof( *traceNodes )) / (1024.0f * 1024.0f) );
+	//%	Sys_FPrintf( SYS_VRB, "%9d average triangles per leaf node\n", numTraceTriangles / numTraceLeafNodes );
+	Sys_FPrintf( SYS_VRB, "%9d average windings per leaf node\n", numTraceWindings / (numTraceLeafNodes + 1) );
+	Sys_FPrintf( SYS_VRB, "%9d max trace depth\n", maxTraceDepth );
+	if( numTraceInstances > 0 )
+	{
+		for( i = 0, numInstanced = 0; i < numTraceInstances; i++ )
+			numInstanced += traceModels[ traceInstances[ i ].modelNum ].numTriangles;
+		Sys_Printf( "%9d model instances of %d models\n", numTraceInstances, numTraceModels );
+		Sys_FPrintf( SYS_VRB, "%9d instanced triangles\n", numInstanced );
+	}
+	
+	/* build the bvhs */
+	if( traceBVH || numTraceInstances > 0 )
+		SetupTraceBVH();
+	
+	/* pack leaf triangles for the simd tests */
+	SetupTraceBlocks();
+	
+	/* find filter triangles that don't need texture lookups */
+	SetupTraceCoverage();
+	
+	/* tabulate shadow group masks */
+	SetupTraceShadowGroups();
+	
+	/* free trace windings */
+	safe_free_tag( traceWindings );
+	numTraceWindings = 0;
+	maxTraceWindings = 0;
+	deadWinding = -1;
+	
+	/* save them for the next run */
+	if( traceCache )
+		WriteTraceCache( traceGeometryKey );
+	
+	/* debug code: write out trace triangles to an alias obj file */
+	#if 0
+	{
+		int				i, j;
+		FILE			*file;
+		char			filename[ MAX_OS_PATH ];
+		traceWinding_t	*tw;
+		
+		
+		/* open the file */
+		strcpy( filename, source );
+		StripExtension( filename );
+		strcat( filename, ".lin" );
+		Sys_Printf( "Opening light trace file %s...\n", filename );
+		file = fopen( filename, "w" );
+		if( file == NULL )
+			Error( "Error opening %s for writing", filename );
+		
+		/* walk node list */
+		for( i = 0; i < numTraceWindings; i++ )
+		{
+			tw = &traceWindings[ i ];
+			for( j = 0; j < tw->numVerts + 1; j++ )
+				fprintf( file, "%f %f %f\n",
+					tw->v[ j % tw->numVerts ].xyz[ 0 ], tw->v[ j % tw->numVerts ].xyz[ 1 ], tw->v[ j % tw->numVerts ].xyz[ 2 ] );
+		}
+		
+		/* close it */
+		fclose( file );
+	}
+	#endif
+}
+
+
+
+/* -------------------------------------------------------------------------------
+
+raytracer
+
+------------------------------------------------------------------------------- */
+
+/*
+TraceTriangle()
+based on code written by william 'spog' joseph
+based on code originally written by tomas moller and ben trumbore, journal of graphics tools, 2(1):21-28, 1997
+*/
+
+#define BARY_EPSILON			0.01f
+#define ASLF_EPSILON			0.0001f	/* so to not get double shadows */
+#define COPLANAR_EPSILON		0.25f	//%	0.000001f
+#define SELF_SHADOW_EPSILON		0.5f
+
+/*
+TraceTriangleShadows()
+returns qtrue if the triangle's shadow group can shadow this trace
+*/
+
+static qboolean TraceTriangleShadows( traceInfo_t *ti, trace_t *trace )
+{
+	/* don't double-trace against sky */
+	if( trace->compileFlags & ti->si->compileFlags & C_SKY )
+		return qfalse;
+	
+	/* most groups are decided by their bit, the rest take the long way */
+	if( ti->castGroup & trace->recvGroups )
+		return qtrue;
+	if( !(ti->castGroup & trace->selfGroups) )
+		return qfalse;
+
+	/* _rs = 1 */
+	/* receive shadows from worldspawn group only */
+	if( trace->recvShadows == 1 )
+	{
+		if( ti->castShadows != 1 )
+		{
+			/* vortex: do self shadow for (_rs 1 _cs 0) */
+			if( ti->castShadows == 0 )
+			{
+				if (trace->forceSelfShadow == qtrue)
+					if( trace->entityNum == ti->entityNum )
+						goto skipShadowGroups;
+				if( TraceSelfSurface( ti->surfaceNum, trace ) )
+					goto skipShadowGroups;
+			}
+			return qfalse;
+		}
+	}
+	/* _rs > 1 */
+	/* receive shadows from same group and worldspawn group */
+	else if( trace->recvShadows > 1 )
+	{
+		/* _cs != 1 and abs(_cs) should match */
+		if( ti->castShadows != 1 && abs( ti->castShadows ) != abs( trace->recvShadows ) )
+			return qfalse;
+		//%	Sys_Printf( "%d:%d ", tt->castShadows, trace->recvShadows );
+	}
+	/* rs <= 1 */
+	/* receive shadows from the same group only (< 0) */
+	else
+	{
+		/* abs (_cs) should match */
+		if( abs( ti->castShadows ) != abs( trace->recvShadows ) )
+			return qfalse;
+	}
+skipShadowGroups:
+	return qtrue;
+}
+
+
+
+/*
+TraceTriangleHit()
+applies a ray/triangle intersection at depth with barycentric u, v to the trace
+returns qtrue if the trace became opaque; nearest hit traces also clip their distance to it and
+keep looking for a nearer hit
+*/
+
+static qboolean TraceTriangleHit( traceInfo_t *ti, traceTriangle_t *tt, trace_t *trace, double u, double v, double depth )
+{
+	int				coverage;
+	double			w, s, t;
+	int				is, it;
+	byte			*pixel;
+	double			shadow;
+	shaderInfo_t	*si;
+	
+	
+	si = ti->si;
+	
+	/* if hitpoint is really close to trace origin (sample point), then check for self-shadowing */
+	if( depth <= SELF_SHADOW_EPSILON )
+	{
+		/* don't self-shadow */
+		if( TraceSelfSurface( ti->surfaceNum, trace ) )
+			return qfalse;
+	}
+
+	/* check for occlusionBias */
+	if( depth <= trace->occlusionBias )
+		return qfalse;
+	
+	/* stack compile flags */
+	trace->compileFlags |= si->compileFlags;
+	
+	/* don't trace against sky */
+	if( si->compileFlags & C_SKY )
+	{
+		/* vortex: save skylight shader we hit */
+		if( si->skyLightValue )
+			trace->skyLightShader = si;
+		return qfalse;
+	}
+	
+	/* try to avoid double shadows near triangle seams */
+	if( u < -ASLF_EPSILON || u > (1.0f + ASLF_EPSILON) ||
+		v < -ASLF_EPSILON || (u + v) > (1.0f + ASLF_EPSILON) )
+		return qfalse;
+
+	/* most surfaces are completely opaque (these can be remembered as occluders) */
+	if( !(si->compileFlags & (C_ALPHASHADOW | C_LIGHTFILTER)) || si->lightImage == NULL || si->lightImage->pixels == NULL )
+	{
+		VectorMA( trace->origin, depth, trace->direction, trace->hit );
+		VectorClear( trace->color );
+		trace->opaque = qtrue;
+		trace->hitSurfaceNum = ti->surfaceNum;
+		traceHitTriangle = tt - traceTriangles;
+		traceHitInstance = traceInstanceNum;
+		if( traceNearest )
+			trace->distance = depth;
+		return qtrue;
+	}
+	
+	/* a nearer filter only replaces the hit if it is opaque on its own */
+	if( trace->opaque )
+		VectorSet( trace->color, 1.0f, 1.0f, 1.0f );
+	
+	/* triangles whose texels all block (or all pass) light skip the lookup */
+	coverage = traceCoverage != NULL ? traceCoverage[ tt - traceTriangles ] : COVERAGE_MIXED;
+	if( coverage == COVERAGE_OPAQUE )
+		VectorClear( trace->color );
+	else if( coverage == COVERAGE_MIXED )
+	{
+		/* calculate w parameter */
+		w = 1.0f - (u + v);
+		
+		/* calculate st from uvw (barycentric) coordinates */
+		s = w * tt->v[ 0 ].st[ 0 ] + u * tt->v[ 1 ].st[ 0 ] + v * tt->v[ 2 ].st[ 0 ];
+		t = w * tt->v[ 0 ].st[ 1 ] + u * tt->v[ 1 ].st[ 1 ] + v * tt->v[ 2 ].st[ 1 ];
+		s = s - floor( s );
+		t = t - floor( t );
+		is = max(0, min(s * si->lightImage->width, si->lightImage->width - 1)); // vortex: added min here because somehow it may get out of texture bounds
+		it = max(0, min(t * si->lightImage->height, si->lightImage->height - 1));
+
+		/* get pixel */
+		pixel = si->lightImage->pixels + 4 * (it * si->lightImage->width + is);
+		
+		/* ydnar: color filter */
+		if( si->compileFlags & C_LIGHTFILTER )
+		{
+			/* filter by texture color */
+			trace->color[ 0 ] *= ((1.0f / 255.0f) * pixel[ 0 ]);
+			trace->color[ 1 ] *= ((1.0f / 255.0f) * pixel[ 1 ]);
+			trace->color[ 2 ] *= ((1.0f / 255.0f) * pixel[ 2 ]);
+		}
+		
+		/* ydnar: alpha filter */
+		if( si->compileFlags & C_ALPHASHADOW )
+		{
+			/* filter by inverse texture alpha */
+			shadow = (1.0f / 255.0f) * (255 - pixel[ 3 ]);
+			trace->color[ 0 ] *= shadow;
+			trace->color[ 1 ] *= shadow;
+			trace->color[ 2 ] *= shadow;
+		}
+	}
+	
+	/* check filter for opaque */
+	if( trace->color[ 0 ] <= 0.001f && trace->color[ 1 ] <= 0.001f && trace->color[ 2 ] <= 0.001f )
+	{
+		VectorMA( trace->origin, depth, trace->direction, trace->hit );
+		trace->opaque = qtrue;
+		trace->hitSurfaceNum = ti->surfaceNum;
+		if( traceNearest )
+			trace->distance = depth;
+		return qtrue;
+	}
+	if( trace->opaque )
+		VectorClear( trace->color );
+	
+	/* continue tracing */
+	return qfalse;
+}
+
+
+
+/*
+TraceTriangleRay()
+single triangle test in double precision, along a ray in the triangle's space (model space for
+instanced models, where depth stays in world units as the direction isn't renormalized)
+*/
+
+static qboolean TraceTriangleRay( traceInfo_t *ti, traceTriangle_t *tt, vec3_t origin, vec3_t direction, float coplanarEpsilon, trace_t *trace )
+{
+	double			tvec[ 3 ], pvec[ 3 ], qvec[ 3 ];
+	double			det, invDet, depth;
+	double			u, v;
+	
+	
+	/* shadow groups */
+	if( !TraceTriangleShadows( ti, trace ) )
+		return qfalse;
+
+	/* begin calculating determinant - also used to calculate u parameter */
+	CrossProduct( direction, tt->edge2, pvec );
+	
+	/* if determinant is near zero, trace lies in plane of triangle */
+	det = DotProduct( tt->edge1, pvec );
+	
+	/* the non-culling branch */
+	if( fabs( det ) < coplanarEpsilon )
+		return qfalse;
+	invDet = 1.0f / det;
+
+	/* calculate distance from first vertex to ray origin */
+	VectorSubtract( origin, tt->v[ 0 ].xyz, tvec );
+	
+	/* calculate u parameter and test bounds */
+	u = DotProduct( tvec, pvec ) * invDet;
+	if( u < -BARY_EPSILON || u > (1.0f + BARY_EPSILON) )
+		return qfalse;
+	
+	/* prepare to test v parameter */
+	CrossProduct( tvec, tt->edge1, qvec );
+	
+	/* calculate v parameter and test bounds */
+	v = DotProduct( direction, qvec ) * invDet;
+	if( v < -BARY_EPSILON || (u + v) > (1.0f + BARY_EPSILON) )
+		return qfalse;
+	
+	/* calculate t (depth) */
+	depth = DotProduct( tt->edge2, qvec ) * invDet;
+	if( depth < trace->inhibitRadius || depth >= trace->distance )
+		return qfalse;
+	
+	/* apply the hit */
+	return TraceTriangleHit( ti, tt, trace, u, v, depth );
 }
 
 
 
+/*
+TraceTriangle()
+single triangle test in double precision
+*/
 
-/* -------------------------------------------------------------------------------
-
-trace initialization
-
-------------------------------------------------------------------------------- */
+qboolean TraceTriangle( traceInfo_t *ti, traceTriangle_t *tt, trace_t *trace )
+{
+	return TraceTriangleRay( ti, tt, trace->origin, trace->direction, COPLANAR_EPSILON, trace );
+}
 
 /*
-SetupTraceNodes() - ydnar
-creates a balanced bsp with axis-aligned splits for efficient raytracing
+TraceBlock()
+intersects a ray with every lane of a triangle block, same test as TraceTriangle() in single precision
+returns a bit mask of the lanes hit, with their u, v and depth
 */
 
-void SetupTraceNodes( void )
+#if defined( TRACE_SIMD )
+
+typedef struct traceBlockRay_s
 {
-	/* note it */
-	Sys_FPrintf( SYS_VRB, "--- SetupTraceNodes ---\n" );
+	simd_t						origin[ 3 ], direction[ 3 ];
+	simd_t						inhibitRadius, distance, coplanarEpsilon;
+}
+traceBlockRay_t;
+
+static int TraceBlock( traceBlock_t *block, traceBlockRay_t *ray, float *u, float *v, float *depth )
+{
+	simd_t			pvec[ 3 ], tvec[ 3 ], qvec[ 3 ], edge1[ 3 ], edge2[ 3 ];
+	simd_t			det, invDet, su, sv, sdepth, mask;
+	int				k;
 	
-	/* find nodraw bit */
-	noDrawContentFlags = noDrawSurfaceFlags = noDrawCompileFlags = 0;
-	ApplySurfaceParm( "nodraw", &noDrawContentFlags, &noDrawSurfaceFlags, &noDrawCompileFlags );
+	
+	for( k = 0; k < 3; k++ )
+	{
+		edge1[ k ] = SimdLoad( block->edge1[ k ] );
+		edge2[ k ] = SimdLoad( block->edge2[ k ] );
+		tvec[ k ] = SimdSub( ray->origin[ k ], SimdLoad( block->origin[ k ] ) );
+	}
+	
+	/* determinant, rejecting rays in the plane of the triangle */
+	SimdCross( ray->direction, edge2, pvec );
+	det = SimdDot( edge1, pvec );
+	mask = SimdGE( SimdAndNot( SimdSet1( -0.0f ), det ), ray->coplanarEpsilon );
+	invDet = SimdDiv( SimdSet1( 1.0f ), det );
+	
+	/* u */
+	su = SimdMul( SimdDot( tvec, pvec ), invDet );
+	mask = SimdAnd( mask, SimdGE( su, SimdSet1( -BARY_EPSILON ) ) );
+	mask = SimdAnd( mask, SimdLE( su, SimdSet1( 1.0f + BARY_EPSILON ) ) );
+	
+	/* v */
+	SimdCross( tvec, edge1, qvec );
+	sv = SimdMul( SimdDot( ray->direction, qvec ), invDet );
+	mask = SimdAnd( mask, SimdGE( sv, SimdSet1( -BARY_EPSILON ) ) );
+	mask = SimdAnd( mask, SimdLE( SimdAdd( su, sv ), SimdSet1( 1.0f + BARY_EPSILON ) ) );
+	
+	/* depth */
+	sdepth = SimdMul( SimdDot( edge2, qvec ), invDet );
+	mask = SimdAnd( mask, SimdGE( sdepth, ray->inhibitRadius ) );
+	mask = SimdAnd( mask, SimdLT( sdepth, ray->distance ) );
+	
+	SimdStore( u, su );
+	SimdStore( v, sv );
+	SimdStore( depth, sdepth );
+	return SimdMask( mask );
+}
 
-	/* create the baseline raytracing tree from the bsp tree */
-	headNodeNum = SetupTraceNodes_r( 0 );
+#endif
 
-	/* create outside node for skybox surfaces */
-	skyboxNodeNum = AllocTraceNode();
 
-	/* populate the tree with triangles from the world and shadow casting entities */
-	PopulateTraceNodes();
+
+/*
+TraceTriangleBlocks()
+tests numItems triangles packed into blocks starting at firstBlock, in order, along a ray in
+their space (see TraceTriangleRay()); nearest hit traces test all of them
+returns qtrue if something opaque is hit
+*/
+
+static qboolean TraceTriangleBlocks( int firstBlock, int numItems, vec3_t origin, vec3_t direction, float coplanarEpsilon, trace_t *trace )
+{
+	int				b, j, numBlocks;
+	qboolean		hit;
+	traceBlock_t	*block;
+	traceTriangle_t	*tt;
+#if defined( TRACE_SIMD )
+	int				mask;
+	float			u[ TRACE_BLOCK_LANES ], v[ TRACE_BLOCK_LANES ], depth[ TRACE_BLOCK_LANES ];
+	traceBlockRay_t	ray;
+	traceInfo_t		*ti;
 	
-	/* create the raytracing bsp */
-	if( loMem == qfalse )
+	
+	/* broadcast the ray */
+	for( j = 0; j < 3; j++ )
 	{
-		SubdivideTraceNode_r( headNodeNum, 0 );
-		if( loMemSky == qfalse )
-			SubdivideTraceNode_r( skyboxNodeNum, 0 );
+		ray.origin[ j ] = SimdSet1( origin[ j ] );
+		ray.direction[ j ] = SimdSet1( direction[ j ] );
 	}
+	ray.inhibitRadius = SimdSet1( trace->inhibitRadius );
+	ray.distance = SimdSet1( trace->distance );
+	ray.coplanarEpsilon = SimdSet1( coplanarEpsilon );
 	
-	/* create triangles from the trace windings */
-	TriangulateTraceNode_r( headNodeNum );
-	TriangulateTraceNode_r( skyboxNodeNum );
+	/* test whole blocks, then apply the hits lane by lane */
+	hit = qfalse;
+	numBlocks = (numItems + TRACE_BLOCK_LANES - 1) / TRACE_BLOCK_LANES;
+	for( b = 0; b < numBlocks; b++ )
+	{
+		block = &traceBlocks[ firstBlock + b ];
+		mask = TraceBlock( block, &ray, u, v, depth );
+		for( j = 0; mask != 0; j++, mask >>= 1 )
+		{
+			if( !(mask & 1) || !(block->castGroups[ j ] & (trace->recvGroups | trace->selfGroups)) || depth[ j ] >= trace->distance )
+				continue;
+			tt = &traceTriangles[ block->items[ j ] ];
+			ti = &traceInfos[ tt->infoNum ];
+			if( TraceTriangleShadows( ti, trace ) && TraceTriangleHit( ti, tt, trace, u[ j ], v[ j ], depth[ j ] ) )
+			{
+				if( !traceNearest )
+					return qtrue;
+				ray.distance = SimdSet1( trace->distance );
+				hit = qtrue;
+			}
+		}
+	}
+#else
 	
-	/* emit some stats */
-	//%	Sys_FPrintf( SYS_VRB, "%9d original triangles\n", numOriginalTriangles );
-	Sys_Printf( "%9d trace windings (%.2fMB)\n", numTraceWindings, (float) (numTraceWindings * sizeof( *traceWindings )) / (1024.0f * 1024.0f) );
-	Sys_Printf( "%9d trace triangles (%.2fMB)\n", numTraceTriangles, (float) (numTraceTriangles * sizeof( *traceTriangles )) / (1024.0f * 1024.0f) );
-	Sys_Printf( "%9d trace nodes (%.2fMB)\n", numTraceNodes, (float) (numTraceNodes * sizeof( *traceNodes )) / (1024.0f * 1024.0f) );
-	Sys_Printf( "%9d leaf nodes (%.2fMB)\n", numTraceLeafNodes, (float) (numTraceLeafNodes * sizeof( *traceNodes )) / (1024.0f * 1024.0f) );
-	//%	Sys_FPrintf( SYS_VRB, "%9d average triangles per leaf node\n", numTraceTriangles / numTraceLeafNodes );
-	Sys_FPrintf( SYS_VRB, "%9d average windings per leaf node\n", numTraceWindings / (numTraceLeafNodes + 1) );
-	Sys_FPrintf( SYS_VRB, "%9d max trace depth\n", maxTraceDepth );
 	
-	/* free trace windings */
-	free( traceWindings );
-	numTraceWindings = 0;
-	maxTraceWindings = 0;
-	deadWinding = -1;
+	/* scalar fallback */
+	hit = qfalse;
+	numBlocks = (numItems + TRACE_BLOCK_LANES - 1) / TRACE_BLOCK_LANES;
+	for( b = 0; b < numBlocks; b++ )
+	{
+		block = &traceBlocks[ firstBlock + b ];
+		for( j = 0; j < TRACE_BLOCK_LANES && b * TRACE_BLOCK_LANES + j < numItems; j++ )
+		{
+			tt = &traceTriangles[ block->items[ j ] ];
+			if( TraceTriangleRay( &traceInfos[ tt->infoNum ], tt, origin, direction, coplanarEpsilon, trace ) )
+			{
+				if( !traceNearest )
+					return qtrue;
+				hit = qtrue;
+			}
+		}
+	}
+#endif
 	
-	/* debug code: write out trace triangles to an alias obj file */
-	#if 0
+	return hit;
+}
+
+
+
+/*
+TraceNodes()
+walks the trace nodes below nodeNum front to back along origin -> end with a small stack,
+stopping at the first solid leaf (noted as passSolid, like TraceLine_r() did for the world and
+skybox walks); triangle walks test each leaf's triangles as soon as it is reached
+returns qtrue if something is hit and tracing can stop
+*/
+
+typedef struct traceStack_s
+{
+	int					nodeNum;
+	vec3_t				origin, end;
+}
+traceStack_t;
+
+static qboolean TraceNodes( int nodeNum, vec3_t origin, vec3_t end, trace_t *trace, qboolean testTriangles )
+{
+	traceNode_t			*node;
+	int					side, numStack;
+	float				front, back, frac;
+	vec3_t				start, stop, mid;
+	traceStack_t		stack[ MAX_TRACE_STACK ];
+
+	
+	/* walk the tree */
+	VectorCopy( origin, start );
+	VectorCopy( end, stop );
+	numStack = 0;
+	while( 1 )
 	{
-		int				i, j;
-		FILE			*file;
-		char			filename[ MAX_OS_PATH ];
-		traceWinding_t	*tw;
+		/* bogus node number means solid, end tracing */
+		if( nodeNum < 0 || traceNodes[ nodeNum ].type == TRACE_LEAF_SOLID )
+		{
+			VectorCopy( start, trace->hit );
+			trace->passSolid = qtrue;
+			return qtrue;
+		}
 		
+		/* get node */
+		node = &traceNodes[ nodeNum ];
 		
-		/* open the file */
-		strcpy( filename, source );
-		StripExtension( filename );
-		strcat( filename, ".lin" );
-		Sys_Printf( "Opening light trace file %s...\n", filename );
-		file = fopen( filename, "w" );
-		if( file == NULL )
-			Error( "Error opening %s for writing", filename );
+		/* leafnode: test its triangles */
+		if( node->type < 0 )
+		{
+			if( testTriangles && node->numItems > 0 &&
+				TraceTriangleBlocks( node->firstBlock, node->numItems, trace->origin, trace->direction, COPLANAR_EPSILON, trace ) )
+				return qtrue;
+		}
 		
-		/* walk node list */
-		for( i = 0; i < numTraceWindings; i++ )
+		/* ydnar 2003-09-07: don't test branches of the bsp with nothing in them when testall is enabled */
+		else if( !trace->testAll || node->numItems > 0 )
 		{
-			tw = &traceWindings[ i ];
-			for( j = 0; j < tw->numVerts + 1; j++ )
-				fprintf( file, "%f %f %f\n",
-					tw->v[ j % tw->numVerts ].xyz[ 0 ], tw->v[ j % tw->numVerts ].xyz[ 1 ], tw->v[ j % tw->numVerts ].xyz[ 2 ] );
+			/* classify beginning and end points */
+			switch( node->type )
+			{
+				case PLANE_X:
+					front = start[ 0 ] - node->plane[ 3 ];
+					back = stop[ 0 ] - node->plane[ 3 ];
+					break;
+				
+				case PLANE_Y:
+					front = start[ 1 ] - node->plane[ 3 ];
+					back = stop[ 1 ] - node->plane[ 3 ];
+					break;
+				
+				case PLANE_Z:
+					front = start[ 2 ] - node->plane[ 3 ];
+					back = stop[ 2 ] - node->plane[ 3 ];
+					break;
+				
+				default:
+					front = DotProduct( start, node->plane ) - node->plane[ 3 ];
+					back = DotProduct( stop, node->plane ) - node->plane[ 3 ];
+					break;
+			}
+			
+			/* entirely in front side? */
+			if( front >= -TRACE_ON_EPSILON && back >= -TRACE_ON_EPSILON )
+			{
+				nodeNum = node->children[ 0 ];
+				continue;
+			}
+			
+			/* entirely on back side? */
+			if( front < TRACE_ON_EPSILON && back < TRACE_ON_EPSILON )
+			{
+				nodeNum = node->children[ 1 ];
+				continue;
+			}
+			
+			/* select side */
+			side = front < 0;
+			
+			/* calculate intercept point */
+			frac = front / (front - back);
+			mid[ 0 ] = start[ 0 ] + (stop[ 0 ] - start[ 0 ]) * frac;
+			mid[ 1 ] = start[ 1 ] + (stop[ 1 ] - start[ 1 ]) * frac;
+			mid[ 2 ] = start[ 2 ] + (stop[ 2 ] - start[ 2 ]) * frac;
+			
+			/* trace first side now and the other side later */
+			if( numStack < MAX_TRACE_STACK )
+			{
+				stack[ numStack ].nodeNum = node->children[ !side ];
+				VectorCopy( mid, stack[ numStack ].origin );
+				VectorCopy( stop, stack[ numStack ].end );
+				numStack++;
+				nodeNum = node->children[ side ];
+				VectorCopy( mid, stop );
+				continue;
+			}
+			
+			/* out of stack, recurse into the first side */
+			if( TraceNodes( node->children[ side ], start, mid, trace, testTriangles ) )
+				return qtrue;
+			nodeNum = node->children[ !side ];
+			VectorCopy( mid, start );
+			continue;
 		}
 		
-		/* close it */
-		fclose( file );
+		/* pop */
+		if( numStack == 0 )
+			return qfalse;
+		numStack--;
+		nodeNum = stack[ numStack ].nodeNum;
+		VectorCopy( stack[ numStack ].origin, start );
+		VectorCopy( stack[ numStack ].end, stop );
 	}
-	#endif
 }
 
 
 
-/* -------------------------------------------------------------------------------
+/*
+TraceBVHBox()
+slab test of a ray segment against a bvh node, returns the entry distance or -1 on a miss
+*/
+
+static float TraceBVHBox( traceBVHNode_t *node, vec3_t origin, vec3_t invDir, float distance )
+{
+	int		i;
+	float	t0, t1, temp, tMin, tMax;
+	
+	
+	tMin = 0.0f;
+	tMax = distance;
+	for( i = 0; i < 3; i++ )
+	{
+		t0 = (node->mins[ i ] - origin[ i ]) * invDir[ i ];
+		t1 = (node->maxs[ i ] - origin[ i ]) * invDir[ i ];
+		if( t0 > t1 )
+		{
+			temp = t0;
+			t0 = t1;
+			t1 = temp;
+		}
+		if( t0 > tMin )
+			tMin = t0;
+		if( t1 < tMax )
+			tMax = t1;
+		if( tMin > tMax )
+			return -1.0f;
+	}
+	return tMin;
+}
 
-raytracer
 
-------------------------------------------------------------------------------- */
 
 /*
-TraceTriangle()
-based on code written by william 'spog' joseph
-based on code originally written by tomas moller and ben trumbore, journal of graphics tools, 2(1):21-28, 1997
+TraceBVHNodes()
+walks the bvh below rootNode front to back along a ray in its space, testing leaf triangles as
+they are reached; leafs of the instance bvh trace each instance's model bvh in model space
+shadow rays stop at the first opaque hit, nearest hit traces keep walking the nodes that start
+before their clipped distance
+returns qtrue if something opaque is hit
 */
 
-#define BARY_EPSILON			0.01f
-#define ASLF_EPSILON			0.0001f	/* so to not get double shadows */
-#define COPLANAR_EPSILON		0.25f	//%	0.000001f
-#define SELF_SHADOW_EPSILON		0.5f
+static qboolean TraceInstance( traceInstance_t *inst, trace_t *trace );
 
-qboolean TraceTriangle( traceInfo_t *ti, traceTriangle_t *tt, trace_t *trace )
+static qboolean TraceBVHNodes( int rootNode, vec3_t origin, vec3_t direction, float coplanarEpsilon, trace_t *trace )
 {
-	int				i;
-	double			tvec[ 3 ], pvec[ 3 ], qvec[ 3 ];
-	double			det, invDet, depth;
-	double			u, v, w, s, t;
-	int				is, it;
-	byte			*pixel;
-	double			shadow;
-	shaderInfo_t	*si;
+	int				i, nodeNum, near, far, stack[ MAX_BVH_STACK ], numStack;
+	int				dirNeg[ 3 ];
+	float			tNear[ 2 ], stackNear[ MAX_BVH_STACK ];
+	vec3_t			invDir;
+	traceBVHNode_t	*node;
+	qboolean		hit;
 	
-	/* don't double-trace against sky */
-	si = ti->si;
-	if( trace->compileFlags & si->compileFlags & C_SKY )
+	
+	/* setup ray */
+	for( i = 0; i < 3; i++ )
+	{
+		if( direction[ i ] != 0.0f )
+			invDir[ i ] = 1.0f / direction[ i ];
+		else
+			invDir[ i ] = 1e30f;
+		dirNeg[ i ] = invDir[ i ] < 0.0f;
+	}
+	if( TraceBVHBox( &bvhNodes[ rootNode ], origin, invDir, trace->distance ) < 0.0f )
 		return qfalse;
-
-	/* _rs = 1 */
-	/* receive shadows from worldspawn group only */
-	if( trace->recvShadows == 1 )
+	
+	/* walk the tree */
+	hit = qfalse;
+	numStack = 0;
+	nodeNum = rootNode;
+	while( 1 )
 	{
-		if( ti->castShadows != 1 )
+		node = &bvhNodes[ nodeNum ];
+		
+		/* leaf: test its triangles or instances */
+		if( node->numItems > 0 )
 		{
-			/* vortex: do self shadow for (_rs 1 _cs 0) */
-			if( ti->castShadows == 0 )
+			if( nodeNum < numTriangleBVHNodes )
 			{
-				if (trace->forceSelfShadow == qtrue)
-					if( trace->entityNum == ti->entityNum )
-						goto skipShadowGroups;
-				for( i = 0; i < trace->numSurfaces; i++ )
-					if( ti->surfaceNum == trace->surfaces[ i ] )
-						goto skipShadowGroups;
+				if( TraceTriangleBlocks( node->first, node->numItems, origin, direction, coplanarEpsilon, trace ) )
+				{
+					if( !traceNearest )
+						return qtrue;
+					hit = qtrue;
+				}
+			}
+			else
+			{
+				for( i = node->first; i < node->first + node->numItems; i++ )
+				{
+					if( TraceInstance( &traceInstances[ i ], trace ) )
+					{
+						if( !traceNearest )
+							return qtrue;
+						hit = qtrue;
+					}
+				}
 			}
-			return qfalse;
 		}
+		
+		/* inner node: visit the child on the ray's near side first */
+		else
+		{
+			near = node->first + dirNeg[ node->axis ];
+			far = node->first + 1 - dirNeg[ node->axis ];
+			tNear[ 0 ] = TraceBVHBox( &bvhNodes[ near ], origin, invDir, trace->distance );
+			tNear[ 1 ] = TraceBVHBox( &bvhNodes[ far ], origin, invDir, trace->distance );
+			if( tNear[ 0 ] >= 0.0f )
+			{
+				if( tNear[ 1 ] >= 0.0f )
+				{
+					stackNear[ numStack ] = tNear[ 1 ];
+					stack[ numStack++ ] = far;
+				}
+				nodeNum = near;
+				continue;
+			}
+			if( tNear[ 1 ] >= 0.0f )
+			{
+				nodeNum = far;
+				continue;
+			}
+		}
+		
+		/* pop, skipping nodes behind a nearer hit */
+		while( numStack > 0 && stackNear[ numStack - 1 ] > trace->distance )
+			numStack--;
+		if( numStack == 0 )
+			break;
+		nodeNum = stack[ --numStack ];
 	}
-	/* _rs > 1 */
-	/* receive shadows from same group and worldspawn group */
-	else if( trace->recvShadows > 1 )
-	{
-		/* _cs != 1 and abs(_cs) should match */
-		if( ti->castShadows != 1 && abs( ti->castShadows ) != abs( trace->recvShadows ) )
-			return qfalse;
-		//%	Sys_Printf( "%d:%d ", tt->castShadows, trace->recvShadows );
-	}
-	/* rs <= 1 */
-	/* receive shadows from the same group only (< 0) */
-	else
-	{
-		/* abs (_cs) should match */
-		if( abs( ti->castShadows ) != abs( trace->recvShadows ) )
-			return qfalse;
-	}
-skipShadowGroups:
+	
+	return hit;
+}
 
-	/* begin calculating determinant - also used to calculate u parameter */
-	CrossProduct( trace->direction, tt->edge2, pvec );
+
+
+/*
+TraceInstance()
+traces a model instance by moving the ray into model space
+*/
+
+static qboolean TraceInstance( traceInstance_t *inst, trace_t *trace )
+{
+	qboolean		r;
+	vec3_t			origin, direction;
 	
-	/* if determinant is near zero, trace lies in plane of triangle */
-	det = DotProduct( tt->edge1, pvec );
 	
-	/* the non-culling branch */
-	if( fabs( det ) < COPLANAR_EPSILON )
+	VectorCopy( trace->origin, origin );
+	m4x4_transform_point( inst->inverse, origin );
+	VectorCopy( trace->direction, direction );
+	m4x4_transform_normal( inst->inverse, direction );
+	traceInstanceNum = inst - traceInstances;
+	r = TraceBVHNodes( inst->rootNode, origin, direction, COPLANAR_EPSILON * inst->coplanarScale, trace );
+	traceInstanceNum = -1;
+	return r;
+}
+
+
+
+/*
+TraceBVH()
+TraceInstances()
+trace the world triangle bvh (-bvh) and the model instances
+*/
+
+static qboolean TraceBVH( trace_t *trace )
+{
+	if( numWorldBVHItems <= 0 )
 		return qfalse;
-	invDet = 1.0f / det;
+	return TraceBVHNodes( 0, trace->origin, trace->direction, COPLANAR_EPSILON, trace );
+}
 
-	/* calculate distance from first vertex to ray origin */
-	VectorSubtract( trace->origin, tt->v[ 0 ].xyz, tvec );
-	
-	/* calculate u parameter and test bounds */
-	u = DotProduct( tvec, pvec ) * invDet;
-	if( u < -BARY_EPSILON || u > (1.0f + BARY_EPSILON) )
+static qboolean TraceInstances( trace_t *trace )
+{
+	if( instanceRootNode < 0 )
 		return qfalse;
+	return TraceBVHNodes( instanceRootNode, trace->origin, trace->direction, COPLANAR_EPSILON, trace );
+}
+
+
+
+/*
+TraceLineBegin()
+sets up the output, runs the early outs and the solid test of TraceLine()
+returns qtrue if the trace still has triangles to test
+*/
+
+static qboolean TraceLineBegin( trace_t *trace )
+{
+	/* setup output (note: this code assumes the input data is completely filled out) */
+	trace->passSolid = qfalse;
+	trace->opaque = qfalse;
+	trace->hitSurfaceNum = -1;
+	trace->compileFlags = 0;
+	trace->testSkybox = qfalse;
+	trace->skyLightShader = NULL;
 	
-	/* prepare to test v parameter */
-	CrossProduct( tvec, tt->edge1, qvec );
-	
-	/* calculate v parameter and test bounds */
-	v = DotProduct( trace->direction, qvec ) * invDet;
-	if( v < -BARY_EPSILON || (u + v) > (1.0f + BARY_EPSILON) )
+	/* early outs */
+	if( !trace->recvShadows || !trace->testOcclusion || trace->distance <= 0.00001f )
 		return qfalse;
 	
-	/* calculate t (depth) */
-	depth = DotProduct( tt->edge2, qvec ) * invDet;
-	if( depth < trace->inhibitRadius || depth >= trace->distance )
-		return qfalse;
+	/* shadow group masks */
+	TraceShadowGroups( trace );
 	
-	/* if hitpoint is really close to trace origin (sample point), then check for self-shadowing */
-	if( depth <= SELF_SHADOW_EPSILON )
+	/* count rays in per-thread blocks */
+	if( ++numTraceRays >= TRACE_RAY_BLOCK )
 	{
-		/* don't self-shadow */
-		for( i = 0; i < trace->numSurfaces; i++ )
-			if( ti->surfaceNum == trace->surfaces[ i ] )
-				return qfalse;
+		ThreadAtomicAdd( &numTraceRayBlocks, 1 );
+		numTraceRays = 0;
 	}
 
-	/* check for occlusionBias */
-	if( depth <= trace->occlusionBias )
-		return qfalse;
-	
-	/* stack compile flags */
-	trace->compileFlags |= si->compileFlags;
-	
-	/* don't trace against sky */
-	if( si->compileFlags & C_SKY )
+	/* trace through nodes, only looking for solid */
+	TraceNodes( headNodeNum, trace->origin, trace->end, trace, qfalse );
+	if( trace->passSolid && !trace->testAll )
 	{
-		/* vortex: save skylight shader we hit */
-		if( si->skyLightValue )
-			trace->skyLightShader = si;
+		trace->opaque = qtrue;
 		return qfalse;
 	}
 	
-	/* try to avoid double shadows near triangle seams */
-	if( u < -ASLF_EPSILON || u > (1.0f + ASLF_EPSILON) ||
-		v < -ASLF_EPSILON || (u + v) > (1.0f + ASLF_EPSILON) )
+	/* skip surfaces? */
+	if( noSurfaces )
 		return qfalse;
-
-	/* most surfaces are completely opaque */
-	if( !(si->compileFlags & (C_ALPHASHADOW | C_LIGHTFILTER)) || si->lightImage == NULL || si->lightImage->pixels == NULL )
-	{
-		VectorMA( trace->origin, depth, trace->direction, trace->hit );
-		VectorClear( trace->color );
-		trace->opaque = qtrue;
-		return qtrue;
-	}
 	
-	/* calculate w parameter */
-	w = 1.0f - (u + v);
+	/* testall means trace through sky */	
+	if (trace->testAll && trace->compileFlags & C_SKY && (trace->numSurfaces == 0 || surfaceInfos[ trace->surfaces[ 0 ] ].childSurfaceNum < 0) )
+		trace->testSkybox = qtrue;
 	
-	/* calculate st from uvw (barycentric) coordinates */
-	s = w * tt->v[ 0 ].st[ 0 ] + u * tt->v[ 1 ].st[ 0 ] + v * tt->v[ 2 ].st[ 0 ];
-	t = w * tt->v[ 0 ].st[ 1 ] + u * tt->v[ 1 ].st[ 1 ] + v * tt->v[ 2 ].st[ 1 ];
-	s = s - floor( s );
-	t = t - floor( t );
-	is = max(0, min(s * si->lightImage->width, si->lightImage->width - 1)); // vortex: added min here because somehow it may get out of texture bounds
-	it = max(0, min(t * si->lightImage->height, si->lightImage->height - 1));
+	return qtrue;
+}
 
-	/* get pixel */
-	pixel = si->lightImage->pixels + 4 * (it * si->lightImage->width + is);
-	
-	/* ydnar: color filter */
-	if( si->compileFlags & C_LIGHTFILTER )
-	{
-		/* filter by texture color */
-		trace->color[ 0 ] *= ((1.0f / 255.0f) * pixel[ 0 ]);
-		trace->color[ 1 ] *= ((1.0f / 255.0f) * pixel[ 1 ]);
-		trace->color[ 2 ] *= ((1.0f / 255.0f) * pixel[ 2 ]);
-	}
-	
-	/* ydnar: alpha filter */
-	if( si->compileFlags & C_ALPHASHADOW )
+
+
+/*
+TraceNodeTriangles()
+walks the trace nodes again (up to the solid hit) testing leaf triangles, then the skybox nodes
+returns qtrue if something opaque is hit and tracing can stop
+*/
+
+static qboolean TraceNodeTriangles( trace_t *trace )
+{
+	/* world triangles are in the bvh with -bvh */
+	if( !traceBVH )
 	{
-		/* filter by inverse texture alpha */
-		shadow = (1.0f / 255.0f) * (255 - pixel[ 3 ]);
-		trace->color[ 0 ] *= shadow;
-		trace->color[ 1 ] *= shadow;
-		trace->color[ 2 ] *= shadow;
+		TraceNodes( headNodeNum, trace->origin, trace->end, trace, qtrue );
+		if( trace->opaque )
+			return qtrue;
 	}
 	
-	/* check filter for opaque */
-	if( trace->color[ 0 ] <= 0.001f && trace->color[ 1 ] <= 0.001f && trace->color[ 2 ] <= 0.001f )
+	/* skybox */
+	if( trace->testSkybox )
 	{
-		VectorMA( trace->origin, depth, trace->direction, trace->hit );
-		trace->opaque = qtrue;
-		return qtrue;
+		TraceNodes( skyboxNodeNum, trace->origin, trace->end, trace, qtrue );
+		if( trace->opaque )
+			return qtrue;
 	}
 	
-	/* continue tracing */
+	/* nothing opaque */
 	return qfalse;
 }
 
+
+
 /*
-TraceLine_r()
-returns qtrue if something is hit and tracing can stop
+TraceLineTriangles()
+tests the world triangles (bvh or test nodes) and then the model instances; nearest hit traces
+test the instances up to the world hit, so a model in front of it still wins
 */
 
-static qboolean TraceLine_r( int nodeNum, vec3_t origin, vec3_t end, trace_t *trace )
+static void TraceLineTriangles( trace_t *trace )
 {
-	traceNode_t		*node;
-	int				side;
-	float			front, back, frac;
-	vec3_t			mid;
-	qboolean		r;
+	if( ((traceBVH && TraceBVH( trace )) || TraceNodeTriangles( trace )) && !traceNearest )
+		return;
+	TraceInstances( trace );
+}
+
+
+
+/*
+TraceLine() - ydnar
+rewrote this function a bit :)
+*/
+
+void TraceLine( trace_t *trace )
+{
+	/* setup, early outs and solid test */
+	traceNearest = qtrue;
+	if( !TraceLineBegin( trace ) )
+		return;
+
+	/* test triangles */
+	TraceLineTriangles( trace );
+}
+
+
+
+/*
+TraceOccluder()
+retests the triangle that last blocked a light on this thread, the trace is only changed on a hit
+*/
+
+static traceOccluder_t *OccluderForLight( light_t *light )
+{
+	return &traceOccluders[ ((size_t) light / sizeof( light_t )) % OCCLUDER_CACHE_SIZE ];
+}
 
+static qboolean TraceOccluder( trace_t *trace )
+{
+	int					compileFlags;
+	qboolean			r;
+	vec3_t				origin, direction;
+	traceOccluder_t		*occluder;
+	traceTriangle_t		*tt;
+	traceInstance_t		*inst;
 	
-	/* bogus node number means solid, end tracing unless testing all */
-	if( nodeNum < 0 )
+	
+	/* count in per-thread blocks */
+	if( ++numOccluderTests >= TRACE_RAY_BLOCK )
 	{
-		VectorCopy( origin, trace->hit );
-		trace->passSolid = qtrue;
-		return qtrue;
+		ThreadAtomicAdd( &numOccluderTestBlocks, 1 );
+		numOccluderTests = 0;
 	}
 	
-	/* get node */
-	node = &traceNodes[ nodeNum ];
+	/* anything cached for this light? */
+	occluder = OccluderForLight( trace->light );
+	if( occluder->light != trace->light || trace->light == NULL )
+		return qfalse;
 	
-	/* solid? */
-	if( node->type == TRACE_LEAF_SOLID )
+	/* test it (instanced triangles in model space) */
+	tt = &traceTriangles[ occluder->triangleNum ];
+	compileFlags = trace->compileFlags;
+	if( occluder->instanceNum >= 0 )
 	{
-		VectorCopy( origin, trace->hit );
-		trace->passSolid = qtrue;
-		return qtrue;
+		inst = &traceInstances[ occluder->instanceNum ];
+		VectorCopy( trace->origin, origin );
+		m4x4_transform_point( inst->inverse, origin );
+		VectorCopy( trace->direction, direction );
+		m4x4_transform_normal( inst->inverse, direction );
+		r = TraceTriangleRay( &traceInfos[ tt->infoNum ], tt, origin, direction, COPLANAR_EPSILON * inst->coplanarScale, trace );
 	}
-	
-	/* leafnode? */
-	if( node->type < 0 )
+	else
+		r = TraceTriangleRay( &traceInfos[ tt->infoNum ], tt, trace->origin, trace->direction, COPLANAR_EPSILON, trace );
+	if( !r )
 	{
-		/* note leaf and return */	
-		if( node->numItems > 0 && trace->numTestNodes < MAX_TRACE_TEST_NODES )
-			trace->testNodes[ trace->numTestNodes++ ] = nodeNum;
+		trace->compileFlags = compileFlags;
 		return qfalse;
 	}
 	
-	/* ydnar 2003-09-07: don't test branches of the bsp with nothing in them when testall is enabled */
-	if( trace->testAll && node->numItems == 0 )
-		return qfalse;
-	
-	/* classify beginning and end points */
-	switch( node->type )
+	/* hit */
+	if( ++numOccluderHits >= TRACE_RAY_BLOCK )
 	{
-		case PLANE_X:
-			front = origin[ 0 ] - node->plane[ 3 ];
-			back = end[ 0 ] - node->plane[ 3 ];
-			break;
-		
-		case PLANE_Y:
-			front = origin[ 1 ] - node->plane[ 3 ];
-			back = end[ 1 ] - node->plane[ 3 ];
-			break;
-		
-		case PLANE_Z:
-			front = origin[ 2 ] - node->plane[ 3 ];
-			back = end[ 2 ] - node->plane[ 3 ];
-			break;
-		
-		default:
-			front = DotProduct( origin, node->plane ) - node->plane[ 3 ];
-			back = DotProduct( end, node->plane ) - node->plane[ 3 ];
-			break;
+		ThreadAtomicAdd( &numOccluderHitBlocks, 1 );
+		numOccluderHits = 0;
 	}
+	return qtrue;
+}
+
+
+
+/*
+StoreOccluder()
+remembers the last opaque triangle hit on this thread as the light's occluder
+*/
+
+static void StoreOccluder( trace_t *trace )
+{
+	traceOccluder_t		*occluder;
 	
-	/* entirely in front side? */
-	if( front >= -TRACE_ON_EPSILON && back >= -TRACE_ON_EPSILON )
-		return TraceLine_r( node->children[ 0 ], origin, end, trace );
-	
-	/* entirely on back side? */
-	if( front < TRACE_ON_EPSILON && back < TRACE_ON_EPSILON )
-		return TraceLine_r( node->children[ 1 ], origin, end, trace );
-	
-	/* select side */
-	side = front < 0;
 	
-	/* calculate intercept point */
-	frac = front / (front - back);
-	mid[ 0 ] = origin[ 0 ] + (end[ 0 ] - origin[ 0 ]) * frac;
-	mid[ 1 ] = origin[ 1 ] + (end[ 1 ] - origin[ 1 ]) * frac;
-	mid[ 2 ] = origin[ 2 ] + (end[ 2 ] - origin[ 2 ]) * frac;
+	if( traceHitTriangle < 0 || trace->light == NULL )
+		return;
+	occluder = OccluderForLight( trace->light );
+	occluder->light = trace->light;
+	occluder->triangleNum = traceHitTriangle;
+	occluder->instanceNum = traceHitInstance;
+}
+
+
+
+/*
+TraceLineShadow()
+TraceLine() for shadow rays towards trace->light, where only passSolid and opaque matter; the
+triangle that last blocked the light on this thread is tested before the full trace
+*/
+
+void TraceLineShadow( trace_t *trace )
+{
+	/* setup, early outs and solid test */
+	traceNearest = qfalse;
+	if( !TraceLineBegin( trace ) )
+		return;
 	
-	/* fixme: check inhibit radius, then solid nodes and ignore */
+	/* last occluder */
+	if( TraceOccluder( trace ) )
+		return;
 	
-	/* set trace hit here */
-	//%	VectorCopy( mid, trace->hit );
+	/* test triangles */
+	traceHitTriangle = -1;
+	TraceLineTriangles( trace );
+	if( trace->opaque )
+		StoreOccluder( trace );
+}
+
+
+
+/*
+LoadPacketRay()
+StorePacketRay()
+moves the per-ray state of a packet ray in and out of the shared trace
+*/
+
+static void LoadPacketRay( trace_t *trace, tracePacket_t *packet, int r )
+{
+	VectorCopy( packet->origin[ r ], trace->origin );
+	VectorCopy( packet->end[ r ], trace->end );
+	VectorCopy( packet->direction[ r ], trace->direction );
+	trace->distance = packet->distance[ r ];
+	VectorCopy( packet->color[ r ], trace->color );
+	VectorCopy( packet->hit[ r ], trace->hit );
+	trace->compileFlags = packet->compileFlags[ r ];
+	trace->passSolid = packet->passSolid[ r ];
+	trace->opaque = packet->opaque[ r ];
+	trace->hitSurfaceNum = packet->hitSurfaceNum[ r ];
+	trace->skyLightShader = packet->skyLightShader[ r ];
+}
+
+static void StorePacketRay( trace_t *trace, tracePacket_t *packet, int r )
+{
+	VectorCopy( trace->direction, packet->direction[ r ] );
+	packet->distance[ r ] = trace->distance;
+	VectorCopy( trace->color, packet->color[ r ] );
+	VectorCopy( trace->hit, packet->hit[ r ] );
+	packet->compileFlags[ r ] = trace->compileFlags;
+	packet->passSolid[ r ] = trace->passSolid;
+	packet->opaque[ r ] = trace->opaque;
+	packet->hitSurfaceNum[ r ] = trace->hitSurfaceNum;
+	packet->skyLightShader[ r ] = trace->skyLightShader;
+}
+
+
+
+/*
+AddTracePacketRay()
+queues the ray from trace->origin to trace->end, starting with trace->color
+*/
+
+void AddTracePacketRay( tracePacket_t *packet, trace_t *trace, int user )
+{
+	int		r;
 	
-	/* trace first side */
-	r = TraceLine_r( node->children[ side ], origin, mid, trace );
-	if( r )
-		return r;
 	
-	/* trace other side */
-	return TraceLine_r( node->children[ !side ], mid, end, trace );
+	if( packet->numRays >= MAX_PACKET_RAYS )
+		Error( "AddTracePacketRay: MAX_PACKET_RAYS (%d) exceeded", MAX_PACKET_RAYS );
+	r = packet->numRays++;
+	VectorCopy( trace->origin, packet->origin[ r ] );
+	VectorCopy( trace->end, packet->end[ r ] );
+	VectorCopy( trace->color, packet->color[ r ] );
+	packet->user[ r ] = user;
 }
 
 
 
 /*
-TraceLine() - ydnar
-rewrote this function a bit :)
+TraceBVHPacket()
+walks the bvh once for all rays in mask, each node keeps the subset of rays that hit its box;
+shadow rays drop out at their first opaque hit, nearest hit rays carry on with their clipped distance
 */
 
-void TraceLine( trace_t *trace )
+static void TraceBVHPacket( trace_t *trace, tracePacket_t *packet, int mask )
 {
-	int				i, j;
-	traceNode_t		*node;
-	traceTriangle_t	*tt;
-	traceInfo_t		*ti;
+	int				i, r, first, nodeNum, near, far, nearMask, farMask, live, numStack;
+	int				stack[ MAX_BVH_STACK ], stackMask[ MAX_BVH_STACK ], dirNeg[ 3 ];
+	vec3_t			invDir[ MAX_PACKET_RAYS ];
+	traceBVHNode_t	*node;
 	
-	/* setup output (note: this code assumes the input data is completely filled out) */
-	trace->passSolid = qfalse;
-	trace->opaque = qfalse;
-	trace->compileFlags = 0;
-	trace->numTestNodes = 0;
-	trace->skyLightShader = NULL;
 	
-	/* early outs */
-	if( !trace->recvShadows || !trace->testOcclusion || trace->distance <= 0.00001f )
+	/* dummy check */
+	if( numWorldBVHItems <= 0 )
 		return;
-
-	/* trace through nodes */
-	TraceLine_r( headNodeNum, trace->origin, trace->end, trace );
-	if( trace->passSolid && !trace->testAll )
+	
+	/* rays that diverge from the first one are traced alone */
+	for( first = 0; !(mask & (1 << first)); first++ );
+	for( r = first + 1; r < packet->numRays; r++ )
 	{
-		trace->opaque = qtrue;
-		return;
+		if( !(mask & (1 << r)) || DotProduct( packet->direction[ r ], packet->direction[ first ] ) >= TRACE_PACKET_COHERENCE )
+			continue;
+		LoadPacketRay( trace, packet, r );
+		TraceBVH( trace );
+		StorePacketRay( trace, packet, r );
+		mask &= ~(1 << r);
 	}
 	
-	/* skip surfaces? */
-	if( noSurfaces )
-		return;
+	/* setup rays, the first ray decides the child order */
+	for( r = first; r < packet->numRays; r++ )
+	{
+		for( i = 0; i < 3; i++ )
+			invDir[ r ][ i ] = packet->direction[ r ][ i ] != 0.0f ? 1.0f / packet->direction[ r ][ i ] : 1e30f;
+	}
+	for( i = 0; i < 3; i++ )
+		dirNeg[ i ] = packet->direction[ first ][ i ] < 0.0f;
+	live = mask;
+	for( r = first; r < packet->numRays; r++ )
+	{
+		if( (mask & (1 << r)) && TraceBVHBox( &bvhNodes[ 0 ], packet->origin[ r ], invDir[ r ], packet->distance[ r ] ) < 0.0f )
+			mask &= ~(1 << r);
+	}
 	
-	/* testall means trace through sky */	
-	if (trace->testAll && trace->numTestNodes < MAX_TRACE_TEST_NODES && trace->compileFlags & C_SKY && (trace->numSurfaces == 0 || surfaceInfos[ trace->surfaces[ 0 ] ].childSurfaceNum < 0) )
-		TraceLine_r( skyboxNodeNum, trace->origin, trace->end, trace );
-
-	/* walk node list */
-	for( i = 0; i < trace->numTestNodes; i++ )
+	/* walk the tree */
+	numStack = 0;
+	nodeNum = 0;
+	while( mask )
 	{
-		/* get node */
-		node = &traceNodes[ trace->testNodes[ i ] ];
+		node = &bvhNodes[ nodeNum ];
 		
-		/* walk node item list */
-		for( j = 0; j < node->numItems; j++ )
+		/* leaf: test its triangles against each ray that reached it */
+		if( node->numItems > 0 )
 		{
-			tt = &traceTriangles[ node->items[ j ] ];
-			ti = &traceInfos[ tt->infoNum ];
-			if( TraceTriangle( ti, tt, trace ) )
-				return;
+			for( r = first; r < packet->numRays; r++ )
+			{
+				if( !(mask & (1 << r)) )
+					continue;
+				LoadPacketRay( trace, packet, r );
+				if( TraceTriangleBlocks( node->first, node->numItems, trace->origin, trace->direction, COPLANAR_EPSILON, trace ) && !traceNearest )
+					live &= ~(1 << r);
+				StorePacketRay( trace, packet, r );
+			}
+		}
+		
+		/* inner node: split the rays between the children */
+		else
+		{
+			near = node->first + dirNeg[ node->axis ];
+			far = node->first + 1 - dirNeg[ node->axis ];
+			nearMask = farMask = 0;
+			for( r = first; r < packet->numRays; r++ )
+			{
+				if( !(mask & (1 << r)) )
+					continue;
+				if( TraceBVHBox( &bvhNodes[ near ], packet->origin[ r ], invDir[ r ], packet->distance[ r ] ) >= 0.0f )
+					nearMask |= (1 << r);
+				if( TraceBVHBox( &bvhNodes[ far ], packet->origin[ r ], invDir[ r ], packet->distance[ r ] ) >= 0.0f )
+					farMask |= (1 << r);
+			}
+			if( nearMask )
+			{
+				if( farMask )
+				{
+					stack[ numStack ] = far;
+					stackMask[ numStack++ ] = farMask;
+				}
+				nodeNum = near;
+				mask = nearMask;
+				continue;
+			}
+			if( farMask )
+			{
+				nodeNum = far;
+				mask = farMask;
+				continue;
+			}
+		}
+		
+		/* pop, dropping rays that have become opaque */
+		mask = 0;
+		while( numStack > 0 && !mask )
+		{
+			numStack--;
+			nodeNum = stack[ numStack ];
+			mask = stackMask[ numStack ] & live;
+		}
+	}
+}
+
+
+
+/*
+TraceLinePacket()
+traces all rays of a packet, like TraceLine() on each (or TraceLineShadow() with shadow), with
+one shared bvh traversal
+*/
+
+void TraceLinePacket( trace_t *trace, tracePacket_t *packet, qboolean shadow )
+{
+	int				r, mask;
+	
+	
+	/* setup and solid test per ray */
+	mask = 0;
+	traceHitTriangle = -1;
+	traceNearest = shadow ? qfalse : qtrue;
+	for( r = 0; r < packet->numRays; r++ )
+	{
+		VectorCopy( packet->origin[ r ], trace->origin );
+		VectorCopy( packet->end[ r ], trace->end );
+		VectorCopy( packet->color[ r ], trace->color );
+		SetupTrace( trace );
+		if( TraceLineBegin( trace ) && !(shadow && TraceOccluder( trace )) )
+		{
+			/* rays that go through the skybox (or any ray without -bvh) are finished alone */
+			if( traceBVH && !trace->testSkybox )
+				mask |= (1 << r);
+			else
+				TraceLineTriangles( trace );
 		}
+		StorePacketRay( trace, packet, r );
+	}
+	
+	/* shared traversal */
+	if( mask )
+		TraceBVHPacket( trace, packet, mask );
+	
+	/* model instances are traced per ray (up to the world hit for nearest hit rays) */
+	for( r = 0; r < packet->numRays && instanceRootNode >= 0; r++ )
+	{
+		if( !(mask & (1 << r)) || (shadow && packet->opaque[ r ]) )
+			continue;
+		LoadPacketRay( trace, packet, r );
+		TraceInstances( trace );
+		StorePacketRay( trace, packet, r );
 	}
+	
+	/* the packet's rays share the light, remember the last occluder found */
+	if( shadow )
+		StoreOccluder( trace );
 }
 
+
+
 /*
 SetupTrace() - ydnar
 sets up certain trace values
@@ -1747,3 +4242,34 @@ float SetupTrace( trace_t *trace )
 	VectorCopy( trace->origin, trace->hit );
 	return trace->distance;
 }
+
+
+
+/*
+ResetTraceRayStats()
+PrintTraceRayStats()
+ray throughput of the tracer and the occluder cache hit rate between the two calls
+*/
+
+void ResetTraceRayStats( void )
+{
+	numTraceRayBlocks = 0;
+	numOccluderTestBlocks = 0;
+	numOccluderHitBlocks = 0;
+	traceRayStart = I_PreciseTime();
+}
+
+void PrintTraceRayStats( void )
+{
+	double		rays, seconds;
+	
+	
+	rays = (double) numTraceRayBlocks * TRACE_RAY_BLOCK;
+	seconds = I_PreciseTime() - traceRayStart;
+	if( rays <= 0 || seconds <= 0 )
+		return;
+	Sys_Printf( "%9.0f rays traced (%.2f million rays/s, %s)\n", rays, rays / seconds / 1000000.0, traceBVH ? "bvh" : "trace nodes" );
+	if( numOccluderTestBlocks > 0 )
+		Sys_Printf( "%9.0f shadow rays tested the last occluder first (%.1f%% blocked by it)\n",
+			(double) numOccluderTestBlocks * TRACE_RAY_BLOCK, 100.0 * numOccluderHitBlocks / numOccluderTestBlocks );
+}
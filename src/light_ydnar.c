@@ -1723,7 +1723,7 @@ void EnableDirtForEntity(int num)
 
 void SetupDirtForEntity(int num)
 {
-	int i, j, v1;
+	int i, j, k, a, b, v1;
 	float angle, elevation, angleStep, elevationStep;
 	double v2, v3, v4;
 	const char *value;
@@ -1833,27 +1833,24 @@ void SetupDirtForEntity(int num)
 		elevationStep = DEG2RAD( DIRT_CONE_ANGLE / (DIRT_NUM_ELEVATION_STEPS ) );
 
 		/* default cone-based dirt vectors */
-		/* get number of dirt vectors */
-		angle = 0.0f;
-		dirtSettings[num].numVectors = 0;
-		for( i = 0, angle = 0.0f; i < DIRT_NUM_ANGLE_STEPS; i++, angle += angleStep )
-			for( j = 0, elevation = elevationStep * 0.5f; j < DIRT_NUM_ELEVATION_STEPS; j++, elevation += elevationStep)
-				dirtSettings[num].numVectors++;
-		dirtSettings[num].vectors = (vec3_t *)safe_malloc(sizeof(vec3_t) * dirtSettings[num].numVectors);
+		dirtSettings[num].vectors = (vec3_t *)safe_malloc(sizeof(vec3_t) * DIRT_NUM_VECTORS);
 
-		/* iterate angle */
-		angle = 0.0f;
+		/* every angle and elevation step, in an order where the first few vectors already spread over the cone (see -dirtearlyout) */
 		dirtSettings[num].numVectors = 0;
-		for( i = 0, angle = 0.0f; i < DIRT_NUM_ANGLE_STEPS; i++, angle += angleStep )
+		for( k = 0; k < DIRT_NUM_VECTORS; k++ )
 		{
-			/* iterate elevation */
-			for( j = 0, elevation = elevationStep * 0.5f; j < DIRT_NUM_ELEVATION_STEPS; j++, elevation += elevationStep )
-			{
-				dirtSettings[num].vectors[ dirtSettings[num].numVectors ][ 0 ] = sin( elevation ) * cos( angle );
-				dirtSettings[num].vectors[ dirtSettings[num].numVectors ][ 1 ] = sin( elevation ) * sin( angle );
-				dirtSettings[num].vectors[ dirtSettings[num].numVectors ][ 2 ] = cos( elevation );
-				dirtSettings[num].numVectors++;
-			}
+			/* bit reversed angle steps, cycling elevations */
+			a = k % DIRT_NUM_ANGLE_STEPS;
+			for( i = 0, b = 1; b < DIRT_NUM_ANGLE_STEPS; b <<= 1 )
+				i = (i << 1) | ((a & b) ? 1 : 0);
+			j = (k / DIRT_NUM_ANGLE_STEPS + a) % DIRT_NUM_ELEVATION_STEPS;
+			angle = angleStep * i;
+			elevation = elevationStep * (j + 0.5f);
+			
+			dirtSettings[num].vectors[ dirtSettings[num].numVectors ][ 0 ] = sin( elevation ) * cos( angle );
+			dirtSettings[num].vectors[ dirtSettings[num].numVectors ][ 1 ] = sin( elevation ) * sin( angle );
+			dirtSettings[num].vectors[ dirtSettings[num].numVectors ][ 2 ] = cos( elevation );
+			dirtSettings[num].numVectors++;
 		}
 	}
 }
@@ -1910,6 +1907,122 @@ void SetupDirt( void )
 }
 
 
+/*
+DirtTangentBasis()
+right and up vectors around a sample normal for the cone dirt modes
+*/
+
+static void DirtTangentBasis( vec3_t normal, vec3_t myRt, vec3_t myUp )
+{
+	vec3_t		worldUp;
+	
+	
+	/* check if the normal is aligned to the world-up */
+	if( normal[ 0 ] == 0.0f && normal[ 1 ] == 0.0f )
+	{
+		if( normal[ 2 ] == 1.0f )		
+		{
+			VectorSet( myRt, 1.0f, 0.0f, 0.0f );
+			VectorSet( myUp, 0.0f, 1.0f, 0.0f );
+		}
+		else if( normal[ 2 ] == -1.0f )
+		{
+			VectorSet( myRt, -1.0f, 0.0f, 0.0f );
+			VectorSet( myUp,  0.0f, 1.0f, 0.0f );
+		}
+	}
+	else
+	{
+		VectorSet( worldUp, 0.0f, 0.0f, 1.0f );
+		CrossProduct( normal, worldUp, myRt );
+		VectorNormalize( myRt, myRt );
+		CrossProduct( myRt, normal, myUp );
+		VectorNormalize( myUp, myUp );
+	}
+}
+
+/*
+DirtConeResult()
+dirt value from the gathered occlusion of the cone dirt modes
+*/
+
+static float DirtConeResult( dirtSettings_t *dirt, float gatherDirt )
+{
+	float	outDirt;
+	
+	
+	/* early out */
+	if( gatherDirt <= 0.0f )
+		return 1.0f;
+	
+	/* apply gain (does this even do much? heh) */
+	outDirt = pow( gatherDirt / (dirt->numVectors + 1), dirt->gain );
+	if( outDirt > 1.0f )
+		outDirt = 1.0f;
+	
+	/* apply scale */
+	outDirt *= dirt->scale;
+	if( outDirt > 1.0f )
+		outDirt = 1.0f;
+	
+	/* return to sender */
+	return 1.0f - outDirt;
+}
+
+/*
+DirtAmbientResult()
+dirt value from the gathered depths of the ambient sphere dirt modes
+*/
+
+static float DirtAmbientResult( dirtSettings_t *dirt, float gatherDirt, trace_t *trace )
+{
+	/* resulting volume is our dirt */
+	#define DIRT_SCALE_START 1.0
+	#define DIRT_GAIN_START  1.08
+	gatherDirt = sqrt((gatherDirt / dirt->wholeDepth) / 0.55);
+	if (gatherDirt <= DIRT_SCALE_START)
+		return pow(gatherDirt, dirt->scale);
+	if (gatherDirt <= DIRT_GAIN_START || !trace->recvShadows || noSurfaces)
+	{
+		/* also fix gain effect on surfaces not receiving shadows */
+		return DIRT_SCALE_START;
+	}
+	/* gain */
+	return 1 + max(0, (gatherDirt - DIRT_GAIN_START)) * (DIRT_GAIN_START / DIRT_SCALE_START) * dirt->gain;
+}
+
+/*
+DirtSequence()
+point n of a base 2 / base 3 halton sequence, scrambled by seed (the base 2 digits are flipped
+and the base 3 axis is rotated), so each sample gets its own evenly spread set of directions
+*/
+
+static void DirtSequence( unsigned int seed, int n, float *u1, float *u2 )
+{
+	unsigned int	bits;
+	float			v, f;
+	
+	
+	/* base 2 radical inverse with random digit flips */
+	bits = (unsigned int) n;
+	bits = (bits << 16) | (bits >> 16);
+	bits = ((bits & 0x00ff00ffu) << 8) | ((bits & 0xff00ff00u) >> 8);
+	bits = ((bits & 0x0f0f0f0fu) << 4) | ((bits & 0xf0f0f0f0u) >> 4);
+	bits = ((bits & 0x33333333u) << 2) | ((bits & 0xccccccccu) >> 2);
+	bits = ((bits & 0x55555555u) << 1) | ((bits & 0xaaaaaaaau) >> 1);
+	bits = (bits >> 8) ^ (unsigned int) (RandomForSeed( seed, 0 ) * 16777216.0f);
+	*u1 = (bits & 0xffffffu) * (1.0f / 16777216.0f);
+	
+	/* base 3 radical inverse with a random rotation */
+	v = 0.0f;
+	for( f = 1.0f / 3.0f; n > 0; n /= 3, f *= (1.0f / 3.0f) )
+		v += (n % 3) * f;
+	v += RandomForSeed( seed, 1 );
+	if( v >= 1.0f )
+		v -= 1.0f;
+	*u2 = v;
+}
+
 /*
 DirtForSample()
 calculates dirt value for a given sample
@@ -1917,10 +2030,10 @@ calculates dirt value for a given sample
 
 float DirtForSample( trace_t *trace )
 {
-	int i;
+	int i, hits;
 	dirtSettings_t *dirt;
-	float gatherDirt, outDirt, angle, elevation, ooDepth, depth1, depth2;
-	vec3_t normal, worldUp, myUp, myRt, temp, direction, displacement;
+	float gatherDirt, angle, elevation, ooDepth, depth1, depth2, u1, u2;
+	vec3_t normal, myUp, myRt, temp, direction, displacement;
 	qboolean oldTestAll;
 	vec_t oldInhibitRadius;
 	
@@ -1940,31 +2053,10 @@ float DirtForSample( trace_t *trace )
 	{
 		/* setup */
 		gatherDirt = 0.0f;
+		hits = 0;
 		ooDepth = 1.0f / dirt->depth;
 		VectorCopy( trace->normal, normal );
-	
-		/* check if the normal is aligned to the world-up */
-		if( normal[ 0 ] == 0.0f && normal[ 1 ] == 0.0f )
-		{
-			if( normal[ 2 ] == 1.0f )		
-			{
-				VectorSet( myRt, 1.0f, 0.0f, 0.0f );
-				VectorSet( myUp, 0.0f, 1.0f, 0.0f );
-			}
-			else if( normal[ 2 ] == -1.0f )
-			{
-				VectorSet( myRt, -1.0f, 0.0f, 0.0f );
-				VectorSet( myUp,  0.0f, 1.0f, 0.0f );
-			}
-		}
-		else
-		{
-			VectorSet( worldUp, 0.0f, 0.0f, 1.0f );
-			CrossProduct( normal, worldUp, myRt );
-			VectorNormalize( myRt, myRt );
-			CrossProduct( myRt, normal, myUp );
-			VectorNormalize( myUp, myUp );
-		}
+		DirtTangentBasis( normal, myRt, myUp );
 	
 		/* 1 = random mode, 0 = non-random mode */
 		if( dirt->mode == 1 )
@@ -1972,9 +2064,14 @@ float DirtForSample( trace_t *trace )
 			/* iterate */
 			for( i = 0; i < dirt->numVectors; i++ )
 			{
-				/* get random vector */
-				angle = Random() * DEG2RAD( 360.0f );
-				elevation = Random() * DEG2RAD( DIRT_CONE_ANGLE );
+				/* open samples are done once the first rays all got through */
+				if( dirtEarlyOut > 0 && i == dirtEarlyOut && hits == 0 )
+					break;
+				
+				/* get scrambled low discrepancy vector */
+				DirtSequence( trace->randomSeed, i, &u1, &u2 );
+				angle = u1 * DEG2RAD( 360.0f );
+				elevation = u2 * DEG2RAD( DIRT_CONE_ANGLE );
 				temp[ 0 ] = cos( angle ) * sin( elevation );
 				temp[ 1 ] = sin( angle ) * sin( elevation );
 				temp[ 2 ] = cos( elevation );
@@ -1994,6 +2091,7 @@ float DirtForSample( trace_t *trace )
 				{
 					VectorSubtract( trace->hit, trace->origin, displacement );
 					gatherDirt += 1.0f - ooDepth * VectorLength( displacement );
+					hits++;
 				}
 			}
 		}
@@ -2002,6 +2100,10 @@ float DirtForSample( trace_t *trace )
 			/* iterate through ordered vectors */
 			for( i = 0; i < dirt->numVectors; i++ )
 			{
+				/* open samples are done once the first rays all got through */
+				if( dirtEarlyOut > 0 && i == dirtEarlyOut && hits == 0 )
+					break;
+				
 				/* transform vector into tangent space */
 				direction[ 0 ] = myRt[ 0 ] * dirt->vectors[ i ][ 0 ] + myUp[ 0 ] * dirt->vectors[ i ][ 1 ] + normal[ 0 ] * dirt->vectors[ i ][ 2 ];
 				direction[ 1 ] = myRt[ 1 ] * dirt->vectors[ i ][ 0 ] + myUp[ 1 ] * dirt->vectors[ i ][ 1 ] + normal[ 1 ] * dirt->vectors[ i ][ 2 ];
@@ -2017,9 +2119,17 @@ float DirtForSample( trace_t *trace )
 				{
 					VectorSubtract( trace->hit, trace->origin, displacement );
 					gatherDirt += (1.0f - ooDepth) * VectorLength( displacement );
+					hits++;
 				}
 			}
 		}
+		
+		/* stopped early */
+		if( i < dirt->numVectors )
+		{
+			ThreadAtomicAdd( &numDirtSamplesStopped, 1 );
+			return 1.0f;
+		}
 
 		/* direct ray */
 		VectorMA( trace->origin, dirt->depth, normal, trace->end );
@@ -2033,22 +2143,8 @@ float DirtForSample( trace_t *trace )
 			gatherDirt += (1.0f - ooDepth) * VectorLength( displacement );
 		}
 		
-		/* early out */
-		if( gatherDirt <= 0.0f )
-			return 1.0f;
-		
-		/* apply gain (does this even do much? heh) */
-		outDirt = pow( gatherDirt / (dirt->numVectors + 1), dirt->gain );
-		if( outDirt > 1.0f )
-			outDirt = 1.0f;
-		
-		/* apply scale */
-		outDirt *= dirt->scale;
-		if( outDirt > 1.0f )
-			outDirt = 1.0f;
-		
 		/* return to sender */
-		return 1.0f - outDirt;
+		return DirtConeResult( dirt, gatherDirt );
 	}
 
 	/* blood omnicide ambient occlusion */
@@ -2110,18 +2206,220 @@ float DirtForSample( trace_t *trace )
 	trace->testAll = oldTestAll;
 
 	/* resulting volume is our dirt */
-	#define DIRT_SCALE_START 1.0
-	#define DIRT_GAIN_START  1.08
-	gatherDirt = sqrt((gatherDirt / dirt->wholeDepth) / 0.55);
-	if (gatherDirt <= DIRT_SCALE_START)
-		return pow(gatherDirt, dirt->scale);
-	if (gatherDirt <= DIRT_GAIN_START || !trace->recvShadows || noSurfaces)
+	return DirtAmbientResult( dirt, gatherDirt, trace );
+}
+
+
+
+/* luxels per side of a packet traced tile, LUXEL_TILE * LUXEL_TILE <= MAX_PACKET_RAYS */
+#define LUXEL_TILE				4
+
+
+
+/*
+DirtForSamples()
+calculates dirt for a tile of samples; the ordered cone and ambient sphere modes send every
+sample along the same set of directions, so those rays are traced as packets
+*/
+
+typedef struct
+{
+	vec3_t			origin, normal;
+	int				cluster;
+	unsigned int	randomSeed;
+	float			*dirt;
+}
+dirtSample_t;
+
+static void DirtForSamples( trace_t *trace, dirtSample_t *samples, int numSamples )
+{
+	int				i, s, r, hits[ MAX_PACKET_RAYS ], numStopped;
+	dirtSettings_t	*dirt;
+	float			ooDepth, depth2, gatherDirt[ MAX_PACKET_RAYS ], depth1[ MAX_PACKET_RAYS ];
+	vec3_t			myRt[ MAX_PACKET_RAYS ], myUp[ MAX_PACKET_RAYS ], direction, displacement;
+	qboolean		oldTestAll;
+	vec_t			oldInhibitRadius;
+	tracePacket_t	packet, back;
+	
+	
+	/* dummy check */
+	dirt = &dirtSettings[ trace->entityNum ];
+	if( !dirt->enabled )
 	{
-		/* also fix gain effect on surfaces not receiving shadows */
-		return DIRT_SCALE_START;
+		dirt = &dirtSettings[ 0 ];
+		if( !dirt->enabled )
+		{
+			for( s = 0; s < numSamples; s++ )
+				*samples[ s ].dirt = 1.0f;
+			return;
+		}
+	}
+	
+	/* random mode has its own vectors per sample */
+	if( dirt->mode == 1 )
+	{
+		for( s = 0; s < numSamples; s++ )
+		{
+			VectorCopy( samples[ s ].origin, trace->origin );
+			VectorCopy( samples[ s ].normal, trace->normal );
+			trace->cluster = samples[ s ].cluster;
+			trace->randomSeed = samples[ s ].randomSeed;
+			*samples[ s ].dirt = DirtForSample( trace );
+		}
+		return;
+	}
+	
+	/* setup */
+	for( s = 0; s < numSamples; s++ )
+	{
+		gatherDirt[ s ] = 0.0f;
+		hits[ s ] = 0;
+		if( samples[ s ].cluster < 0 )
+			*samples[ s ].dirt = 0.0f;
+	}
+	
+	/* q3map2 ordered cone, the last pass is the direct ray */
+	if( dirt->mode == 0 )
+	{
+		ooDepth = 1.0f / dirt->depth;
+		for( s = 0; s < numSamples; s++ )
+			DirtTangentBasis( samples[ s ].normal, myRt[ s ], myUp[ s ] );
+		
+		numStopped = 0;
+		for( i = 0; i <= dirt->numVectors; i++ )
+		{
+			/* open samples are done once the first rays all got through (their dirt stays 1) */
+			if( dirtEarlyOut > 0 && i == dirtEarlyOut && i < dirt->numVectors )
+			{
+				for( s = 0; s < numSamples; s++ )
+				{
+					if( samples[ s ].cluster >= 0 && hits[ s ] == 0 )
+					{
+						hits[ s ] = -1;
+						numStopped++;
+					}
+				}
+			}
+			
+			packet.numRays = 0;
+			for( s = 0; s < numSamples; s++ )
+			{
+				if( samples[ s ].cluster < 0 || hits[ s ] < 0 )
+					continue;
+				
+				/* transform vector into tangent space */
+				if( i < dirt->numVectors )
+				{
+					direction[ 0 ] = myRt[ s ][ 0 ] * dirt->vectors[ i ][ 0 ] + myUp[ s ][ 0 ] * dirt->vectors[ i ][ 1 ] + samples[ s ].normal[ 0 ] * dirt->vectors[ i ][ 2 ];
+					direction[ 1 ] = myRt[ s ][ 1 ] * dirt->vectors[ i ][ 0 ] + myUp[ s ][ 1 ] * dirt->vectors[ i ][ 1 ] + samples[ s ].normal[ 1 ] * dirt->vectors[ i ][ 2 ];
+					direction[ 2 ] = myRt[ s ][ 2 ] * dirt->vectors[ i ][ 0 ] + myUp[ s ][ 2 ] * dirt->vectors[ i ][ 1 ] + samples[ s ].normal[ 2 ] * dirt->vectors[ i ][ 2 ];
+				}
+				else
+					VectorCopy( samples[ s ].normal, direction );
+				
+				/* set endpoint */
+				VectorCopy( samples[ s ].origin, trace->origin );
+				VectorMA( trace->origin, dirt->depth, direction, trace->end );
+				AddTracePacketRay( &packet, trace, s );
+			}
+			if( packet.numRays == 0 )
+				break;
+			
+			/* trace */
+			TraceLinePacket( trace, &packet, qfalse );
+			for( r = 0; r < packet.numRays; r++ )
+			{
+				if( packet.opaque[ r ] || packet.passSolid[ r ] )
+				{
+					VectorSubtract( packet.hit[ r ], packet.origin[ r ], displacement );
+					gatherDirt[ packet.user[ r ] ] += (1.0f - ooDepth) * VectorLength( displacement );
+					hits[ packet.user[ r ] ]++;
+				}
+			}
+		}
+		
+		for( s = 0; s < numSamples; s++ )
+		{
+			if( samples[ s ].cluster >= 0 )
+				*samples[ s ].dirt = DirtConeResult( dirt, gatherDirt[ s ] );
+		}
+		if( numStopped > 0 )
+			ThreadAtomicAdd( &numDirtSamplesStopped, numStopped );
+		return;
+	}
+	
+	/* blood omnicide ambient occlusion */
+	oldTestAll = trace->testAll;
+	oldInhibitRadius = trace->inhibitRadius;
+	trace->inhibitRadius = 0;
+	trace->testAll = qfalse;
+	
+	/* iterate through uniform vectors */
+	for( i = 0; i < dirt->numVectors; i++ )
+	{
+		/* direct rays */
+		packet.numRays = 0;
+		for( s = 0; s < numSamples; s++ )
+		{
+			if( samples[ s ].cluster < 0 )
+				continue;
+			VectorCopy( samples[ s ].origin, trace->origin );
+			VectorAdd( trace->origin, dirt->vectors[ i ], trace->end );
+			AddTracePacketRay( &packet, trace, s );
+		}
+		TraceLinePacket( trace, &packet, qfalse );
+		
+		/* back rays for the ones that got through */
+		back.numRays = 0;
+		for( r = 0; r < packet.numRays; r++ )
+		{
+			s = packet.user[ r ];
+			depth1[ s ] = dirt->depth;
+			if( packet.passSolid[ r ] == qtrue )
+				depth1[ s ] = 0.0f;
+			else if( packet.opaque[ r ] )
+			{
+				VectorSubtract( packet.hit[ r ], packet.origin[ r ], displacement );
+				depth1[ s ] = min( dirt->depth, VectorLength( displacement ) );
+			}
+			if( packet.opaque[ r ] == qfalse )
+			{
+				VectorCopy( packet.hit[ r ], trace->origin );
+				VectorCopy( samples[ s ].origin, trace->end );
+				VectorCopy( packet.color[ r ], trace->color );
+				AddTracePacketRay( &back, trace, s );
+			}
+		}
+		TraceLinePacket( trace, &back, qfalse );
+		for( r = 0; r < back.numRays; r++ )
+		{
+			s = back.user[ r ];
+			depth2 = dirt->depth;
+			if( back.passSolid[ r ] == qtrue )
+				depth2 = 0.0f;
+			else if( back.opaque[ r ] )
+			{
+				VectorSubtract( back.hit[ r ], back.origin[ r ], displacement );
+				depth2 = min( dirt->depth, VectorLength( displacement ) );
+			}
+			depth1[ s ] = min( depth1[ s ], depth2 );
+		}
+		
+		/* add dirt */
+		for( r = 0; r < packet.numRays; r++ )
+			gatherDirt[ packet.user[ r ] ] += pow( depth1[ packet.user[ r ] ], dirt->depthExponent );
+	}
+	
+	/* rollback trace settings */
+	trace->inhibitRadius = oldInhibitRadius;
+	trace->testAll = oldTestAll;
+	
+	/* resulting volume is our dirt */
+	for( s = 0; s < numSamples; s++ )
+	{
+		if( samples[ s ].cluster >= 0 )
+			*samples[ s ].dirt = DirtAmbientResult( dirt, gatherDirt[ s ], trace );
 	}
-	/* gain */
-	return 1 + max(0, (gatherDirt - DIRT_GAIN_START)) * (DIRT_GAIN_START / DIRT_SCALE_START) * dirt->gain;
 }
 
 /*
@@ -2131,11 +2429,12 @@ calculates dirty fraction for each luxel
 
 void DirtyRawLightmap(int rawLightmapNum)
 {
-	int					i, x, y, sx, sy, *cluster;
+	int					i, x, y, tx, ty, sx, sy, *cluster, numSamples;
 	float				*origin, *normal, *dirt, *dirt2, average, samples;
 	rawLightmap_t		*lm;
 	surfaceInfo_t		*info;
 	trace_t				trace;
+	dirtSample_t		tile[ LUXEL_TILE * LUXEL_TILE ], *sample;
 
 	/* bail if this number exceeds the number of raw lightmaps */
 	if( rawLightmapNum >= numRawLightmaps )
@@ -2173,31 +2472,42 @@ void DirtyRawLightmap(int rawLightmapNum)
 		}
 	}
 	
-	/* gather dirt */
-	for( y = 0; y < lm->sh; y++ )
+	/* gather dirt, a tile of luxels at a time */
+	for( ty = 0; ty < lm->sh; ty += LUXEL_TILE )
 	{
-		for( x = 0; x < lm->sw; x++ )
+		for( tx = 0; tx < lm->sw; tx += LUXEL_TILE )
 		{
-			/* get luxel */
-			origin = SUPER_TRIORIGIN( x, y );
-			normal = SUPER_TRINORMAL( x, y );
-			cluster = SUPER_CLUSTER( x, y );
-			dirt = SUPER_DIRT( x, y );
-
-			/* bad cluster? */
-			if( *cluster < 0 )
+			numSamples = 0;
+			for( y = ty; y < ty + LUXEL_TILE && y < lm->sh; y++ )
 			{
-				*dirt = 0.0f;
-				continue;
-			}
+				for( x = tx; x < tx + LUXEL_TILE && x < lm->sw; x++ )
+				{
+					/* get luxel */
+					origin = SUPER_TRIORIGIN( x, y );
+					normal = SUPER_TRINORMAL( x, y );
+					cluster = SUPER_CLUSTER( x, y );
+					dirt = SUPER_DIRT( x, y );
 
-			/* set up trace */
-			VectorMA( origin, 1.5f, normal, trace.origin);
-			VectorCopy( normal, trace.normal );
-			trace.cluster = ClusterForPointExt( trace.origin, 0.0f );
+					/* bad cluster? */
+					if( *cluster < 0 )
+					{
+						*dirt = 0.0f;
+						continue;
+					}
+
+					/* set up sample */
+					sample = &tile[ numSamples++ ];
+					VectorMA( origin, 1.5f, normal, sample->origin );
+					VectorCopy( normal, sample->normal );
+					sample->cluster = ClusterForPointExt( sample->origin, 0.0f );
+					sample->randomSeed = RandomSeed( rawLightmapNum, y * lm->sw + x, 0 );
+					sample->dirt = dirt;
+				}
+			}
 
 			/* get dirt */
-			*dirt = DirtForSample( &trace );
+			if( numSamples > 0 )
+				DirtForSamples( &trace, tile, numSamples );
 		}
 	}
 
@@ -2412,28 +2722,52 @@ static qboolean SubmapRawLuxel( rawLightmap_t *lm, int x, int y, float bx, float
 	return qtrue;
 }
 
+/*
+RefineLuxelSamples()
+decides if a set of neighbouring samples needs subsampling: they have to be bright enough to
+matter, and either partially occluded or (with -adaptive) differ by more than the contrast threshold
+*/
+
+static qboolean RefineLuxelSamples( vec3_t total, int mapped, int lighted, float minBrightness, float maxBrightness )
+{
+	/* if total color is under a certain amount, then don't bother subsampling */
+	if( total[ 0 ] <= 4.0f && total[ 1 ] <= 4.0f && total[ 2 ] <= 4.0f )
+		return qfalse;
+	
+	/* shadow edge */
+	if( lighted != 0 && lighted != mapped )
+		return qtrue;
+	
+	/* high contrast */
+	return (lightSamplesAdaptive && lightSamplesContrast > 0.0f && (maxBrightness - minBrightness) > lightSamplesContrast * maxBrightness) ? qtrue : qfalse;
+}
+
 /*
 SubsampleRawLuxel_r()
 recursively subsamples a luxel until its color gradient is low enough or subsampling limit is reached
+each level splits the luxel into a 2x2 ordered grid, returns the number of samples taken
 */
 
-static void SubsampleRawLuxel_r( rawLightmap_t *lm, trace_t *trace, vec3_t sampleOrigin, int x, int y, float bias, float *lightLuxel )
+static int SubsampleRawLuxel_r( rawLightmap_t *lm, trace_t *trace, vec3_t sampleOrigin, int x, int y, float bias, float *lightLuxel )
 {
-	int			b, samples, mapped, lighted;
+	int			b, samples, mapped, lighted, numSubsamples;
 	int			cluster[ 4 ];
 	vec4_t		luxel[ 4 ];
 	vec3_t		origin[ 4 ], normal[ 4 ];
 	float		biasDirs[ 4 ][ 2 ] = { { -1.0f, -1.0f }, { 1.0f, -1.0f }, { -1.0f, 1.0f }, { 1.0f, 1.0f } };
 	vec3_t		color, total;
+	float		brightness, minBrightness, maxBrightness;
 	
 	/* limit check */
 	if( lightLuxel[ 3 ] >= lightSamples )
-		return;
+		return 0;
 	
 	/* setup */
 	VectorClear( total );
 	mapped = 0;
 	lighted = 0;
+	minBrightness = 1e10f;
+	maxBrightness = 0.0f;
 	
 	/* make 2x2 subsample stamp */
 	for( b = 0; b < 4; b++ )
@@ -2460,21 +2794,25 @@ static void SubsampleRawLuxel_r( rawLightmap_t *lm, trace_t *trace, vec3_t sampl
 		/* sample light */
 		LightContribution( trace, LIGHT_SURFACES, qfalse );
 		
-		/* add to totals (fixme: make contrast function) */
+		/* add to totals */
 		VectorCopy( trace->color, luxel[ b ] );
 		VectorAdd( total, trace->color, total );
 		if( (luxel[ b ][ 0 ] + luxel[ b ][ 1 ] + luxel[ b ][ 2 ]) > 0.0f )
 			lighted++;
+		brightness = luxel[ b ][ 0 ] * 0.3f + luxel[ b ][ 1 ] * 0.59f + luxel[ b ][ 2 ] * 0.11f;
+		minBrightness = min( minBrightness, brightness );
+		maxBrightness = max( maxBrightness, brightness );
 	}
+	numSubsamples = mapped;
 	
-	/* subsample further? */
-	if( (lightLuxel[ 3 ] + 1.0f) < lightSamples && (total[ 0 ] > 4.0f || total[ 1 ] > 4.0f || total[ 2 ] > 4.0f) && lighted != 0 && lighted != mapped )
+	/* subsample further? (with -adaptive, half the offset puts the sub-stamps on the next ordered grid level) */
+	if( (lightLuxel[ 3 ] + 1.0f) < lightSamples && RefineLuxelSamples( total, mapped, lighted, minBrightness, maxBrightness ) )
 	{
 		for( b = 0; b < 4; b++ )
 		{
 			if( cluster[ b ] < 0 )
 				continue;
-			SubsampleRawLuxel_r( lm, trace, origin[ b ], x, y, (bias * 0.25f), luxel[ b ] );
+			numSubsamples += SubsampleRawLuxel_r( lm, trace, origin[ b ], x, y, bias * (lightSamplesAdaptive ? 0.5f : 0.25f), luxel[ b ] );
 		}
 	}
 	
@@ -2504,6 +2842,7 @@ static void SubsampleRawLuxel_r( rawLightmap_t *lm, trace_t *trace, vec3_t sampl
 		lightLuxel[ 3 ] += 1.0f;
 		lightLuxel[ 4 ] += 1.0f;
 	}
+	return numSubsamples;
 }
 
 /*
@@ -2591,31 +2930,184 @@ void LightGridRawLightmap(int rawLightmapNum)
 			}
 		}
 	}
-
-	/* set counts */
-	numLuxelsIlluminated += (lm->sw * lm->sh);
+
+	/* set counts */
+	numLuxelsIlluminated += (lm->sw * lm->sh);
+}
+
+/*
+IlluminateRawLightmap()
+illuminates the luxels
+*/
+
+#define STACK_LL_SIZE			(SUPER_LUXEL_SIZE * 64 * 64)
+#define LIGHT_LUXEL( x, y )		(lightLuxels + ((((y) * lm->sw) + (x)) * SUPER_LUXEL_SIZE))
+
+#define REFINE_LIGHT			1	/* luxel is subsampled for the current light */
+#define REFINE_ANY				2	/* luxel was subsampled for any light */
+
+/* lightmaps with at least this many luxels have their first pass split into row bands of about BAND_LUXELS each */
+#define MIN_BAND_LUXELS			4096
+#define BAND_LUXELS				1024
+
+typedef struct
+{
+	rawLightmap_t	*lm;
+	trace_t			*trace;
+	float			*lightLuxels;
+	lightCutTree_t	*cuts;
+	int				y, yEnd;
+	int				lighted;
+}
+luxelBand_t;
+
+/*
+IlluminateLuxelRows()
+samples the current light once per mapped luxel in rows [y0, y1), returns the number of lit luxels
+luxels are walked in LUXEL_TILE square tiles whose shadow rays are traced as one packet
+*/
+
+static int IlluminateLuxelRows( rawLightmap_t *lm, trace_t *trace, float *lightLuxels, int y0, int y1 )
+{
+	int				x, y, tx, ty, r, *cluster, totalLighted;
+	float			*origin, *normal, *lightLuxel, *deluxel, brightness;
+	qboolean		testOcclusion;
+	tracePacket_t	packet;
+	
+	
+	/* LightContribution() skips its shadow ray without testOcclusion, it is queued instead */
+	testOcclusion = trace->testOcclusion;
+	trace->testOcclusion = qfalse;
+	
+	totalLighted = 0;
+	for( ty = y0; ty < y1; ty += LUXEL_TILE )
+	{
+		for( tx = 0; tx < lm->sw; tx += LUXEL_TILE )
+		{
+			packet.numRays = 0;
+			for( y = ty; y < ty + LUXEL_TILE && y < y1; y++ )
+			{
+				for( x = tx; x < tx + LUXEL_TILE && x < lm->sw; x++ )
+				{
+					/* get cluster */
+					cluster = SUPER_CLUSTER( x, y );
+					if( *cluster < 0 )
+						continue;
+					
+					/* get particulars */
+					lightLuxel = LIGHT_LUXEL( x, y );
+					if( deluxemap )
+						deluxel = SUPER_DELUXEL( x, y );
+					origin = SUPER_ORIGIN( x, y );
+					normal = SUPER_NORMAL( x, y );
+
+					/* set contribution count */
+					lightLuxel[ 3 ] = 1.0f;
+
+					/* setup trace */
+					trace->cluster = *cluster;
+					VectorCopy( origin, trace->origin );
+					VectorCopy( normal, trace->normal );
+						
+					/* get light for this sample, queueing the shadow ray */
+					if( LightContribution( trace, LIGHT_SURFACES, qfalse ) == 1 && testOcclusion &&
+						(trace->light->type != EMIT_SUN || !trace->forceSunlight) )
+						AddTracePacketRay( &packet, trace, y * lm->sw + x );
+					VectorCopy( trace->color, lightLuxel );
+				
+					/* add to light direction map */
+					if( deluxemap )
+					{
+						/* vortex: use noShadow color */
+						/* color to grayscale */
+						brightness = trace->colorNoShadow[ 0 ] * 0.3f + trace->colorNoShadow[ 1 ] * 0.59f + trace->colorNoShadow[ 2 ] * 0.11f;
+						brightness *= (1.0 / 255.0);
+						VectorScale( trace->direction, brightness, trace->direction );
+						VectorAdd( deluxel, trace->direction, deluxel );
+					}
+				}
+			}
+			
+			/* trace the tile's shadow rays together */
+			if( packet.numRays > 0 )
+			{
+				trace->testOcclusion = qtrue;
+				TraceLinePacket( trace, &packet, qtrue );
+				trace->testOcclusion = qfalse;
+				for( r = 0; r < packet.numRays; r++ )
+				{
+					lightLuxel = lightLuxels + packet.user[ r ] * SUPER_LUXEL_SIZE;
+					if( LightContributionShadowed( trace->light, packet.compileFlags[ r ], packet.passSolid[ r ], packet.opaque[ r ] ) )
+						VectorClear( lightLuxel );
+					else
+						VectorCopy( packet.color[ r ], lightLuxel );
+				}
+			}
+			
+			/* add to count */
+			for( y = ty; y < ty + LUXEL_TILE && y < y1; y++ )
+			{
+				for( x = tx; x < tx + LUXEL_TILE && x < lm->sw; x++ )
+				{
+					cluster = SUPER_CLUSTER( x, y );
+					lightLuxel = LIGHT_LUXEL( x, y );
+					if( *cluster >= 0 && (lightLuxel[ 0 ] || lightLuxel[ 1 ] || lightLuxel[ 2 ]) )
+					{
+						lightLuxel[ 4 ] += 1.0f;
+						totalLighted++;
+					}
+				}
+			}
+		}
+	}
+	
+	trace->testOcclusion = testOcclusion;
+	return totalLighted;
 }
 
 /*
-IlluminateRawLightmap()
-illuminates the luxels
+IlluminateLuxelBand()
+subtask: first pass over one row band with a private copy of the trace
 */
 
-#define STACK_LL_SIZE			(SUPER_LUXEL_SIZE * 64 * 64)
-#define LIGHT_LUXEL( x, y )		(lightLuxels + ((((y) * lm->sw) + (x)) * SUPER_LUXEL_SIZE))
+static void IlluminateLuxelBand( void *data )
+{
+	luxelBand_t	*band = (luxelBand_t *)data;
+	trace_t		trace;
+	
+	
+	memcpy( &trace, band->trace, sizeof( trace ) );
+	band->lighted = IlluminateLuxelRows( band->lm, &trace, band->lightLuxels, band->y, band->yEnd );
+}
+
+static void IlluminateLightCutBand( void *data )
+{
+	luxelBand_t	*band = (luxelBand_t *)data;
+	trace_t		trace;
+	
+	
+	memcpy( &trace, band->trace, sizeof( trace ) );
+	IlluminateLightCutRows( band->lm, band->cuts, &trace, band->y, band->yEnd );
+}
 
 void IlluminateRawLightmap(int rawLightmapNum)
 {
 	int	i, t, x, y, sx, sy, size, llSize, lightmapNum, luxelFilterRadius, weight;
-	int	*cluster, mapped, lighted, totalLighted;
+	int	*cluster, mapped, lighted, totalLighted, numSubsamples;
 	rawLightmap_t *lm;
 	surfaceInfo_t *info;
-	float *origin, *lightLuxels, *lightLuxel, *normal, *luxel, *deluxel, filterRadius, brightness, samples;
+	float *origin, *lightLuxels, *lightLuxel, *normal, *luxel, *deluxel, filterRadius, samples;
+	float brightness, minBrightness, maxBrightness;
+	byte *refine;
 	vec3_t color, total, temp, temp2;
 	float tests[ 4 ][ 2 ] = { { 0.0f, 0 }, { 1, 0 }, { 0, 1 }, { 1, 1 } };
 	float averageColor[ 5 ];
 	trace_t	trace;
 	float stackLightLuxels[ STACK_LL_SIZE ];
+	int b, numBands, bandRows;
+	luxelBand_t *bands;
+	threadTaskGroup_t group;
+	lightCutTree_t *cuts;
 	
 	/* bail if this number exceeds the number of raw lightmaps */
 	if( rawLightmapNum >= numRawLightmaps )
@@ -2771,6 +3263,17 @@ void IlluminateRawLightmap(int rawLightmapNum)
 	/* create a culled light list for this raw lightmap */
 	CreateTraceLightsForBounds( qfalse, lm->mins, lm->maxs, lm->plane, lm->numLightClusters, lm->lightClusters, LIGHT_SURFACES, &trace );
 
+	/* reuse the luxels of the last run if nothing that lights them changed */
+	if( RelightRawLightmap( rawLightmapNum, &trace ) )
+	{
+		FreeTraceLights( &trace );
+		numLuxelsIlluminated += (lm->sw * lm->sh);
+		return;
+	}
+	
+	/* move the area lights into a light tree if there are too many to walk */
+	cuts = CreateLightCuts( lm, &trace );
+
 	/* allocate temporary per-light luxel storage */
 	llSize = lm->sw * lm->sh * SUPER_LUXEL_SIZE * sizeof( float );
 	if( llSize <= (STACK_LL_SIZE * sizeof( float )) )
@@ -2778,6 +3281,28 @@ void IlluminateRawLightmap(int rawLightmapNum)
 	else
 		lightLuxels = (float *)safe_malloc( llSize );
 	
+	/* allocate adaptive supersampling flags */
+	refine = NULL;
+	numSubsamples = 0;
+	if( lightSamples > 1 )
+	{
+		refine = (byte *)safe_malloc( lm->sw * lm->sh );
+		memset( refine, 0, lm->sw * lm->sh );
+	}
+	
+	/* split big lightmaps into row bands */
+	numBands = 1;
+	bandRows = lm->sh;
+	bands = NULL;
+	if( numthreads > 1 && lm->sw * lm->sh >= MIN_BAND_LUXELS )
+	{
+		bandRows = BAND_LUXELS / lm->sw;
+		if( bandRows < 1 )
+			bandRows = 1;
+		numBands = (lm->sh + bandRows - 1) / bandRows;
+		bands = (luxelBand_t *)safe_malloc( numBands * sizeof( *bands ) );
+	}
+	
 	/* clear luxels */
 	for( y = 0; y < lm->sh; y++ )
 	{
@@ -2817,6 +3342,27 @@ void IlluminateRawLightmap(int rawLightmapNum)
 			memset( lm->superLuxels[ lightmapNum ], 0, size );
 	}
 	
+	/* sample the light tree, the lights left in the list are walked one by one */
+	if( cuts != NULL )
+	{
+		if( numBands > 1 )
+		{
+			ThreadTaskGroupInit( &group );
+			for( b = 0; b < numBands; b++ )
+			{
+				bands[ b ].lm = lm;
+				bands[ b ].trace = &trace;
+				bands[ b ].cuts = cuts;
+				bands[ b ].y = b * bandRows;
+				bands[ b ].yEnd = (b + 1) * bandRows < lm->sh ? (b + 1) * bandRows : lm->sh;
+				ThreadSpawnTask( &group, IlluminateLightCutBand, &bands[ b ] );
+			}
+			ThreadWaitTaskGroup( &group );
+		}
+		else
+			IlluminateLightCutRows( lm, cuts, &trace, 0, lm->sh );
+	}
+	
 	/* debugging code */
 	//%	if( trace.numLights <= 0 )
 	//%		Sys_Printf( "Lightmap %9d: 0 lights, axis: %.2f, %.2f, %.2f\n", rawLightmapNum, lm->axis[ 0 ], lm->axis[ 1 ], lm->axis[ 2 ] );
@@ -2846,55 +3392,26 @@ void IlluminateRawLightmap(int rawLightmapNum)
 		memset( lightLuxels, 0, llSize );
 		totalLighted = 0;
 		
-		/* initial pass, one sample per luxel */
-		for( y = 0; y < lm->sh; y++ )
+		/* initial pass, one sample per luxel (large lightmaps are split into row bands for idle threads) */
+		if( numBands > 1 )
 		{
-			for( x = 0; x < lm->sw; x++ )
+			ThreadTaskGroupInit( &group );
+			for( b = 0; b < numBands; b++ )
 			{
-				/* get cluster */
-				cluster = SUPER_CLUSTER( x, y );
-				if( *cluster < 0 )
-					continue;
-				
-				/* get particulars */
-				lightLuxel = LIGHT_LUXEL( x, y );
-				if( deluxemap )
-					deluxel = SUPER_DELUXEL( x, y );
-				origin = SUPER_ORIGIN( x, y );
-				normal = SUPER_NORMAL( x, y );
-
-				/* set contribution count */
-				lightLuxel[ 3 ] = 1.0f;
-
-				/* setup trace */
-				trace.cluster = *cluster;
-				VectorCopy( origin, trace.origin );
-				VectorCopy( normal, trace.normal );
-					
-				/* get light for this sample */
-				LightContribution( &trace, LIGHT_SURFACES, qfalse );
-				VectorCopy( trace.color, lightLuxel );
-
-				/* add to count */
-				if( trace.color[ 0 ] || trace.color[ 1 ] || trace.color[ 2 ] )
-				{
-					lightLuxel[ 4 ] += 1.0f;
-					totalLighted++;
-				}
-			
-				/* add to light direction map */
-				if( deluxemap )
-				{
-					/* vortex: use noShadow color */
-					/* color to grayscale */
-					brightness = trace.colorNoShadow[ 0 ] * 0.3f + trace.colorNoShadow[ 1 ] * 0.59f + trace.colorNoShadow[ 2 ] * 0.11f;
-					brightness *= (1.0 / 255.0);
-					VectorScale( trace.direction, brightness, trace.direction );
-					if( deluxemap )
-						VectorAdd( deluxel, trace.direction, deluxel );
-				}
+				bands[ b ].lm = lm;
+				bands[ b ].trace = &trace;
+				bands[ b ].lightLuxels = lightLuxels;
+				bands[ b ].y = b * bandRows;
+				bands[ b ].yEnd = (b + 1) * bandRows < lm->sh ? (b + 1) * bandRows : lm->sh;
+				bands[ b ].lighted = 0;
+				ThreadSpawnTask( &group, IlluminateLuxelBand, &bands[ b ] );
 			}
+			ThreadWaitTaskGroup( &group );
+			for( b = 0; b < numBands; b++ )
+				totalLighted += bands[ b ].lighted;
 		}
+		else
+			totalLighted = IlluminateLuxelRows( lm, &trace, lightLuxels, 0, lm->sh );
 		
 		/* don't even bother with everything else if nothing was lit */
 		if( totalLighted == 0 )
@@ -2910,11 +3427,13 @@ void IlluminateRawLightmap(int rawLightmapNum)
 		if( luxelFilterRadius == 0 && (filterRadius > 0.0f || filter) )
 			luxelFilterRadius = 1;
 		
-		/* secondary pass, adaptive supersampling (fixme: use a contrast function to determine if subsampling is necessary) */
+		/* secondary pass, adaptive supersampling */
 		/* 2003-09-27: changed it so filtering disamples supersampling, as it would waste time */
 		if( lightSamples > 1 && luxelFilterRadius == 0 )
 		{
-			/* walk luxels */
+			/* flag the luxels of 2x2 stamps that need refining */
+			for( t = 0; t < lm->sw * lm->sh; t++ )
+				refine[ t ] &= ~REFINE_LIGHT;
 			for( y = 0; y < (lm->sh - 1); y++ )
 			{
 				for( x = 0; x < (lm->sw - 1); x++ )
@@ -2923,6 +3442,8 @@ void IlluminateRawLightmap(int rawLightmapNum)
 					mapped = 0;
 					lighted = 0;
 					VectorClear( total );
+					minBrightness = 1e10f;
+					maxBrightness = 0.0f;
 					
 					/* test 2x2 stamp */
 					for( t = 0; t < 4; t++ )
@@ -2942,42 +3463,50 @@ void IlluminateRawLightmap(int rawLightmapNum)
 						VectorAdd( total, lightLuxel, total );
 						if( (lightLuxel[ 0 ] + lightLuxel[ 1 ] + lightLuxel[ 2 ]) > 0.0f )
 							lighted++;
+						brightness = lightLuxel[ 0 ] * 0.3f + lightLuxel[ 1 ] * 0.59f + lightLuxel[ 2 ] * 0.11f;
+						minBrightness = min( minBrightness, brightness );
+						maxBrightness = max( maxBrightness, brightness );
 					}
 					
-					/* if total color is under a certain amount, then don't bother subsampling */
-					if( total[ 0 ] <= 4.0f && total[ 1 ] <= 4.0f && total[ 2 ] <= 4.0f )
+					/* flat or dark stamps keep their single sample */
+					if( !RefineLuxelSamples( total, mapped, lighted, minBrightness, maxBrightness ) )
 						continue;
-					
-					/* if all 4 pixels are either in shadow or light, then don't subsample */
-					if( lighted != 0 && lighted != mapped )
+					for( t = 0; t < 4; t++ )
 					{
-						for( t = 0; t < 4; t++ )
+						sx = x + tests[ t ][ 0 ];
+						sy = y + tests[ t ][ 1 ];
+						if( *SUPER_CLUSTER( sx, sy ) < 0 )
+							continue;
+						
+						/* -samples subsamples right away, once for every stamp the luxel is in */
+						if( !lightSamplesAdaptive )
 						{
-							/* set sample coords */
-							sx = x + tests[ t ][ 0 ];
-							sy = y + tests[ t ][ 1 ];
-							
-							/* get luxel */
-							cluster = SUPER_CLUSTER( sx, sy );
-							if( *cluster < 0 )
-								continue;
-							lightLuxel = LIGHT_LUXEL( sx, sy );
-							origin = SUPER_ORIGIN( sx, sy );
-							
-							/* only subsample shadowed luxels */
-							//%	if( (lightLuxel[ 0 ] + lightLuxel[ 1 ] + lightLuxel[ 2 ]) <= 0.0f )
-							//%		continue;
-							
-							/* subsample it */
-							SubsampleRawLuxel_r( lm, &trace, origin, sx, sy, 0.25f, lightLuxel );
-							
-							/* debug code to colorize subsampled areas to yellow */
-							//%	luxel = SUPER_LUXEL( lightmapNum, sx, sy );
-							//%	VectorSet( luxel, 255, 204, 0 );
+							refine[ sy * lm->sw + sx ] |= REFINE_ANY;
+							numSubsamples += SubsampleRawLuxel_r( lm, &trace, SUPER_ORIGIN( sx, sy ), sx, sy, 0.25f, LIGHT_LUXEL( sx, sy ) );
 						}
+						else
+							refine[ sy * lm->sw + sx ] |= REFINE_LIGHT;
 					}
 				}
 			}
+			
+			/* -adaptive subsamples each flagged luxel once */
+			for( y = 0; y < lm->sh; y++ )
+			{
+				for( x = 0; x < lm->sw; x++ )
+				{
+					if( !(refine[ y * lm->sw + x ] & REFINE_LIGHT) )
+						continue;
+					refine[ y * lm->sw + x ] |= REFINE_ANY;
+					lightLuxel = LIGHT_LUXEL( x, y );
+					origin = SUPER_ORIGIN( x, y );
+					numSubsamples += SubsampleRawLuxel_r( lm, &trace, origin, x, y, 0.25f, lightLuxel );
+					
+					/* debug code to colorize subsampled areas to yellow */
+					//%	luxel = SUPER_LUXEL( lightmapNum, x, y );
+					//%	VectorSet( luxel, 255, 204, 0 );
+				}
+			}
 		}
 		
 		/* allocate sampling lightmap storage */
@@ -2985,7 +3514,7 @@ void IlluminateRawLightmap(int rawLightmapNum)
 		{
 			/* allocate sampling lightmap storage */
 			size = lm->sw * lm->sh * SUPER_LUXEL_SIZE * sizeof( float );
-			lm->superLuxels[ lightmapNum ] = (float *)safe_malloc( size );
+			lm->superLuxels[ lightmapNum ] = (float *)safe_malloc_tag( size, &superLuxelTag );
 			memset( lm->superLuxels[ lightmapNum ], 0, size );
 		}
 		
@@ -3097,17 +3626,67 @@ void IlluminateRawLightmap(int rawLightmapNum)
 		}
 	}
 	
+	/* count refined luxels */
+	if( refine != NULL )
+	{
+		for( i = 0, t = 0; i < lm->sw * lm->sh; i++ )
+		{
+			if( refine[ i ] & REFINE_ANY )
+				t++;
+		}
+		ThreadAtomicAdd( &numLuxelsRefined, t );
+		ThreadAtomicAdd( &numLuxelSubsamples, numSubsamples );
+		free( refine );
+	}
+	
 	/* free temporary luxels */
 	if( lightLuxels != stackLightLuxels )
 		free( lightLuxels );
+	if( bands != NULL )
+		free( bands );
 
 	/* free light list */
 	FreeTraceLights( &trace );
+	FreeLightCuts( cuts );
 
 	/* set counts */
 	numLuxelsIlluminated += (lm->sw * lm->sh);
 }
 
+/*
+RawLightmapCost()
+estimates the work in per-luxel raw lightmap stages as the number of luxels
+*/
+
+float RawLightmapCost( int rawLightmapNum )
+{
+	rawLightmap_t	*lm;
+	
+	
+	lm = &rawLightmaps[ rawLightmapNum ];
+	return (float) lm->sw * lm->sh;
+}
+
+/*
+IlluminateRawLightmapCost()
+estimates the work in IlluminateRawLightmap() as luxels times the lights whose envelopes reach the
+lightmap bounds, the index lookup CreateTraceLightsForBounds() starts with (the plane and pvs tests
+after it are left out, they cost as much as building the list)
+*/
+
+float IlluminateRawLightmapCost( int rawLightmapNum )
+{
+	int				numLightsReached;
+	rawLightmap_t	*lm;
+	
+	
+	lm = &rawLightmaps[ rawLightmapNum ];
+	if( gridOnly || lightmapDebugState )
+		return (float) lm->sw * lm->sh;
+	numLightsReached = CountTraceLightsForBounds( lm->mins, lm->maxs );
+	return (float) lm->sw * lm->sh * (max( numLightsReached, 0 ) + 1);
+}
+
 /*
 FilterRawLightmap
 applies postprocess filtering on luxels
@@ -3708,6 +4287,7 @@ void IlluminateVertexes(int num)
 					/* setup trace */
 					VectorCopy( verts[ i ].xyz, trace.origin );
 					VectorCopy( verts[ i ].normal, trace.normal );
+					trace.randomSeed = RandomSeed( num, i, bounce );
 					
 					/* dirty */
 					if( dirty )
@@ -4343,6 +4923,221 @@ qboolean ChopBounds( vec3_t mins, vec3_t maxs, vec3_t origin, vec3_t normal )
 
 
 
+/*
+light index
+a bvh over the light envelopes, so CreateTraceLightsForBounds() only visits the lights near its bounds
+*/
+
+#define LIGHT_INDEX_LEAF		4
+#define LIGHT_INDEX_STACK		64			/* bvh depth is log2( numLights ) */
+
+typedef struct lightIndexNode_s
+{
+	vec3_t				mins, maxs;
+	int					first, num;		/* children first and first + 1 (num 0), or indexNums range */
+}
+lightIndexNode_t;
+
+static int					numIndexLights = 0, numIndexSuns = 0, numIndexUnlit = 0, numIndexNodes = 0;
+static light_t				**indexLights = NULL;		/* lights in list order */
+static int					*indexNums = NULL;			/* list positions, suns first, then in leaf order */
+static lightIndexNode_t		*indexNodes = NULL;
+static int					lightIndexAxis;
+static THREAD_LOCAL int		*lightScratch = NULL, maxLightScratch = 0;
+
+
+
+/*
+CompareLightIndexOrigins()
+qsort() callback, orders light list positions on lightIndexAxis
+*/
+
+static int CompareLightIndexOrigins( const void *a, const void *b )
+{
+	float		pa, pb;
+	
+	
+	pa = indexLights[ *((const int*) a) ]->origin[ lightIndexAxis ];
+	pb = indexLights[ *((const int*) b) ]->origin[ lightIndexAxis ];
+	if( pa < pb )
+		return -1;
+	if( pa > pb )
+		return 1;
+	return 0;
+}
+
+
+
+/*
+CompareLightIndexNums()
+qsort() callback, restores list order
+*/
+
+static int CompareLightIndexNums( const void *a, const void *b )
+{
+	return *((const int*) a) - *((const int*) b);
+}
+
+
+
+/*
+BuildLightIndex_r()
+median split bvh over the envelope boxes of lights first..first + num - 1
+*/
+
+static void BuildLightIndex_r( int nodeNum, int first, int num )
+{
+	int					i, children;
+	light_t				*light;
+	lightIndexNode_t	*node;
+	vec3_t				mins, maxs, size;
+	
+	
+	/* bound the envelopes and the origins */
+	node = &indexNodes[ nodeNum ];
+	ClearBounds( node->mins, node->maxs );
+	ClearBounds( mins, maxs );
+	for( i = first; i < first + num; i++ )
+	{
+		light = indexLights[ indexNums[ i ] ];
+		node->mins[ 0 ] = min( node->mins[ 0 ], light->origin[ 0 ] - light->envelope );
+		node->mins[ 1 ] = min( node->mins[ 1 ], light->origin[ 1 ] - light->envelope );
+		node->mins[ 2 ] = min( node->mins[ 2 ], light->origin[ 2 ] - light->envelope );
+		node->maxs[ 0 ] = max( node->maxs[ 0 ], light->origin[ 0 ] + light->envelope );
+		node->maxs[ 1 ] = max( node->maxs[ 1 ], light->origin[ 1 ] + light->envelope );
+		node->maxs[ 2 ] = max( node->maxs[ 2 ], light->origin[ 2 ] + light->envelope );
+		AddPointToBounds( light->origin, mins, maxs );
+	}
+	
+	/* leaf */
+	if( num <= LIGHT_INDEX_LEAF )
+	{
+		node->first = first;
+		node->num = num;
+		return;
+	}
+	
+	/* split at the median of the longest axis */
+	VectorSubtract( maxs, mins, size );
+	lightIndexAxis = (size[ 0 ] >= size[ 1 ] && size[ 0 ] >= size[ 2 ]) ? 0 : (size[ 1 ] >= size[ 2 ] ? 1 : 2);
+	qsort( &indexNums[ first ], num, sizeof( *indexNums ), CompareLightIndexOrigins );
+	children = numIndexNodes;
+	numIndexNodes += 2;
+	node->first = children;
+	node->num = 0;
+	BuildLightIndex_r( children, first, num / 2 );
+	BuildLightIndex_r( children + 1, first + num / 2, num - num / 2 );
+}
+
+
+
+/*
+SetupLightIndex()
+rebuilds the light index after the light list changed
+*/
+
+static void SetupLightIndex( void )
+{
+	int			i, num;
+	light_t		*light;
+	
+	
+	/* free the old index */
+	if( indexLights != NULL )
+		free( indexLights );
+	if( indexNums != NULL )
+		free( indexNums );
+	if( indexNodes != NULL )
+		free( indexNodes );
+	
+	/* lights in list order */
+	for( num = 0, light = lights; light != NULL; light = light->next, num++ );
+	numIndexLights = num;
+	indexLights = (light_t**) safe_malloc( (num + 1) * sizeof( *indexLights ) );
+	indexNums = (int*) safe_malloc( (num + 1) * sizeof( *indexNums ) );
+	indexNodes = (lightIndexNode_t*) safe_malloc( (2 * num + 1) * sizeof( *indexNodes ) );
+	for( i = 0, light = lights; light != NULL; light = light->next, i++ )
+		indexLights[ i ] = light;
+	
+	/* suns reach everything, lights without an envelope nothing */
+	numIndexSuns = numIndexUnlit = 0;
+	for( i = 0; i < num; i++ )
+	{
+		if( indexLights[ i ]->envelope <= 0 )
+			numIndexUnlit++;
+		else if( indexLights[ i ]->type == EMIT_SUN )
+			indexNums[ numIndexSuns++ ] = i;
+	}
+	num = numIndexSuns;
+	for( i = 0; i < numIndexLights; i++ )
+	{
+		if( indexLights[ i ]->envelope > 0 && indexLights[ i ]->type != EMIT_SUN )
+			indexNums[ num++ ] = i;
+	}
+	
+	/* build the bvh over the rest */
+	numIndexNodes = 1;
+	BuildLightIndex_r( 0, numIndexSuns, num - numIndexSuns );
+}
+
+
+
+/*
+GatherIndexLights()
+collects the list positions of the suns and the lights whose envelope box touches the bounds
+into lightScratch, in list order, returns the count
+*/
+
+static int GatherIndexLights( vec3_t mins, vec3_t maxs, qboolean sunsOnly )
+{
+	int					i, num, numStack, stack[ LIGHT_INDEX_STACK ];
+	lightIndexNode_t	*node;
+	
+	
+	/* make room */
+	if( maxLightScratch < numIndexLights )
+	{
+		if( lightScratch != NULL )
+			free( lightScratch );
+		maxLightScratch = numIndexLights;
+		lightScratch = (int*) safe_malloc( (maxLightScratch + 1) * sizeof( *lightScratch ) );
+	}
+	
+	/* suns */
+	for( num = 0; num < numIndexSuns; num++ )
+		lightScratch[ num ] = indexNums[ num ];
+	if( sunsOnly || numIndexLights - numIndexUnlit <= numIndexSuns )
+		return num;
+	
+	/* walk the bvh */
+	numStack = 0;
+	stack[ numStack++ ] = 0;
+	while( numStack > 0 )
+	{
+		node = &indexNodes[ stack[ --numStack ] ];
+		if( node->mins[ 0 ] > maxs[ 0 ] || node->maxs[ 0 ] < mins[ 0 ] ||
+			node->mins[ 1 ] > maxs[ 1 ] || node->maxs[ 1 ] < mins[ 1 ] ||
+			node->mins[ 2 ] > maxs[ 2 ] || node->maxs[ 2 ] < mins[ 2 ] )
+			continue;
+		if( node->num > 0 )
+		{
+			for( i = node->first; i < node->first + node->num; i++ )
+				lightScratch[ num++ ] = indexNums[ i ];
+		}
+		else
+		{
+			stack[ numStack++ ] = node->first + 1;
+			stack[ numStack++ ] = node->first;
+		}
+	}
+	
+	/* back to list order */
+	qsort( lightScratch, num, sizeof( *lightScratch ), CompareLightIndexNums );
+	return num;
+}
+
+
+
 /*
 SetupEnvelopes()
 calculates each light's effective envelope,
@@ -4362,13 +5157,6 @@ void SetupEnvelopes( qboolean forGrid, qboolean fastFlag )
 	light_t		*buckets[ 256 ];
 	
 	
-	/* early out for weird cases where there are no lights */
-	if( lights == NULL )
-		return;
-	
-	/* note it */
-	Sys_Printf( "--- SetupEnvelopes%s%s ---\n", forGrid ? " (lightgrid)" : " (lightmaps)", fastFlag ? " (fast)" : "" );
-	
 	/* count lights */
 	numLights = 0;
 	numCulledLights = 0;
@@ -4378,6 +5166,17 @@ void SetupEnvelopes( qboolean forGrid, qboolean fastFlag )
 	numSpotLights  = 0;
 	numSunLights = 0;
 	numPointLights = 0;
+	
+	/* early out for weird cases where there are no lights (still counts as set up, with an empty index) */
+	if( lights == NULL )
+	{
+		SetupLightIndex();
+		return;
+	}
+	
+	/* note it */
+	Sys_Printf( "--- SetupEnvelopes%s%s ---\n", forGrid ? " (lightgrid)" : " (lightmaps)", fastFlag ? " (fast)" : "" );
+	
 	owner = &lights;
 	while( *owner != NULL )
 	{
@@ -4657,6 +5456,9 @@ void SetupEnvelopes( qboolean forGrid, qboolean fastFlag )
 		}
 	}
 	
+	/* index the light envelopes */
+	SetupLightIndex();
+	
 	/* emit some statistics */
 	if( numPointLights || verbose )
 		Sys_Printf( "%9d point lights\n", numPointLights );
@@ -4674,6 +5476,54 @@ void SetupEnvelopes( qboolean forGrid, qboolean fastFlag )
 		Sys_Printf( "%9d culled lights\n", numCulledLights );
 }
 
+/*
+GatherSphereLights()
+gathers the lights whose envelopes can reach the bounding sphere of a box from the index,
+returns the count and the sphere
+*/
+
+static int GatherSphereLights( vec3_t mins, vec3_t maxs, vec3_t origin, float *radius )
+{
+	int			i;
+	vec3_t		dir, boundsMins, boundsMaxs;
+	
+	
+	/* calculate spherical bounds */
+	VectorAdd( mins, maxs, origin );
+	VectorScale( origin, 0.5f, origin );
+	VectorSubtract( maxs, origin, dir );
+	*radius = (float) VectorLength( dir );
+	
+	/* padded for the sphere test's rounding */
+	for( i = 0; i < 3; i++ )
+	{
+		boundsMins[ i ] = origin[ i ] - *radius - 1.0f;
+		boundsMaxs[ i ] = origin[ i ] + *radius + 1.0f;
+	}
+	return GatherIndexLights( boundsMins, boundsMaxs, sunOnly );
+}
+
+
+
+/*
+CountTraceLightsForBounds()
+counts the lights that pass the envelope cull of CreateTraceLightsForBounds() for a box, without
+the per light tests or the light list; returns -1 if the lights are not set up yet
+*/
+
+int CountTraceLightsForBounds( vec3_t mins, vec3_t maxs )
+{
+	vec3_t		origin;
+	float		radius;
+	
+	
+	if( numLights < 0 )
+		return -1;
+	return GatherSphereLights( mins, maxs, origin, &radius );
+}
+
+
+
 /*
 CreateTraceLightsForBounds()
 creates a list of lights that affect the given bounding box and pvs clusters (bsp leaves)
@@ -4681,28 +5531,26 @@ creates a list of lights that affect the given bounding box and pvs clusters (bs
 
 void CreateTraceLightsForBounds( qboolean forGrid, vec3_t mins, vec3_t maxs, vec3_t normal, int numClusters, int *clusters, int flags, trace_t *trace )
 {
-	int			i;
+	int			i, c, numCandidates;
 	light_t		*light;
 	vec3_t		origin, dir, nullVector = { 0.0f, 0.0f, 0.0f };
 	float		radius, dist, length;
 	
-	/* potential pre-setup  */
+	/* potential pre-setup (single threaded callers only, threaded stages set up the lights first) */
 	if( numLights < 0 )
 		SetupEnvelopes( forGrid, fast );
 	
 	/* debug code */
 	//% Sys_Printf( "CTWLFB: (%4.1f %4.1f %4.1f) (%4.1f %4.1f %4.1f)\n", mins[ 0 ], mins[ 1 ], mins[ 2 ], maxs[ 0 ], maxs[ 1 ], maxs[ 2 ] );
 	
+	/* get the lights whose envelopes can reach the bounding sphere from the index */
+	numCandidates = GatherSphereLights( mins, maxs, origin, &radius );
+	lightsEnvelopeCulled += numIndexLights - numCandidates;
+	
 	/* allocate the light list */
-	trace->lights = (light_t **)safe_malloc( sizeof( light_t* ) * (numLights + 1) );
+	trace->lights = (light_t **)safe_malloc( sizeof( light_t* ) * (numCandidates + 1) );
 	trace->numLights = 0;
 	
-	/* calculate spherical bounds */
-	VectorAdd( mins, maxs, origin );
-	VectorScale( origin, 0.5f, origin );
-	VectorSubtract( maxs, origin, dir );
-	radius = (float) VectorLength( dir );
-	
 	/* get length of normal vector */
 	if( normal != NULL )
 		length = VectorLength( normal );
@@ -4714,8 +5562,10 @@ void CreateTraceLightsForBounds( qboolean forGrid, vec3_t mins, vec3_t maxs, vec
 	
 	/* test each light and see if it reaches the sphere */
 	/* note: the attenuation code MUST match LightContributionAllStyles() */
-	for( light = lights; light; light = light->next )
+	for( c = 0; c < numCandidates; c++ )
 	{
+		light = indexLights[ lightScratch[ c ] ];
+		
 		/* check zero sized envelope */
 		if( light->envelope <= 0 )
 		{
@@ -4993,7 +5843,7 @@ float FloodLightForSample( trace_t *trace , float floodLightDistance, qboolean f
     {
 		/* iterate through ordered vectors */
 		for( i = 0; i < numFloodVectors; i++ )
-			if (rand()%10 != 0 ) continue;
+			if( (int) (RandomForSeed( trace->randomSeed, i ) * 10.0f) != 0 ) continue;
 	}
 	else
 	{
@@ -5122,6 +5972,7 @@ void FloodLightRawLightmapPass( rawLightmap_t *lm , vec3_t lmFloodLightRGB, floa
 			trace.cluster = *cluster;
 			VectorCopy( origin, trace.origin );
 			VectorCopy( normal, trace.normal );
+			trace.randomSeed = RandomSeed( lm - rawLightmaps, y * lm->sw + x, 0 );
    
 			/* get floodlight */
 			floodLightAmount = FloodLightForSample( &trace , lmFloodLightDistance, lmFloodLightLowQuality)*lmFloodLightIntensity;
@@ -54,6 +54,9 @@ for having their resolutions scaled down.
 
 ------------------------------------------------------------------------------- */
 
+memTag_t	rawLightmapTag = MEMTAG( "raw lightmaps" );
+memTag_t	superLuxelTag = MEMTAG( "super luxels" );
+
 /*
 WriteTGA24()
 based on WriteTGA() from imagelib.c
@@ -374,7 +377,7 @@ void FinishRawLightmap( int num )
 	}
 	
 	/* allocate buffer for clusters and copy */
-	lm->lightClusters = (int *)safe_malloc( lm->numLightClusters * sizeof( *lm->lightClusters ) );
+	lm->lightClusters = (int *)safe_malloc_tag( lm->numLightClusters * sizeof( *lm->lightClusters ), &rawLightmapTag );
 	c = 0;
 	for( i = 0; i < lm->numLightSurfaces; i++ )
 	{
@@ -416,7 +419,7 @@ void FinishRawLightmap( int num )
 	/* allocate bsp lightmap storage */
 	size = lm->w * lm->h * BSP_LUXEL_SIZE * sizeof( float );
 	if( lm->bspLuxels[ 0 ] == NULL )
-		lm->bspLuxels[ 0 ] = (float *)safe_malloc( size );
+		lm->bspLuxels[ 0 ] = (float *)safe_malloc_tag( size, &rawLightmapTag );
 	memset( lm->bspLuxels[ 0 ], 0, size );
 	
 	/* allocate radiosity lightmap storage */
@@ -424,39 +427,39 @@ void FinishRawLightmap( int num )
 	{
 		size = lm->w * lm->h * RAD_LUXEL_SIZE * sizeof( float );
 		if( lm->radLuxels[ 0 ] == NULL )
-			lm->radLuxels[ 0 ] = (float *)safe_malloc( size );
+			lm->radLuxels[ 0 ] = (float *)safe_malloc_tag( size, &rawLightmapTag );
 		memset( lm->radLuxels[ 0 ], 0, size );
 	}
 
 	/* allocate sampling lightmap storage */
 	size = lm->sw * lm->sh * SUPER_LUXEL_SIZE * sizeof( float );
 	if( lm->superLuxels[ 0 ] == NULL )
-		lm->superLuxels[ 0 ] = (float *)safe_malloc( size );
+		lm->superLuxels[ 0 ] = (float *)safe_malloc_tag( size, &superLuxelTag );
 	memset( lm->superLuxels[ 0 ], 0, size );
 	
 		
 	/* allocate sampled origin map storage */
 	size = lm->sw * lm->sh * SUPER_ORIGIN_SIZE * sizeof( float );
 	if( lm->superOrigins == NULL )
-		lm->superOrigins = (float *)safe_malloc( size );
+		lm->superOrigins = (float *)safe_malloc_tag( size, &superLuxelTag );
 	memset( lm->superOrigins, 0, size );
 
 	/* allocate normal map storage */
 	size = lm->sw * lm->sh * SUPER_NORMAL_SIZE * sizeof( float );
 	if( lm->superNormals == NULL )
-		lm->superNormals = (float *)safe_malloc( size );
+		lm->superNormals = (float *)safe_malloc_tag( size, &superLuxelTag );
 	memset( lm->superNormals, 0, size );
 		
 	/* allocate floodlight map storage */
 	size = lm->sw * lm->sh * SUPER_FLOODLIGHT_SIZE * sizeof( float );
 	if( lm->superFloodLight == NULL )
-		lm->superFloodLight = (float *)safe_malloc( size );
+		lm->superFloodLight = (float *)safe_malloc_tag( size, &superLuxelTag );
 	memset( lm->superFloodLight, 0, size );
 		
 	/* allocate cluster map storage */
 	size = lm->sw * lm->sh * sizeof( int );
 	if( lm->superClusters == NULL )
-		lm->superClusters = (int *)safe_malloc( size );
+		lm->superClusters = (int *)safe_malloc_tag( size, &superLuxelTag );
 	size = lm->sw * lm->sh;
 	sc = lm->superClusters;
 	for( i = 0; i < size; i++ )
@@ -465,13 +468,13 @@ void FinishRawLightmap( int num )
 	/* allocate real origins storage */
 	size = lm->sw * lm->sh * SUPER_TRIORIGIN_SIZE * sizeof( float );
 	if( lm->superTriorigins == NULL )
-		lm->superTriorigins = (float *)safe_malloc( size );
+		lm->superTriorigins = (float *)safe_malloc_tag( size, &superLuxelTag );
 	memset( lm->superTriorigins, 0, size );
 
 	/* allocate triangle normals storage */
 	size = lm->sw * lm->sh * SUPER_TRINORMAL_SIZE * sizeof( float );
 	if( lm->superTrinormals == NULL )
-		lm->superTrinormals = (float *)safe_malloc( size );
+		lm->superTrinormals = (float *)safe_malloc_tag( size, &superLuxelTag );
 	memset( lm->superTrinormals, 0, size );
 
 	/* deluxemap allocation */
@@ -480,19 +483,19 @@ void FinishRawLightmap( int num )
 		/* allocate sampling deluxel storage */
 		size = lm->sw * lm->sh * SUPER_DELUXEL_SIZE * sizeof( float );
 		if( lm->superDeluxels == NULL )
-			lm->superDeluxels = (float *)safe_malloc( size );
+			lm->superDeluxels = (float *)safe_malloc_tag( size, &superLuxelTag );
 		memset( lm->superDeluxels, 0, size );
 			
 		/* allocate bsp deluxel storage */
 		size = lm->w * lm->h * BSP_DELUXEL_SIZE * sizeof( float );
 		if( lm->bspDeluxels == NULL )
-			lm->bspDeluxels = (float *)safe_malloc( size );
+			lm->bspDeluxels = (float *)safe_malloc_tag( size, &rawLightmapTag );
 		memset( lm->bspDeluxels, 0, size );
 
 		/* allocate bsp normals storage */
 		size = lm->w * lm->h * BSP_NORMAL_SIZE * sizeof( float );
 		if( lm->bspNormals == NULL )
-			lm->bspNormals = (float *)safe_malloc( size );
+			lm->bspNormals = (float *)safe_malloc_tag( size, &rawLightmapTag );
 		memset( lm->bspNormals, 0, size );
 	}
 
@@ -1153,7 +1156,7 @@ void SetupSurfaceLightmaps( void )
 	/* allocate a list of raw lightmaps */
 	numRawSuperLuxels = 0;
 	numRawLightmaps = 0;
-	rawLightmaps = (rawLightmap_t *)safe_malloc( numSurfsLightmapped * sizeof( *rawLightmaps ) );
+	rawLightmaps = (rawLightmap_t *)safe_malloc_tag( numSurfsLightmapped * sizeof( *rawLightmaps ), &rawLightmapTag );
 	memset( rawLightmaps, 0, numSurfsLightmapped * sizeof( *rawLightmaps ) );
 
 	/* init pacifier */
@@ -3080,7 +3083,7 @@ void StoreSurfaceLightmaps( void )
 			if( lm->bspLuxels[ lightmapNum ] == NULL )
 			{
 				size = lm->w * lm->h * BSP_LUXEL_SIZE * sizeof( float );
-				lm->bspLuxels[ lightmapNum ] = (float *)safe_malloc( size );
+				lm->bspLuxels[ lightmapNum ] = (float *)safe_malloc_tag( size, &rawLightmapTag );
 				memset( lm->bspLuxels[ lightmapNum ], 0, size );
 			}
 
@@ -3089,7 +3092,7 @@ void StoreSurfaceLightmaps( void )
 			{
 				size = lm->w * lm->h * RAD_LUXEL_SIZE * sizeof( float );
 				if( lm->radLuxels[ lightmapNum ] == NULL )
-					lm->radLuxels[ lightmapNum ] = (float *)safe_malloc( size );
+					lm->radLuxels[ lightmapNum ] = (float *)safe_malloc_tag( size, &rawLightmapTag );
 				memset( lm->radLuxels[ lightmapNum ], 0, size );
 			}
 			
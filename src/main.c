@@ -50,6 +50,54 @@ vec_t Random( void )
 
 
 
+/*
+RandomMix()
+integer hash finalizer, every input bit affects every output bit
+*/
+
+static unsigned int RandomMix( unsigned int x )
+{
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+
+
+/*
+RandomSeed()
+hashes up to three indexes (lightmap, luxel, pass...) into the seed of a random stream
+*/
+
+unsigned int RandomSeed( int a, int b, int c )
+{
+	unsigned int	seed;
+	
+	
+	seed = RandomMix( (unsigned int) a + 0x9e3779b9U );
+	seed = RandomMix( seed ^ ((unsigned int) b + 0x85ebca6bU) );
+	seed = RandomMix( seed ^ ((unsigned int) c + 0xc2b2ae35U) );
+	return seed;
+}
+
+
+
+/*
+RandomForSeed()
+returns the nth pseudorandom number between 0 and 1 of a stream; there is no shared state, so
+threaded code gets the same numbers regardless of thread count or scheduling
+*/
+
+vec_t RandomForSeed( unsigned int seed, int n )
+{
+	return (vec_t) (RandomMix( seed ^ RandomMix( (unsigned int) n + 0x27d4eb2fU ) ) >> 8) * (1.0f / 16777216.0f);
+}
+
+
+
 /*
 ExitQ3Map()
 cleanup routine
@@ -57,6 +105,7 @@ cleanup routine
 
 static void ExitQ3Map( void )
 {
+	Sys_LogShutdown();
 	if( bspDrawVerts != NULL )
 		free( bspDrawVerts );
 	if( bspDrawSurfaces != NULL )
@@ -616,6 +665,7 @@ int main( int argc, char **argv )
 {
 	int	i, r;
 	double start, end;
+	qboolean syncLog = qfalse;
 	
 	/* we want consistent 'randomness' */
 	srand( 0 );
@@ -686,7 +736,30 @@ int main( int argc, char **argv )
 			argv[ i ] = NULL;
 		}
 
-		/* memlog (write a memlog.txt) */
+		/* stage profile (write a chrome trace) */
+		else if( !strcmp( argv[ i ], "-profile" ) )
+		{
+			argv[ i ] = NULL;
+			i++;
+			ProfileStart( argv[ i ] );
+			argv[ i ] = NULL;
+		}
+
+		/* print on the calling thread instead of the log writer */
+		else if( !strcmp( argv[ i ], "-synclog" ) )
+		{
+			syncLog = qtrue;
+			argv[ i ] = NULL;
+		}
+
+		/* pin pooled worker threads to cores */
+		else if( !strcmp( argv[ i ], "-affinity" ) )
+		{
+			threadAffinity = qtrue;
+			argv[ i ] = NULL;
+		}
+
+		/* memlog (tagged memory peaks per stage, written to memlog.txt) */
 		else if( !strcmp( argv[ i ], "-memlog" ) )
 		{
 			memlog = qtrue;
@@ -711,8 +784,13 @@ int main( int argc, char **argv )
 	PicoSetLoadFileFunc( PicoLoadFileFunc );
 	PicoSetFreeFileFunc( free );
 	
-	/* set number of threads */
+	/* hand console and editor output to the log writer */
+	if( !syncLog )
+		Sys_LogStart();
+	
+	/* set number of threads and start worker pool shared by all stages */
 	ThreadSetDefault();
+	ThreadPoolStart();
 	
 	/* generate sinusoid jitter table */
 	for( i = 0; i < MAX_JITTERS; i++ )
@@ -807,6 +885,9 @@ int main( int argc, char **argv )
 	else
 		r = BSPMain( argc, argv );
 
+	/* write stage profile */
+	ProfileWrite();
+
 	/* emit time */
 	end = I_FloatTime();
 	Sys_Printf( "%9.0f seconds elapsed\n", end - start );
@@ -815,6 +896,12 @@ int main( int argc, char **argv )
 	if (memlog)
 		safe_malloc_logend();
 	
+	/* stop worker pool */
+	ThreadPoolShutdown();
+	
+	/* flush log */
+	Sys_LogShutdown();
+	
 	/* shut down connection */
 	Broadcast_Shutdown();
 	
@@ -650,7 +650,7 @@ void InsertModel( char *name, int frame, int skin, m4x4_t transform, float uvSca
 					}
 					else
 					{
-						free(buildBrush);
+						FreeBrush( buildBrush );
 						continue;
 					}
 
@@ -669,7 +669,7 @@ void InsertModel( char *name, int frame, int skin, m4x4_t transform, float uvSca
 							*added_brushes += 1;
 					}
 					else
-						free( buildBrush );
+						FreeBrush( buildBrush );
 				}
 			}
 		}
@@ -36,8 +36,8 @@ several games based on the Quake III Arena engine, in the form of "Q3Map2."
 /* dependencies */
 #include "q3map2.h"
 
-int		c_active_portals;
-int		c_peak_portals;
+memPool_t	portalPool = MEMPOOL( "portal", sizeof( portal_t ), 1 );
+
 int		c_boundary;
 int		c_boundary_sides;
 
@@ -50,12 +50,7 @@ portal_t *AllocPortal (void)
 {
 	portal_t	*p;
 	
-	if( numthreads == 1 )
-		c_active_portals++;
-	if (c_active_portals > c_peak_portals)
-		c_peak_portals = c_active_portals;
-	
-	p = (portal_t *)safe_malloc (sizeof(portal_t));
+	p = (portal_t *)MemPoolAlloc (&portalPool, sizeof(portal_t));
 	memset (p, 0, sizeof(portal_t));
 	
 	return p;
@@ -65,9 +60,7 @@ void FreePortal (portal_t *p)
 {
 	if (p->winding)
 		FreeWinding (p->winding);
-	if( numthreads == 1 )
-		c_active_portals--;
-	free (p);
+	MemPoolFree (&portalPool, p);
 }
 
 
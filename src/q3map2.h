@@ -67,6 +67,8 @@ dependencies
 #include "polylib.h"
 #include "imagelib.h"
 #include "threads.h"
+#include "profile.h"
+#include "mempool.h"
 #include "inout.h"
 #include "vfs.h"
 #include "png.h"
@@ -239,7 +241,8 @@ constants
 #define LIGHT_Q3A_DEFAULT		(LIGHT_ATTEN_ANGLE | LIGHT_ATTEN_DISTANCE | LIGHT_GRID | LIGHT_SURFACES | LIGHT_FAST)
 #define LIGHT_WOLF_DEFAULT		(LIGHT_ATTEN_LINEAR | LIGHT_ATTEN_DISTANCE | LIGHT_GRID | LIGHT_SURFACES | LIGHT_FAST)
 
-#define MAX_TRACE_TEST_NODES	4096
+#define MAX_PACKET_RAYS			16		/* a 4x4 tile of luxels */
+#define MAX_LIGHT_CUT			64		/* -lightcuts limit */
 
 #define LUXEL_EPSILON			0.0f
 #define VERTEX_EPSILON			0.0f
@@ -1323,6 +1326,8 @@ pstack_t;
 typedef struct
 {
 	vportal_t			*base;
+	byte				*portalvis;		/* where visible portals are marked (base->portalvis unless split) */
+	int					split;			/* only flow through this portal of the base leaf (-1 for all) */
 	int					c_chains;
 	pstack_t			pstack_head;
 }
@@ -1376,6 +1381,26 @@ typedef struct light_s
 light_t;
 
 
+/* a binary tree over the plain area lights of a raw lightmap, see CreateLightCuts() */
+typedef struct lightCutNode_s
+{
+	vec3_t				mins, maxs;		/* of the light origins */
+	float				intensity;		/* sum of the lights' photons times color */
+	int					children[ 2 ];
+	light_t				*light;			/* leafs only */
+}
+lightCutNode_t;
+
+typedef struct lightCutTree_s
+{
+	int					numLights;
+	light_t				**lights;
+	int					numNodes;
+	lightCutNode_t		*nodes;
+}
+lightCutTree_t;
+
+
 typedef struct
 {
 	/* constant input */
@@ -1396,6 +1421,7 @@ typedef struct
 	int					cluster;
 	vec3_t				origin, normal;
 	vec_t				inhibitRadius;	/* sphere in which occluding geometry is ignored */
+	unsigned int		randomSeed;		/* see RandomSeed(), for sampling that needs random vectors */
 	
 	/* per-light input */
 	light_t				*light;
@@ -1404,6 +1430,8 @@ typedef struct
 	/* calculated input */
 	vec3_t				displacement, direction;
 	vec_t				distance;
+	unsigned int		recvGroups, selfGroups;	/* cast group bits that shadow, or need a closer look */
+	unsigned int		surfaceHash;	/* bit per surfaces[] & 31 */
 	
 	/* input and output */
 	vec3_t				color;			/* starts out at full color, may be reduced if transparent surfaces are crossed */
@@ -1414,15 +1442,42 @@ typedef struct
 	int					compileFlags;	/* for determining surface compile flags traced through */
 	qboolean			passSolid;
 	qboolean			opaque;
+	int					hitSurfaceNum;	/* bsp surface of the triangle that made the trace opaque, or -1 */
 	shaderInfo_t        *skyLightShader;
 
 	/* working data */
-	int					numTestNodes;
-	int					testNodes[ MAX_TRACE_TEST_NODES ]; 
+	qboolean			testSkybox;
 }
 trace_t;
 
 
+/* a group of rays that share the constant input of one trace_t, see TraceLinePacket() */
+typedef struct
+{
+	int					numRays;
+	
+	/* input */
+	vec3_t				origin[ MAX_PACKET_RAYS ], end[ MAX_PACKET_RAYS ];
+	int					user[ MAX_PACKET_RAYS ];		/* caller data, not used by the tracer */
+	
+	/* calculated input */
+	vec3_t				direction[ MAX_PACKET_RAYS ];
+	vec_t				distance[ MAX_PACKET_RAYS ];
+	
+	/* input and output, as in trace_t */
+	vec3_t				color[ MAX_PACKET_RAYS ];
+	
+	/* output */
+	vec3_t				hit[ MAX_PACKET_RAYS ];
+	int					compileFlags[ MAX_PACKET_RAYS ];
+	qboolean			passSolid[ MAX_PACKET_RAYS ];
+	qboolean			opaque[ MAX_PACKET_RAYS ];
+	int					hitSurfaceNum[ MAX_PACKET_RAYS ];
+	shaderInfo_t		*skyLightShader[ MAX_PACKET_RAYS ];
+}
+tracePacket_t;
+
+
 
 /* must be identical to bspDrawVert_t except for float color! */
 typedef struct
@@ -1573,6 +1628,8 @@ prototypes
 
 /* main.c */
 vec_t						Random( void );
+unsigned int				RandomSeed( int a, int b, int c );
+vec_t						RandomForSeed( unsigned int seed, int n );
 int							BSPInfo( int count, char **fileNames );
 int							ScaleBSPMain( int argc, char **argv );
 int							ConvertMain( int argc, char **argv );
@@ -1598,6 +1655,8 @@ int							ConvertBSPToMap( char *bspName, int collapseByTexture );
 int							ConvertBSPToASE( char *bspName, int collapseByTexture );
 
 /* brush.c */
+extern memPool_t			brushPool, nodePool;
+
 sideRef_t					*AllocSideRef( side_t *side, sideRef_t *next );
 int							CountBrushList( brush_t *brushes );
 brush_t						*AllocBrush( int numsides );
@@ -1621,6 +1680,7 @@ void						SplitBrush( brush_t *brush, int planenum, brush_t **front, brush_t **b
 
 tree_t						*AllocTree( void );
 node_t						*AllocNode( void );
+void						FreeTreeNode( node_t *node );
 
 
 /* mesh.c */
@@ -1648,6 +1708,8 @@ void						AddBrushBevels( void );
 brush_t						*FinishBrush( void );
 
 /* portals.c */
+extern memPool_t			portalPool;
+
 void						MakeHeadnodePortals( tree_t *tree );
 void						MakeNodePortal( node_t *node );
 void						SplitNodePortals( node_t *node );
@@ -1828,6 +1890,7 @@ int							VisMain( int argc, char **argv );
 int							CountBits( byte *bits, int numbits );
 void						PassageFlow( int portalnum );
 void						CreatePassages( int portalnum );
+float						CreatePassagesCost( int portalnum );
 void						PassageMemory( void );
 void						BasePortalVis( int portalnum );
 void						BetterPortalVis( int portalnum );
@@ -1841,13 +1904,20 @@ float						PointToPolygonFormFactor( const vec3_t point, const vec3_t normal, co
 int							LightContribution ( trace_t *trace, int lightflags, qboolean point3d );
 void						LightContributionAllStyles( trace_t *trace, byte styles[ MAX_LIGHTMAPS ], vec3_t colors[ MAX_LIGHTMAPS ], int lightflags, qboolean point3d );
 int                         LightContributionSuper(trace_t *trace, int lightflags, qboolean point3d, int samples, const vec3_t multiVec1, const vec3_t multiVec2, const vec3_t multiVec3, float sampleSize );
+qboolean					LightContributionShadowed( light_t *light, int compileFlags, qboolean passSolid, qboolean opaque );
 int							LightMain( int argc, char **argv );
 
 
 /* light_trace.c */
 void						SetupTraceNodes( void );
 void						TraceLine( trace_t *trace );
+void						AddTracePacketRay( tracePacket_t *packet, trace_t *trace, int user );
+void						TraceLineShadow( trace_t *trace );
+void						TraceLinePacket( trace_t *trace, tracePacket_t *packet, qboolean shadow );
 float						SetupTrace( trace_t *trace );
+void						ResetTraceRayStats( void );
+void						PrintTraceRayStats( void );
+void						TraceGeometryKey( byte key[ 16 ] );
 
 
 /* light_bounce.c */
@@ -1856,6 +1926,23 @@ void						RadLightForTriangles( int num, int lightmapNum, rawLightmap_t *lm, sha
 void						RadLightForPatch( int num, int lightmapNum, rawLightmap_t *lm, shaderInfo_t *si, float scale, float subdivide, clipWork_t *cw );
 void						RadCreateDiffuseLights( void );
 void						RadFreeLights();
+qboolean					BounceCacheRawLightmaps( void );
+qboolean					BounceGatherRawLightmaps( void );
+
+
+/* light_relight.c */
+void						SetupRelight( int argc, char **argv );
+void						LoadRelight( void );
+qboolean					RelightRawLightmap( int rawLightmapNum, trace_t *trace );
+qboolean					RelightGridBlock( int num, trace_t *trace );
+void						WriteRelightGrid( void );
+void						WriteRelight( void );
+
+
+/* light_cuts.c */
+lightCutTree_t				*CreateLightCuts( rawLightmap_t *lm, trace_t *trace );
+void						FreeLightCuts( lightCutTree_t *tree );
+void						IlluminateLightCutRows( rawLightmap_t *lm, lightCutTree_t *tree, trace_t *trace, int y0, int y1 );
 
 
 /* light_ydnar.c */
@@ -1877,6 +1964,8 @@ float						FloodLightForSample( trace_t *trace , float floodLightDistance, qbool
 void						FloodLightRawLightmap(int num);
 
 void						IlluminateRawLightmap(int num);
+float						RawLightmapCost(int num);
+float						IlluminateRawLightmapCost(int num);
 void						LightGridRawLightmap(int num);
 void						FilterRawLightmap(int num);
 void						StitchRawLightmap(int num);
@@ -1893,6 +1982,7 @@ int							ClusterForPointExtFilter( vec3_t point, float epsilon, int numClusters
 int							ShaderForPointInLeaf( vec3_t point, int leafNum, float epsilon, int wantContentFlags, int wantSurfaceFlags, int *contentFlags, int *surfaceFlags );
 void						SetupEnvelopes( qboolean forGrid, qboolean fastFlag );
 void						FreeTraceLights( trace_t *trace );
+int							CountTraceLightsForBounds( vec3_t mins, vec3_t maxs );
 void						CreateTraceLightsForBounds( qboolean forGrid, vec3_t mins, vec3_t maxs, vec3_t normal, int numClusters, int *clusters, int flags, trace_t *trace );
 void						CreateTraceLightsForSurface( int num, trace_t *trace );
 
@@ -1910,6 +2000,8 @@ void						StoreSurfaceLightmaps( void );
 
 void                        GetExternalLightmapPath(char *source, char *prefixPath, int lightmapNum, char *ext, char *outLightmapName);
 
+extern memTag_t				rawLightmapTag, superLuxelTag;
+
 /* optimize.c */
 int                         OptimizeBSPMain( int argc, char **argv );
 
@@ -2266,6 +2358,9 @@ light global variables
 Q_EXTERN qboolean			wolfLight Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			loMem Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			loMemSky Q_ASSIGN( qfalse );
+Q_EXTERN qboolean			traceBVH Q_ASSIGN( qfalse );
+Q_EXTERN qboolean			traceCache Q_ASSIGN( qfalse );
+Q_EXTERN qboolean			incrementalLight Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			noStyles Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			keepLights Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			colorNormalize Q_ASSIGN( qfalse );
@@ -2294,6 +2389,10 @@ Q_EXTERN int				bounce Q_ASSIGN( 0 );
 Q_EXTERN qboolean			bounceOnly Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			bouncing Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			bouncegrid Q_ASSIGN( qfalse );
+Q_EXTERN qboolean			bounceCache Q_ASSIGN( qfalse );
+Q_EXTERN int				bounceCacheSamples Q_ASSIGN( 64 );
+Q_EXTERN qboolean			bounceGather Q_ASSIGN( qfalse );
+Q_EXTERN int				bounceGatherSamples Q_ASSIGN( 64 );
 Q_EXTERN qboolean			normalmap Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			trisoup Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			shade Q_ASSIGN( qfalse );
@@ -2303,6 +2402,10 @@ Q_EXTERN int				gridSuperSample Q_ASSIGN( 0 );
 Q_EXTERN qboolean           gridOnly Q_ASSIGN( qfalse );
 Q_EXTERN qboolean           gridFromLightmap Q_ASSIGN( qfalse );
 Q_EXTERN int				lightSamples Q_ASSIGN( 1 );
+Q_EXTERN qboolean			lightSamplesAdaptive Q_ASSIGN( qfalse );
+Q_EXTERN float				lightSamplesContrast Q_ASSIGN( 0.0f );
+Q_EXTERN int				lightCutSize Q_ASSIGN( 0 );
+Q_EXTERN float				lightCutQuality Q_ASSIGN( 0.02f );
 Q_EXTERN qboolean			filter Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			dark Q_ASSIGN( qfalse );
 Q_EXTERN qboolean			sunOnly Q_ASSIGN( qfalse );
@@ -2341,6 +2444,8 @@ Q_EXTERN dirtMode_t			dirtMode Q_ASSIGN( DIRTMODE_ORDERED_CONE );
 Q_EXTERN dirtFilter_t		dirtFilter Q_ASSIGN( DIRTFILTER_AVERAGE );
 Q_EXTERN float				dirtDepth Q_ASSIGN( 128.0f );
 Q_EXTERN float				dirtDepthExponent Q_ASSIGN( 2.0f );
+Q_EXTERN int				dirtEarlyOut Q_ASSIGN( 0 );
+Q_EXTERN int				numDirtSamplesStopped Q_ASSIGN( 0 );
 Q_EXTERN float				dirtScale Q_ASSIGN( 1.0f );
 Q_EXTERN float				dirtGain Q_ASSIGN( 1.0f );
 Q_EXTERN vec3_t             dirtGainMask Q_ASSIGN_VEC3( 1, 1, 1 );
@@ -2551,6 +2656,10 @@ Q_EXTERN int				numLuxelsNudged Q_ASSIGN( 0 );
 Q_EXTERN int				numLuxelsRemapped Q_ASSIGN( 0 );
 Q_EXTERN int				numLuxelsOccluded Q_ASSIGN( 0 );
 Q_EXTERN int				numLuxelsIlluminated Q_ASSIGN( 0 );
+Q_EXTERN int				numLuxelsRefined Q_ASSIGN( 0 );
+Q_EXTERN int				numLuxelSubsamples Q_ASSIGN( 0 );
+Q_EXTERN int				numLightCutLights Q_ASSIGN( 0 );
+Q_EXTERN int				numLightCutSamples Q_ASSIGN( 0 );
 Q_EXTERN int				numLuxelsStitched Q_ASSIGN( 0 );
 Q_EXTERN int				numVertsIlluminated Q_ASSIGN( 0 );
 
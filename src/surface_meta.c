@@ -62,6 +62,8 @@ int					maxMetaTriangles = 0;
 int					numMetaTriangles = 0;
 metaTriangle_t		*metaTriangles = NULL;
 
+static memTag_t		metaTriangleTag = MEMTAG( "meta triangles" );
+
 /*
 ClearMetaVertexes()
 called before staring a new entity to clear out the triangle list
@@ -87,11 +89,11 @@ static int FindMetaVertex( bspDrawVert_t *src )
 	{
 		/* reallocate more room */
 		maxMetaVerts += GROW_META_VERTS;
-		temp = (bspDrawVert_t *)safe_malloc( maxMetaVerts * sizeof( bspDrawVert_t ) );
+		temp = (bspDrawVert_t *)safe_malloc_tag( maxMetaVerts * sizeof( bspDrawVert_t ), &metaTriangleTag );
 		if( metaVerts != NULL )
 		{
 			memcpy( temp, metaVerts, numMetaVerts * sizeof( bspDrawVert_t ) );
-			free( metaVerts );
+			safe_free_tag( metaVerts );
 		}
 		metaVerts = temp;
 	}
@@ -118,11 +120,11 @@ static int AddMetaTriangle( void )
 	{
 		/* reallocate more room */
 		maxMetaTriangles += GROW_META_TRIANGLES;
-		temp = (metaTriangle_t *)safe_malloc( maxMetaTriangles * sizeof( metaTriangle_t ) );
+		temp = (metaTriangle_t *)safe_malloc_tag( maxMetaTriangles * sizeof( metaTriangle_t ), &metaTriangleTag );
 		if( metaTriangles != NULL )
 		{
 			memcpy( temp, metaTriangles, numMetaTriangles * sizeof( metaTriangle_t ) );
-			free( metaTriangles );
+			safe_free_tag( metaTriangles );
 		}
 		metaTriangles = temp;
 	}
@@ -1825,7 +1827,7 @@ void GroupMetaTriangles( void )
 	/* allocate */
 	numMetaTriangleGroups = 0;
 	maxMetaTrianglesInGroup = 0;
-	metaTriangleGroups = (metaTriangleGroup_t *)safe_malloc( sizeof(metaTriangleGroup_t) * numMetaTriangles );
+	metaTriangleGroups = (metaTriangleGroup_t *)safe_malloc_tag( sizeof(metaTriangleGroup_t) * numMetaTriangles, &metaTriangleTag );
 
 	/* sort the triangles by shader major, fognum minor */
 	qsort( metaTriangles, numMetaTriangles, sizeof( metaTriangle_t ), CompareMetaTriangles );
@@ -1973,7 +1975,7 @@ void MergeMetaTriangles( void )
 	/* clear meta triangle list */
 	numTriangles = numMetaTriangles;
 	ClearMetaTriangles();
-	free( metaTriangleGroups );
+	safe_free_tag( metaTriangleGroups );
 	metaTriangleGroups = NULL;
 
 	/* emit some stats */
@@ -111,7 +111,7 @@ void FreeTree_r (node_t *node)
 	if (node->volume)
 		FreeBrush (node->volume);
 
-	free (node);
+	FreeTreeNode (node);
 }
 
 
@@ -125,6 +125,10 @@ void FreeTree (tree_t *tree)
 	FreeTreePortals_r (tree->headnode);
 	FreeTree_r (tree->headnode);
 	free (tree);
+
+	/* nodes and portals only live as long as their tree */
+	MemPoolRelease (&portalPool);
+	MemPoolRelease (&nodePool);
 }
 
 //===============================================================
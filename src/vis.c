@@ -226,13 +226,15 @@ CalcPortalVis
 */
 void CalcPortalVis (void)
 {
+	ProfileBegin( "PortalFlow" );
 #ifdef MREDEBUG
 	Sys_Printf("%6d portals out of %d", 0, numportals*2);
 	//get rid of the counter
-	RunThreadsOnIndividual (numportals*2, qfalse, PortalFlow);
+	RunTasksOnIndividual (numportals*2, qfalse, PortalFlow);
 #else
-	RunThreadsOnIndividual (numportals*2, qtrue, PortalFlow);
+	RunTasksOnIndividual (numportals*2, qtrue, PortalFlow);
 #endif
+	ProfileEnd();
 
 }
 
@@ -247,17 +249,21 @@ void CalcPassageVis(void)
 
 #ifdef MREDEBUG
 	_printf("%6d portals out of %d", 0, numportals*2);
-	RunThreadsOnIndividual (numportals*2, qfalse, CreatePassages);
+	RunThreadsOnIndividualCost (numportals*2, qfalse, CreatePassages, CreatePassagesCost);
 	_printf("\n");
 	_printf("%6d portals out of %d", 0, numportals*2);
 	RunThreadsOnIndividual (numportals*2, qfalse, PassageFlow);
 	_printf("\n");
 #else
 	Sys_Printf( "--- CreatePassages ---\n" );
-	RunThreadsOnIndividual( numportals*2, qtrue, CreatePassages );
+	ProfileBegin( "CreatePassages" );
+	RunThreadsOnIndividualCost( numportals*2, qtrue, CreatePassages, CreatePassagesCost );
+	ProfileEnd();
 	
 	Sys_Printf( "--- PassageFlow ---\n" );
+	ProfileBegin( "PassageFlow" );
 	RunThreadsOnIndividual( numportals * 2, qtrue, PassageFlow );
+	ProfileEnd();
 #endif
 }
 
@@ -272,17 +278,21 @@ void CalcPassagePortalVis(void)
 
 #ifdef MREDEBUG
 	Sys_Printf("%6d portals out of %d", 0, numportals*2);
-	RunThreadsOnIndividual (numportals*2, qfalse, CreatePassages);
+	RunThreadsOnIndividualCost (numportals*2, qfalse, CreatePassages, CreatePassagesCost);
 	Sys_Printf("\n");
 	Sys_Printf("%6d portals out of %d", 0, numportals*2);
 	RunThreadsOnIndividual (numportals*2, qfalse, PassagePortalFlow);
 	Sys_Printf("\n");
 #else
 	Sys_Printf( "--- CreatePassages ---\n" );
-	RunThreadsOnIndividual( numportals * 2, qtrue, CreatePassages);
+	ProfileBegin( "CreatePassages" );
+	RunThreadsOnIndividualCost( numportals * 2, qtrue, CreatePassages, CreatePassagesCost );
+	ProfileEnd();
 	
 	Sys_Printf( "--- PassagePortalFlow  ---\n" );
+	ProfileBegin( "PassagePortalFlow" );
 	RunThreadsOnIndividual( numportals * 2, qtrue, PassagePortalFlow );
+	ProfileEnd();
 #endif
 }
 
@@ -331,7 +341,9 @@ void CalcVis (void)
 	
 	/* base portal vis */
 	Sys_Printf( "--- BasePortalVis ---\n" );
+	ProfileBegin( "BasePortalVis" );
 	RunThreadsOnIndividual( numportals * 2, qtrue, BasePortalVis );
+	ProfileEnd();
 
 	/* fast/passage vis */
 	SortPortals ();
@@ -346,8 +358,10 @@ void CalcVis (void)
 
 	/* assemble the leaf vis lists by oring and compressing the portal lists */
 	Sys_Printf( "--- CreateLeafVis ---\n" );
+	ProfileBegin( "CreateLeafVis" );
 	for( i = 0; i < portalclusters; i++ )
 		ClusterMerge( i );
+	ProfileEnd();
 
 	/* emit some stats */
 	Sys_Printf( "%9d clusters\n", portalclusters );
@@ -1102,14 +1116,18 @@ int VisMain (int argc, char **argv)
 	StripExtension( source );
 	strcat( source, ".bsp" );
 	Sys_Printf( "loading %s\n", source );
+	ProfileBegin( "LoadBSPFile" );
 	LoadBSPFile( source );
+	ProfileEnd();
 	
 	/* load the portal file */
 	sprintf( portalfile, "%s%s", inbase, ExpandArg( argv[ i ] ) );
 	StripExtension( portalfile );
 	strcat( portalfile, ".prt" );
 	Sys_Printf( "loading %s\n", portalfile );
+	ProfileBegin( "LoadPortals" );
 	LoadPortals( portalfile );
+	ProfileEnd();
 	
 	/* ydnar: exit if no portals, hence no vis */
 	if( numportals == 0 )
@@ -1130,7 +1148,9 @@ int VisMain (int argc, char **argv)
 	CountActivePortals();
 	/* WritePortals( "maps/hints.prs" );*/
 	
+	ProfileBegin( "CalcVis" );
 	CalcVis();
+	ProfileEnd();
 	
 	/* delete the prt file */
 	if( !saveprt )
@@ -1139,7 +1159,9 @@ int VisMain (int argc, char **argv)
 	/* write the bsp file */
 	Sys_Printf( "--- WriteBSPFile ---\n" );
 	Sys_Printf( "Writing %s\n", source );
+	ProfileBegin( "WriteBSPFile" );
 	WriteBSPFile( source );
+	ProfileEnd();
 
 	return 0;
 }
@@ -38,6 +38,9 @@ several games based on the Quake III Arena engine, in the form of "Q3Map2."
 
 
 
+static memTag_t	passageTag = MEMTAG( "vis passages" );
+static memTag_t	portalBitsTag = MEMTAG( "vis portal bits" );
+
 
 /*
 
@@ -71,6 +74,9 @@ int CountBits (byte *bits, int numbits)
 	return c;
 }
 
+/* portals that might see at least this many others have their flow split across idle threads */
+#define	SPLIT_FLOW_MIGHTSEE	256
+
 int		c_fullskip;
 int		c_chop, c_nochop;
 int		active;
@@ -435,7 +441,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 #endif
 
 	might = (long *)stack.mightsee;
-	vis = (long *)thread->base->portalvis;
+	vis = (long *)thread->portalvis;
 	
 	// check all portals for flowing into other leafs	
 	for (i = 0; i < leaf->numportals; i++)
@@ -443,6 +449,8 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		p = leaf->portals[i];
 		if (p->removed)
 			continue;
+		if (stack.depth == 1 && thread->split >= 0 && i != thread->split)
+			continue;	// another thread follows this branch
 		pnum = p - portals;
 
 		/* MrE: portal trace debug code
@@ -488,7 +496,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		}
 		
 		if (!more && 
-			(thread->base->portalvis[pnum>>3] & (1<<(pnum&7))) )
+			(thread->portalvis[pnum>>3] & (1<<(pnum&7))) )
 		{	// can't see anything new
 			continue;
 		}
@@ -570,7 +578,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		{	// the second leaf can only be blocked if coplanar
 
 			// mark the portal as visible
-			thread->base->portalvis[pnum>>3] |= (1<<(pnum&7));
+			thread->portalvis[pnum>>3] |= (1<<(pnum&7));
 
 			RecursiveLeafFlow (p->leaf, thread, &stack);
 			continue;
@@ -619,7 +627,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 			continue;
 
 		// mark the portal as visible
-		thread->base->portalvis[pnum>>3] |= (1<<(pnum&7));
+		thread->portalvis[pnum>>3] |= (1<<(pnum&7));
 
 		// flow through it for real
 		RecursiveLeafFlow (p->leaf, thread, &stack);
@@ -628,6 +636,65 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	}	
 }
 
+/*
+===============
+InitPortalFlow
+===============
+*/
+static void InitPortalFlow (threaddata_t *data, vportal_t *p, byte *portalvis, int split)
+{
+	int		i;
+
+	memset (data, 0, sizeof(*data));
+	data->base = p;
+	data->portalvis = portalvis;
+	data->split = split;
+	
+	data->pstack_head.portal = p;
+	data->pstack_head.source = p->winding;
+	data->pstack_head.portalplane = p->plane;
+	data->pstack_head.depth = 0;
+	for (i=0 ; i<portallongs ; i++)
+		((long *)data->pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
+}
+
+/*
+===============
+PortalFlowBranch
+
+subtask: flows through a single portal of the base leaf into a private
+bit vector, then merges it into the base portalvis
+===============
+*/
+typedef struct
+{
+	vportal_t		*p;
+	int				split;
+	int				c_chains;
+}
+flowBranch_t;
+
+static void PortalFlowBranch (void *param)
+{
+	flowBranch_t	*branch = (flowBranch_t *)param;
+	threaddata_t	data;
+	byte			*portalvis;
+	int				i;
+
+	portalvis = (byte *)safe_malloc (portalbytes);
+	memset (portalvis, 0, portalbytes);
+
+	InitPortalFlow (&data, branch->p, portalvis, branch->split);
+	RecursiveLeafFlow (branch->p->leaf, &data, &data.pstack_head);
+	branch->c_chains = data.c_chains;
+
+	ThreadLock ();
+	for (i=0 ; i<portallongs ; i++)
+		((long *)branch->p->portalvis)[i] |= ((long *)portalvis)[i];
+	ThreadUnlock ();
+	free (portalvis);
+}
+
 /*
 ===============
 PortalFlow
@@ -637,10 +704,13 @@ generates the portalvis bit vector
 */
 void PortalFlow (int portalnum)
 {
-	threaddata_t	data;
-	int				i;
-	vportal_t		*p;
-	int				c_might, c_can;
+	threaddata_t		data;
+	flowBranch_t		branches[MAX_PORTALS_ON_LEAF];
+	threadTaskGroup_t	group;
+	leaf_t				*leaf;
+	int					i;
+	vportal_t			*p;
+	int					c_might, c_can, c_chains;
 
 #ifdef MREDEBUG
 	Sys_Printf("\r%6d", portalnum);
@@ -657,25 +727,36 @@ void PortalFlow (int portalnum)
 	p->status = stat_working;
 
 	c_might = CountBits (p->portalflood, numportals*2);
+	leaf = &leafs[p->leaf];
 
-	memset (&data, 0, sizeof(data));
-	data.base = p;
-	
-	data.pstack_head.portal = p;
-	data.pstack_head.source = p->winding;
-	data.pstack_head.portalplane = p->plane;
-	data.pstack_head.depth = 0;
-	for (i=0 ; i<portallongs ; i++)
-		((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
-
-	RecursiveLeafFlow (p->leaf, &data, &data.pstack_head);
+	if (numthreads > 1 && c_might >= SPLIT_FLOW_MIGHTSEE && leaf->numportals > 1)
+	{	// expensive portal, let idle threads take the other branches
+		ThreadTaskGroupInit (&group);
+		for (i=0 ; i<leaf->numportals ; i++)
+		{
+			branches[i].p = p;
+			branches[i].split = i;
+			branches[i].c_chains = 0;
+			ThreadSpawnTask (&group, PortalFlowBranch, &branches[i]);
+		}
+		ThreadWaitTaskGroup (&group);
+		c_chains = 0;
+		for (i=0 ; i<leaf->numportals ; i++)
+			c_chains += branches[i].c_chains;
+	}
+	else
+	{
+		InitPortalFlow (&data, p, p->portalvis, -1);
+		RecursiveLeafFlow (p->leaf, &data, &data.pstack_head);
+		c_chains = data.c_chains;
+	}
 
 	p->status = stat_done;
 
 	c_can = CountBits (p->portalvis, numportals*2);
 
 	Sys_FPrintf (SYS_VRB,"portal:%4i  mightsee:%4i  cansee:%4i (%i chains)\n", 
-		(int)(p - portals),	c_might, c_can, data.c_chains);
+		(int)(p - portals),	c_might, c_can, c_chains);
 }
 
 /*
@@ -1305,6 +1386,23 @@ int AddSeperators (fixedWinding_t *source, fixedWinding_t *pass, qboolean flipcl
 	return numseperators;
 }
 
+/*
+===============
+CreatePassagesCost
+
+estimated work in CreatePassages: target portals times mightsee
+===============
+*/
+float CreatePassagesCost(int portalnum)
+{
+	vportal_t		*portal;
+
+	portal = sorted_portals[portalnum];
+	if (portal->removed)
+		return 0;
+	return (float)leafs[portal->leaf].numportals * (portal->nummightsee + 1);
+}
+
 /*
 ===============
 CreatePassages
@@ -1346,7 +1444,7 @@ void CreatePassages(int portalnum)
 		if (target->removed)
 			continue;
 
-		passage = (passage_t *) safe_malloc(sizeof(passage_t) + portalbytes);
+		passage = (passage_t *) safe_malloc_tag(sizeof(passage_t) + portalbytes, &passageTag);
 		memset(passage, 0, sizeof(passage_t) + portalbytes);
 		numseperators = AddSeperators(portal->winding, target->winding, qfalse, seperators, MAX_SEPERATORS*2);
 		numseperators += AddSeperators(target->winding, portal->winding, qtrue, &seperators[numseperators], MAX_SEPERATORS*2-numseperators);
@@ -1551,13 +1649,13 @@ void BasePortalVis( int portalnum )
 	if (p->removed)
 		return;
 
-	p->portalfront = (byte *)safe_malloc (portalbytes);
+	p->portalfront = (byte *)safe_malloc_tag (portalbytes, &portalBitsTag);
 	memset (p->portalfront, 0, portalbytes);
 
-	p->portalflood = (byte *)safe_malloc (portalbytes);
+	p->portalflood = (byte *)safe_malloc_tag (portalbytes, &portalBitsTag);
 	memset (p->portalflood, 0, portalbytes);
 	
-	p->portalvis = (byte *)safe_malloc (portalbytes);
+	p->portalvis = (byte *)safe_malloc_tag (portalbytes, &portalBitsTag);
 	memset (p->portalvis, 0, portalbytes);
 	
 	for (j=0, tp = portals ; j<numportals*2 ; j++, tp++)